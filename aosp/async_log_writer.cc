@@ -0,0 +1,165 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/aosp/async_log_writer.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <utility>
+
+#include <android-base/file.h>
+
+namespace chromeos_update_engine {
+
+namespace {
+
+size_t RoundUpToPowerOfTwo(size_t size) {
+  size_t result = 1;
+  while (result < size)
+    result <<= 1;
+  return result;
+}
+
+}  // namespace
+
+AsyncLogWriter::AsyncLogWriter(android::base::unique_fd fd, size_t buffer_size)
+    : fd_(std::move(fd)),
+      capacity_(RoundUpToPowerOfTwo(buffer_size)),
+      ring_(new char[capacity_]),
+      last_sync_(std::chrono::steady_clock::now()),
+      flusher_(&AsyncLogWriter::FlusherLoop, this) {}
+
+AsyncLogWriter::~AsyncLogWriter() {
+  {
+    std::lock_guard<std::mutex> lock(flusher_mutex_);
+    stopping_ = true;
+  }
+  flusher_cv_.notify_one();
+  flusher_.join();
+  Flush();
+}
+
+void AsyncLogWriter::Write(std::initializer_list<std::string_view> parts) {
+  size_t size = 0;
+  for (const auto& part : parts)
+    size += part.size();
+  if (size == 0)
+    return;
+
+  if (size > capacity_ / 4) {
+    // Too large to share the ring buffer, write it out right away after the
+    // lines committed before it.
+    std::lock_guard<std::mutex> lock(io_mutex_);
+    Drain(false);
+    for (const auto& part : parts) {
+      ignore_result(android::base::WriteFully(fd_, part.data(), part.size()));
+    }
+    unsynced_bytes_ += size;
+    return;
+  }
+
+  // Reserve |size| bytes, waiting for the flusher if the buffer is full.
+  uint64_t start = reserved_.load(std::memory_order_relaxed);
+  do {
+    while (start + size - consumed_.load(std::memory_order_acquire) >
+           capacity_) {
+      flusher_cv_.notify_one();
+      std::this_thread::yield();
+      start = reserved_.load(std::memory_order_relaxed);
+    }
+  } while (!reserved_.compare_exchange_weak(start,
+                                            start + size,
+                                            std::memory_order_acq_rel,
+                                            std::memory_order_relaxed));
+
+  uint64_t position = start;
+  for (const auto& part : parts) {
+    const size_t offset = position & (capacity_ - 1);
+    const size_t first = std::min(part.size(), capacity_ - offset);
+    memcpy(ring_.get() + offset, part.data(), first);
+    memcpy(ring_.get(), part.data() + first, part.size() - first);
+    position += part.size();
+  }
+
+  // Publish in reservation order, so the flusher never sees a hole. Only
+  // concurrent writers wait here, for as long as it takes them to copy.
+  while (committed_.load(std::memory_order_acquire) != start)
+    std::this_thread::yield();
+  committed_.store(start + size, std::memory_order_release);
+
+  if (start + size - consumed_.load(std::memory_order_relaxed) >
+      capacity_ / 2) {
+    flusher_cv_.notify_one();
+  }
+}
+
+void AsyncLogWriter::Flush() {
+  std::lock_guard<std::mutex> lock(io_mutex_);
+  Drain(true);
+}
+
+bool AsyncLogWriter::TryFlush() {
+  std::unique_lock<std::mutex> lock(io_mutex_, std::try_to_lock);
+  if (!lock.owns_lock())
+    return false;
+  Drain(true);
+  return true;
+}
+
+void AsyncLogWriter::Drain(bool force_sync) {
+  const uint64_t start = consumed_.load(std::memory_order_relaxed);
+  const uint64_t end = committed_.load(std::memory_order_acquire);
+  if (end != start) {
+    WriteRing(start, end - start);
+    consumed_.store(end, std::memory_order_release);
+    unsynced_bytes_ += end - start;
+  }
+
+  const auto now = std::chrono::steady_clock::now();
+  if (unsynced_bytes_ > 0 &&
+      (force_sync || unsynced_bytes_ >= kSyncBytes ||
+       now - last_sync_ >= kSyncInterval)) {
+    fdatasync(fd_);
+    unsynced_bytes_ = 0;
+    last_sync_ = now;
+  }
+}
+
+void AsyncLogWriter::WriteRing(uint64_t position, size_t size) {
+  const size_t offset = position & (capacity_ - 1);
+  const size_t first = std::min(size, capacity_ - offset);
+  ignore_result(android::base::WriteFully(fd_, ring_.get() + offset, first));
+  if (size > first) {
+    ignore_result(android::base::WriteFully(fd_, ring_.get(), size - first));
+  }
+}
+
+void AsyncLogWriter::FlusherLoop() {
+  std::unique_lock<std::mutex> lock(flusher_mutex_);
+  while (!stopping_) {
+    flusher_cv_.wait_for(lock, kFlushInterval);
+    lock.unlock();
+    {
+      std::lock_guard<std::mutex> io_lock(io_mutex_);
+      Drain(false);
+    }
+    lock.lock();
+  }
+}
+
+}  // namespace chromeos_update_engine
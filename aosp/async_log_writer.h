@@ -0,0 +1,108 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_AOSP_ASYNC_LOG_WRITER_H_
+#define UPDATE_ENGINE_AOSP_ASYNC_LOG_WRITER_H_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <initializer_list>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <thread>
+
+#include <android-base/unique_fd.h>
+#include <base/macros.h>
+
+namespace chromeos_update_engine {
+
+// Writes log lines to a file from a background thread.
+//
+// Write() only copies the line into a ring buffer shared by all threads, using
+// atomic operations and no locks. A background thread writes the buffered
+// lines to the file in batches every |kFlushInterval|, or earlier once the
+// buffer is half full, and only syncs the file to disk every |kSyncInterval|
+// or |kSyncBytes|. Flush() writes and syncs everything synchronously, it's
+// meant for fatal errors. At process exit, the writer should be leaked rather
+// than destroyed, and flushed with TryFlush().
+//
+// Nothing in here may log, since it would end up calling back into Write().
+class AsyncLogWriter {
+ public:
+  static constexpr size_t kDefaultBufferSize = 256 * 1024;
+  static constexpr std::chrono::milliseconds kFlushInterval{200};
+  static constexpr std::chrono::seconds kSyncInterval{5};
+  static constexpr size_t kSyncBytes = 1024 * 1024;
+
+  // |buffer_size| is rounded up to a power of two.
+  explicit AsyncLogWriter(android::base::unique_fd fd,
+                          size_t buffer_size = kDefaultBufferSize);
+  // Stops the flusher thread and flushes all buffered lines. No other thread
+  // may be writing.
+  ~AsyncLogWriter();
+
+  // Appends the concatenation of |parts| to the file, as one unit which isn't
+  // interleaved with other writes. Safe to call from any thread.
+  void Write(std::initializer_list<std::string_view> parts);
+
+  // Writes all lines appended so far to the file and syncs it.
+  void Flush();
+
+  // Like Flush(), but gives up if another thread is writing to the file.
+  // Returns whether it flushed. Safe to call from exit(), even when it runs
+  // from a signal handler.
+  bool TryFlush();
+
+ private:
+  // Writes the lines committed to the ring buffer to the file, and syncs it if
+  // |force_sync| or the sync policy says so. Called with |io_mutex_| held.
+  void Drain(bool force_sync);
+
+  // Writes |size| bytes of the ring buffer starting at |position|.
+  void WriteRing(uint64_t position, size_t size);
+
+  void FlusherLoop();
+
+  const android::base::unique_fd fd_;
+  const size_t capacity_;
+  const std::unique_ptr<char[]> ring_;
+
+  // Monotonic positions in the ring buffer: bytes reserved by writers, bytes
+  // fully copied in, in order, and bytes written to the file.
+  std::atomic<uint64_t> reserved_{0};
+  std::atomic<uint64_t> committed_{0};
+  std::atomic<uint64_t> consumed_{0};
+
+  // Serializes writing to |fd_|.
+  std::mutex io_mutex_;
+  size_t unsynced_bytes_{0};
+  std::chrono::steady_clock::time_point last_sync_;
+
+  // Wakes up the flusher thread early.
+  std::mutex flusher_mutex_;
+  std::condition_variable flusher_cv_;
+  bool stopping_{false};
+  std::thread flusher_;
+
+  DISALLOW_COPY_AND_ASSIGN(AsyncLogWriter);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_AOSP_ASYNC_LOG_WRITER_H_
@@ -0,0 +1,114 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/aosp/async_log_writer.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <android-base/file.h>
+#include <base/strings/string_split.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/utils.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+class AsyncLogWriterTest : public ::testing::Test {
+ protected:
+  android::base::unique_fd OpenLogFile() {
+    return android::base::unique_fd(
+        open(log_file_.path().c_str(), O_WRONLY | O_TRUNC | O_CLOEXEC));
+  }
+
+  string ReadLogFile() {
+    string contents;
+    EXPECT_TRUE(android::base::ReadFileToString(log_file_.path(), &contents));
+    return contents;
+  }
+
+  ScopedTempFile log_file_{"async_log_writer.XXXXXX"};
+};
+
+TEST_F(AsyncLogWriterTest, FlushTest) {
+  AsyncLogWriter writer(OpenLogFile());
+  writer.Write({"[prefix] ", "first", "\n"});
+  writer.Write({"second\n"});
+  writer.Write({});
+  writer.Flush();
+  EXPECT_EQ("[prefix] first\nsecond\n", ReadLogFile());
+}
+
+TEST_F(AsyncLogWriterTest, TryFlushTest) {
+  AsyncLogWriter writer(OpenLogFile());
+  writer.Write({"line\n"});
+  EXPECT_TRUE(writer.TryFlush());
+  EXPECT_EQ("line\n", ReadLogFile());
+}
+
+TEST_F(AsyncLogWriterTest, LargeWriteTest) {
+  const string large_line(1024, 'x');
+  {
+    AsyncLogWriter writer(OpenLogFile(), 1024);
+    writer.Write({"small\n"});
+    writer.Write({large_line, "\n"});
+    writer.Write({"after\n"});
+  }
+  EXPECT_EQ("small\n" + large_line + "\nafter\n", ReadLogFile());
+}
+
+// Lines from concurrent writers are never torn, even when they wrap around
+// the buffer or wait for the flusher to make room.
+TEST_F(AsyncLogWriterTest, ConcurrentWritesTest) {
+  constexpr int kThreads = 4;
+  constexpr int kLines = 5000;
+  {
+    AsyncLogWriter writer(OpenLogFile(), 4096);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < kThreads; t++) {
+      threads.emplace_back([&writer, t] {
+        for (int i = 0; i < kLines; i++) {
+          writer.Write({"thread ", std::to_string(t), " line ",
+                        std::to_string(i), "\n"});
+        }
+      });
+    }
+    for (auto& thread : threads)
+      thread.join();
+  }
+
+  std::map<int, int> next_line;
+  for (const auto& line : base::SplitString(ReadLogFile(),
+                                            "\n",
+                                            base::KEEP_WHITESPACE,
+                                            base::SPLIT_WANT_NONEMPTY)) {
+    int t, i;
+    ASSERT_EQ(2, sscanf(line.c_str(), "thread %d line %d", &t, &i)) << line;
+    // Each thread's lines appear in order.
+    EXPECT_EQ(next_line[t]++, i);
+  }
+  for (int t = 0; t < kThreads; t++)
+    EXPECT_EQ(kLines, next_line[t]);
+}
+
+}  // namespace chromeos_update_engine
@@ -24,6 +24,7 @@
 
 #include <android/sysprop/GkiProperties.sysprop.h>
 #include <android-base/properties.h>
+#include <base/files/file_enumerator.h>
 #include <base/files/file_util.h>
 #include <base/strings/string_number_conversions.h>
 #include <base/strings/string_util.h>
@@ -58,6 +59,22 @@ const char kPropBootHardwareSKU[] = "ro.boot.hardware.sku";
 const char kPropBootRevision[] = "ro.boot.revision";
 const char kPropBuildDateUTC[] = "ro.build.date.utc";
 
+// The power supplies reported by the kernel, and the battery temperature (in
+// tenths of a degree Celsius) above which the device is likely to throttle.
+const char kPowerSupplyDir[] = "/sys/class/power_supply";
+const int kBatteryThrottleTemperature = 450;
+
+// Reads the integer in the sysfs attribute |name| of the power supply at
+// |dir|, returns false if it's missing or malformed.
+bool ReadPowerSupplyInt(const base::FilePath& dir,
+                        const char* name,
+                        int* value) {
+  string contents;
+  return base::ReadFileToString(dir.Append(name), &contents) &&
+         base::StringToInt(base::TrimWhitespaceASCII(contents, base::TRIM_ALL),
+                           value);
+}
+
 string GetPartitionBuildDate(const string& partition_name) {
   return android::base::GetProperty("ro." + partition_name + ".build.date.utc",
                                     "");
@@ -261,6 +278,38 @@ bool HardwareAndroid::AllowDowngrade() const {
   return true;
 }
 
+bool HardwareAndroid::GetPowerState(PowerState* state) const {
+  *state = PowerState();
+  bool found = false;
+  // The entries are symlinks into /sys/devices, which are followed.
+  base::FileEnumerator supplies(base::FilePath(kPowerSupplyDir),
+                                false,
+                                base::FileEnumerator::DIRECTORIES);
+  for (base::FilePath dir = supplies.Next(); !dir.empty();
+       dir = supplies.Next()) {
+    string type;
+    if (!base::ReadFileToString(dir.Append("type"), &type))
+      continue;
+    base::TrimWhitespaceASCII(type, base::TRIM_ALL, &type);
+    int value = 0;
+    if (type == "Battery") {
+      if (ReadPowerSupplyInt(dir, "capacity", &value)) {
+        state->battery_percent = value;
+        found = true;
+      }
+      if (ReadPowerSupplyInt(dir, "temp", &value) &&
+          value >= kBatteryThrottleTemperature) {
+        state->thermal_throttled = true;
+      }
+    } else if (ReadPowerSupplyInt(dir, "online", &value)) {
+      // Mains, USB and wireless chargers all report whether they're online.
+      state->on_external_power |= value != 0;
+      found = true;
+    }
+  }
+  return found;
+}
+
 bool HardwareAndroid::GetFirstActiveOmahaPingSent() const {
   LOG(WARNING) << "STUB: Assuming first active omaha was never set.";
   return false;
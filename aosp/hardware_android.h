@@ -55,6 +55,7 @@ class HardwareAndroid : public HardwareInterface {
   bool GetPowerwashSafeDirectory(base::FilePath* path) const override;
   int64_t GetBuildTimestamp() const override;
   bool AllowDowngrade() const override;
+  bool GetPowerState(PowerState* state) const override;
   bool GetFirstActiveOmahaPingSent() const override;
   bool SetFirstActiveOmahaPingSent() override;
   void SetWarmReset(bool warm_reset) override;
@@ -16,12 +16,12 @@
 
 #include <inttypes.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
 #include <algorithm>
 #include <functional>
-#include <iomanip>
 #include <sstream>
 #include <string>
 #include <string_view>
@@ -37,6 +37,7 @@
 #include <log/log.h>
 
 #include "android/log.h"
+#include "update_engine/aosp/async_log_writer.h"
 #include "update_engine/common/utils.h"
 
 using std::string;
@@ -119,14 +120,25 @@ const char* LogPriorityToCString(int priority) {
 
 using LoggerFunction = std::function<void(const struct __android_log_message*)>;
 
+// The writer of the persistent log. It's never deleted, since other threads
+// may keep logging while the process exits and deleting it would wait for its
+// flusher thread.
+AsyncLogWriter* g_log_writer = nullptr;
+
+void FlushLogWriterAtExit() {
+  // exit() may be called from a signal handler, which could have interrupted
+  // a thread holding the writer's lock.
+  g_log_writer->TryFlush();
+}
+
 class FileLogger {
  public:
   explicit FileLogger(const string& path) {
-    fd_.reset(TEMP_FAILURE_RETRY(
+    android::base::unique_fd fd(TEMP_FAILURE_RETRY(
         open(path.c_str(),
              O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_NOFOLLOW,
              0644)));
-    if (fd_ == -1) {
+    if (fd == -1) {
       // Use ALOGE that logs to logd before __android_log_set_logger.
       ALOGE("Cannot open persistent log %s: %s", path.c_str(), strerror(errno));
       return;
@@ -134,59 +146,78 @@ class FileLogger {
     // The log file will have AID_LOG as group ID; this GID is inherited from
     // the parent directory "/data/misc/update_engine_log" which sets the SGID
     // bit.
-    if (fchmod(fd_.get(), 0640) == -1) {
+    if (fchmod(fd.get(), 0640) == -1) {
       // Use ALOGE that logs to logd before __android_log_set_logger.
       ALOGE("Cannot chmod 0640 persistent log %s: %s",
             path.c_str(),
             strerror(errno));
       return;
     }
+    writer_ = new AsyncLogWriter(std::move(fd));
+    if (g_log_writer == nullptr) {
+      g_log_writer = writer_;
+      atexit(&FlushLogWriterAtExit);
+    }
   }
-  // Copy-constructor needed to be converted to std::function.
-  FileLogger(const FileLogger& other) { fd_.reset(dup(other.fd_)); }
+  // Copies share the same writer, as needed to be converted to std::function.
+  FileLogger(const FileLogger& other) = default;
   void operator()(const struct __android_log_message* log_message) {
-    if (fd_ == -1) {
+    if (!writer_) {
       return;
     }
 
     std::string_view message_str =
         log_message->message != nullptr ? log_message->message : "";
 
-    WriteToFd(GetPrefix(log_message));
-    WriteToFd(message_str);
-    WriteToFd("\n");
-    fsync(fd_);
+    char prefix[kMaxPrefixSize];
+    writer_->Write({GetPrefix(log_message, prefix), message_str, "\n"});
+    // The process is about to abort, make sure the reason reaches the disk.
+    if (log_message->priority == ANDROID_LOG_FATAL) {
+      writer_->Flush();
+    }
   }
 
  private:
-  android::base::unique_fd fd_;
-  void WriteToFd(std::string_view message) {
-    ignore_result(
-        android::base::WriteFully(fd_, message.data(), message.size()));
-  }
+  static constexpr size_t kMaxPrefixSize = 256;
+
+  AsyncLogWriter* writer_{nullptr};
 
-  string GetPrefix(const struct __android_log_message* log_message) {
-    std::stringstream ss;
+  // Formats the prefix of |log_message| into |buffer|, which must be
+  // |kMaxPrefixSize| bytes long.
+  std::string_view GetPrefix(const struct __android_log_message* log_message,
+                             char* buffer) {
     timeval tv;
     gettimeofday(&tv, nullptr);
     time_t t = tv.tv_sec;
     struct tm local_time;
     localtime_r(&t, &local_time);
     struct tm* tm_time = &local_time;
-    ss << "[" << std::setfill('0') << std::setw(2) << 1 + tm_time->tm_mon
-       << std::setw(2) << tm_time->tm_mday << '/' << std::setw(2)
-       << tm_time->tm_hour << std::setw(2) << tm_time->tm_min << std::setw(2)
-       << tm_time->tm_sec << '.' << std::setw(6) << tv.tv_usec << "] ";
+    int size = snprintf(buffer,
+                        kMaxPrefixSize,
+                        "[%02d%02d/%02d%02d%02d.%06ld] ",
+                        1 + tm_time->tm_mon,
+                        tm_time->tm_mday,
+                        tm_time->tm_hour,
+                        tm_time->tm_min,
+                        tm_time->tm_sec,
+                        static_cast<long>(tv.tv_usec));  // NOLINT(runtime/int)
     // libchrome logs prepends |message| with severity, file and line, but
     // leave logger_data->file as nullptr.
     // libbase / liblog logs doesn't. Hence, add them to match the style.
     // For liblog logs that doesn't set logger_data->file, not printing the
     // priority is acceptable.
-    if (log_message->file) {
-      ss << "[" << LogPriorityToCString(log_message->priority) << ':'
-         << log_message->file << '(' << log_message->line << ")] ";
+    if (log_message->file && size > 0 &&
+        static_cast<size_t>(size) < kMaxPrefixSize) {
+      size += snprintf(buffer + size,
+                       kMaxPrefixSize - size,
+                       "[%s:%s(%" PRIu32 ")] ",
+                       LogPriorityToCString(log_message->priority),
+                       log_message->file,
+                       log_message->line);
     }
-    return ss.str();
+    if (size < 0)
+      return {};
+    return {buffer, std::min(static_cast<size_t>(size), kMaxPrefixSize - 1)};
   }
 };
 
@@ -288,8 +319,8 @@ void SetupLogging(bool log_to_system, bool log_to_file) {
   // By calling liblog's __android_log_set_logger function, all of libchrome
   // (used by update_engine) / libbase / liblog (used by depended modules)
   // logging eventually redirects to CombinedLogger.
-  static auto g_logger =
-      std::make_unique<CombinedLogger>(log_to_system, log_to_file);
+  // Leaked on purpose, the loggers must outlive all the threads logging.
+  static auto* g_logger = new CombinedLogger(log_to_system, log_to_file);
   __android_log_set_logger([](const struct __android_log_message* log_message) {
     (*g_logger)(log_message);
   });
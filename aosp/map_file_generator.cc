@@ -14,12 +14,9 @@
 // limitations under the License.
 //
 
-#include <array>
-
 #include <android-base/stringprintf.h>
 #include <android-base/unique_fd.h>
 #include <fcntl.h>
-#include <sparse/sparse.h>
 
 #include "android-base/file.h"
 #include "common/utils.h"
@@ -28,6 +25,7 @@
 #include "update_engine/payload_generator/ext2_filesystem.h"
 #include "update_engine/payload_generator/filesystem_interface.h"
 #include "update_engine/payload_generator/raw_filesystem.h"
+#include "update_engine/payload_generator/sparse_utils.h"
 #include "update_engine/payload_generator/squashfs_filesystem.h"
 
 namespace chromeos_update_engine {
@@ -76,16 +74,6 @@ int WriteBlockMap(const char* img,
   return 0;
 }
 
-bool IsSparseImage(int fd) {
-  static constexpr std::string_view kSparseMagic = "\x3A\xFF\x26\xED";
-
-  std::array<char, kSparseMagic.size()> buf{};
-  if (pread(fd, buf.data(), kSparseMagic.size(), 0) != 4) {
-    return false;
-  }
-  return memcmp(buf.data(), kSparseMagic.data(), kSparseMagic.size()) == 0;
-}
-
 int Main(int argc, const char* argv[]) {
   const char* img = argv[1];
   const char* output_file = argv[2];
@@ -95,19 +83,12 @@ int Main(int argc, const char* argv[]) {
     return -errno;
   }
   TemporaryFile tmpfile;
-  if (IsSparseImage(fd.get())) {
+  if (sparse_utils::IsSparseImage(img)) {
     LOG(INFO) << "Detected sparse image " << img << ", unsparsing...";
-    struct sparse_file* s = sparse_file_import(fd, true, false);
-    if (s == nullptr) {
-      LOG(ERROR) << "Failed to unsparse " << img;
+    if (!sparse_utils::UnsparseImage(img, tmpfile.fd)) {
       return -2;
     }
-    if (sparse_file_write(s, tmpfile.fd, false, false, false) < 0) {
-      LOG(ERROR) << "Failed to write unsparsed output to " << tmpfile.path;
-      return -1;
-    }
     img = tmpfile.path;
-    fd.reset(open(img, O_RDONLY | O_CLOEXEC));
   }
   std::unique_ptr<FilesystemInterface> fs;
 
@@ -189,6 +189,25 @@ void MetricsReporterAndroid::ReportSuccessfulUpdateMetrics(
                       IsFECEnabled(install_plan_));
 }
 
+void MetricsReporterAndroid::ReportCheckpointMetrics(
+    base::TimeDelta interval, base::TimeDelta total_duration) {
+  // There is no statsd atom for these yet.
+  LOG(INFO) << "Update progress was saved every " << interval.InMilliseconds()
+            << "ms, taking " << total_duration.InMilliseconds() << "ms total";
+}
+
+void MetricsReporterAndroid::ReportSpillQueueMetrics(
+    int64_t peak_buffered_bytes,
+    int64_t spilled_bytes,
+    int64_t high_water_waits,
+    int64_t empty_waits) {
+  // There is no statsd atom for these yet.
+  LOG(INFO) << "Spill queue held up to " << peak_buffered_bytes << " bytes and "
+            << "spilled " << spilled_bytes << " bytes, the download waited "
+            << high_water_waits << " times and the applier " << empty_waits
+            << " times";
+}
+
 void MetricsReporterAndroid::ReportAbnormallyTerminatedUpdateAttemptMetrics() {
   int attempt_result =
       static_cast<int>(metrics::AttemptResult::kAbnormalTermination);
@@ -404,6 +404,18 @@ bool UpdateAttempterAndroid::ApplyPayload(
   if (!headers[kPayloadBatchedWrites].empty()) {
     install_plan_.batched_writes = true;
   }
+  if (!headers[kPayloadSpillDownload].empty()) {
+    install_plan_.spill_download = true;
+  }
+  if (!headers[kPayloadSourcePrefetchOps].empty() &&
+      !base::StringToUint(headers[kPayloadSourcePrefetchOps],
+                          &install_plan_.source_prefetch_ops)) {
+    LOG(WARNING) << "Invalid " << kPayloadSourcePrefetchOps << " header: "
+                 << headers[kPayloadSourcePrefetchOps];
+  }
+  if (!headers[kPayloadTraceOperations].empty()) {
+    install_plan_.trace_operations = true;
+  }
 
   BuildUpdateActions(fetcher);
 
@@ -1063,6 +1075,31 @@ void UpdateAttempterAndroid::CollectAndReportUpdateMetricsOnUpdateFinished(
         duration_uptime,
         static_cast<int>(reboot_count),
         0);  // url_switch_count
+
+    int64_t checkpoint_interval_ms = 0;
+    int64_t checkpoint_duration_ms = 0;
+    if (prefs_->GetInt64(kPrefsUpdateStateCheckpointInterval,
+                         &checkpoint_interval_ms) &&
+        prefs_->GetInt64(kPrefsUpdateStateCheckpointDuration,
+                         &checkpoint_duration_ms)) {
+      metrics_reporter_->ReportCheckpointMetrics(
+          base::TimeDelta::FromMilliseconds(checkpoint_interval_ms),
+          base::TimeDelta::FromMilliseconds(checkpoint_duration_ms));
+    }
+
+    int64_t spill_queue_peak_bytes = 0;
+    if (prefs_->GetInt64(kPrefsUpdateStateSpillQueuePeakBytes,
+                         &spill_queue_peak_bytes)) {
+      int64_t spilled_bytes = 0;
+      int64_t high_water_waits = 0;
+      int64_t empty_waits = 0;
+      prefs_->GetInt64(kPrefsUpdateStateSpillQueueSpilledBytes, &spilled_bytes);
+      prefs_->GetInt64(kPrefsUpdateStateSpillQueueHighWaterWaits,
+                       &high_water_waits);
+      prefs_->GetInt64(kPrefsUpdateStateSpillQueueEmptyWaits, &empty_waits);
+      metrics_reporter_->ReportSpillQueueMetrics(
+          spill_queue_peak_bytes, spilled_bytes, high_water_waits, empty_waits);
+    }
   }
 }
 
@@ -186,6 +186,22 @@ TEST_F(UpdateAttempterAndroidTest, ReportMetricsOnUpdateTerminated) {
   EXPECT_TRUE(prefs_.Exists(kPrefsSystemUpdatedMarker));
 }
 
+TEST_F(UpdateAttempterAndroidTest, ReportSpillQueueMetricsOnSuccess) {
+  prefs_.SetInt64(kPrefsUpdateStateSpillQueuePeakBytes, 4096);
+  prefs_.SetInt64(kPrefsUpdateStateSpillQueueSpilledBytes, 1024);
+  prefs_.SetInt64(kPrefsUpdateStateSpillQueueHighWaterWaits, 3);
+  prefs_.SetInt64(kPrefsUpdateStateSpillQueueEmptyWaits, 7);
+
+  EXPECT_CALL(*metrics_reporter_, ReportSpillQueueMetrics(4096, 1024, 3, 7))
+      .Times(1);
+
+  InstallPlan::Payload payload;
+  payload.size = 50;
+  AddPayload(std::move(payload));
+  SetUpdateStatus(UpdateStatus::UPDATE_AVAILABLE);
+  update_attempter_android_.ProcessingDone(nullptr, ErrorCode::kSuccess);
+}
+
 TEST_F(UpdateAttempterAndroidTest, ReportMetricsForBytesDownloaded) {
   // Check both prefs are updated correctly.
   update_attempter_android_.BytesReceived(20, 50, 200);
@@ -0,0 +1,407 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+// Applies a payload end to end the way a device would, without a device or a
+// real server: the payload is served by test_http_server with a configurable
+// bandwidth, latency and connection drops, downloaded with
+// LibcurlHttpFetcher and applied by DownloadAction and FilesystemVerifierAction
+// to file backed partition images. The time taken by every action and by every
+// type of operation is written as JSON, e.g.
+//   update_engine_apply_benchmark --payload=delta.bin \
+//       --partition_names=system:vendor \
+//       --source_partitions=old_system.img:old_vendor.img \
+//       --target_partitions=new_system.img:new_vendor.img \
+//       --bandwidth=10485760 --latency_ms=50 --drop_every=67108864
+
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <cinttypes>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <android-base/unique_fd.h>
+#include <base/bind.h>
+#include <base/files/file_path.h>
+#include <base/files/file_util.h>
+#include <base/json/json_writer.h>
+#include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
+#include <base/strings/string_number_conversions.h>
+#include <base/strings/string_split.h>
+#include <base/strings/string_util.h>
+#include <base/strings/stringprintf.h>
+#include <base/time/time.h>
+#include <base/values.h>
+#include <brillo/message_loops/base_message_loop.h>
+#include <brillo/process/process.h>
+#include <brillo/streams/file_stream.h>
+#include <gflags/gflags.h>
+#include <xz.h>
+
+#include "update_engine/common/action_processor.h"
+#include "update_engine/common/constants.h"
+#include "update_engine/common/download_action.h"
+#include "update_engine/common/error_code_utils.h"
+#include "update_engine/common/fake_boot_control.h"
+#include "update_engine/common/fake_hardware.h"
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/prefs.h"
+#include "update_engine/common/terminator.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/libcurl_http_fetcher.h"
+#include "update_engine/payload_consumer/filesystem_verifier_action.h"
+#include "update_engine/payload_consumer/install_plan.h"
+
+using std::string;
+using std::vector;
+
+DEFINE_string(payload, "", "Path to the payload to apply.");
+DEFINE_string(partition_names,
+              "",
+              "Names of the partitions in the payload, separated by colons, "
+              "e.g. system:vendor .");
+DEFINE_string(source_partitions,
+              "",
+              "Path to the source images of a delta payload, separated by "
+              "colons in the order of --partition_names. Leave empty for a "
+              "full payload.");
+DEFINE_string(target_partitions,
+              "",
+              "Path to the target images, separated by colons in the order "
+              "of --partition_names. They are created if missing and "
+              "overwritten.");
+DEFINE_uint64(bandwidth,
+              0,
+              "Bytes per second the payload is served at, 0 for unlimited.");
+DEFINE_int32(latency_ms,
+             0,
+             "Milliseconds the server waits before answering every request.");
+DEFINE_uint64(drop_every,
+              0,
+              "Number of bytes after which the server drops the connection, "
+              "forcing the client to resume. 0 never drops it.");
+DEFINE_int32(retry_seconds,
+             1,
+             "Seconds the client waits before resuming a dropped transfer.");
+DEFINE_bool(enable_threading,
+            false,
+            "Whether to apply the operations of a partition in parallel.");
+DEFINE_string(http_server,
+              "",
+              "Path to test_http_server, next to this binary by default.");
+DEFINE_string(output,
+              "-",
+              "Path to write the JSON report to, - for stdout.");
+
+namespace chromeos_update_engine {
+
+namespace {
+
+constexpr char kListeningMsgPrefix[] = "listening on port ";
+
+// Runs test_http_server for as long as it is in scope.
+class HttpServer {
+ public:
+  HttpServer() = default;
+  ~HttpServer() {
+    if (process_)
+      process_->Kill(SIGTERM, 10);
+  }
+
+  // Starts the server at |path| serving |payload_path| and waits for the port
+  // it listens on.
+  bool Start(const string& path, const string& payload_path) {
+    auto process = std::make_unique<brillo::ProcessImpl>();
+    process->AddArg(path);
+    process->AddArg("--payload=" + payload_path);
+    process->RedirectUsingPipe(STDOUT_FILENO, false);
+    TEST_AND_RETURN_FALSE(process->Start());
+
+    brillo::StreamPtr stdout = brillo::FileStream::FromFileDescriptor(
+        process->GetPipe(STDOUT_FILENO), false /* own */, nullptr);
+    TEST_AND_RETURN_FALSE(stdout);
+    vector<char> buf(128);
+    string line;
+    while (line.find('\n') == string::npos) {
+      size_t read = 0;
+      TEST_AND_RETURN_FALSE(
+          stdout->ReadBlocking(buf.data(), buf.size(), &read, nullptr));
+      TEST_AND_RETURN_FALSE(read > 0);
+      line.append(buf.data(), read);
+    }
+    TEST_AND_RETURN_FALSE(base::StartsWith(
+        line, kListeningMsgPrefix, base::CompareCase::SENSITIVE));
+    line = line.substr(strlen(kListeningMsgPrefix));
+    line.resize(line.find('\n'));
+    TEST_AND_RETURN_FALSE(base::StringToUint(line, &port_));
+    LOG(INFO) << "test_http_server listening on port " << port_;
+    process_ = std::move(process);
+    return true;
+  }
+
+  unsigned int port() const { return port_; }
+
+ private:
+  std::unique_ptr<brillo::Process> process_;
+  unsigned int port_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(HttpServer);
+};
+
+// Counts the bytes downloaded, including the ones downloaded again after a
+// dropped connection.
+class BenchmarkDownloadDelegate : public DownloadActionDelegate {
+ public:
+  void BytesReceived(uint64_t bytes_progressed,
+                     uint64_t bytes_received,
+                     uint64_t total) override {
+    bytes_downloaded_ += bytes_progressed;
+  }
+  bool ShouldCancel(ErrorCode* cancel_reason) override { return false; }
+  void DownloadComplete() override {}
+
+  uint64_t bytes_downloaded() const { return bytes_downloaded_; }
+
+ private:
+  uint64_t bytes_downloaded_{0};
+};
+
+// Records when every action completes. The actions run one after the other,
+// so each one took the time since the previous one completed.
+class BenchmarkProcessorDelegate : public ActionProcessorDelegate {
+ public:
+  void Start() { last_time_ = base::TimeTicks::Now(); }
+
+  void ProcessingDone(const ActionProcessor* processor,
+                      ErrorCode code) override {
+    code_ = code;
+    brillo::MessageLoop::current()->BreakLoop();
+  }
+  void ProcessingStopped(const ActionProcessor* processor) override {
+    brillo::MessageLoop::current()->BreakLoop();
+  }
+  void ActionCompleted(ActionProcessor* processor,
+                       AbstractAction* action,
+                       ErrorCode code) override {
+    const base::TimeTicks now = base::TimeTicks::Now();
+    auto entry = std::make_unique<base::DictionaryValue>();
+    entry->SetString("action", action->Type());
+    entry->SetString("error_code", utils::ErrorCodeToString(code));
+    entry->SetDouble("seconds", (now - last_time_).InSecondsF());
+    actions_.Append(std::move(entry));
+    if (action->Type() == DownloadAction::StaticType()) {
+      download_time_ = now - last_time_;
+      // The operation stats are gone once the action is destroyed.
+      const DeltaPerformer* performer =
+          static_cast<DownloadAction*>(action)->delta_performer();
+      if (performer)
+        operations_ = performer->operation_stats().ToValue();
+    }
+    last_time_ = now;
+  }
+
+  ErrorCode code() const { return code_; }
+  const base::ListValue& actions() const { return actions_; }
+  base::TimeDelta download_time() const { return download_time_; }
+  std::unique_ptr<base::ListValue> TakeOperations() {
+    return std::move(operations_);
+  }
+
+ private:
+  ErrorCode code_{ErrorCode::kError};
+  base::TimeTicks last_time_;
+  base::ListValue actions_;
+  base::TimeDelta download_time_;
+  std::unique_ptr<base::ListValue> operations_;
+};
+
+vector<string> SplitFlag(const string& flag) {
+  if (flag.empty())
+    return {};
+  return base::SplitString(
+      flag, ":", base::TRIM_WHITESPACE, base::SPLIT_WANT_ALL);
+}
+
+string DefaultHttpServerPath() {
+  base::FilePath exe_path;
+  base::ReadSymbolicLink(base::FilePath("/proc/self/exe"), &exe_path);
+  return exe_path.DirName().Append("test_http_server").value();
+}
+
+bool RunBenchmark() {
+  const vector<string> names = SplitFlag(FLAGS_partition_names);
+  const vector<string> sources = SplitFlag(FLAGS_source_partitions);
+  const vector<string> targets = SplitFlag(FLAGS_target_partitions);
+  TEST_AND_RETURN_FALSE(!FLAGS_payload.empty());
+  TEST_AND_RETURN_FALSE(!names.empty());
+  TEST_AND_RETURN_FALSE(targets.size() == names.size());
+  TEST_AND_RETURN_FALSE(sources.empty() || sources.size() == names.size());
+  const bool is_delta = !sources.empty();
+
+  const string payload_path =
+      base::MakeAbsoluteFilePath(base::FilePath(FLAGS_payload)).value();
+  TEST_AND_RETURN_FALSE(!payload_path.empty());
+
+  HttpServer server;
+  TEST_AND_RETURN_FALSE(server.Start(
+      FLAGS_http_server.empty() ? DefaultHttpServerPath() : FLAGS_http_server,
+      payload_path));
+
+  FakeBootControl fake_boot_control;
+  FakeHardware fake_hardware;
+  // Official builds only download over HTTPS.
+  fake_hardware.SetIsOfficialBuild(false);
+  MemoryPrefs prefs;
+
+  InstallPlan install_plan;
+  install_plan.source_slot =
+      is_delta ? 0 : BootControlInterface::kInvalidSlot;
+  install_plan.target_slot = 1;
+  if (FLAGS_enable_threading)
+    install_plan.enable_threading = true;
+  InstallPlan::Payload payload;
+  payload.type =
+      is_delta ? InstallPayloadType::kDelta : InstallPayloadType::kFull;
+  payload.size = utils::FileSize(payload_path);
+  TEST_AND_RETURN_FALSE(HashCalculator::RawHashOfFile(
+      payload_path, payload.size, &payload.hash));
+  install_plan.payloads = {payload};
+  // test_http_server takes the serving parameters from the URL, see
+  // HandlePayload() in test_http_server.cc.
+  install_plan.download_url = base::StringPrintf(
+      "http://127.0.0.1:%u/payload/%" PRIu64 "/%d/%" PRIu64,
+      server.port(),
+      FLAGS_bandwidth,
+      FLAGS_latency_ms,
+      FLAGS_drop_every);
+
+  for (size_t i = 0; i < names.size(); i++) {
+    // The partition writer doesn't create missing target images.
+    android::base::unique_fd fd(
+        HANDLE_EINTR(open(targets[i].c_str(), O_WRONLY | O_CREAT, 0644)));
+    if (fd < 0) {
+      PLOG(ERROR) << "Unable to create " << targets[i];
+      return false;
+    }
+    fake_boot_control.SetPartitionDevice(
+        names[i], install_plan.target_slot, targets[i]);
+    if (is_delta) {
+      fake_boot_control.SetPartitionDevice(
+          names[i], install_plan.source_slot, sources[i]);
+    }
+  }
+
+  auto fetcher = std::make_unique<LibcurlHttpFetcher>(&fake_hardware);
+  fetcher->set_retry_seconds(FLAGS_retry_seconds);
+  // Every dropped connection counts as a retry.
+  if (FLAGS_drop_every > 0) {
+    fetcher->set_max_retry_count(payload.size / FLAGS_drop_every +
+                                 kDownloadMaxRetryCount);
+  }
+
+  xz_crc32_init();
+  brillo::BaseMessageLoop loop;
+  loop.SetAsCurrent();
+  auto install_plan_action = std::make_unique<InstallPlanAction>(install_plan);
+  auto download_action =
+      std::make_unique<DownloadAction>(&prefs,
+                                       &fake_boot_control,
+                                       &fake_hardware,
+                                       fetcher.release(),
+                                       true /* interactive */);
+  BenchmarkDownloadDelegate download_delegate;
+  download_action->set_delegate(&download_delegate);
+  auto filesystem_verifier_action = std::make_unique<FilesystemVerifierAction>(
+      fake_boot_control.GetDynamicPartitionControl());
+
+  BondActions(install_plan_action.get(), download_action.get());
+  BondActions(download_action.get(), filesystem_verifier_action.get());
+  ActionProcessor processor;
+  BenchmarkProcessorDelegate delegate;
+  processor.set_delegate(&delegate);
+  processor.EnqueueAction(std::move(install_plan_action));
+  processor.EnqueueAction(std::move(download_action));
+  processor.EnqueueAction(std::move(filesystem_verifier_action));
+
+  const base::TimeTicks start_time = base::TimeTicks::Now();
+  delegate.Start();
+  loop.PostTask(FROM_HERE,
+                base::Bind(&ActionProcessor::StartProcessing,
+                           base::Unretained(&processor)));
+  loop.Run();
+  const base::TimeDelta total_time = base::TimeTicks::Now() - start_time;
+
+  base::DictionaryValue report;
+  report.SetString("error_code", utils::ErrorCodeToString(delegate.code()));
+  report.SetDouble("payload_size", payload.size);
+  report.SetDouble("bytes_downloaded", download_delegate.bytes_downloaded());
+  report.SetDouble("total_seconds", total_time.InSecondsF());
+  if (!delegate.download_time().is_zero()) {
+    report.SetDouble("download_bytes_per_second",
+                     payload.size / delegate.download_time().InSecondsF());
+  }
+  report.Set("actions", delegate.actions().CreateDeepCopy());
+  auto operations = delegate.TakeOperations();
+  if (operations)
+    report.Set("operations", std::move(operations));
+
+  string json;
+  TEST_AND_RETURN_FALSE(base::JSONWriter::WriteWithOptions(
+      report, base::JSONWriter::OPTIONS_PRETTY_PRINT, &json));
+  if (FLAGS_output == "-") {
+    printf("%s", json.c_str());
+  } else {
+    TEST_AND_RETURN_FALSE(
+        utils::WriteFile(FLAGS_output.c_str(), json.data(), json.size()));
+  }
+  return delegate.code() == ErrorCode::kSuccess;
+}
+
+int Main(int argc, char** argv) {
+  gflags::SetUsageMessage(
+      "Applies a payload downloaded from a local test_http_server to file "
+      "backed partitions and reports where the time went as JSON.");
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  CHECK_EQ(argc, 1) << " Unused args.";
+
+  Terminator::Init();
+
+  logging::LoggingSettings log_settings;
+#if BASE_VER < 780000
+  log_settings.log_file = "apply_benchmark.log";
+#else
+  log_settings.log_file_path = "apply_benchmark.log";
+#endif
+  log_settings.logging_dest = logging::LOG_TO_SYSTEM_DEBUG_LOG;
+  log_settings.lock_log = logging::LOCK_LOG_FILE;
+  log_settings.delete_old = logging::APPEND_TO_OLD_LOG_FILE;
+  logging::InitLogging(log_settings);
+
+  return RunBenchmark() ? 0 : 1;
+}
+
+}  // namespace
+
+}  // namespace chromeos_update_engine
+
+int main(int argc, char** argv) {
+  return chromeos_update_engine::Main(argc, argv);
+}
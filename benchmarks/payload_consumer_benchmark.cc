@@ -0,0 +1,1026 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+// Benchmarks of the code paths update_engine spends its time in while applying
+// a payload, run against file backed synthetic partition images. Throughput is
+// reported in bytes/s of partition data and in operations (or writes) per
+// second, e.g.
+//   update_engine_benchmarks --benchmark_filter=ExecuteDiffOperation
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/unique_fd.h>
+#include <benchmark/benchmark.h>
+#include <brillo/secure_blob.h>
+#include <fec/ecc.h>
+#include <google/protobuf/arena.h>
+#include <libsnapshot/cow_writer.h>
+#include <puffin/utils.h>
+#include <verity/hash_tree_builder.h>
+#include <zlib.h>
+
+#include "update_engine/aosp/async_log_writer.h"
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/lz4diff/lz4diff.h"
+#include "update_engine/lz4diff/lz4diff_test_utils.h"
+#include "update_engine/lz4diff/lz4patch.h"
+#include "update_engine/payload_consumer/block_extent_writer.h"
+#include "update_engine/payload_consumer/bzip_extent_writer.h"
+#include "update_engine/payload_consumer/cached_file_descriptor.h"
+#include "update_engine/payload_consumer/extent_map.h"
+#include "update_engine/payload_consumer/extent_writer.h"
+#include "update_engine/payload_consumer/file_descriptor.h"
+#include "update_engine/payload_consumer/file_descriptor_utils.h"
+#include "update_engine/payload_consumer/install_operation_executor.h"
+#include "update_engine/payload_consumer/install_plan.h"
+#include "update_engine/payload_consumer/partition_operations_loader.h"
+#include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_consumer/verity_writer_android.h"
+#include "update_engine/payload_consumer/xor_extent_writer.h"
+#include "update_engine/payload_consumer/xor_utils.h"
+#include "update_engine/payload_consumer/xz_extent_writer.h"
+#include "update_engine/payload_generator/annotated_operation.h"
+#include "update_engine/payload_generator/bzip.h"
+#include "update_engine/payload_generator/delta_diff_generator.h"
+#include "update_engine/payload_generator/delta_diff_utils.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/merge_sequence_generator.h"
+#include "update_engine/payload_generator/payload_generation_config.h"
+#include "update_engine/payload_generator/xz.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+
+using google::protobuf::RepeatedPtrField;
+using test_utils::CompressLikeErofs;
+using test_utils::MakeCompressibleData;
+
+// Size of the images the throughput benchmarks run on.
+constexpr uint64_t kImageBlocks = 2048;
+constexpr uint64_t kImageSize = kImageBlocks * kBlockSize;
+// Size of the images the diff benchmarks run on. Generating the patches is much
+// slower than applying them, so these are smaller.
+constexpr uint64_t kDiffImageSize = 1024 * 1024;
+// Length of the extents used to make the writers seek.
+constexpr uint64_t kFragmentBlocks = 16;
+// A typical line of the update_engine log, and how many the log benchmarks
+// write per iteration.
+constexpr char kLogPrefix[] =
+    "[0101/000000.000000] [INFO:delta_performer.cc(123)] ";
+constexpr char kLogMessage[] =
+    "Completed 1234/5678 operations (21%), 1234 bytes";
+constexpr int kLogLines = 2000;
+
+// Returns a copy of |data| with new data inserted in the middle and one block
+// in every 32 overwritten, roughly what an update does to a file. The result
+// has the size of |data|.
+brillo::Blob MakeModifiedData(const brillo::Blob& data, uint32_t seed) {
+  brillo::Blob modified = data;
+  const brillo::Blob inserted = MakeCompressibleData(64 * 1024, seed);
+  modified.insert(modified.begin() + modified.size() / 2,
+                  inserted.begin(),
+                  inserted.end());
+  const brillo::Blob changed = MakeCompressibleData(kBlockSize, seed + 1);
+  for (size_t offset = 0; offset + kBlockSize <= data.size();
+       offset += 32 * kBlockSize) {
+    std::copy(changed.begin(), changed.end(), modified.begin() + offset);
+  }
+  modified.resize(data.size());
+  return modified;
+}
+
+void PadToBlocks(brillo::Blob* data) {
+  data->resize(utils::DivRoundUp(data->size(), kBlockSize) * kBlockSize);
+}
+
+bool GzipCompress(const brillo::Blob& data, brillo::Blob* output) {
+  z_stream stream{};
+  TEST_AND_RETURN_FALSE(deflateInit2(&stream,
+                                     Z_BEST_COMPRESSION,
+                                     Z_DEFLATED,
+                                     15 + 16,
+                                     8,
+                                     Z_DEFAULT_STRATEGY) == Z_OK);
+  output->resize(deflateBound(&stream, data.size()));
+  stream.next_in = const_cast<uint8_t*>(data.data());
+  stream.avail_in = data.size();
+  stream.next_out = output->data();
+  stream.avail_out = output->size();
+  const int ret = deflate(&stream, Z_FINISH);
+  deflateEnd(&stream);
+  TEST_AND_RETURN_FALSE(ret == Z_STREAM_END);
+  output->resize(stream.total_out);
+  return true;
+}
+
+// Returns [0, |num_blocks|) split into extents of |extent_blocks| blocks, in
+// reverse order, so that every extent needs a seek.
+RepeatedPtrField<Extent> FragmentedExtents(uint64_t num_blocks,
+                                           uint64_t extent_blocks) {
+  RepeatedPtrField<Extent> extents;
+  for (uint64_t end = num_blocks; end > 0;) {
+    const uint64_t start = end > extent_blocks ? end - extent_blocks : 0;
+    *extents.Add() = ExtentForRange(start, end - start);
+    end = start;
+  }
+  return extents;
+}
+
+// A partition image in a temporary file.
+class ImageFile {
+ public:
+  explicit ImageFile(uint64_t size)
+      : file_("benchmark_image.XXXXXX", false, size) {
+    CHECK(fd_->Open(file_.path().c_str(), O_RDWR));
+  }
+  explicit ImageFile(const brillo::Blob& data) : ImageFile(data.size()) {
+    CHECK(utils::PWriteAll(fd_, data.data(), data.size(), 0));
+  }
+
+  const std::string& path() const { return file_.path(); }
+  const FileDescriptorPtr& fd() const { return fd_; }
+
+ private:
+  ScopedTempFile file_;
+  FileDescriptorPtr fd_ = std::make_shared<EintrSafeFileDescriptor>();
+
+  DISALLOW_COPY_AND_ASSIGN(ImageFile);
+};
+
+// Reports |bytes| and |items| processed by each iteration of |state|.
+void SetProcessed(benchmark::State& state, uint64_t bytes, uint64_t items) {
+  state.SetBytesProcessed(state.iterations() * bytes);
+  state.SetItemsProcessed(state.iterations() * items);
+}
+
+// A REPLACE* operation writing an image of |kImageSize| bytes.
+struct ReplacePayload {
+  InstallOperation op;
+  brillo::Blob data;
+};
+
+bool MakeReplacePayload(InstallOperation::Type type, ReplacePayload* payload) {
+  const brillo::Blob data = MakeCompressibleData(kImageSize, 1);
+  payload->op.set_type(type);
+  *payload->op.add_dst_extents() = ExtentForRange(0, kImageBlocks);
+  switch (type) {
+    case InstallOperation::REPLACE:
+      payload->data = data;
+      break;
+    case InstallOperation::REPLACE_BZ:
+      TEST_AND_RETURN_FALSE(BzipCompress(data, &payload->data));
+      break;
+    case InstallOperation::REPLACE_XZ:
+      XzCompressInit();
+      TEST_AND_RETURN_FALSE(XzCompress(data, &payload->data));
+      break;
+    default:
+      return false;
+  }
+  payload->op.set_data_length(payload->data.size());
+  return true;
+}
+
+// A diff operation turning |source| into |target|, both block aligned.
+struct DiffPayload {
+  InstallOperation op;
+  brillo::Blob source;
+  brillo::Blob target;
+  brillo::Blob patch;
+};
+
+// Generates the patch of |payload| with the diff generator, which must pick
+// |type|.
+bool GenerateDiff(InstallOperation::Type type,
+                  const FilesystemInterface::File& old_file,
+                  const FilesystemInterface::File& new_file,
+                  DiffPayload* payload) {
+  uint32_t minor_version = kSourceMinorPayloadVersion;
+  InstallOperation::Type candidate = type;
+  switch (type) {
+    case InstallOperation::SOURCE_BSDIFF:
+      break;
+    case InstallOperation::BROTLI_BSDIFF:
+      // The generator upgrades SOURCE_BSDIFF to BROTLI_BSDIFF when allowed.
+      minor_version = kBrotliBsdiffMinorPayloadVersion;
+      candidate = InstallOperation::SOURCE_BSDIFF;
+      break;
+    case InstallOperation::PUFFDIFF:
+      minor_version = kPuffdiffMinorPayloadVersion;
+      break;
+    case InstallOperation::ZUCCHINI:
+      minor_version = kZucchiniMinorPayloadVersion;
+      break;
+    default:
+      return false;
+  }
+  const std::vector<Extent> src_extents{ExtentForRange(
+      0, payload->source.size() / kBlockSize)};
+  const std::vector<Extent> dst_extents{ExtentForRange(
+      0, payload->target.size() / kBlockSize)};
+  PayloadGenerationConfig config{
+      .version = PayloadVersion(kBrilloMajorPayloadVersion, minor_version)};
+  diff_utils::BestDiffGenerator generator(payload->source,
+                                          payload->target,
+                                          src_extents,
+                                          dst_extents,
+                                          old_file,
+                                          new_file,
+                                          config);
+  AnnotatedOperation aop;
+  // Zucchini only runs on files with certain extensions.
+  aop.name = "benchmark.so";
+  aop.op.set_type(InstallOperation::REPLACE);
+  payload->patch = payload->target;
+  TEST_AND_RETURN_FALSE(generator.GenerateBestDiffOperation(
+      {{candidate, 2 * payload->target.size()}}, &aop, &payload->patch));
+  TEST_AND_RETURN_FALSE(aop.op.type() == type);
+  payload->op.set_type(type);
+  return true;
+}
+
+bool MakeDiffPayload(InstallOperation::Type type, DiffPayload* payload) {
+  const brillo::Blob old_data = MakeCompressibleData(kDiffImageSize, 1);
+  const brillo::Blob new_data = MakeModifiedData(old_data, 2);
+  FilesystemInterface::File old_file;
+  FilesystemInterface::File new_file;
+  switch (type) {
+    case InstallOperation::SOURCE_BSDIFF:
+    case InstallOperation::BROTLI_BSDIFF:
+    case InstallOperation::ZUCCHINI:
+      payload->source = old_data;
+      payload->target = new_data;
+      TEST_AND_RETURN_FALSE(GenerateDiff(type, old_file, new_file, payload));
+      break;
+    case InstallOperation::PUFFDIFF:
+      TEST_AND_RETURN_FALSE(GzipCompress(old_data, &payload->source));
+      TEST_AND_RETURN_FALSE(GzipCompress(new_data, &payload->target));
+      PadToBlocks(&payload->source);
+      PadToBlocks(&payload->target);
+      TEST_AND_RETURN_FALSE(
+          puffin::LocateDeflatesInGzip(payload->source, &old_file.deflates));
+      TEST_AND_RETURN_FALSE(
+          puffin::LocateDeflatesInGzip(payload->target, &new_file.deflates));
+      TEST_AND_RETURN_FALSE(GenerateDiff(type, old_file, new_file, payload));
+      break;
+    case InstallOperation::LZ4DIFF_BSDIFF:
+    case InstallOperation::LZ4DIFF_PUFFDIFF: {
+      CompressedFile old_info;
+      CompressedFile new_info;
+      TEST_AND_RETURN_FALSE(
+          CompressLikeErofs(old_data, 9, &payload->source, &old_info));
+      TEST_AND_RETURN_FALSE(
+          CompressLikeErofs(new_data, 9, &payload->target, &new_info));
+      InstallOperation::Type op_type{};
+      TEST_AND_RETURN_FALSE(Lz4Diff(payload->source,
+                                    payload->target,
+                                    old_info,
+                                    new_info,
+                                    &payload->patch,
+                                    &op_type));
+      // Lz4Diff picks the inner diff algorithm itself.
+      payload->op.set_type(op_type);
+      PadToBlocks(&payload->source);
+      PadToBlocks(&payload->target);
+      break;
+    }
+    default:
+      return false;
+  }
+  *payload->op.add_src_extents() =
+      ExtentForRange(0, payload->source.size() / kBlockSize);
+  *payload->op.add_dst_extents() =
+      ExtentForRange(0, payload->target.size() / kBlockSize);
+  payload->op.set_data_length(payload->patch.size());
+  return true;
+}
+
+// Returns the payload of |type|, generated once per process, or nullptr if it
+// can't be generated.
+const DiffPayload* GetDiffPayload(InstallOperation::Type type) {
+  static std::map<InstallOperation::Type, std::unique_ptr<DiffPayload>>
+      payloads;
+  auto it = payloads.find(type);
+  if (it == payloads.end()) {
+    auto payload = std::make_unique<DiffPayload>();
+    if (!MakeDiffPayload(type, payload.get())) {
+      LOG(ERROR) << "Failed to generate a " << InstallOperationTypeName(type)
+                 << " patch";
+      payload.reset();
+    }
+    it = payloads.emplace(type, std::move(payload)).first;
+  }
+  return it->second.get();
+}
+
+// A BlockExtentWriter which drops the data, to measure the buffering alone.
+// Unless |offer_buffer|, the writers upstream can't decompress into its buffer.
+class NullBlockExtentWriter : public BlockExtentWriter {
+ public:
+  explicit NullBlockExtentWriter(bool offer_buffer = true)
+      : offer_buffer_(offer_buffer) {}
+  bool WriteExtent(const void* bytes,
+                   const Extent& extent,
+                   size_t block_size) override {
+    benchmark::DoNotOptimize(bytes);
+    return true;
+  }
+  uint8_t* GetWritableBuffer(size_t* size) override {
+    return offer_buffer_ ? BlockExtentWriter::GetWritableBuffer(size)
+                         : nullptr;
+  }
+
+ private:
+  const bool offer_buffer_;
+};
+
+// Returns a serialized manifest with |kManifestPartitions| partitions of
+// |kManifestOperations| SOURCE_COPY operations each, built once per process.
+constexpr size_t kManifestPartitions = 4;
+constexpr size_t kManifestOperations = 500000;
+const std::string& GetLargeManifest() {
+  static const std::string* data = [] {
+    // Serialize one partition at a time, so building the manifest doesn't
+    // inflate the RSS.
+    DeltaArchiveManifest header;
+    header.set_block_size(kBlockSize);
+    auto data = new std::string(header.SerializeAsString());
+    for (size_t i = 0; i < kManifestPartitions; i++) {
+      DeltaArchiveManifest manifest;
+      auto partition = manifest.add_partitions();
+      partition->set_partition_name("partition" + std::to_string(i));
+      for (size_t j = 0; j < kManifestOperations; j++) {
+        auto op = partition->add_operations();
+        op->set_type(InstallOperation::SOURCE_COPY);
+        *op->add_src_extents() = ExtentForRange(j * 2, 1);
+        *op->add_dst_extents() = ExtentForRange(j, 1);
+      }
+      *data += manifest.SerializeAsString();
+    }
+    return data;
+  }();
+  return *data;
+}
+
+// Returns the resident set size of this process in bytes.
+int64_t GetRss() {
+  int64_t pages = 0;
+  FILE* statm = fopen("/proc/self/statm", "r");
+  if (statm) {
+    if (fscanf(statm, "%*d %" SCNd64, &pages) != 1)
+      pages = 0;
+    fclose(statm);
+  }
+  return pages * getpagesize();
+}
+
+}  // namespace
+
+void BM_ExecuteReplaceOperation(benchmark::State& state,
+                                InstallOperation::Type type) {
+  ReplacePayload payload;
+  if (!MakeReplacePayload(type, &payload)) {
+    state.SkipWithError("Failed to generate the payload");
+    return;
+  }
+  ImageFile target(kImageSize);
+  InstallOperationExecutor executor(kBlockSize);
+  for (auto _ : state) {
+    if (!executor.ExecuteReplaceOperation(
+            payload.op,
+            std::make_unique<DirectExtentWriter>(target.fd()),
+            payload.data.data())) {
+      state.SkipWithError("Failed to execute the operation");
+      break;
+    }
+  }
+  SetProcessed(state, kImageSize, 1);
+}
+BENCHMARK_CAPTURE(BM_ExecuteReplaceOperation,
+                  REPLACE,
+                  InstallOperation::REPLACE)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_ExecuteReplaceOperation,
+                  REPLACE_BZ,
+                  InstallOperation::REPLACE_BZ)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_ExecuteReplaceOperation,
+                  REPLACE_XZ,
+                  InstallOperation::REPLACE_XZ)
+    ->Unit(benchmark::kMillisecond);
+
+void BM_ExecuteZeroOrDiscardOperation(benchmark::State& state,
+                                      InstallOperation::Type type) {
+  InstallOperation op;
+  op.set_type(type);
+  *op.mutable_dst_extents() = FragmentedExtents(kImageBlocks, kFragmentBlocks);
+  ImageFile target(kImageSize);
+  InstallOperationExecutor executor(kBlockSize);
+  for (auto _ : state) {
+    if (!executor.ExecuteZeroOrDiscardOperation(
+            op, std::make_unique<DirectExtentWriter>(target.fd()))) {
+      state.SkipWithError("Failed to execute the operation");
+      break;
+    }
+  }
+  SetProcessed(state, kImageSize, 1);
+}
+BENCHMARK_CAPTURE(BM_ExecuteZeroOrDiscardOperation,
+                  ZERO,
+                  InstallOperation::ZERO)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_ExecuteZeroOrDiscardOperation,
+                  DISCARD,
+                  InstallOperation::DISCARD)
+    ->Unit(benchmark::kMillisecond);
+
+void BM_ExecuteSourceCopyOperation(benchmark::State& state) {
+  InstallOperation op;
+  op.set_type(InstallOperation::SOURCE_COPY);
+  *op.mutable_src_extents() = FragmentedExtents(kImageBlocks, kFragmentBlocks);
+  *op.add_dst_extents() = ExtentForRange(0, kImageBlocks);
+  ImageFile source(MakeCompressibleData(kImageSize, 1));
+  ImageFile target(kImageSize);
+  InstallOperationExecutor executor(kBlockSize);
+  for (auto _ : state) {
+    if (!executor.ExecuteSourceCopyOperation(
+            op,
+            std::make_unique<DirectExtentWriter>(target.fd()),
+            source.fd())) {
+      state.SkipWithError("Failed to execute the operation");
+      break;
+    }
+  }
+  SetProcessed(state, kImageSize, 1);
+}
+BENCHMARK(BM_ExecuteSourceCopyOperation)->Unit(benchmark::kMillisecond);
+
+void BM_ExecuteDiffOperation(benchmark::State& state,
+                             InstallOperation::Type type) {
+  const DiffPayload* payload = GetDiffPayload(type);
+  if (payload == nullptr) {
+    state.SkipWithError("Failed to generate the patch");
+    return;
+  }
+  ImageFile source(payload->source);
+  ImageFile target(payload->target.size());
+  InstallOperationExecutor executor(kBlockSize);
+  for (auto _ : state) {
+    if (!executor.ExecuteDiffOperation(
+            payload->op,
+            std::make_unique<DirectExtentWriter>(target.fd()),
+            source.fd(),
+            payload->patch.data(),
+            payload->patch.size())) {
+      state.SkipWithError("Failed to execute the operation");
+      break;
+    }
+  }
+  SetProcessed(state, payload->target.size(), 1);
+}
+BENCHMARK_CAPTURE(BM_ExecuteDiffOperation,
+                  SOURCE_BSDIFF,
+                  InstallOperation::SOURCE_BSDIFF)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_ExecuteDiffOperation,
+                  BROTLI_BSDIFF,
+                  InstallOperation::BROTLI_BSDIFF)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_ExecuteDiffOperation,
+                  PUFFDIFF,
+                  InstallOperation::PUFFDIFF)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_ExecuteDiffOperation,
+                  ZUCCHINI,
+                  InstallOperation::ZUCCHINI)
+    ->Unit(benchmark::kMillisecond);
+// Lz4Diff decides between LZ4DIFF_BSDIFF and LZ4DIFF_PUFFDIFF, so this covers
+// whichever it picks for the synthetic image.
+BENCHMARK_CAPTURE(BM_ExecuteDiffOperation,
+                  LZ4DIFF,
+                  InstallOperation::LZ4DIFF_BSDIFF)
+    ->Unit(benchmark::kMillisecond);
+
+void BM_Lz4Patch(benchmark::State& state) {
+  const DiffPayload* payload =
+      GetDiffPayload(InstallOperation::LZ4DIFF_BSDIFF);
+  if (payload == nullptr) {
+    state.SkipWithError("Failed to generate the patch");
+    return;
+  }
+  size_t patched_size = 0;
+  for (auto _ : state) {
+    patched_size = 0;
+    if (!Lz4Patch(ToStringView(payload->source),
+                  ToStringView(payload->patch),
+                  [&patched_size](const uint8_t* data, size_t size) {
+                    benchmark::DoNotOptimize(data);
+                    patched_size += size;
+                    return size;
+                  })) {
+      state.SkipWithError("Failed to apply the patch");
+      break;
+    }
+  }
+  SetProcessed(state, patched_size, 1);
+}
+BENCHMARK(BM_Lz4Patch)->Unit(benchmark::kMillisecond);
+
+// Decompressing into the downstream writer's buffer against decompressing into
+// an intermediate buffer. Arg: whether the downstream writer offers its buffer.
+void BM_DecompressingExtentWriter(benchmark::State& state,
+                                  InstallOperation::Type type) {
+  const bool offer_buffer = state.range(0);
+  ReplacePayload payload;
+  if (!MakeReplacePayload(type, &payload)) {
+    state.SkipWithError("Failed to generate the payload");
+    return;
+  }
+  for (auto _ : state) {
+    auto null_writer = std::make_unique<NullBlockExtentWriter>(offer_buffer);
+    std::unique_ptr<ExtentWriter> writer;
+    if (type == InstallOperation::REPLACE_BZ) {
+      writer = std::make_unique<BzipExtentWriter>(std::move(null_writer));
+    } else {
+      writer = std::make_unique<XzExtentWriter>(std::move(null_writer));
+    }
+    if (!writer->Init(payload.op.dst_extents(), kBlockSize) ||
+        !writer->Write(payload.data.data(), payload.data.size())) {
+      state.SkipWithError("Failed to decompress the data");
+      break;
+    }
+  }
+  SetProcessed(state, kImageSize, 1);
+}
+BENCHMARK_CAPTURE(BM_DecompressingExtentWriter,
+                  REPLACE_BZ,
+                  InstallOperation::REPLACE_BZ)
+    ->ArgName("offer_buffer")
+    ->Arg(0)
+    ->Arg(1)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_DecompressingExtentWriter,
+                  REPLACE_XZ,
+                  InstallOperation::REPLACE_XZ)
+    ->ArgName("offer_buffer")
+    ->Arg(0)
+    ->Arg(1)
+    ->Unit(benchmark::kMillisecond);
+
+// Arg: bytes per Write() call.
+void BM_DirectExtentWriter(benchmark::State& state) {
+  const size_t write_size = state.range(0);
+  const brillo::Blob data = MakeCompressibleData(kImageSize, 1);
+  const auto extents = FragmentedExtents(kImageBlocks, kFragmentBlocks);
+  ImageFile target(kImageSize);
+  for (auto _ : state) {
+    DirectExtentWriter writer(target.fd());
+    bool success = writer.Init(extents, kBlockSize);
+    for (size_t offset = 0; success && offset < data.size();
+         offset += write_size) {
+      success = writer.Write(data.data() + offset,
+                             std::min(write_size, data.size() - offset));
+    }
+    if (!success) {
+      state.SkipWithError("Failed to write the extents");
+      break;
+    }
+  }
+  SetProcessed(state, kImageSize, utils::DivRoundUp(kImageSize, write_size));
+}
+BENCHMARK(BM_DirectExtentWriter)
+    ->ArgName("write_size")
+    ->Arg(1000)
+    ->Arg(kBlockSize)
+    ->Arg(1024 * 1024);
+
+// Arg: bytes per Write() call.
+void BM_BlockExtentWriter(benchmark::State& state) {
+  const size_t write_size = state.range(0);
+  const brillo::Blob data = MakeCompressibleData(kImageSize, 1);
+  const auto extents = FragmentedExtents(kImageBlocks, kFragmentBlocks);
+  for (auto _ : state) {
+    NullBlockExtentWriter writer;
+    bool success = writer.Init(extents, kBlockSize);
+    for (size_t offset = 0; success && offset < data.size();
+         offset += write_size) {
+      success = writer.Write(data.data() + offset,
+                             std::min(write_size, data.size() - offset));
+    }
+    if (!success) {
+      state.SkipWithError("Failed to write the extents");
+      break;
+    }
+  }
+  SetProcessed(state, kImageSize, utils::DivRoundUp(kImageSize, write_size));
+}
+BENCHMARK(BM_BlockExtentWriter)
+    ->ArgName("write_size")
+    ->Arg(1000)
+    ->Arg(kBlockSize)
+    ->Arg(1024 * 1024);
+
+void BM_XORExtentWriter(benchmark::State& state) {
+  constexpr uint32_t kCowVersion = 2;
+  constexpr uint64_t kXorRunBlocks = 32;
+  const brillo::Blob source_data = MakeCompressibleData(kImageSize, 1);
+  const brillo::Blob target_data = MakeModifiedData(source_data, 2);
+  ImageFile source(source_data);
+  ScopedTempFile cow_file("benchmark_cow.XXXXXX");
+
+  InstallOperation op;
+  op.set_type(InstallOperation::SOURCE_BSDIFF);
+  *op.add_src_extents() = ExtentForRange(0, kImageBlocks);
+  *op.add_dst_extents() = ExtentForRange(0, kImageBlocks);
+  // Every other run of blocks is XORed with source data at an unaligned
+  // offset, the rest are written as raw blocks.
+  std::vector<CowMergeOperation> merge_ops;
+  for (uint64_t block = 0; block + kXorRunBlocks < kImageBlocks;
+       block += 2 * kXorRunBlocks) {
+    merge_ops.push_back(
+        CreateCowMergeOperation(ExtentForRange(block, kXorRunBlocks),
+                                ExtentForRange(block, kXorRunBlocks),
+                                CowMergeOperation::COW_XOR,
+                                777));
+  }
+  ExtentMap<const CowMergeOperation*> xor_map;
+  for (const auto& merge_op : merge_ops) {
+    CHECK(xor_map.AddExtent(merge_op.dst_extent(), &merge_op));
+  }
+
+  for (auto _ : state) {
+    state.PauseTiming();
+    android::base::unique_fd cow_fd(
+        open(cow_file.path().c_str(), O_RDWR | O_TRUNC));
+    auto cow_writer = android::snapshot::CreateCowWriter(
+        kCowVersion,
+        android::snapshot::CowOptions{.block_size = kBlockSize,
+                                      .compression = "none"},
+        std::move(cow_fd));
+    state.ResumeTiming();
+    if (cow_writer == nullptr) {
+      state.SkipWithError("Failed to create the COW writer");
+      break;
+    }
+    XORExtentWriter writer(
+        op, source.fd(), cow_writer.get(), xor_map, kImageSize);
+    if (!writer.Init(op.dst_extents(), kBlockSize) ||
+        !writer.Write(target_data.data(), target_data.size()) ||
+        !cow_writer->Finalize()) {
+      state.SkipWithError("Failed to write the COW");
+      break;
+    }
+  }
+  SetProcessed(state, kImageSize, 1);
+}
+BENCHMARK(BM_XORExtentWriter)->Unit(benchmark::kMillisecond);
+
+// The XOR kernel against the byte by byte loop it replaced.
+void BM_XorInPlace(benchmark::State& state,
+                   void (*xor_in_place)(uint8_t*, const uint8_t*, size_t)) {
+  brillo::Blob src(kImageSize, 0x5A);
+  brillo::Blob dst(src.size(), 0xA5);
+  for (auto _ : state) {
+    xor_in_place(dst.data(), src.data(), dst.size());
+    benchmark::DoNotOptimize(dst.data());
+  }
+  SetProcessed(state, dst.size(), 1);
+}
+BENCHMARK_CAPTURE(BM_XorInPlace, XorInPlace, XorInPlace)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_XorInPlace, XorInPlaceScalar, XorInPlaceScalar)
+    ->Unit(benchmark::kMillisecond);
+
+// Args: cache size, bytes per Write() call.
+template <typename CachedFd>
+void BM_CachedFileDescriptor(benchmark::State& state) {
+  const size_t cache_size = state.range(0);
+  const size_t write_size = state.range(1);
+  const brillo::Blob data = MakeCompressibleData(kImageSize, 1);
+  ImageFile target(kImageSize);
+  CachedFd fd(target.fd(), cache_size);
+  for (auto _ : state) {
+    bool success = fd.Seek(0, SEEK_SET) == 0;
+    for (size_t offset = 0; success && offset < data.size();
+         offset += write_size) {
+      success = utils::WriteAll(&fd,
+                                data.data() + offset,
+                                std::min(write_size, data.size() - offset));
+    }
+    if (!success || !fd.Flush()) {
+      state.SkipWithError("Failed to write the file");
+      break;
+    }
+  }
+  SetProcessed(state, kImageSize, utils::DivRoundUp(kImageSize, write_size));
+}
+BENCHMARK_TEMPLATE(BM_CachedFileDescriptor, CachedFileDescriptor)
+    ->ArgNames({"cache_size", "write_size"})
+    ->Args({kBlockSize, 1000})
+    ->Args({64 * 1024, 1000})
+    ->Args({1024 * 1024, 1000})
+    ->Args({1024 * 1024, 64 * 1024});
+BENCHMARK_TEMPLATE(BM_CachedFileDescriptor, AsyncCachedFileDescriptor)
+    ->ArgNames({"cache_size", "write_size"})
+    ->Args({64 * 1024, 1000})
+    ->Args({1024 * 1024, 1000})
+    ->Args({1024 * 1024, 64 * 1024});
+
+// Writes extents of random size at random offsets, like the blocks written by
+// InstallOperations. Arg: cache size.
+template <typename CachedFd>
+void BM_CachedFileDescriptorRandomExtents(benchmark::State& state) {
+  constexpr size_t kNumExtents = 1000;
+  constexpr uint64_t kMaxExtentBlocks = 64;
+  const size_t cache_size = state.range(0);
+  const brillo::Blob data(kMaxExtentBlocks * kBlockSize, 0x5A);
+  uint32_t seed = 0;
+  std::vector<Extent> extents;
+  uint64_t bytes = 0;
+  for (size_t i = 0; i < kNumExtents; i++) {
+    const uint64_t num_blocks = 1 + rand_r(&seed) % kMaxExtentBlocks;
+    const uint64_t start_block = rand_r(&seed) % (kImageBlocks - num_blocks);
+    extents.push_back(ExtentForRange(start_block, num_blocks));
+    bytes += num_blocks * kBlockSize;
+  }
+  ImageFile target(kImageSize);
+  CachedFd fd(target.fd(), cache_size);
+  for (auto _ : state) {
+    bool success = true;
+    for (const Extent& extent : extents) {
+      const off64_t offset = extent.start_block() * kBlockSize;
+      success = fd.Seek(offset, SEEK_SET) == offset &&
+                utils::WriteAll(
+                    &fd, data.data(), extent.num_blocks() * kBlockSize);
+      if (!success)
+        break;
+    }
+    if (!success || !fd.Flush()) {
+      state.SkipWithError("Failed to write the file");
+      break;
+    }
+  }
+  SetProcessed(state, bytes, kNumExtents);
+  if constexpr (std::is_same_v<CachedFd, AsyncCachedFileDescriptor>) {
+    const auto stats = fd.GetStats();
+    state.counters["flushes"] = stats.flushes;
+    state.counters["stalls"] = stats.stalls;
+  }
+}
+BENCHMARK_TEMPLATE(BM_CachedFileDescriptorRandomExtents, CachedFileDescriptor)
+    ->ArgName("cache_size")
+    ->Arg(1024 * 1024)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_CachedFileDescriptorRandomExtents,
+                   AsyncCachedFileDescriptor)
+    ->ArgName("cache_size")
+    ->Arg(1024 * 1024)
+    ->Unit(benchmark::kMillisecond);
+
+void BM_CopyAndHashExtents(benchmark::State& state) {
+  const auto src_extents = FragmentedExtents(kImageBlocks, kFragmentBlocks);
+  RepeatedPtrField<Extent> tgt_extents;
+  *tgt_extents.Add() = ExtentForRange(0, kImageBlocks);
+  ImageFile source(MakeCompressibleData(kImageSize, 1));
+  ImageFile target(kImageSize);
+  brillo::Blob hash;
+  for (auto _ : state) {
+    if (!fd_utils::CopyAndHashExtents(source.fd(),
+                                      src_extents,
+                                      target.fd(),
+                                      tgt_extents,
+                                      kBlockSize,
+                                      &hash)) {
+      state.SkipWithError("Failed to copy the extents");
+      break;
+    }
+  }
+  SetProcessed(state, kImageSize, 1);
+}
+BENCHMARK(BM_CopyAndHashExtents)->Unit(benchmark::kMillisecond);
+
+// Arg: bytes per Update() call.
+void BM_HashCalculator(benchmark::State& state) {
+  const size_t chunk_size = state.range(0);
+  const brillo::Blob data = MakeCompressibleData(kImageSize, 1);
+  for (auto _ : state) {
+    HashCalculator calculator;
+    for (size_t offset = 0; offset < data.size(); offset += chunk_size) {
+      calculator.Update(data.data() + offset,
+                        std::min(chunk_size, data.size() - offset));
+    }
+    if (!calculator.Finalize()) {
+      state.SkipWithError("Failed to hash the data");
+      break;
+    }
+    benchmark::DoNotOptimize(calculator.raw_hash().data());
+  }
+  SetProcessed(state, kImageSize, utils::DivRoundUp(kImageSize, chunk_size));
+}
+BENCHMARK(BM_HashCalculator)
+    ->ArgName("chunk_size")
+    ->Arg(kBlockSize)
+    ->Arg(64 * 1024)
+    ->Arg(1024 * 1024);
+
+void BM_VerityWriterHashTree(benchmark::State& state) {
+  constexpr size_t kUpdateSize = 1024 * 1024;
+  const brillo::Blob data = MakeCompressibleData(kImageSize, 1);
+  InstallPlan::Partition partition;
+  partition.block_size = kBlockSize;
+  partition.hash_tree_algorithm = "sha256";
+  partition.hash_tree_data_offset = 0;
+  partition.hash_tree_data_size = kImageSize;
+  partition.hash_tree_offset = kImageSize;
+  partition.hash_tree_size =
+      HashTreeBuilder(kBlockSize, HashTreeBuilder::HashFunction("sha256"))
+          .CalculateSize(kImageSize);
+  ImageFile image(kImageSize + partition.hash_tree_size);
+  CHECK(utils::PWriteAll(image.fd(), data.data(), data.size(), 0));
+  partition.target_path = image.path();
+  for (auto _ : state) {
+    VerityWriterAndroid verity_writer;
+    bool success = verity_writer.Init(partition);
+    for (size_t offset = 0; success && offset < data.size();
+         offset += kUpdateSize) {
+      success = verity_writer.Update(offset, data.data() + offset, kUpdateSize);
+    }
+    if (!success ||
+        !verity_writer.Finalize(image.fd().get(), image.fd().get())) {
+      state.SkipWithError("Failed to write the hash tree");
+      break;
+    }
+  }
+  SetProcessed(state, kImageSize, 1);
+}
+BENCHMARK(BM_VerityWriterHashTree)->Unit(benchmark::kMillisecond);
+
+// Arg: FEC roots.
+void BM_VerityWriterEncodeFEC(benchmark::State& state) {
+  const uint32_t fec_roots = state.range(0);
+  const uint64_t fec_size =
+      utils::DivRoundUp(kImageBlocks, FEC_RSM - fec_roots) * fec_roots *
+      kBlockSize;
+  ImageFile image(kImageSize + fec_size);
+  const brillo::Blob data = MakeCompressibleData(kImageSize, 1);
+  CHECK(utils::PWriteAll(image.fd(), data.data(), data.size(), 0));
+  for (auto _ : state) {
+    if (!VerityWriterAndroid::EncodeFEC(image.fd().get(),
+                                        image.fd().get(),
+                                        0,
+                                        kImageSize,
+                                        kImageSize,
+                                        fec_size,
+                                        fec_roots,
+                                        kBlockSize,
+                                        false /* verify_mode */)) {
+      state.SkipWithError("Failed to encode FEC");
+      break;
+    }
+  }
+  SetProcessed(state, kImageSize, 1);
+}
+BENCHMARK(BM_VerityWriterEncodeFEC)
+    ->ArgName("fec_roots")
+    ->Arg(2)
+    ->Arg(16)
+    ->Unit(benchmark::kMillisecond);
+
+// Parses the whole manifest at once, the |rss| counter is the memory it takes.
+// Arg: whether the manifest is allocated on an Arena.
+void BM_ParseManifest(benchmark::State& state) {
+  const bool on_arena = state.range(0);
+  const std::string& data = GetLargeManifest();
+  for (auto _ : state) {
+    const int64_t rss = GetRss();
+    google::protobuf::Arena arena;
+    DeltaArchiveManifest heap_manifest;
+    DeltaArchiveManifest* manifest =
+        on_arena
+            ? google::protobuf::Arena::CreateMessage<DeltaArchiveManifest>(
+                  &arena)
+            : &heap_manifest;
+    if (!manifest->ParseFromString(data)) {
+      state.SkipWithError("Failed to parse the manifest");
+      break;
+    }
+    state.counters["rss"] = benchmark::Counter(GetRss() - rss,
+                                               benchmark::Counter::kDefaults,
+                                               benchmark::Counter::kIs1024);
+  }
+  SetProcessed(
+      state, data.size(), kManifestPartitions * kManifestOperations);
+}
+BENCHMARK(BM_ParseManifest)
+    ->ArgName("on_arena")
+    ->Arg(0)
+    ->Arg(1)
+    ->Unit(benchmark::kMillisecond);
+
+// Parses the manifest through PartitionOperationsLoader, one partition at a
+// time, the way DeltaPerformer does. The |rss| counter is the memory the
+// manifest without its operations takes.
+void BM_PartitionOperationsLoader(benchmark::State& state) {
+  const std::string& data = GetLargeManifest();
+  for (auto _ : state) {
+    const int64_t rss = GetRss();
+    PartitionOperationsLoader loader;
+    DeltaArchiveManifest manifest;
+    if (!loader.Init(reinterpret_cast<const uint8_t*>(data.data()),
+                     data.size(),
+                     &manifest)) {
+      state.SkipWithError("Failed to parse the manifest");
+      break;
+    }
+    state.counters["rss"] = benchmark::Counter(GetRss() - rss,
+                                               benchmark::Counter::kDefaults,
+                                               benchmark::Counter::kIs1024);
+    for (size_t i = 0; i < loader.partitions_size(); i++) {
+      google::protobuf::Arena arena;
+      auto partition =
+          google::protobuf::Arena::CreateMessage<PartitionUpdate>(&arena);
+      partition->CopyFrom(manifest.partitions(i));
+      if (!loader.LoadOperations(i, partition)) {
+        state.SkipWithError("Failed to load the operations");
+        return;
+      }
+    }
+  }
+  SetProcessed(
+      state, data.size(), kManifestPartitions * kManifestOperations);
+}
+BENCHMARK(BM_PartitionOperationsLoader)->Unit(benchmark::kMillisecond);
+
+// What the file logger did before AsyncLogWriter: three writes and a sync per
+// line.
+void BM_SynchronousLogWrites(benchmark::State& state) {
+  const std::string_view prefix = kLogPrefix;
+  const std::string_view message = kLogMessage;
+  ScopedTempFile log_file("benchmark_log.XXXXXX");
+  android::base::unique_fd fd(open(log_file.path().c_str(), O_WRONLY));
+  for (auto _ : state) {
+    for (int i = 0; i < kLogLines; i++) {
+      if (!android::base::WriteFully(fd, prefix.data(), prefix.size()) ||
+          !android::base::WriteFully(fd, message.data(), message.size()) ||
+          !android::base::WriteFully(fd, "\n", 1) || fsync(fd) != 0) {
+        state.SkipWithError("Failed to write the log");
+        return;
+      }
+    }
+  }
+  SetProcessed(state,
+               (prefix.size() + message.size() + 1) * kLogLines,
+               kLogLines);
+}
+BENCHMARK(BM_SynchronousLogWrites)->Unit(benchmark::kMillisecond);
+
+// Includes the final flush when the writer is destroyed.
+void BM_AsyncLogWriter(benchmark::State& state) {
+  const std::string_view prefix = kLogPrefix;
+  const std::string_view message = kLogMessage;
+  ScopedTempFile log_file("benchmark_log.XXXXXX");
+  for (auto _ : state) {
+    AsyncLogWriter writer(
+        android::base::unique_fd(open(log_file.path().c_str(), O_WRONLY)));
+    for (int i = 0; i < kLogLines; i++)
+      writer.Write({prefix, message, "\n"});
+  }
+  SetProcessed(state,
+               (prefix.size() + message.size() + 1) * kLogLines,
+               kLogLines);
+}
+BENCHMARK(BM_AsyncLogWriter)->Unit(benchmark::kMillisecond);
+
+}  // namespace chromeos_update_engine
+
+BENCHMARK_MAIN();
@@ -128,6 +128,10 @@ static constexpr const auto& kPrefsUpdateOverCellularTargetSize =
     "update-over-cellular-target-size";
 static constexpr const auto& kPrefsUpdateServerCertificate =
     "update-server-cert";
+static constexpr const auto& kPrefsUpdateStateCheckpointDuration =
+    "update-state-checkpoint-duration";
+static constexpr const auto& kPrefsUpdateStateCheckpointInterval =
+    "update-state-checkpoint-interval";
 static constexpr const auto& kPrefsUpdateStateNextDataLength =
     "update-state-next-data-length";
 static constexpr const auto& kPrefsUpdateStateNextDataOffset =
@@ -142,6 +146,14 @@ static constexpr const auto& kPrefsUpdateStateSignatureBlob =
     "update-state-signature-blob";
 static constexpr const auto& kPrefsUpdateStateSignedSHA256Context =
     "update-state-signed-sha-256-context";
+static constexpr const auto& kPrefsUpdateStateSpillQueueEmptyWaits =
+    "update-state-spill-queue-empty-waits";
+static constexpr const auto& kPrefsUpdateStateSpillQueueHighWaterWaits =
+    "update-state-spill-queue-high-water-waits";
+static constexpr const auto& kPrefsUpdateStateSpillQueuePeakBytes =
+    "update-state-spill-queue-peak-bytes";
+static constexpr const auto& kPrefsUpdateStateSpillQueueSpilledBytes =
+    "update-state-spill-queue-spilled-bytes";
 static constexpr const auto& kPrefsUpdateBootTimestampStart =
     "update-boot-timestamp-start";
 static constexpr const auto& kPrefsUpdateTimestampStart =
@@ -186,6 +198,12 @@ static constexpr const auto& kPayloadDisableVABC = "DISABLE_VABC";
 static constexpr const auto& kPayloadEnableThreading = "ENABLE_THREADING";
 // Enable batched writes for VABC
 static constexpr const auto& kPayloadBatchedWrites = "BATCHED_WRITES";
+// Keep downloading while the payload is applied, spilling to /data if needed
+static constexpr const auto& kPayloadSpillDownload = "SPILL_DOWNLOAD";
+// Number of operations whose source is prefetched ahead, 0 to disable
+static constexpr const auto& kPayloadSourcePrefetchOps = "SOURCE_PREFETCH_OPS";
+// Mark the stages of every install operation in the system trace
+static constexpr const auto& kPayloadTraceOperations = "TRACE_OPERATIONS";
 
 // Max retry count for download
 static constexpr const auto& kPayloadDownloadRetry = "DOWNLOAD_RETRY";
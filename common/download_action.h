@@ -23,13 +23,20 @@
 
 #include <memory>
 #include <string>
+#include <thread>
 #include <utility>
 
+#include <base/memory/weak_ptr.h>
+#include <base/single_thread_task_runner.h>
+#include <base/time/time.h>
+
 #include "update_engine/common/boot_control_interface.h"
 #include "update_engine/common/http_fetcher.h"
 #include "update_engine/common/multi_range_http_fetcher.h"
 #include "update_engine/payload_consumer/delta_performer.h"
 #include "update_engine/payload_consumer/install_plan.h"
+#include "update_engine/payload_consumer/main_thread_lease.h"
+#include "update_engine/payload_consumer/payload_spill_queue.h"
 
 // The Download Action downloads a specified url to disk. The url should point
 // to an update in a delta payload format. The payload will be piped into a
@@ -110,6 +117,12 @@ class DownloadAction : public InstallPlanAction, public HttpFetcherDelegate {
 
   HttpFetcher* http_fetcher() { return http_fetcher_.get(); }
 
+  // The DeltaPerformer applying the payload, nullptr before the download
+  // starts or once the action was terminated.
+  const DeltaPerformer* delta_performer() const {
+    return delta_performer_.get();
+  }
+
  private:
   // Attempt to load cached manifest data from prefs
   // return true on success, false otherwise.
@@ -118,6 +131,28 @@ class DownloadAction : public InstallPlanAction, public HttpFetcherDelegate {
   // Start downloading the current payload using delta_performer.
   void StartDownloading();
 
+  // Starts |applier_|, which applies the payload from |spill_queue_| while
+  // the download continues on the main thread.
+  bool StartApplier();
+
+  // Runs on |applier_| until the queue is closed and drained or a write fails,
+  // then posts OnApplierDone() to |task_runner|.
+  void ApplyQueuedData(scoped_refptr<base::SingleThreadTaskRunner> task_runner,
+                       base::WeakPtr<DownloadAction> weak_this);
+
+  // Aborts and joins |applier_|. Returns the error it failed with, if any.
+  ErrorCode StopApplier();
+
+  // Called on the main thread once |applier_| is done with |code|.
+  void OnApplierDone(ErrorCode code);
+
+  // Verifies the applied payload and completes the action.
+  void FinishTransfer(bool successful);
+
+  // Logs the state of |spill_queue_|. With |final| set, also adds its high- and
+  // low-water statistics to the ones kept in the prefs for the metrics.
+  void LogSpillQueueStats(bool final);
+
   // Pointer to the current payload in install_plan_.payloads.
   InstallPlan::Payload* payload_{nullptr};
 
@@ -156,6 +191,20 @@ class DownloadAction : public InstallPlanAction, public HttpFetcherDelegate {
   // The path to the zip file with X509 certificates.
   const std::string update_certificates_path_;
 
+  // Only used when |install_plan_.spill_download| is set. Received bytes are
+  // pushed to |spill_queue_| and |applier_| writes them to
+  // |delta_performer_|, which only uses the prefs, the boot control, the
+  // hardware and |delegate_| while it holds |main_thread_lease_|.
+  std::unique_ptr<PayloadSpillQueue> spill_queue_;
+  std::unique_ptr<MainThreadLease> main_thread_lease_;
+  std::thread applier_;
+  // Set by |applier_| before it exits.
+  ErrorCode applier_code_{ErrorCode::kSuccess};
+  base::TimeTicks spill_queue_log_time_;
+
+  // Must be the last member.
+  base::WeakPtrFactory<DownloadAction> weak_ptr_factory_{this};
+
   DISALLOW_COPY_AND_ASSIGN(DownloadAction);
 };
 
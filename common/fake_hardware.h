@@ -133,6 +133,13 @@ class FakeHardware : public HardwareInterface {
 
   bool AllowDowngrade() const override { return false; }
 
+  bool GetPowerState(PowerState* state) const override {
+    if (!power_state_known_)
+      return false;
+    *state = power_state_;
+    return true;
+  }
+
   bool GetFirstActiveOmahaPingSent() const override {
     return first_active_omaha_ping_sent_;
   }
@@ -192,6 +199,11 @@ class FakeHardware : public HardwareInterface {
     build_timestamp_ = build_timestamp;
   }
 
+  void SetPowerState(const PowerState& power_state) {
+    power_state_ = power_state;
+    power_state_known_ = true;
+  }
+
   void SetWarmReset(bool warm_reset) override { warm_reset_ = warm_reset; }
 
   void SetVbmetaDigestForInactiveSlot(bool reset) override {}
@@ -245,6 +257,8 @@ class FakeHardware : public HardwareInterface {
   bool powerwash_scheduled_{false};
   bool save_rollback_data_{false};
   int64_t build_timestamp_{0};
+  PowerState power_state_;
+  bool power_state_known_{false};
   bool first_active_omaha_ping_sent_{false};
   bool warm_reset_{false};
   mutable std::map<std::string, std::string> partition_timestamps_;
@@ -16,8 +16,14 @@
 
 #include "update_engine/common/file_fetcher.h"
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include <algorithm>
 #include <string>
+#include <utility>
 
 #include <base/bind.h>
 #include <base/format_macros.h>
@@ -29,6 +35,7 @@
 
 #include "update_engine/common/hardware_interface.h"
 #include "update_engine/common/platform_constants.h"
+#include "update_engine/common/utils.h"
 
 using std::string;
 
@@ -73,9 +80,18 @@ void FileFetcher::BeginTransfer(const string& url) {
   if (base::StartsWith(url, "fd://", base::CompareCase::INSENSITIVE_ASCII)) {
     int fd = std::stoi(url.substr(strlen("fd://")));
     file_path = url;
+    // The caller keeps ownership of |fd|, so map a duplicate of it.
+    if (StartMappedTransfer(
+            android::base::unique_fd(fcntl(fd, F_DUPFD_CLOEXEC, 0)))) {
+      return;
+    }
     stream_ = brillo::FileStream::FromFileDescriptor(fd, false, nullptr);
   } else {
     file_path = url.substr(strlen("file://"));
+    if (StartMappedTransfer(android::base::unique_fd(
+            open(file_path.c_str(), O_RDONLY | O_CLOEXEC)))) {
+      return;
+    }
     stream_ =
         brillo::FileStream::Open(base::FilePath(file_path),
                                  brillo::Stream::AccessMode::READ,
@@ -100,6 +116,21 @@ void FileFetcher::BeginTransfer(const string& url) {
   ScheduleRead();
 }
 
+bool FileFetcher::StartMappedTransfer(android::base::unique_fd fd) {
+  struct stat st {};
+  if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+    return false;
+  mapped_fd_ = std::move(fd);
+  mapped_file_size_ = st.st_size;
+  posix_fadvise(mapped_fd_, offset_, 0, POSIX_FADV_SEQUENTIAL);
+
+  http_response_code_ = kHttpResponseOk;
+  bytes_copied_ = 0;
+  transfer_in_progress_ = true;
+  ScheduleRead();
+  return true;
+}
+
 void FileFetcher::TerminateTransfer() {
   CleanUp();
   if (delegate_) {
@@ -112,6 +143,16 @@ void FileFetcher::ScheduleRead() {
   if (transfer_paused_ || ongoing_read_ || !transfer_in_progress_)
     return;
 
+  if (mapped_fd_ >= 0) {
+    // Deliver the data from a task, so the delegate can pause or terminate the
+    // transfer in between windows.
+    mapped_read_task_ = brillo::MessageLoop::current()->PostTask(
+        FROM_HERE,
+        base::Bind(&FileFetcher::OnMappedReadTask, base::Unretained(this)));
+    ongoing_read_ = true;
+    return;
+  }
+
   buffer_.resize(kReadBufferSize);
   size_t bytes_to_read = buffer_.size();
   if (data_length_ >= 0) {
@@ -154,6 +195,98 @@ void FileFetcher::OnReadDoneCallback(size_t bytes_read) {
   }
 }
 
+void FileFetcher::OnMappedReadTask() {
+  mapped_read_task_ = brillo::MessageLoop::kTaskIdNull;
+  ongoing_read_ = false;
+  if (transfer_paused_ || !transfer_in_progress_)
+    return;
+
+  const uint64_t position = offset_ + bytes_copied_;
+  uint64_t bytes_to_read =
+      position < mapped_file_size_ ? mapped_file_size_ - position : 0;
+  if (data_length_ >= 0) {
+    bytes_to_read = std::min(bytes_to_read, data_length_ - bytes_copied_);
+  }
+  bytes_to_read = std::min<uint64_t>(bytes_to_read, kMappedWindowSize);
+  if (!bytes_to_read) {
+    OnReadDoneCallback(0);
+    return;
+  }
+
+  // Touching a page of the mapping past the end of the file raises SIGBUS, so
+  // if the file was truncated since the transfer started read what is left.
+  struct stat st {};
+  if (fstat(mapped_fd_, &st) != 0 ||
+      static_cast<uint64_t>(st.st_size) < position + bytes_to_read) {
+    ReadWindow(position, bytes_to_read);
+    return;
+  }
+
+  // mmap() needs a page aligned offset.
+  const uint64_t page_size = getpagesize();
+  const uint64_t window_offset = position / page_size * page_size;
+  const size_t skip = position - window_offset;
+  mapped_window_size_ = skip + bytes_to_read;
+  mapped_window_ = mmap(nullptr,
+                        mapped_window_size_,
+                        PROT_READ,
+                        MAP_PRIVATE,
+                        mapped_fd_,
+                        window_offset);
+  if (mapped_window_ == MAP_FAILED) {
+    PLOG(ERROR) << "Unable to map " << mapped_window_size_
+                << " bytes at offset " << window_offset;
+    mapped_window_ = nullptr;
+    CleanUp();
+    if (delegate_)
+      delegate_->TransferComplete(this, false);
+    return;
+  }
+  madvise(mapped_window_, mapped_window_size_, MADV_SEQUENTIAL);
+  // Start reading the next window while the delegate works on this one.
+  posix_fadvise(mapped_fd_,
+                position + bytes_to_read,
+                kMappedWindowSize,
+                POSIX_FADV_WILLNEED);
+
+  bytes_copied_ += bytes_to_read;
+  if (delegate_ &&
+      !delegate_->ReceivedBytes(
+          this, static_cast<uint8_t*>(mapped_window_) + skip, bytes_to_read))
+    return;
+
+  // The payload is only read once, don't let it linger in the page cache.
+  UnmapWindow();
+  posix_fadvise(
+      mapped_fd_, window_offset, skip + bytes_to_read, POSIX_FADV_DONTNEED);
+  ScheduleRead();
+}
+
+void FileFetcher::ReadWindow(uint64_t position, size_t size) {
+  buffer_.resize(size);
+  ssize_t bytes_read = 0;
+  if (!utils::PReadAll(
+          mapped_fd_, buffer_.data(), size, position, &bytes_read)) {
+    PLOG(ERROR) << "Unable to read " << size << " bytes at offset "
+                << position;
+    CleanUp();
+    if (delegate_)
+      delegate_->TransferComplete(this, false);
+    return;
+  }
+  // Nothing is left past a short read, the next task completes the transfer.
+  mapped_file_size_ = position + bytes_read;
+  OnReadDoneCallback(bytes_read);
+}
+
+void FileFetcher::UnmapWindow() {
+  if (mapped_window_) {
+    munmap(mapped_window_, mapped_window_size_);
+    mapped_window_ = nullptr;
+    mapped_window_size_ = 0;
+  }
+}
+
 void FileFetcher::OnReadErrorCallback(const brillo::Error* error) {
   LOG(ERROR) << "Asynchronous read failed: " << error->GetMessage();
   CleanUp();
@@ -184,6 +317,13 @@ void FileFetcher::CleanUp() {
     stream_->CloseBlocking(nullptr);
     stream_.reset();
   }
+  if (mapped_read_task_ != brillo::MessageLoop::kTaskIdNull) {
+    brillo::MessageLoop::current()->CancelTask(mapped_read_task_);
+    mapped_read_task_ = brillo::MessageLoop::kTaskIdNull;
+  }
+  UnmapWindow();
+  mapped_fd_.reset();
+  mapped_file_size_ = 0;
   // Destroying the |stream_| releases the callback, so we don't have any
   // ongoing read at this point.
   ongoing_read_ = false;
@@ -21,19 +21,29 @@
 #include <string>
 #include <utility>
 
+#include <android-base/unique_fd.h>
 #include <base/logging.h>
 #include <base/macros.h>
+#include <brillo/message_loops/message_loop.h>
 #include <brillo/streams/stream.h>
 
 #include "update_engine/common/http_fetcher.h"
 
 // This is a concrete implementation of HttpFetcher that reads files
 // asynchronously.
+//
+// Regular files are mapped into memory a window at a time, and each window is
+// passed to the delegate as a whole from a message loop task, which saves
+// copying the payload in small chunks. Other files, like pipes, are read
+// through a brillo::Stream.
 
 namespace chromeos_update_engine {
 
 class FileFetcher : public HttpFetcher {
  public:
+  // Size of the windows of regular files passed to the delegate at once.
+  static constexpr size_t kMappedWindowSize = 8 * 1024 * 1024;
+
   // Returns whether the passed url is supported.
   static bool SupportedUrl(const std::string& url);
 
@@ -92,6 +102,21 @@ class FileFetcher : public HttpFetcher {
   void OnReadDoneCallback(size_t bytes_read);
   void OnReadErrorCallback(const brillo::Error* error);
 
+  // Takes over |fd| for a mapped transfer if it refers to a regular file.
+  bool StartMappedTransfer(android::base::unique_fd fd);
+
+  // Maps the next window of |mapped_fd_|, passes it to the delegate and
+  // schedules the next one.
+  void OnMappedReadTask();
+
+  // Reads |size| bytes at |position| of |mapped_fd_| into |buffer_| and passes
+  // them to the delegate. Used instead of mapping a window once the file has
+  // been truncated.
+  void ReadWindow(uint64_t position, size_t size);
+
+  // Unmaps |mapped_window_|, if any.
+  void UnmapWindow();
+
   // Whether the transfer was started and didn't finish yet.
   bool transfer_in_progress_{false};
 
@@ -113,6 +138,14 @@ class FileFetcher : public HttpFetcher {
 
   brillo::StreamPtr stream_;
 
+  // The file read by mapping it, instead of through |stream_|.
+  android::base::unique_fd mapped_fd_;
+  uint64_t mapped_file_size_{0};
+  void* mapped_window_{nullptr};
+  size_t mapped_window_size_{0};
+  brillo::MessageLoop::TaskId mapped_read_task_{
+      brillo::MessageLoop::kTaskIdNull};
+
   // The buffer used for reading from the stream.
   brillo::Blob buffer_;
 
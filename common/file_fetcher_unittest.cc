@@ -16,15 +16,50 @@
 
 #include "update_engine/common/file_fetcher.h"
 
+#include <unistd.h>
+
 #include <string>
 
+#include <brillo/message_loops/fake_message_loop.h>
 #include <gtest/gtest.h>
 
 #include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+
+using std::string;
 
 namespace chromeos_update_engine {
 
-class FileFetcherUnitTest : public ::testing::Test {};
+class FileFetcherUnitTest : public ::testing::Test {
+ protected:
+  void SetUp() override { loop_.SetAsCurrent(); }
+
+  brillo::FakeMessageLoop loop_{nullptr};
+};
+
+namespace {
+
+class WindowRecordingDelegate : public HttpFetcherDelegate {
+ public:
+  bool ReceivedBytes(HttpFetcher* fetcher,
+                     const void* bytes,
+                     size_t length) override {
+    data_.append(static_cast<const char*>(bytes), length);
+    times_received_bytes_called_++;
+    return true;
+  }
+  void TransferComplete(HttpFetcher* fetcher, bool successful) override {
+    successful_ = successful;
+    complete_ = true;
+  }
+
+  string data_;
+  int times_received_bytes_called_{0};
+  bool successful_{false};
+  bool complete_{false};
+};
+
+}  // namespace
 
 TEST_F(FileFetcherUnitTest, SupporterUrlsTest) {
   EXPECT_TRUE(FileFetcher::SupportedUrl("file:///path/to/somewhere.bin"));
@@ -34,4 +69,57 @@ TEST_F(FileFetcherUnitTest, SupporterUrlsTest) {
   EXPECT_FALSE(FileFetcher::SupportedUrl("http:///no_http_here"));
 }
 
+// Regular files are passed to the delegate a whole window at a time.
+TEST_F(FileFetcherUnitTest, MappedWindowsTest) {
+  string contents(FileFetcher::kMappedWindowSize * 2 + 12345, '\0');
+  for (size_t i = 0; i < contents.size(); i++)
+    contents[i] = static_cast<char>(i * 7);
+  ScopedTempFile file("ue_file_fetcher.XXXXXX");
+  ASSERT_TRUE(test_utils::WriteFileString(file.path(), contents));
+
+  // Start at an offset which isn't page aligned.
+  const size_t kOffset = 5000;
+  const size_t kLength = contents.size() - kOffset - 100;
+  FileFetcher fetcher;
+  WindowRecordingDelegate delegate;
+  fetcher.set_delegate(&delegate);
+  fetcher.SetOffset(kOffset);
+  fetcher.SetLength(kLength);
+  fetcher.BeginTransfer("file://" + file.path());
+  while (loop_.RunOnce(false)) {
+  }
+
+  EXPECT_TRUE(delegate.complete_);
+  EXPECT_TRUE(delegate.successful_);
+  EXPECT_EQ(3, delegate.times_received_bytes_called_);
+  EXPECT_EQ(kLength, fetcher.GetBytesDownloaded());
+  EXPECT_TRUE(delegate.data_ == contents.substr(kOffset, kLength));
+}
+
+// A file truncated in the middle of the transfer is read instead of mapped, so
+// the fetcher doesn't touch pages past its end.
+TEST_F(FileFetcherUnitTest, TruncatedFileTest) {
+  string contents(FileFetcher::kMappedWindowSize * 3, 'a');
+  ScopedTempFile file("ue_file_fetcher.XXXXXX");
+  ASSERT_TRUE(test_utils::WriteFileString(file.path(), contents));
+
+  const size_t kTruncatedSize = FileFetcher::kMappedWindowSize + 12345;
+  FileFetcher fetcher;
+  WindowRecordingDelegate delegate;
+  fetcher.set_delegate(&delegate);
+  fetcher.BeginTransfer("file://" + file.path());
+  bool truncated = false;
+  while (loop_.RunOnce(false)) {
+    if (delegate.times_received_bytes_called_ == 1 && !truncated) {
+      ASSERT_EQ(0, truncate(file.path().c_str(), kTruncatedSize));
+      truncated = true;
+    }
+  }
+
+  EXPECT_TRUE(delegate.complete_);
+  EXPECT_EQ(2, delegate.times_received_bytes_called_);
+  EXPECT_EQ(kTruncatedSize, fetcher.GetBytesDownloaded());
+  EXPECT_TRUE(delegate.data_ == contents.substr(0, kTruncatedSize));
+}
+
 }  // namespace chromeos_update_engine
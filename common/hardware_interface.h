@@ -124,6 +124,20 @@ class HardwareInterface {
   // older timestamp.
   virtual bool AllowDowngrade() const = 0;
 
+  // The charging, battery and thermal state of the device.
+  struct PowerState {
+    // Whether the device is plugged in to a charger.
+    bool on_external_power{false};
+    // The remaining battery capacity in percent, or -1 if unknown.
+    int battery_percent{-1};
+    // Whether the device is hot enough that it may throttle or shut down.
+    bool thermal_throttled{false};
+  };
+
+  // Stores the current power state of the device in |state|. Returns false if
+  // it can't be determined.
+  virtual bool GetPowerState(PowerState* state) const = 0;
+
   // Returns whether the first active ping was sent to Omaha at some point, and
   // that the value is persisted across recovery (and powerwash) once set with
   // |SetFirstActiveOmahaPingSent()|.
@@ -175,6 +175,22 @@ class MetricsReporterInterface {
       int reboot_count,
       int url_switch_count) = 0;
 
+  // Helper function to report how often the progress of a successful update
+  // was saved, every |interval| on average, and the |total_duration| spent
+  // saving it. There are no metrics for these yet, they're only logged.
+  virtual void ReportCheckpointMetrics(base::TimeDelta interval,
+                                       base::TimeDelta total_duration) = 0;
+
+  // Helper function to report how the payload spill queue of a successful
+  // update behaved: the |peak_buffered_bytes| it held at once, the
+  // |spilled_bytes| which went through its file, and how often the download
+  // waited for the applier (|high_water_waits|) or the applier for the download
+  // (|empty_waits|). There are no metrics for these yet, they're only logged.
+  virtual void ReportSpillQueueMetrics(int64_t peak_buffered_bytes,
+                                       int64_t spilled_bytes,
+                                       int64_t high_water_waits,
+                                       int64_t empty_waits) = 0;
+
   // Helper function to report the after the completion of a SSL certificate
   // check. One of the following metrics is reported:
   //
@@ -72,6 +72,14 @@ class MetricsReporterStub : public MetricsReporterInterface {
       int reboot_count,
       int url_switch_count) override {}
 
+  void ReportCheckpointMetrics(base::TimeDelta interval,
+                               base::TimeDelta total_duration) override {}
+
+  void ReportSpillQueueMetrics(int64_t peak_buffered_bytes,
+                               int64_t spilled_bytes,
+                               int64_t high_water_waits,
+                               int64_t empty_waits) override {}
+
   void ReportCertificateCheckMetrics(ServerToCheck server_to_check,
                                      CertificateCheckResult result) override {}
 
@@ -69,6 +69,8 @@ class MockHardware : public HardwareInterface {
     ON_CALL(*this, GetPowerwashSafeDirectory(testing::_))
         .WillByDefault(
             testing::Invoke(&fake_, &FakeHardware::GetPowerwashSafeDirectory));
+    ON_CALL(*this, GetPowerState(testing::_))
+        .WillByDefault(testing::Invoke(&fake_, &FakeHardware::GetPowerState));
     ON_CALL(*this, GetFirstActiveOmahaPingSent())
         .WillByDefault(testing::Invoke(
             &fake_, &FakeHardware::GetFirstActiveOmahaPingSent()));
@@ -95,6 +97,7 @@ class MockHardware : public HardwareInterface {
   MOCK_CONST_METHOD0(GetPowerwashCount, int());
   MOCK_CONST_METHOD1(GetNonVolatileDirectory, bool(base::FilePath*));
   MOCK_CONST_METHOD1(GetPowerwashSafeDirectory, bool(base::FilePath*));
+  MOCK_CONST_METHOD1(GetPowerState, bool(PowerState*));
   MOCK_CONST_METHOD0(GetFirstActiveOmahaPingSent, bool());
 
   // Returns a reference to the underlying FakeHardware.
@@ -71,6 +71,15 @@ class MockMetricsReporter : public MetricsReporterInterface {
                      int reboot_count,
                      int url_switch_count));
 
+  MOCK_METHOD2(ReportCheckpointMetrics,
+               void(base::TimeDelta interval, base::TimeDelta total_duration));
+
+  MOCK_METHOD4(ReportSpillQueueMetrics,
+               void(int64_t peak_buffered_bytes,
+                    int64_t spilled_bytes,
+                    int64_t high_water_waits,
+                    int64_t empty_waits));
+
   MOCK_METHOD2(ReportCertificateCheckMetrics,
                void(ServerToCheck server_to_check,
                     CertificateCheckResult result));
@@ -19,8 +19,8 @@
 #include <algorithm>
 #include <filesystem>
 #include <unistd.h>
+#include <utility>
 
-#include <android-base/file.h>
 #include <base/files/file_enumerator.h>
 #include <base/files/file_util.h>
 #include <base/logging.h>
@@ -188,55 +188,95 @@ std::string Prefs::FileStorage::GetTemporaryDir() const {
   return prefs_dir_.value() + "_tmp";
 }
 
-bool Prefs::FileStorage::CreateTemporaryPrefs() {
-  // Delete any existing prefs_tmp
-  DeleteTemporaryPrefs();
-  // Get the paths to the source and destination directories.
-  std::filesystem::path source_directory(prefs_dir_.value());
-  std::filesystem::path destination_directory(GetTemporaryDir());
-
-  if (!std::filesystem::exists(source_directory)) {
-    LOG(ERROR) << "prefs directory does not exist: " << source_directory;
-    return false;
-  }
-  // Copy the directory.
-  std::filesystem::copy(source_directory, destination_directory);
+std::string Prefs::FileStorage::GetJournalPath() const {
+  // Not a valid key name, so it never shows up as one.
+  return prefs_dir_.Append(".journal").value();
+}
 
+bool Prefs::FileStorage::CreateTemporaryPrefs() {
+  // Drop any transaction which was never submitted.
+  transaction_values_.emplace();
   return true;
 }
 
 bool Prefs::FileStorage::DeleteTemporaryPrefs() {
-  std::filesystem::path destination_directory(GetTemporaryDir());
-
-  if (std::filesystem::exists(destination_directory)) {
-    return std::filesystem::remove_all(destination_directory);
-  }
+  transaction_values_.reset();
   return true;
 }
 
 bool Prefs::FileStorage::SwapPrefs() {
-  if (!utils::DeleteDirectory(prefs_dir_.value().c_str())) {
-    LOG(ERROR) << "Failed to remove prefs dir " << prefs_dir_;
+  if (!transaction_values_) {
+    LOG(ERROR) << "No prefs transaction to submit.";
     return false;
   }
-  if (rename(GetTemporaryDir().c_str(), prefs_dir_.value().c_str()) != 0) {
-    LOG(ERROR) << "Error replacing prefs with prefs_tmp" << strerror(errno);
-    return false;
+  StagedValues values = std::move(*transaction_values_);
+  transaction_values_.reset();
+
+  vector<PrefsJournal::Entry> entries;
+  for (auto& [key, value] : values) {
+    // Checkpoints rewrite keys like the signature blob with the same value
+    // every time, keep them out of the journal.
+    string current_value;
+    const bool exists = GetKey(key, &current_value);
+    if (value ? exists && current_value == *value : !exists)
+      continue;
+    entries.push_back({key, std::move(value)});
   }
-  if (!utils::FsyncDirectory(
-          android::base::Dirname(prefs_dir_.value()).c_str())) {
-    PLOG(ERROR) << "Failed to fsync prefs parent dir after swapping prefs";
+  if (entries.empty())
+    return true;
+  TEST_AND_RETURN_FALSE(AppendToJournal(entries));
+  if (journal_->size() > kMaxJournalSize && !CompactJournal()) {
+    // The journal still holds every key, so this is not fatal.
+    LOG(WARNING) << "Failed to compact the prefs journal.";
+  }
+  return true;
+}
+
+bool Prefs::FileStorage::OpenJournal() {
+  vector<PrefsJournal::Entry> entries;
+  journal_ = PrefsJournal::Open(GetJournalPath(), &entries);
+  TEST_AND_RETURN_FALSE(journal_);
+  for (auto& entry : entries)
+    journal_values_[std::move(entry.key)] = std::move(entry.value);
+  return true;
+}
+
+bool Prefs::FileStorage::AppendToJournal(
+    const vector<PrefsJournal::Entry>& entries) {
+  if (!journal_) {
+    if (!base::DirectoryExists(prefs_dir_)) {
+      TEST_AND_RETURN_FALSE(base::CreateDirectory(prefs_dir_));
+    }
+    TEST_AND_RETURN_FALSE(OpenJournal());
   }
+  TEST_AND_RETURN_FALSE(journal_->Append(entries));
+  for (const auto& entry : entries)
+    journal_values_[entry.key] = entry.value;
+  return true;
+}
+
+bool Prefs::FileStorage::CompactJournal() {
+  // Replaying the journal is idempotent, so it's safe to be interrupted at any
+  // point before the journal is reset.
+  for (const auto& [key, value] : journal_values_)
+    TEST_AND_RETURN_FALSE(WriteKeyFile(key, value));
+  TEST_AND_RETURN_FALSE(journal_->Reset());
+  journal_values_.clear();
   return true;
 }
 
 bool Prefs::FileStorage::Init(const base::FilePath& prefs_dir) {
   prefs_dir_ = prefs_dir;
+  journal_.reset();
+  journal_values_.clear();
+  transaction_values_.reset();
   if (!std::filesystem::exists(prefs_dir_.value())) {
     LOG(INFO) << "Prefs dir does not exist, possibly due to an interrupted "
                  "transaction.";
     if (std::filesystem::exists(GetTemporaryDir())) {
-      SwapPrefs();
+      if (rename(GetTemporaryDir().c_str(), prefs_dir_.value().c_str()) != 0) {
+        PLOG(ERROR) << "Error replacing prefs with prefs_tmp";
+      }
     }
   }
 
@@ -249,14 +289,65 @@ bool Prefs::FileStorage::Init(const base::FilePath& prefs_dir) {
     }
   }
 
+  if (std::filesystem::exists(GetJournalPath())) {
+    TEST_AND_RETURN_FALSE(OpenJournal());
+    if (!journal_values_.empty()) {
+      LOG(INFO) << "Writing back " << journal_values_.size()
+                << " prefs from the journal.";
+      if (!CompactJournal()) {
+        LOG(ERROR) << "Failed to compact the prefs journal.";
+      }
+    }
+  }
+
   // Delete empty directories. Ignore errors when deleting empty directories.
   DeleteEmptyDirectories(prefs_dir_);
   return true;
 }
 
+const Prefs::FileStorage::StagedValue* Prefs::FileStorage::FindStagedValue(
+    std::string_view key) const {
+  if (transaction_values_) {
+    auto it = transaction_values_->find(key);
+    if (it != transaction_values_->end())
+      return &it->second;
+  }
+  auto it = journal_values_.find(key);
+  return it != journal_values_.end() ? &it->second : nullptr;
+}
+
+bool Prefs::FileStorage::WriteKeyFile(std::string_view key,
+                                      const StagedValue& value) {
+  base::FilePath filename;
+  TEST_AND_RETURN_FALSE(GetFileNameForKey(key, &filename));
+  if (!value) {
+#if BASE_VER < 800000
+    TEST_AND_RETURN_FALSE(base::DeleteFile(filename, false));
+#else
+    TEST_AND_RETURN_FALSE(base::DeleteFile(filename));
+#endif
+    return true;
+  }
+  if (!base::DirectoryExists(filename.DirName())) {
+    // Only attempt to create the directory if it doesn't exist to avoid calls
+    // to parent directories where we might not have permission to write to.
+    TEST_AND_RETURN_FALSE(base::CreateDirectory(filename.DirName()));
+  }
+  TEST_AND_RETURN_FALSE(
+      utils::WriteStringToFileAtomic(filename.value(), *value));
+  return true;
+}
+
 bool Prefs::FileStorage::GetKey(std::string_view key, string* value) const {
   base::FilePath filename;
   TEST_AND_RETURN_FALSE(GetFileNameForKey(key, &filename));
+  const StagedValue* staged_value = FindStagedValue(key);
+  if (staged_value) {
+    if (!*staged_value)
+      return false;
+    *value = **staged_value;
+    return true;
+  }
   if (!base::ReadFileToString(filename, value)) {
     return false;
   }
@@ -267,6 +358,7 @@ bool Prefs::FileStorage::GetSubKeys(std::string_view ns,
                                     vector<string>* keys) const {
   base::FilePath filename;
   TEST_AND_RETURN_FALSE(GetFileNameForKey(ns, &filename));
+  const size_t first_key = keys->size();
   base::FileEnumerator namespace_enum(
       prefs_dir_, true, base::FileEnumerator::FILES);
   for (base::FilePath f = namespace_enum.Next(); !f.empty();
@@ -278,37 +370,59 @@ bool Prefs::FileStorage::GetSubKeys(std::string_view ns,
           prefs_dir_.AsEndingWithSeparator().value().length()));
     }
   }
+
+  // Apply the keys staged in the journal, then in the transaction.
+  auto apply_staged_values = [&](const StagedValues& values) {
+    for (auto it = values.lower_bound(ns);
+         it != values.end() && it->first.compare(0, ns.size(), ns) == 0;
+         ++it) {
+      auto key_it =
+          std::find(keys->begin() + first_key, keys->end(), it->first);
+      if (it->second && key_it == keys->end()) {
+        keys->push_back(it->first);
+      } else if (!it->second && key_it != keys->end()) {
+        keys->erase(key_it);
+      }
+    }
+  };
+  apply_staged_values(journal_values_);
+  if (transaction_values_)
+    apply_staged_values(*transaction_values_);
   return true;
 }
 
 bool Prefs::FileStorage::SetKey(std::string_view key, std::string_view value) {
   base::FilePath filename;
   TEST_AND_RETURN_FALSE(GetFileNameForKey(key, &filename));
-  if (!base::DirectoryExists(filename.DirName())) {
-    // Only attempt to create the directory if it doesn't exist to avoid calls
-    // to parent directories where we might not have permission to write to.
-    TEST_AND_RETURN_FALSE(base::CreateDirectory(filename.DirName()));
+  if (transaction_values_) {
+    (*transaction_values_)[string{key}] = string{value};
+    return true;
   }
-  TEST_AND_RETURN_FALSE(
-      utils::WriteStringToFileAtomic(filename.value(), value));
-  return true;
+  // The journal takes precedence over the file, so keep updating it.
+  if (journal_values_.find(key) != journal_values_.end())
+    return AppendToJournal({{string{key}, string{value}}});
+  return WriteKeyFile(key, string{value});
 }
 
 bool Prefs::FileStorage::KeyExists(std::string_view key) const {
   base::FilePath filename;
   TEST_AND_RETURN_FALSE(GetFileNameForKey(key, &filename));
+  const StagedValue* staged_value = FindStagedValue(key);
+  if (staged_value)
+    return staged_value->has_value();
   return base::PathExists(filename);
 }
 
 bool Prefs::FileStorage::DeleteKey(std::string_view key) {
   base::FilePath filename;
   TEST_AND_RETURN_FALSE(GetFileNameForKey(key, &filename));
-#if BASE_VER < 800000
-  TEST_AND_RETURN_FALSE(base::DeleteFile(filename, false));
-#else
-  TEST_AND_RETURN_FALSE(base::DeleteFile(filename));
-#endif
-  return true;
+  if (transaction_values_) {
+    (*transaction_values_)[string{key}] = std::nullopt;
+    return true;
+  }
+  if (journal_values_.find(key) != journal_values_.end())
+    return AppendToJournal({{string{key}, std::nullopt}});
+  return WriteKeyFile(key, std::nullopt);
 }
 
 bool Prefs::FileStorage::GetFileNameForKey(std::string_view key,
@@ -318,14 +432,8 @@ bool Prefs::FileStorage::GetFileNameForKey(std::string_view key,
   for (char c : key)
     TEST_AND_RETURN_FALSE(base::IsAsciiAlpha(c) || base::IsAsciiDigit(c) ||
                           c == '_' || c == '-' || c == kKeySeparator);
-  if (std::filesystem::exists(GetTemporaryDir())) {
-    *filename =
-        base::FilePath(GetTemporaryDir())
-            .Append(base::FilePath::StringPieceType(key.data(), key.size()));
-  } else {
-    *filename = prefs_dir_.Append(
-        base::FilePath::StringPieceType(key.data(), key.size()));
-  }
+  *filename = prefs_dir_.Append(
+      base::FilePath::StringPieceType(key.data(), key.size()));
   return true;
 }
 
@@ -19,6 +19,8 @@
 
 #include <functional>
 #include <map>
+#include <memory>
+#include <optional>
 #include <string>
 #include <string_view>
 #include <vector>
@@ -27,6 +29,7 @@
 
 #include "gtest/gtest_prod.h"  // for FRIEND_TEST
 #include "update_engine/common/prefs_interface.h"
+#include "update_engine/common/prefs_journal.h"
 
 namespace chromeos_update_engine {
 
@@ -60,15 +63,15 @@ class PrefsBase : public PrefsInterface {
     // key was deleted.
     virtual bool DeleteKey(std::string_view key) = 0;
 
-    // Makes a copy of prefs directory called prefs_tmp, which is modified
-    // during update_engine checkpointing
+    // Starts a transaction. Until it is submitted or dropped, changes are
+    // visible to readers of this storage but not persisted.
     virtual bool CreateTemporaryPrefs() { return false; }
 
-    // Deletes prefs_tmp directory
+    // Drops the changes of the current transaction, if any.
     virtual bool DeleteTemporaryPrefs() { return false; }
 
-    // Replaces prefs with prefs_tmp to make update_engine checkpointing more
-    // atomic
+    // Atomically persists all changes of the current transaction, to make
+    // update_engine checkpointing atomic.
     virtual bool SwapPrefs() { return false; }
 
    private:
@@ -114,9 +117,17 @@ class PrefsBase : public PrefsInterface {
 // Implements a preference store by storing the value associated with
 // a key in a separate file named after the key under a preference
 // store directory.
+//
+// Transactions are staged in memory and submitted as a single record to a
+// PrefsJournal kept in the store directory. Keys updated by the journal are
+// served from memory, and written back to their files once the journal grows
+// past kMaxJournalSize, or the next time the store is initialized.
 
 class Prefs : public PrefsBase {
  public:
+  // Size of the journal above which its keys are written back to their files.
+  static constexpr size_t kMaxJournalSize = 256 * 1024;
+
   Prefs() : PrefsBase(&file_storage_) {}
 
   // Initializes the store by associating this object with |prefs_dir|
@@ -128,6 +139,7 @@ class Prefs : public PrefsBase {
   FRIEND_TEST(PrefsTest, GetFileNameForKey);
   FRIEND_TEST(PrefsTest, GetFileNameForKeyBadCharacter);
   FRIEND_TEST(PrefsTest, GetFileNameForKeyEmpty);
+  FRIEND_TEST(PrefsTest, TransactionJournalCompactionTest);
 
   class FileStorage : public PrefsBase::StorageInterface {
    public:
@@ -150,17 +162,52 @@ class Prefs : public PrefsBase {
     FRIEND_TEST(PrefsTest, GetFileNameForKey);
     FRIEND_TEST(PrefsTest, GetFileNameForKeyBadCharacter);
     FRIEND_TEST(PrefsTest, GetFileNameForKeyEmpty);
+    FRIEND_TEST(PrefsTest, TransactionJournalCompactionTest);
+
+    // Value of a key staged in memory, unset if the key is deleted.
+    using StagedValue = std::optional<std::string>;
+    using StagedValues = std::map<std::string, StagedValue, std::less<>>;
 
     // Sets |filename| to the full path to the file containing the data
     // associated with |key|. Returns true on success, false otherwise.
     bool GetFileNameForKey(std::string_view key,
                            base::FilePath* filename) const;
 
-    // Returns path of prefs_tmp used during update_engine checkpointing
+    // Returns path of prefs_tmp, left behind by older versions which
+    // checkpointed by copying the whole prefs directory.
     std::string GetTemporaryDir() const;
 
+    // Returns the path of the transaction journal.
+    std::string GetJournalPath() const;
+
+    // Returns the staged value of |key| in the current transaction or the
+    // journal, or nullptr if the file of |key| is up to date.
+    const StagedValue* FindStagedValue(std::string_view key) const;
+
+    // Writes or deletes the file of |key| directly.
+    bool WriteKeyFile(std::string_view key, const StagedValue& value);
+
+    // Opens the journal and loads the keys it holds into |journal_values_|.
+    bool OpenJournal();
+
+    // Appends |entries| to the journal, opening it first if needed, and
+    // applies them to |journal_values_|.
+    bool AppendToJournal(const std::vector<PrefsJournal::Entry>& entries);
+
+    // Writes all keys held in the journal back to their files and empties the
+    // journal.
+    bool CompactJournal();
+
     // Preference store directory.
     base::FilePath prefs_dir_;
+
+    // Opened on the first submitted transaction, or by Init() if a journal
+    // exists.
+    std::unique_ptr<PrefsJournal> journal_;
+    // Keys whose latest value is in the journal rather than in their files.
+    StagedValues journal_values_;
+    // Changes of the current transaction, set while one is in progress.
+    std::optional<StagedValues> transaction_values_;
   };
 
   // The concrete file storage implementation.
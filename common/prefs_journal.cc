@@ -0,0 +1,195 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/prefs_journal.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <filesystem>
+#include <iterator>
+#include <utility>
+
+#include <android-base/file.h>
+#include <base/logging.h>
+#include <zlib.h>
+
+#include "update_engine/common/utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+constexpr size_t kRecordHeaderSize = 3 * sizeof(uint32_t);
+
+enum EntryType : uint8_t {
+  kSet = 1,
+  kDelete = 2,
+};
+
+void AppendUint32(string* out, uint32_t value) {
+  out->append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+bool ReadUint32(const string& data, size_t* offset, size_t end, uint32_t* out) {
+  if (end - *offset < sizeof(*out))
+    return false;
+  memcpy(out, data.data() + *offset, sizeof(*out));
+  *offset += sizeof(*out);
+  return true;
+}
+
+uint32_t Checksum(const char* data, size_t size) {
+  return crc32(
+      crc32(0L, Z_NULL, 0), reinterpret_cast<const Bytef*>(data), size);
+}
+
+// Parses the entries of a single record payload spanning [offset, end) of
+// |data|. Returns false if the payload is malformed.
+bool DecodePayload(const string& data,
+                   size_t offset,
+                   size_t end,
+                   vector<PrefsJournal::Entry>* entries) {
+  while (offset < end) {
+    const uint8_t type = data[offset++];
+    uint32_t key_size, value_size;
+    TEST_AND_RETURN_FALSE(ReadUint32(data, &offset, end, &key_size));
+    TEST_AND_RETURN_FALSE(key_size > 0 && end - offset >= key_size);
+    PrefsJournal::Entry entry{data.substr(offset, key_size), std::nullopt};
+    offset += key_size;
+    TEST_AND_RETURN_FALSE(ReadUint32(data, &offset, end, &value_size));
+    TEST_AND_RETURN_FALSE(end - offset >= value_size);
+    if (type == kSet) {
+      entry.value = data.substr(offset, value_size);
+    } else {
+      TEST_AND_RETURN_FALSE(type == kDelete && value_size == 0);
+    }
+    offset += value_size;
+    entries->push_back(std::move(entry));
+  }
+  return true;
+}
+
+}  // namespace
+
+std::unique_ptr<PrefsJournal> PrefsJournal::Open(const string& path,
+                                                 vector<Entry>* entries) {
+  const bool existed = std::filesystem::exists(path);
+  android::base::unique_fd fd(TEMP_FAILURE_RETRY(
+      open(path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644)));
+  if (fd < 0) {
+    PLOG(ERROR) << "Failed to open prefs journal " << path;
+    return nullptr;
+  }
+  string data;
+  if (!android::base::ReadFdToString(fd, &data)) {
+    PLOG(ERROR) << "Failed to read prefs journal " << path;
+    return nullptr;
+  }
+  const size_t valid_size = DecodeRecords(data, entries);
+  if (valid_size != data.size()) {
+    LOG(WARNING) << "Dropping " << data.size() - valid_size
+                 << " bytes of incomplete records from prefs journal " << path;
+    if (ftruncate(fd, valid_size) != 0 || fdatasync(fd) != 0) {
+      PLOG(ERROR) << "Failed to truncate prefs journal " << path;
+      return nullptr;
+    }
+  }
+  if (!existed && !utils::FsyncDirectory(
+                      std::filesystem::path(path).parent_path().c_str())) {
+    LOG(ERROR) << "Failed to fsync the directory of " << path;
+    return nullptr;
+  }
+  return std::unique_ptr<PrefsJournal>(
+      new PrefsJournal(std::move(fd), valid_size));
+}
+
+bool PrefsJournal::Append(const vector<Entry>& entries) {
+  const string record = EncodeRecord(entries);
+  if (!utils::WriteAll(fd_.get(), record.data(), record.size()) ||
+      fdatasync(fd_) != 0) {
+    PLOG(ERROR) << "Failed to append " << record.size()
+                << " bytes to prefs journal";
+    // Don't leave a partial record behind, it would hide every later one.
+    if (ftruncate(fd_, size_) != 0) {
+      PLOG(ERROR) << "Failed to truncate prefs journal";
+    }
+    return false;
+  }
+  size_ += record.size();
+  return true;
+}
+
+bool PrefsJournal::Reset() {
+  if (ftruncate(fd_, 0) != 0 || fdatasync(fd_) != 0) {
+    PLOG(ERROR) << "Failed to reset prefs journal";
+    return false;
+  }
+  size_ = 0;
+  return true;
+}
+
+string PrefsJournal::EncodeRecord(const vector<Entry>& entries) {
+  string record(kRecordHeaderSize, '\0');
+  for (const auto& entry : entries) {
+    record.push_back(entry.value ? kSet : kDelete);
+    AppendUint32(&record, entry.key.size());
+    record.append(entry.key);
+    const size_t value_size = entry.value ? entry.value->size() : 0;
+    AppendUint32(&record, value_size);
+    if (entry.value)
+      record.append(*entry.value);
+  }
+  const size_t payload_size = record.size() - kRecordHeaderSize;
+  const uint32_t header[] = {
+      kRecordMagic,
+      static_cast<uint32_t>(payload_size),
+      Checksum(record.data() + kRecordHeaderSize, payload_size)};
+  memcpy(record.data(), header, sizeof(header));
+  return record;
+}
+
+size_t PrefsJournal::DecodeRecords(const string& data,
+                                   vector<Entry>* entries) {
+  size_t offset = 0;
+  while (offset < data.size()) {
+    size_t pos = offset;
+    uint32_t magic, payload_size, checksum;
+    if (!ReadUint32(data, &pos, data.size(), &magic) ||
+        !ReadUint32(data, &pos, data.size(), &payload_size) ||
+        !ReadUint32(data, &pos, data.size(), &checksum) ||
+        magic != kRecordMagic || data.size() - pos < payload_size ||
+        Checksum(data.data() + pos, payload_size) != checksum) {
+      break;
+    }
+    vector<Entry> record_entries;
+    if (!DecodePayload(data, pos, pos + payload_size, &record_entries)) {
+      LOG(ERROR) << "Malformed prefs journal record at offset " << offset;
+      break;
+    }
+    std::move(record_entries.begin(),
+              record_entries.end(),
+              std::back_inserter(*entries));
+    offset = pos + payload_size;
+  }
+  return offset;
+}
+
+}  // namespace chromeos_update_engine
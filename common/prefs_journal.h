@@ -0,0 +1,90 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_COMMON_PREFS_JOURNAL_H_
+#define UPDATE_ENGINE_COMMON_PREFS_JOURNAL_H_
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <android-base/unique_fd.h>
+#include <base/macros.h>
+
+namespace chromeos_update_engine {
+
+// An append-only log of prefs mutations. Every call to Append() writes a single
+// self-checksummed record and syncs it to disk, so a batch of key updates
+// either reaches the disk as a whole or not at all.
+//
+// Record layout, all integers in host byte order:
+//   [u32 magic][u32 payload length][u32 crc32 of payload][payload]
+// where the payload is a sequence of entries:
+//   [u8 type][u32 key length][key][u32 value length][value]
+// Deletions have type kDelete and an empty value.
+//
+// On Open() the records are replayed in order. Replay stops at the first
+// record which is truncated or fails its checksum, and the file is cut back to
+// the end of the last good record, dropping the tail of an interrupted append.
+class PrefsJournal {
+ public:
+  // A single mutation, |value| is unset for a deleted key.
+  struct Entry {
+    std::string key;
+    std::optional<std::string> value;
+  };
+
+  static constexpr uint32_t kRecordMagic = 0x4A505545;  // "EUPJ"
+
+  // Opens or creates the journal at |path|, and appends all entries of the
+  // valid records to |entries|. Returns nullptr on failure.
+  static std::unique_ptr<PrefsJournal> Open(const std::string& path,
+                                            std::vector<Entry>* entries);
+
+  // Appends a record holding all |entries| and waits until it is durable.
+  // On failure the journal is left as it was before the call.
+  bool Append(const std::vector<Entry>& entries);
+
+  // Drops all records. Only call this once all replayed and appended entries
+  // are persisted somewhere else.
+  bool Reset();
+
+  // Size of the journal file in bytes.
+  size_t size() const { return size_; }
+
+  // Serializes |entries| into a complete record, exposed for testing.
+  static std::string EncodeRecord(const std::vector<Entry>& entries);
+
+ private:
+  PrefsJournal(android::base::unique_fd fd, size_t size)
+      : fd_(std::move(fd)), size_(size) {}
+
+  // Parses the records in |data| into |entries|, and returns the number of
+  // bytes occupied by valid records.
+  static size_t DecodeRecords(const std::string& data,
+                              std::vector<Entry>* entries);
+
+  android::base::unique_fd fd_;
+  size_t size_;
+
+  DISALLOW_COPY_AND_ASSIGN(PrefsJournal);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_COMMON_PREFS_JOURNAL_H_
@@ -0,0 +1,134 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/prefs_journal.h"
+
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <base/files/scoped_temp_dir.h>
+#include <gtest/gtest.h>
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+class PrefsJournalTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    ASSERT_TRUE(temp_dir_.CreateUniqueTempDir());
+    path_ = temp_dir_.GetPath().Append("journal").value();
+  }
+
+  std::unique_ptr<PrefsJournal> Open(vector<PrefsJournal::Entry>* entries) {
+    entries->clear();
+    return PrefsJournal::Open(path_, entries);
+  }
+
+  base::ScopedTempDir temp_dir_;
+  string path_;
+};
+
+TEST_F(PrefsJournalTest, ReplayTest) {
+  vector<PrefsJournal::Entry> entries;
+  auto journal = Open(&entries);
+  ASSERT_NE(nullptr, journal);
+  EXPECT_TRUE(entries.empty());
+  EXPECT_EQ(0U, journal->size());
+
+  ASSERT_TRUE(journal->Append({{"key1", "value1"}, {"ns/key2", ""}}));
+  ASSERT_TRUE(journal->Append({{"key1", std::nullopt}}));
+  const size_t size = journal->size();
+  journal.reset();
+
+  journal = Open(&entries);
+  ASSERT_NE(nullptr, journal);
+  EXPECT_EQ(size, journal->size());
+  ASSERT_EQ(3U, entries.size());
+  EXPECT_EQ("key1", entries[0].key);
+  EXPECT_EQ("value1", entries[0].value);
+  EXPECT_EQ("ns/key2", entries[1].key);
+  EXPECT_EQ("", entries[1].value);
+  EXPECT_EQ("key1", entries[2].key);
+  EXPECT_FALSE(entries[2].value);
+}
+
+TEST_F(PrefsJournalTest, ResetTest) {
+  vector<PrefsJournal::Entry> entries;
+  auto journal = Open(&entries);
+  ASSERT_NE(nullptr, journal);
+  ASSERT_TRUE(journal->Append({{"key", "value"}}));
+  ASSERT_TRUE(journal->Reset());
+  EXPECT_EQ(0U, journal->size());
+  ASSERT_TRUE(journal->Append({{"key", "other"}}));
+  journal.reset();
+
+  journal = Open(&entries);
+  ASSERT_EQ(1U, entries.size());
+  EXPECT_EQ("other", entries[0].value);
+}
+
+// An interrupted append only loses the record being appended, and the journal
+// can be appended to again after it's reopened.
+TEST_F(PrefsJournalTest, TornRecordTest) {
+  vector<PrefsJournal::Entry> entries;
+  auto journal = Open(&entries);
+  ASSERT_NE(nullptr, journal);
+  ASSERT_TRUE(journal->Append({{"key", "value"}}));
+  const size_t size = journal->size();
+  journal.reset();
+
+  const string record = PrefsJournal::EncodeRecord({{"key", "torn"}});
+  string data;
+  ASSERT_TRUE(android::base::ReadFileToString(path_, &data));
+  ASSERT_TRUE(android::base::WriteStringToFile(
+      data + record.substr(0, record.size() - 1), path_));
+
+  journal = Open(&entries);
+  ASSERT_NE(nullptr, journal);
+  EXPECT_EQ(size, journal->size());
+  ASSERT_EQ(1U, entries.size());
+  EXPECT_EQ("value", entries[0].value);
+
+  ASSERT_TRUE(journal->Append({{"key", "new"}}));
+  journal.reset();
+  journal = Open(&entries);
+  ASSERT_EQ(2U, entries.size());
+  EXPECT_EQ("new", entries[1].value);
+}
+
+// A record which fails its checksum and everything after it are dropped.
+TEST_F(PrefsJournalTest, CorruptRecordTest) {
+  const string record1 = PrefsJournal::EncodeRecord({{"key1", "value1"}});
+  string record2 = PrefsJournal::EncodeRecord({{"key2", "value2"}});
+  const string record3 = PrefsJournal::EncodeRecord({{"key3", "value3"}});
+  record2.back() ^= 1;
+  ASSERT_TRUE(
+      android::base::WriteStringToFile(record1 + record2 + record3, path_));
+
+  vector<PrefsJournal::Entry> entries;
+  auto journal = Open(&entries);
+  ASSERT_NE(nullptr, journal);
+  EXPECT_EQ(record1.size(), journal->size());
+  ASSERT_EQ(1U, entries.size());
+  EXPECT_EQ("key1", entries[0].key);
+}
+
+}  // namespace chromeos_update_engine
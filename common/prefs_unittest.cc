@@ -584,6 +584,83 @@ TEST_F(PrefsTest, MultiNamespaceKeyTest) {
   MultiNamespaceKeyTest();
 }
 
+TEST_F(PrefsTest, TransactionTest) {
+  const string kOtherKey = "ns/other-key";
+  ASSERT_TRUE(prefs_.SetString(kKey, "old"));
+  ASSERT_TRUE(prefs_.SetString(kOtherKey, "old"));
+
+  // Changes are visible while the transaction is in progress, but not on disk.
+  ASSERT_TRUE(prefs_.StartTransaction());
+  ASSERT_TRUE(prefs_.SetString(kKey, "new"));
+  ASSERT_TRUE(prefs_.Delete(kOtherKey));
+  string value;
+  EXPECT_TRUE(prefs_.GetString(kKey, &value));
+  EXPECT_EQ("new", value);
+  EXPECT_FALSE(prefs_.Exists(kOtherKey));
+  vector<string> keys;
+  EXPECT_TRUE(prefs_.GetSubKeys("ns", &keys));
+  EXPECT_TRUE(keys.empty());
+  EXPECT_TRUE(base::ReadFileToString(prefs_dir_.Append(kKey), &value));
+  EXPECT_EQ("old", value);
+
+  // A cancelled transaction leaves no trace.
+  ASSERT_TRUE(prefs_.CancelTransaction());
+  EXPECT_TRUE(prefs_.GetString(kKey, &value));
+  EXPECT_EQ("old", value);
+  EXPECT_TRUE(prefs_.Exists(kOtherKey));
+
+  ASSERT_TRUE(prefs_.StartTransaction());
+  ASSERT_TRUE(prefs_.SetString(kKey, "new"));
+  ASSERT_TRUE(prefs_.Delete(kOtherKey));
+  ASSERT_TRUE(prefs_.SubmitTransaction());
+  EXPECT_TRUE(prefs_.GetString(kKey, &value));
+  EXPECT_EQ("new", value);
+  EXPECT_FALSE(prefs_.Exists(kOtherKey));
+
+  // Keys updated by the journal keep being served from it.
+  ASSERT_TRUE(prefs_.SetString(kKey, "newer"));
+  EXPECT_TRUE(prefs_.GetString(kKey, &value));
+  EXPECT_EQ("newer", value);
+
+  // A new instance replays the journal and writes it back to the files.
+  Prefs prefs;
+  ASSERT_TRUE(prefs.Init(prefs_dir_));
+  EXPECT_TRUE(prefs.GetString(kKey, &value));
+  EXPECT_EQ("newer", value);
+  EXPECT_FALSE(prefs.Exists(kOtherKey));
+  EXPECT_TRUE(base::ReadFileToString(prefs_dir_.Append(kKey), &value));
+  EXPECT_EQ("newer", value);
+  EXPECT_FALSE(base::PathExists(prefs_dir_.Append(kOtherKey)));
+  EXPECT_FALSE(base::PathExists(prefs_dir_.Append("ns")));
+}
+
+TEST_F(PrefsTest, TransactionJournalCompactionTest) {
+  const string kLargeValue(Prefs::kMaxJournalSize / 4, 'x');
+  string value;
+  for (int i = 0; i < 5; i++) {
+    ASSERT_TRUE(prefs_.StartTransaction());
+    ASSERT_TRUE(prefs_.SetInt64(kKey, i));
+    ASSERT_TRUE(prefs_.SetString("large", kLargeValue + std::to_string(i)));
+    ASSERT_TRUE(prefs_.SubmitTransaction());
+  }
+  // The fourth transaction pushed the journal over its limit and was written
+  // back, only the last one is left in the journal.
+  EXPECT_EQ(2U, prefs_.file_storage_.journal_values_.size());
+  EXPECT_LT(prefs_.file_storage_.journal_->size(), Prefs::kMaxJournalSize);
+  EXPECT_TRUE(base::ReadFileToString(prefs_dir_.Append(kKey), &value));
+  EXPECT_EQ("3", value);
+  int64_t int_value;
+  EXPECT_TRUE(prefs_.GetInt64(kKey, &int_value));
+  EXPECT_EQ(4, int_value);
+
+  // Values which don't change aren't journaled again.
+  const size_t journal_size = prefs_.file_storage_.journal_->size();
+  ASSERT_TRUE(prefs_.StartTransaction());
+  ASSERT_TRUE(prefs_.SetInt64(kKey, 4));
+  ASSERT_TRUE(prefs_.SubmitTransaction());
+  EXPECT_EQ(journal_size, prefs_.file_storage_.journal_->size());
+}
+
 class MemoryPrefsTest : public BasePrefsTest {
  protected:
   void SetUp() override { common_prefs_ = &prefs_; }
@@ -20,13 +20,17 @@
 
 #include <algorithm>
 #include <string>
+#include <utility>
 
+#include <base/bind.h>
 #include <base/files/file_path.h>
 #include <base/metrics/statistics_recorder.h>
 #include <base/strings/stringprintf.h>
+#include <base/threading/thread_task_runner_handle.h>
 
 #include "update_engine/common/boot_control_interface.h"
 #include "update_engine/common/error_code_utils.h"
+#include "update_engine/common/hardware_interface.h"
 #include "update_engine/common/multi_range_http_fetcher.h"
 #include "update_engine/common/prefs_interface.h"
 #include "update_engine/common/utils.h"
@@ -36,6 +40,16 @@ using std::string;
 
 namespace chromeos_update_engine {
 
+namespace {
+// Sizes of the memory ring and the spill file used with
+// |InstallPlan::spill_download|.
+constexpr size_t kSpillQueueMemorySize = 16 * 1024 * 1024;
+constexpr uint64_t kSpillQueueFileSize = 256 * 1024 * 1024;
+constexpr char kSpillFileName[] = "payload_spill";
+// How often the state of the spill queue is logged while downloading.
+constexpr int kSpillQueueLogIntervalSeconds = 30;
+}  // namespace
+
 DownloadAction::DownloadAction(PrefsInterface* prefs,
                                BootControlInterface* boot_control,
                                HardwareInterface* hardware,
@@ -51,7 +65,11 @@ DownloadAction::DownloadAction(PrefsInterface* prefs,
       delegate_(nullptr),
       update_certificates_path_(std::move(update_certificates_path)) {}
 
-DownloadAction::~DownloadAction() {}
+DownloadAction::~DownloadAction() {
+  if (applier_.joinable()) {
+    StopApplier();
+  }
+}
 
 void DownloadAction::PerformAction() {
   http_fetcher_->set_delegate(this);
@@ -186,18 +204,157 @@ void DownloadAction::StartDownloading() {
     }
   }
 
+  if (install_plan_.spill_download && !StartApplier()) {
+    LOG(WARNING) << "Unable to set up the spill queue, applying the payload "
+                    "as it's downloaded.";
+  }
+
   http_fetcher_->BeginTransfer(install_plan_.download_url);
 }
 
+bool DownloadAction::StartApplier() {
+  string spill_path;
+  base::FilePath dir;
+  if (hardware_ && hardware_->GetNonVolatileDirectory(&dir)) {
+    spill_path = dir.Append(kSpillFileName).value();
+  } else {
+    LOG(WARNING) << "No non-volatile directory, the spill queue only buffers "
+                 << kSpillQueueMemorySize << " bytes in memory.";
+  }
+  auto spill_queue = std::make_unique<PayloadSpillQueue>(
+      kSpillQueueMemorySize, spill_path, kSpillQueueFileSize);
+  TEST_AND_RETURN_FALSE(spill_queue->Init());
+  spill_queue_ = std::move(spill_queue);
+  main_thread_lease_ =
+      std::make_unique<MainThreadLease>(base::ThreadTaskRunnerHandle::Get());
+  delta_performer_->set_main_thread_lease(main_thread_lease_.get());
+  applier_code_ = ErrorCode::kSuccess;
+  spill_queue_log_time_ = base::TimeTicks::Now();
+  applier_ = std::thread(&DownloadAction::ApplyQueuedData,
+                         this,
+                         base::ThreadTaskRunnerHandle::Get(),
+                         weak_ptr_factory_.GetWeakPtr());
+  LOG(INFO) << "Applying the payload on a separate thread, high-water mark "
+            << spill_queue_->high_water_mark() << " bytes, low-water mark "
+            << spill_queue_->low_water_mark() << " bytes.";
+  return true;
+}
+
+void DownloadAction::ApplyQueuedData(
+    scoped_refptr<base::SingleThreadTaskRunner> task_runner,
+    base::WeakPtr<DownloadAction> weak_this) {
+  ErrorCode code = ErrorCode::kSuccess;
+  brillo::Blob data;
+  while (spill_queue_->Pop(&data)) {
+    if (!delta_performer_->Write(data.data(), data.size(), &code)) {
+      LOG(ERROR) << "Error " << utils::ErrorCodeToString(code) << " (" << code
+                 << ") in DeltaPerformer's Write method when "
+                 << "processing the queued payload -- Terminating processing";
+      if (code == ErrorCode::kSuccess)
+        code = ErrorCode::kDownloadWriteError;
+      break;
+    }
+  }
+  // Pop() also stops if the spill file can't be read, which leaves data in
+  // the queue.
+  if (code == ErrorCode::kSuccess &&
+      spill_queue_->GetStats().buffered_bytes != 0) {
+    code = ErrorCode::kDownloadWriteError;
+  }
+  applier_code_ = code;
+  // Unblocks the main thread if it's waiting for room in the queue.
+  spill_queue_->Abort();
+  task_runner->PostTask(
+      FROM_HERE,
+      base::BindOnce(&DownloadAction::OnApplierDone, weak_this, code));
+}
+
+ErrorCode DownloadAction::StopApplier() {
+  spill_queue_->Abort();
+  main_thread_lease_->Abort();
+  applier_.join();
+  if (delta_performer_)
+    delta_performer_->set_main_thread_lease(nullptr);
+  main_thread_lease_.reset();
+  LogSpillQueueStats(true);
+  spill_queue_.reset();
+  return applier_code_;
+}
+
+void DownloadAction::OnApplierDone(ErrorCode code) {
+  // Ignore it if the applier was already stopped.
+  if (!applier_.joinable())
+    return;
+  StopApplier();
+  if (code == ErrorCode::kSuccess) {
+    // The applier only finishes successfully after the transfer completed.
+    FinishTransfer(true);
+    return;
+  }
+  code_ = code;
+  if (download_active_) {
+    // The action completes with |code_| in TransferTerminated().
+    TerminateProcessing();
+    return;
+  }
+  if (delta_performer_) {
+    delta_performer_->Close();
+    delta_performer_.reset();
+  }
+  processor_->ActionComplete(this, code_);
+}
+
+void DownloadAction::LogSpillQueueStats(bool final) {
+  const auto stats = spill_queue_->GetStats();
+  LOG(INFO) << "Spill queue: " << stats.buffered_bytes << " bytes buffered, "
+            << stats.peak_buffered_bytes << " bytes at peak, "
+            << stats.spilled_bytes << " bytes spilled, "
+            << stats.high_water_waits << " waits at the high-water mark, "
+            << stats.empty_waits << " waits on an empty queue.";
+  if (!final)
+    return;
+  // Accumulated over all the attempts of this update, the totals are reported
+  // with the metrics of the update once it succeeds.
+  const auto add_to_pref = [this](const string& key, uint64_t value) {
+    int64_t total = 0;
+    prefs_->GetInt64(key, &total);
+    prefs_->SetInt64(key, total + static_cast<int64_t>(value));
+  };
+  int64_t peak_bytes = 0;
+  prefs_->GetInt64(kPrefsUpdateStateSpillQueuePeakBytes, &peak_bytes);
+  prefs_->SetInt64(
+      kPrefsUpdateStateSpillQueuePeakBytes,
+      std::max(peak_bytes, static_cast<int64_t>(stats.peak_buffered_bytes)));
+  add_to_pref(kPrefsUpdateStateSpillQueueSpilledBytes, stats.spilled_bytes);
+  add_to_pref(kPrefsUpdateStateSpillQueueHighWaterWaits,
+              stats.high_water_waits);
+  add_to_pref(kPrefsUpdateStateSpillQueueEmptyWaits, stats.empty_waits);
+}
+
 void DownloadAction::SuspendAction() {
   http_fetcher_->Pause();
+  if (applier_.joinable()) {
+    // Stops the applier before it pops more data or starts another operation.
+    spill_queue_->SetPaused(true);
+    main_thread_lease_->SetSuspended(true);
+  }
+  if (delta_performer_)
+    delta_performer_->CancelPrefetch();
 }
 
 void DownloadAction::ResumeAction() {
+  if (applier_.joinable()) {
+    main_thread_lease_->SetSuspended(false);
+    spill_queue_->SetPaused(false);
+  }
   http_fetcher_->Unpause();
 }
 
 void DownloadAction::TerminateProcessing() {
+  // The applier must be done with |delta_performer_| before it's closed.
+  if (applier_.joinable()) {
+    StopApplier();
+  }
   if (delta_performer_) {
     delta_performer_->Close();
     delta_performer_.reset();
@@ -222,6 +379,29 @@ bool DownloadAction::ReceivedBytes(HttpFetcher* fetcher,
     delegate_->BytesReceived(
         length, bytes_downloaded_total - base_offset_, bytes_total_);
   }
+  if (spill_queue_) {
+    // Blocks only while the queue is at its high-water mark, the applier may
+    // use the state shared with this thread meanwhile.
+    main_thread_lease_->Park();
+    const bool pushed = spill_queue_->Push(bytes, length);
+    main_thread_lease_->Unpark();
+    if (!pushed) {
+      code_ = StopApplier();
+      if (code_ == ErrorCode::kSuccess)
+        code_ = ErrorCode::kDownloadWriteError;
+      LOG(ERROR) << "Unable to queue the received payload, error "
+                 << utils::ErrorCodeToString(code_) << " (" << code_
+                 << ") -- Terminating processing";
+      TerminateProcessing();
+      return false;
+    }
+    if (base::TimeTicks::Now() - spill_queue_log_time_ >=
+        base::TimeDelta::FromSeconds(kSpillQueueLogIntervalSeconds)) {
+      spill_queue_log_time_ = base::TimeTicks::Now();
+      LogSpillQueueStats(false);
+    }
+    return true;
+  }
   if (delta_performer_ && !delta_performer_->Write(bytes, length, &code_)) {
     if (code_ != ErrorCode::kSuccess) {
       LOG(ERROR) << "Error " << utils::ErrorCodeToString(code_) << " (" << code_
@@ -243,6 +423,20 @@ bool DownloadAction::ReceivedBytes(HttpFetcher* fetcher,
 }
 
 void DownloadAction::TransferComplete(HttpFetcher* fetcher, bool successful) {
+  if (applier_.joinable()) {
+    download_active_ = false;
+    if (successful) {
+      // Let the applier finish the queued data, OnApplierDone() completes the
+      // action.
+      spill_queue_->Close();
+      return;
+    }
+    StopApplier();
+  }
+  FinishTransfer(successful);
+}
+
+void DownloadAction::FinishTransfer(bool successful) {
   if (delta_performer_) {
     LOG_IF(WARNING, delta_performer_->Close() != 0)
         << "Error closing the writer.";
@@ -16,8 +16,20 @@
 
 #include <unistd.h>
 #include <cstdint>
+#include <functional>
+#include <future>
 #include <memory>
+#include <string>
+#include <utility>
 
+#include <base/bind.h>
+#if BASE_VER < 780000  // Android
+#include <base/message_loop/message_loop.h>
+#else  // CrOS
+#include <base/task/single_thread_task_executor.h>
+#endif  // BASE_VER < 780000
+#include <brillo/message_loops/base_message_loop.h>
+#include <brillo/message_loops/message_loop_utils.h>
 #include <gmock/gmock.h>
 #include <gmock/gmock-actions.h>
 #include <gmock/gmock-function-mocker.h>
@@ -42,8 +54,10 @@
 
 namespace chromeos_update_engine {
 using testing::_;
+using testing::Assign;
 using testing::DoAll;
 using testing::Return;
+using testing::SaveArg;
 using testing::SetArgPointee;
 
 class DownloadActionTest : public ::testing::Test {
@@ -172,4 +186,215 @@ TEST_F(DownloadActionTest, CacheManifestValid) {
   // Manifest is cached, so no data should be downloaded from http fetcher.
   ASSERT_EQ(download_action->http_fetcher()->GetBytesDownloaded(), 0UL);
 }
+
+namespace {
+
+// A DeltaPerformer which passes the data written to it to a callback. With
+// |InstallPlan::spill_download| set the callback runs on the applier thread.
+class FakeDeltaPerformer : public DeltaPerformer {
+ public:
+  using WriteCallback =
+      std::function<bool(const void* bytes, size_t count, ErrorCode* error)>;
+
+  FakeDeltaPerformer(PrefsInterface* prefs,
+                     BootControlInterface* boot_control,
+                     HardwareInterface* hardware,
+                     InstallPlan* install_plan,
+                     WriteCallback on_write)
+      : DeltaPerformer(prefs,
+                       boot_control,
+                       hardware,
+                       nullptr,
+                       install_plan,
+                       &install_plan->payloads[0],
+                       false),
+        on_write_(std::move(on_write)) {}
+
+  using DeltaPerformer::Write;
+  bool Write(const void* bytes, size_t count, ErrorCode* error) override {
+    return on_write_(bytes, count, error);
+  }
+  int Close() override { return 0; }
+
+ private:
+  WriteCallback on_write_;
+
+  DISALLOW_COPY_AND_ASSIGN(FakeDeltaPerformer);
+};
+
+}  // namespace
+
+// Feeds the payload to a DownloadAction applying it from the spill queue. The
+// test calls the HttpFetcherDelegate methods itself, the fetcher is paused and
+// never sends anything.
+class DownloadActionSpillQueueTest : public ::testing::Test {
+ protected:
+  // FakeHardware has no non-volatile directory, so the queue only holds this
+  // much in memory before Push() blocks.
+  static constexpr size_t kSpillQueueMemorySize = 16 * 1024 * 1024;
+
+  void SetUp() override {
+    loop_.SetAsCurrent();
+    install_plan_.download_url = "http://fake_url.invalid";
+    install_plan_.spill_download = true;
+    auto& payload = install_plan_.payloads.emplace_back();
+    payload.payload_urls.emplace_back("http://fake_url.invalid");
+    // The fake payload can't be verified.
+    payload.already_applied = true;
+  }
+
+  void StartAction(FakeDeltaPerformer::WriteCallback on_write) {
+    action_pipe_->set_contents(install_plan_);
+    MockHttpFetcher* http_fetcher = new MockHttpFetcher("x", 1);
+    http_fetcher->Pause();
+    download_action_ = std::make_unique<DownloadAction>(
+        &prefs_, &boot_control_, &hardware_, http_fetcher, false);
+    download_action_->SetTestFileWriter(
+        std::make_unique<FakeDeltaPerformer>(&prefs_,
+                                             &boot_control_,
+                                             &hardware_,
+                                             &install_plan_,
+                                             std::move(on_write)));
+    download_action_->set_in_pipe(action_pipe_);
+    download_action_->SetProcessor(&processor_);
+    EXPECT_CALL(processor_, ActionComplete(download_action_.get(), _))
+        .WillOnce(DoAll(SaveArg<1>(&code_), Assign(&completed_, true)));
+    download_action_->PerformAction();
+  }
+
+  bool ReceivedBytes(const brillo::Blob& data) {
+    return download_action_->ReceivedBytes(
+        download_action_->http_fetcher(), data.data(), data.size());
+  }
+
+  void TransferComplete(bool successful) {
+    download_action_->TransferComplete(download_action_->http_fetcher(),
+                                       successful);
+  }
+
+  void RunUntilComplete() {
+    brillo::MessageLoopRunUntil(
+        &loop_,
+        base::TimeDelta::FromSeconds(10),
+        base::Bind([](const bool* completed) { return *completed; },
+                   base::Unretained(&completed_)));
+  }
+
+  // Returns a WriteCallback which waits for |ready|, then appends the data to
+  // |written_|.
+  FakeDeltaPerformer::WriteCallback AppendToWritten(
+      std::shared_future<void> ready) {
+    return [this, ready](const void* bytes, size_t count, ErrorCode* error) {
+      ready.wait();
+      const uint8_t* data = static_cast<const uint8_t*>(bytes);
+      written_.insert(written_.end(), data, data + count);
+      return true;
+    };
+  }
+
+  // Returns a WriteCallback which waits for |ready|, then fails with |code|.
+  FakeDeltaPerformer::WriteCallback FailWith(std::shared_future<void> ready,
+                                             ErrorCode code) {
+    return [ready, code](const void* bytes, size_t count, ErrorCode* error) {
+      ready.wait();
+      *error = code;
+      return false;
+    };
+  }
+
+#if BASE_VER < 780000  // Android
+  base::MessageLoopForIO base_loop_;
+  brillo::BaseMessageLoop loop_{&base_loop_};
+#else   // CrOS
+  base::SingleThreadTaskExecutor base_loop_{base::MessagePumpType::IO};
+  brillo::BaseMessageLoop loop_{base_loop_.task_runner()};
+#endif  // BASE_VER < 780000
+
+  MockPrefs prefs_;
+  BootControlStub boot_control_;
+  FakeHardware hardware_;
+  InstallPlan install_plan_;
+  std::shared_ptr<ActionPipe<InstallPlan>> action_pipe_{
+      new ActionPipe<InstallPlan>()};
+  MockActionProcessor processor_;
+  std::unique_ptr<DownloadAction> download_action_;
+
+  // Only touched by the applier thread until the action completed.
+  brillo::Blob written_;
+  bool completed_{false};
+  ErrorCode code_{ErrorCode::kError};
+};
+
+TEST_F(DownloadActionSpillQueueTest, AppliesQueuedDataTest) {
+  std::promise<void> ready;
+  ready.set_value();
+  StartAction(AppendToWritten(ready.get_future().share()));
+
+  brillo::Blob payload;
+  for (int i = 0; i < 4; i++) {
+    brillo::Blob chunk(kMockHttpFetcherChunkSize + i, 'a' + i);
+    ASSERT_TRUE(ReceivedBytes(chunk));
+    payload.insert(payload.end(), chunk.begin(), chunk.end());
+  }
+  TransferComplete(true);
+  RunUntilComplete();
+
+  ASSERT_TRUE(completed_);
+  EXPECT_EQ(ErrorCode::kSuccess, code_);
+  EXPECT_EQ(payload, written_);
+}
+
+// The transfer completes while the applier is still busy, the action only
+// completes once the queued data was applied.
+TEST_F(DownloadActionSpillQueueTest, TransferCompletesBeforeApplierTest) {
+  std::promise<void> ready;
+  StartAction(AppendToWritten(ready.get_future().share()));
+
+  const brillo::Blob payload(3 * kMockHttpFetcherChunkSize, 'p');
+  ASSERT_TRUE(ReceivedBytes(payload));
+  TransferComplete(true);
+  EXPECT_FALSE(completed_);
+
+  ready.set_value();
+  RunUntilComplete();
+  ASSERT_TRUE(completed_);
+  EXPECT_EQ(ErrorCode::kSuccess, code_);
+  EXPECT_EQ(payload, written_);
+}
+
+// The applier fails after the transfer completed.
+TEST_F(DownloadActionSpillQueueTest, ApplierFailsAfterTransferCompleteTest) {
+  std::promise<void> ready;
+  StartAction(FailWith(ready.get_future().share(),
+                       ErrorCode::kDownloadOperationExecutionError));
+
+  ASSERT_TRUE(ReceivedBytes(brillo::Blob(kMockHttpFetcherChunkSize, 'a')));
+  ASSERT_TRUE(ReceivedBytes(brillo::Blob(kMockHttpFetcherChunkSize, 'b')));
+  TransferComplete(true);
+  ready.set_value();
+  RunUntilComplete();
+
+  ASSERT_TRUE(completed_);
+  EXPECT_EQ(ErrorCode::kDownloadOperationExecutionError, code_);
+}
+
+// A failing applier aborts the queue, which makes Push() fail and the action
+// complete with the applier's error.
+TEST_F(DownloadActionSpillQueueTest, FailedPushTest) {
+  std::promise<void> ready;
+  ready.set_value();
+  StartAction(FailWith(ready.get_future().share(),
+                       ErrorCode::kDownloadOperationExecutionError));
+
+  ASSERT_TRUE(ReceivedBytes(brillo::Blob(1, 'a')));
+  // More than the queue holds, so Push() blocks until the applier failed and
+  // aborted the queue if it didn't already.
+  EXPECT_FALSE(ReceivedBytes(brillo::Blob(kSpillQueueMemorySize + 1, 'b')));
+  EXPECT_TRUE(completed_);
+  EXPECT_EQ(ErrorCode::kDownloadOperationExecutionError, code_);
+
+  // OnApplierDone() was posted by then, it must not complete the action again.
+  brillo::MessageLoopRunMaxIterations(&loop_, 10);
+}
+
 }  // namespace chromeos_update_engine
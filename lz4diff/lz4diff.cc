@@ -26,6 +26,11 @@
 #include <lz4.h>
 #include <lz4hc.h>
 
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
 #include "update_engine/common/utils.h"
 #include "update_engine/common/hash_calculator.h"
 #include "update_engine/payload_generator/deflate_utils.h"
@@ -84,7 +89,7 @@ bool StoreDstCompressedFileInfo(std::string_view recompressed_blob,
 }
 
 template <typename Blob>
-static bool TryBsdiff(Blob src, Blob dst, Blob* output) noexcept {
+static bool TryBsdiff(const Blob& src, const Blob& dst, Blob* output) noexcept {
   static constexpr auto kLz4diffDefaultBrotliQuality = 9;
   CHECK_NE(output, nullptr);
   ScopedTempFile patch;
@@ -119,6 +124,63 @@ bool TryFindDeflates(puffin::Buffer data,
   return false;
 }
 
+// Records in |header| the destination clusters whose compressed bytes are the
+// same as a source cluster's, which the patcher copies from the source instead
+// of re-compressing them.
+static void StoreSrcClusterCopies(std::string_view src,
+                                  const CompressedFile& src_file_info,
+                                  std::string_view dst,
+                                  const CompressedFile& dst_file_info,
+                                  Lz4diffHeader* header) {
+  // The same bytes only decompress the same way with the same padding.
+  if (src_file_info.zero_padding_enabled !=
+      dst_file_info.zero_padding_enabled) {
+    return;
+  }
+  // Source clusters by the hash of their compressed bytes. Clusters stored
+  // uncompressed are cheap to "re-compress" already.
+  std::unordered_map<std::string, size_t> src_clusters;
+  std::vector<std::string_view> src_cluster_data;
+  src_cluster_data.reserve(src_file_info.blocks.size());
+  size_t offset = 0;
+  for (const auto& block : src_file_info.blocks) {
+    const auto cluster = src.substr(offset, block.compressed_length);
+    src_cluster_data.push_back(cluster);
+    if (block.IsCompressed()) {
+      src_clusters.emplace(HashCalculator::SHA256Digest(cluster),
+                           src_cluster_data.size() - 1);
+    }
+    offset += block.compressed_length;
+  }
+
+  auto& dst_block_info = *header->mutable_dst_info()->mutable_block_info();
+  size_t num_copies = 0;
+  offset = 0;
+  for (int i = 0; i < dst_block_info.size(); i++) {
+    const auto& block = dst_file_info.blocks[i];
+    const auto cluster = dst.substr(offset, block.compressed_length);
+    offset += block.compressed_length;
+    if (!block.IsCompressed()) {
+      continue;
+    }
+    const auto it = src_clusters.find(HashCalculator::SHA256Digest(cluster));
+    if (it == src_clusters.end()) {
+      continue;
+    }
+    const auto& src_block = src_file_info.blocks[it->second];
+    if (src_block.uncompressed_length != block.uncompressed_length ||
+        src_cluster_data[it->second] != cluster) {
+      continue;
+    }
+    dst_block_info[i].set_src_cluster_index(it->second);
+    num_copies++;
+  }
+  if (num_copies > 0) {
+    LOG(INFO) << num_copies << "/" << dst_block_info.size()
+              << " clusters are copied from the source.";
+  }
+}
+
 static bool ConstructLz4diffPatch(Blob inner_patch,
                                   const Lz4diffHeader& header,
                                   Blob* output) {
@@ -138,18 +200,23 @@ static bool ConstructLz4diffPatch(Blob inner_patch,
   return true;
 }
 
-static bool TryPuffdiff(puffin::Buffer src,
-                        puffin::Buffer dst,
+// Finds the deflate streams of |src| and |dst| for |TryPuffdiff|. Returns
+// false if either has none, as PUFFDIFF can't do better than BSDIFF then.
+static bool FindPuffdiffDeflates(const puffin::Buffer& src,
+                                 const puffin::Buffer& dst,
+                                 std::vector<puffin::BitExtent>* src_deflates,
+                                 std::vector<puffin::BitExtent>* dst_deflates) {
+  TEST_AND_RETURN_FALSE(TryFindDeflates(src, src_deflates));
+  TEST_AND_RETURN_FALSE(TryFindDeflates(dst, dst_deflates));
+  return !src_deflates->empty() && !dst_deflates->empty();
+}
+
+static bool TryPuffdiff(const puffin::Buffer& src,
+                        const puffin::Buffer& dst,
+                        const std::vector<puffin::BitExtent>& src_deflates,
+                        const std::vector<puffin::BitExtent>& dst_deflates,
                         Blob* output) noexcept {
   CHECK_NE(output, nullptr);
-  std::vector<puffin::BitExtent> src_deflates;
-  TEST_AND_RETURN_FALSE(TryFindDeflates(src, &src_deflates));
-  std::vector<puffin::BitExtent> dst_deflates;
-  TEST_AND_RETURN_FALSE(TryFindDeflates(dst, &dst_deflates));
-  if (src_deflates.empty() || dst_deflates.empty()) {
-    return false;
-  }
-
   Blob puffdiff_delta;
   ScopedTempFile temp_file("puffdiff-delta.XXXXXX");
   // Perform PuffDiff operation.
@@ -182,7 +249,8 @@ bool Lz4Diff(std::string_view src,
              const CompressedFile& src_file_info,
              const CompressedFile& dst_file_info,
              Blob* output,
-             InstallOperation::Type* op_type) noexcept {
+             InstallOperation::Type* op_type,
+             bool concurrent_puffdiff) noexcept {
   const auto& src_block_info = src_file_info.blocks;
   const auto& dst_block_info = dst_file_info.blocks;
 
@@ -196,6 +264,33 @@ bool Lz4Diff(std::string_view src,
   }
 
   Lz4diffHeader header;
+  // PUFFDIFF might fail, as the input data might not be deflate compressed.
+  // Otherwise, if |concurrent_puffdiff|, it runs on another thread while
+  // BSDIFF runs on this one, as either takes seconds on large files. Both
+  // only read the decompressed data.
+  Blob puffdiff_delta;
+  bool puffdiff_succeeded = false;
+  std::thread puffdiff_thread;
+  std::vector<puffin::BitExtent> src_deflates;
+  std::vector<puffin::BitExtent> dst_deflates;
+  const bool try_puffdiff = FindPuffdiffDeflates(
+      decompressed_src, decompressed_dst, &src_deflates, &dst_deflates);
+  auto puffdiff = [&] {
+    puffdiff_succeeded = TryPuffdiff(decompressed_src,
+                                     decompressed_dst,
+                                     src_deflates,
+                                     dst_deflates,
+                                     &puffdiff_delta);
+  };
+  if (try_puffdiff && concurrent_puffdiff) {
+    puffdiff_thread = std::thread(puffdiff);
+  }
+  DEFER {
+    if (puffdiff_thread.joinable()) {
+      puffdiff_thread.join();
+    }
+  };
+
   // BSDIFF isn't supposed to fail, so return error if BSDIFF failed.
   Blob patch_data;
   TEST_AND_RETURN_FALSE(
@@ -204,11 +299,13 @@ bool Lz4Diff(std::string_view src,
   if (op_type) {
     *op_type = InstallOperation::LZ4DIFF_BSDIFF;
   }
-  // PUFFDIFF might fail, as the input data might not be deflate compressed.
 
-  Blob puffdiff_delta;
-  if (TryPuffdiff(decompressed_src, decompressed_dst, &puffdiff_delta) &&
-      puffdiff_delta.size() < patch_data.size()) {
+  if (puffdiff_thread.joinable()) {
+    puffdiff_thread.join();
+  } else if (try_puffdiff) {
+    puffdiff();
+  }
+  if (puffdiff_succeeded && puffdiff_delta.size() < patch_data.size()) {
     patch_data = std::move(puffdiff_delta);
     header.set_inner_type(InnerPatchType::PUFFDIFF);
     if (op_type) {
@@ -227,6 +324,7 @@ bool Lz4Diff(std::string_view src,
   StoreSrcCompressedFileInfo(src_file_info, &header);
   StoreDstCompressedFileInfo(
       ToStringView(recompressed_blob), dst, dst_file_info, &header);
+  StoreSrcClusterCopies(src, src_file_info, dst, dst_file_info, &header);
   return ConstructLz4diffPatch(std::move(patch_data), header, output);
 }
 
@@ -235,13 +333,15 @@ bool Lz4Diff(const Blob& src,
              const CompressedFile& src_file_info,
              const CompressedFile& dst_file_info,
              Blob* output,
-             InstallOperation::Type* op_type) noexcept {
+             InstallOperation::Type* op_type,
+             bool concurrent_puffdiff) noexcept {
   return Lz4Diff(ToStringView(src),
                  ToStringView(dst),
                  src_file_info,
                  dst_file_info,
                  output,
-                 op_type);
+                 op_type,
+                 concurrent_puffdiff);
 }
 
 }  // namespace chromeos_update_engine
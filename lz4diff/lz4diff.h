@@ -26,19 +26,25 @@
 
 namespace chromeos_update_engine {
 
+// If |concurrent_puffdiff|, PUFFDIFF runs on a thread of its own while BSDIFF
+// runs on the calling one. Callers already running one diff per thread of a
+// pool, like the payload generator, should only turn it on when the pool has
+// threads to spare, see PayloadGenerationConfig::concurrent_lz4diff_puffdiff.
 bool Lz4Diff(std::string_view src,
              std::string_view dst,
              const CompressedFile& src_file_info,
              const CompressedFile& dst_file_info,
              Blob* output,
-             InstallOperation::Type* op_type = nullptr) noexcept;
+             InstallOperation::Type* op_type = nullptr,
+             bool concurrent_puffdiff = false) noexcept;
 
 bool Lz4Diff(const Blob& src,
              const Blob& dst,
              const CompressedFile& src_file_info,
              const CompressedFile& dst_file_info,
              Blob* output,
-             InstallOperation::Type* op_type = nullptr) noexcept;
+             InstallOperation::Type* op_type = nullptr,
+             bool concurrent_puffdiff = false) noexcept;
 
 }  // namespace chromeos_update_engine
 
@@ -21,95 +21,246 @@
 #include "update_engine/payload_generator/delta_diff_generator.h"
 #include "update_engine/payload_generator/payload_generation_config.h"
 
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
 #include <base/logging.h>
 #include <lz4.h>
 #include <lz4hc.h>
 
 namespace chromeos_update_engine {
 
+namespace {
+
+// Most threads recompressing the clusters of a blob.
+constexpr size_t kMaxCompressThreads = 4;
+// Compressed clusters each thread gets at least, as starting a thread for
+// fewer costs more than it saves.
+constexpr size_t kMinClustersPerThread = 8;
+// Clusters each thread may compress ahead of the one handed to the sink,
+// which bounds the memory held by the output of the parallel path.
+constexpr size_t kClustersAheadPerThread = 16;
+
+// Compresses |block| of |blob|, whose compressed clusters span the first
+// |uncompressed_size| bytes, into the |block.compressed_length| bytes at
+// |output|. |hc| is only used by this thread.
+bool CompressCluster(LZ4_streamHC_t* hc,
+                     std::string_view blob,
+                     size_t uncompressed_size,
+                     const CompressedBlock& block,
+                     const bool zero_padding_enabled,
+                     const CompressionAlgorithm& compression_algo,
+                     uint8_t* output) {
+  const auto uncompressed_block =
+      blob.substr(block.uncompressed_offset, block.uncompressed_length);
+  int ret = 0;
+  // LZ4 spec enforces that last op of a compressed block must be an insert op
+  // of at least 5 bytes. Compressors will try to conform to that requirement
+  // if the input size is just right. We don't want that. So always give a
+  // little bit more data.
+  switch (int src_size = uncompressed_size - block.uncompressed_offset;
+          compression_algo.type()) {
+    case CompressionAlgorithm::LZ4HC:
+      ret = LZ4_compress_HC_destSize(hc,
+                                     uncompressed_block.data(),
+                                     reinterpret_cast<char*>(output),
+                                     &src_size,
+                                     block.compressed_length,
+                                     compression_algo.level());
+      break;
+    case CompressionAlgorithm::LZ4:
+      ret = LZ4_compress_destSize(uncompressed_block.data(),
+                                  reinterpret_cast<char*>(output),
+                                  &src_size,
+                                  block.compressed_length);
+      break;
+    default:
+      LOG(ERROR) << "Unrecognized compression algorithm: "
+                 << compression_algo.type();
+      return false;
+  }
+  TEST_GT(ret, 0);
+  const uint64_t bytes_written = ret;
+  // Last block may have trailing zeros
+  TEST_LE(bytes_written, block.compressed_length);
+  if (bytes_written < block.compressed_length) {
+    if (zero_padding_enabled) {
+      const auto padding = block.compressed_length - bytes_written;
+      std::memmove(output + padding, output, bytes_written);
+      std::fill(output, output + padding, 0);
+    } else {
+      std::fill(
+          output + bytes_written, output + block.compressed_length, 0);
+    }
+  }
+  return true;
+}
+
+// Compresses the clusters on |num_threads| threads, each with its own LZ4HC
+// context, and hands them to |sink| in order as soon as all the clusters
+// before them were. A thread only takes a cluster if it's less than
+// |num_threads * kClustersAheadPerThread| clusters ahead of the sink, whose
+// output slot is then free for it.
+bool CompressClustersInParallel(std::string_view blob,
+                                const std::vector<CompressedBlock>& block_info,
+                                size_t uncompressed_size,
+                                const bool zero_padding_enabled,
+                                const CompressionAlgorithm& compression_algo,
+                                size_t num_threads,
+                                const SinkFunc& sink) {
+  struct Slot {
+    Blob data;
+    // The cluster held by this slot once compressed.
+    size_t cluster{SIZE_MAX};
+    bool success{false};
+  };
+  const size_t window = num_threads * kClustersAheadPerThread;
+  std::vector<Slot> slots(window);
+  std::mutex mutex;
+  std::condition_variable cv;
+  size_t next_cluster = 0;
+  size_t sunk_clusters = 0;
+  bool aborted = false;
+
+  auto worker = [&]() {
+    LZ4_streamHC_t* hc = LZ4_createStreamHC();
+    DEFER {
+      LZ4_freeStreamHC(hc);
+    };
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      cv.wait(lock, [&] {
+        return aborted || next_cluster >= block_info.size() ||
+               next_cluster < sunk_clusters + window;
+      });
+      if (aborted || next_cluster >= block_info.size())
+        return;
+      const size_t cluster = next_cluster++;
+      lock.unlock();
+      Slot& slot = slots[cluster % window];
+      const CompressedBlock& block = block_info[cluster];
+      bool success = true;
+      // Uncompressed clusters are passed to the sink straight from |blob|.
+      if (block.IsCompressed()) {
+        slot.data.resize(block.compressed_length);
+        success = hc && CompressCluster(hc,
+                                        blob,
+                                        uncompressed_size,
+                                        block,
+                                        zero_padding_enabled,
+                                        compression_algo,
+                                        slot.data.data());
+      }
+      lock.lock();
+      slot.cluster = cluster;
+      slot.success = success;
+      cv.notify_all();
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < num_threads; i++)
+    threads.emplace_back(worker);
+  DEFER {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      aborted = true;
+    }
+    cv.notify_all();
+    for (auto& thread : threads)
+      thread.join();
+  };
+
+  for (size_t cluster = 0; cluster < block_info.size(); cluster++) {
+    Slot& slot = slots[cluster % window];
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      cv.wait(lock, [&] { return slot.cluster == cluster; });
+    }
+    TEST_AND_RETURN_FALSE(slot.success);
+    const CompressedBlock& block = block_info[cluster];
+    if (block.IsCompressed()) {
+      TEST_EQ(sink(slot.data.data(), slot.data.size()), slot.data.size());
+    } else {
+      const auto uncompressed_block =
+          blob.substr(block.uncompressed_offset, block.uncompressed_length);
+      TEST_EQ(sink(reinterpret_cast<const uint8_t*>(uncompressed_block.data()),
+                   uncompressed_block.size()),
+              uncompressed_block.size());
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      sunk_clusters = cluster + 1;
+    }
+    cv.notify_all();
+  }
+  return true;
+}
+
+}  // namespace
+
 bool TryCompressBlob(std::string_view blob,
                      const std::vector<CompressedBlock>& block_info,
                      const bool zero_padding_enabled,
                      const CompressionAlgorithm compression_algo,
-                     const SinkFunc& sink) {
+                     const SinkFunc& sink,
+                     size_t num_threads) {
   size_t uncompressed_size = 0;
+  size_t num_compressed = 0;
   for (const auto& block : block_info) {
     CHECK_EQ(uncompressed_size, block.uncompressed_offset)
         << "Compressed block info is expected to be sorted.";
     uncompressed_size += block.uncompressed_length;
+    if (block.IsCompressed())
+      num_compressed++;
   }
-  auto hc = LZ4_createStreamHC();
-  DEFER {
-    if (hc) {
-      LZ4_freeStreamHC(hc);
-      hc = nullptr;
-    }
-  };
-  size_t compressed_offset = 0;
-  Blob block_buffer;
-  for (const auto& block : block_info) {
-    const auto uncompressed_block =
-        blob.substr(block.uncompressed_offset, block.uncompressed_length);
-    if (!block.IsCompressed()) {
-      TEST_EQ(sink(reinterpret_cast<const uint8_t*>(uncompressed_block.data()),
-                   uncompressed_block.size()),
-              uncompressed_block.size());
-      continue;
-    }
-    block_buffer.resize(block.compressed_length);
-    // Execute the increment at end of each loop
+  if (num_threads == 0) {
+    num_threads = std::min<size_t>(std::thread::hardware_concurrency(),
+                                   kMaxCompressThreads);
+  }
+  num_threads = std::min(num_threads, num_compressed / kMinClustersPerThread);
+
+  if (num_threads > 1) {
+    TEST_AND_RETURN_FALSE(CompressClustersInParallel(blob,
+                                                     block_info,
+                                                     uncompressed_size,
+                                                     zero_padding_enabled,
+                                                     compression_algo,
+                                                     num_threads,
+                                                     sink));
+  } else {
+    auto hc = LZ4_createStreamHC();
     DEFER {
-      compressed_offset += block.compressed_length;
-      block_buffer.clear();
+      if (hc) {
+        LZ4_freeStreamHC(hc);
+        hc = nullptr;
+      }
     };
-
-    int ret = 0;
-    // LZ4 spec enforces that last op of a compressed block must be an insert op
-    // of at least 5 bytes. Compressors will try to conform to that requirement
-    // if the input size is just right. We don't want that. So always give a
-    // little bit more data.
-    switch (int src_size = uncompressed_size - block.uncompressed_offset;
-            compression_algo.type()) {
-      case CompressionAlgorithm::LZ4HC:
-        ret = LZ4_compress_HC_destSize(
-            hc,
-            uncompressed_block.data(),
-            reinterpret_cast<char*>(block_buffer.data()),
-            &src_size,
-            block.compressed_length,
-            compression_algo.level());
-        break;
-      case CompressionAlgorithm::LZ4:
-        ret =
-            LZ4_compress_destSize(uncompressed_block.data(),
-                                  reinterpret_cast<char*>(block_buffer.data()),
-                                  &src_size,
-                                  block.compressed_length);
-        break;
-      default:
-        LOG(ERROR) << "Unrecognized compression algorithm: "
-                   << compression_algo.type();
-        return {};
-    }
-    TEST_GT(ret, 0);
-    const uint64_t bytes_written = ret;
-    // Last block may have trailing zeros
-    TEST_LE(bytes_written, block.compressed_length);
-    if (bytes_written < block.compressed_length) {
-      if (zero_padding_enabled) {
-        const auto padding = block.compressed_length - bytes_written;
-        std::memmove(
-            block_buffer.data() + padding, block_buffer.data(), bytes_written);
-        std::fill(block_buffer.data(), block_buffer.data() + padding, 0);
-
-      } else {
-        std::fill(block_buffer.data() + bytes_written,
-                  block_buffer.data() + block.compressed_length,
-                  0);
+    Blob block_buffer;
+    for (const auto& block : block_info) {
+      if (!block.IsCompressed()) {
+        const auto uncompressed_block =
+            blob.substr(block.uncompressed_offset, block.uncompressed_length);
+        TEST_EQ(
+            sink(reinterpret_cast<const uint8_t*>(uncompressed_block.data()),
+                 uncompressed_block.size()),
+            uncompressed_block.size());
+        continue;
       }
+      block_buffer.resize(block.compressed_length);
+      TEST_AND_RETURN_FALSE(CompressCluster(hc,
+                                            blob,
+                                            uncompressed_size,
+                                            block,
+                                            zero_padding_enabled,
+                                            compression_algo,
+                                            block_buffer.data()));
+      TEST_EQ(sink(block_buffer.data(), block_buffer.size()),
+              block_buffer.size());
     }
-    TEST_EQ(sink(block_buffer.data(), block_buffer.size()),
-            block_buffer.size());
   }
   // Any trailing data will be copied to the output buffer.
   TEST_EQ(
@@ -122,7 +273,8 @@ bool TryCompressBlob(std::string_view blob,
 Blob TryCompressBlob(std::string_view blob,
                      const std::vector<CompressedBlock>& block_info,
                      const bool zero_padding_enabled,
-                     const CompressionAlgorithm compression_algo) {
+                     const CompressionAlgorithm compression_algo,
+                     size_t num_threads) {
   size_t uncompressed_size = 0;
   size_t compressed_size = 0;
   for (const auto& block : block_info) {
@@ -141,13 +293,48 @@ Blob TryCompressBlob(std::string_view blob,
                        [&output](const uint8_t* data, size_t size) {
                          output.insert(output.end(), data, data + size);
                          return size;
-                       })) {
+                       },
+                       num_threads)) {
     return {};
   }
 
   return output;
 }
 
+ClusterCompressor::ClusterCompressor(
+    const bool zero_padding_enabled,
+    const CompressionAlgorithm& compression_algo)
+    : hc_(LZ4_createStreamHC()),
+      zero_padding_enabled_(zero_padding_enabled),
+      compression_algo_(compression_algo) {}
+
+ClusterCompressor::~ClusterCompressor() {
+  if (hc_) {
+    LZ4_freeStreamHC(hc_);
+  }
+}
+
+bool ClusterCompressor::Compress(std::string_view data,
+                                 const CompressedBlock& block,
+                                 Blob* output) {
+  TEST_AND_RETURN_FALSE(data.size() >= block.uncompressed_length);
+  if (!block.IsCompressed()) {
+    output->assign(data.begin(), data.begin() + block.uncompressed_length);
+    return true;
+  }
+  // |data| starts at the cluster, so compress it as if it were the first one.
+  CompressedBlock cluster = block;
+  cluster.uncompressed_offset = 0;
+  output->resize(block.compressed_length);
+  return CompressCluster(hc_,
+                         data,
+                         data.size(),
+                         cluster,
+                         zero_padding_enabled_,
+                         compression_algo_,
+                         output->data());
+}
+
 Blob TryDecompressBlob(std::string_view blob,
                        const std::vector<CompressedBlock>& block_info,
                        const bool zero_padding_enabled) {
@@ -250,6 +437,9 @@ std::ostream& operator<<(std::ostream& out, const CompressedBlockInfo& info) {
   if (!info.postfix_bspatch().empty()) {
     out << ", postfix_bspatch: " << info.postfix_bspatch().size();
   }
+  if (info.has_src_cluster_index()) {
+    out << ", src_cluster_index: " << info.src_cluster_index();
+  }
   out << "}";
   return out;
 }
@@ -20,6 +20,10 @@
 #include "lz4diff_format.h"
 #include <string_view>
 
+#include <base/macros.h>
+
+union LZ4_streamHC_u;
+
 namespace chromeos_update_engine {
 
 using SinkFunc = std::function<size_t(const uint8_t*, size_t)>;
@@ -33,15 +37,45 @@ using SinkFunc = std::function<size_t(const uint8_t*, size_t)>;
 // generate a BSDIFF patch between them if there's mismatch. Therefore, it is OK
 // that |TryCompressBlob| produces slightly different output than mkfs.erofs, so
 // as long as |TryCompressBlob| exhibits consistne bebavior across platforms.
+// Clusters are independent, so they're compressed on up to |num_threads|
+// threads, or a few threads depending on the CPUs if 0, which produces the
+// same output as a single thread. |sink| is always called from the calling
+// thread, once per cluster and in order.
 Blob TryCompressBlob(std::string_view blob,
                      const std::vector<CompressedBlock>& block_info,
                      const bool zero_padding_enabled,
-                     const CompressionAlgorithm compression_algo);
+                     const CompressionAlgorithm compression_algo,
+                     size_t num_threads = 0);
 bool TryCompressBlob(std::string_view blob,
                      const std::vector<CompressedBlock>& block_info,
                      const bool zero_padding_enabled,
                      const CompressionAlgorithm compression_algo,
-                     const SinkFunc& sink);
+                     const SinkFunc& sink,
+                     size_t num_threads = 0);
+
+// Recompresses the clusters of a blob one at a time, for callers which only
+// hold part of the uncompressed blob at once.
+class ClusterCompressor {
+ public:
+  ClusterCompressor(const bool zero_padding_enabled,
+                    const CompressionAlgorithm& compression_algo);
+  ~ClusterCompressor();
+
+  // Compresses |block| into |output| from |data|, the uncompressed blob from
+  // |block.uncompressed_offset| on. The compressor looks past the end of the
+  // cluster, so the output only matches |TryCompressBlob| for sure if |data|
+  // extends to the end of the last compressed cluster.
+  bool Compress(std::string_view data,
+                const CompressedBlock& block,
+                Blob* output);
+
+ private:
+  LZ4_streamHC_u* hc_;
+  const bool zero_padding_enabled_;
+  const CompressionAlgorithm compression_algo_;
+
+  DISALLOW_COPY_AND_ASSIGN(ClusterCompressor);
+};
 
 Blob TryDecompressBlob(std::string_view blob,
                        const std::vector<CompressedBlock>& block_info,
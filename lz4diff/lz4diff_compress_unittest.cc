@@ -19,6 +19,7 @@
 #include <algorithm>
 #include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <base/format_macros.h>
@@ -69,6 +70,33 @@ static void ExtractErofsImage(const char* erofs_image,
   ASSERT_EQ(err, 0);
 }
 
+// Returns |num_clusters| clusters of |cluster_size| bytes of compressible
+// data, every |raw_every|th of them stored uncompressed, in |blob| and
+// |blocks|.
+void MakeClusters(size_t num_clusters,
+                  size_t cluster_size,
+                  size_t raw_every,
+                  Blob* blob,
+                  vector<CompressedBlock>* blocks) {
+  const char* const kWords[] = {"update ", "engine ", "lz4 ", "cluster ",
+                                "erofs ", "block ", "patch ", "payload "};
+  uint32_t seed = 1;
+  blob->clear();
+  blocks->clear();
+  for (size_t i = 0; i < num_clusters; i++) {
+    const size_t offset = blob->size();
+    while (blob->size() < offset + cluster_size) {
+      seed = seed * 1103515245 + 12345;
+      const char* word = kWords[(seed >> 16) % std::size(kWords)];
+      blob->insert(blob->end(), word, word + strlen(word));
+    }
+    blob->resize(offset + cluster_size);
+    const bool raw = raw_every && i % raw_every == 0;
+    blocks->emplace_back(
+        offset, raw ? cluster_size : cluster_size / 4, cluster_size);
+  }
+}
+
 class Lz4diffCompressTest : public ::testing::Test {};
 
 using test_utils::GetBuildArtifactsPath;
@@ -111,6 +139,92 @@ TEST_F(Lz4diffCompressTest, ExtractElfBinary) {
   ASSERT_EQ(decompressed_blob, expected_blob);
 }
 
+TEST_F(Lz4diffCompressTest, ParallelCompressMatchesSerialTest) {
+  Blob blob;
+  vector<CompressedBlock> blocks;
+  MakeClusters(100, 4 * kBlockSize, 7, &blob, &blocks);
+  for (auto type : {CompressionAlgorithm::LZ4, CompressionAlgorithm::LZ4HC}) {
+    CompressionAlgorithm algo;
+    algo.set_type(type);
+    algo.set_level(9);
+    for (bool zero_padding : {false, true}) {
+      const Blob serial = TryCompressBlob(
+          ToStringView(blob), blocks, zero_padding, algo, 1);
+      ASSERT_FALSE(serial.empty());
+      EXPECT_EQ(serial,
+                TryCompressBlob(
+                    ToStringView(blob), blocks, zero_padding, algo, 4));
+    }
+  }
+}
+
+TEST_F(Lz4diffCompressTest, ParallelCompressSinkOrderTest) {
+  Blob blob;
+  vector<CompressedBlock> blocks;
+  MakeClusters(100, 4 * kBlockSize, 5, &blob, &blocks);
+  CompressionAlgorithm algo;
+  algo.set_type(CompressionAlgorithm::LZ4HC);
+  algo.set_level(9);
+  const std::thread::id caller = std::this_thread::get_id();
+  vector<size_t> sizes;
+  ASSERT_TRUE(TryCompressBlob(
+      ToStringView(blob),
+      blocks,
+      false,
+      algo,
+      [&](const uint8_t* data, size_t size) {
+        EXPECT_EQ(caller, std::this_thread::get_id());
+        sizes.push_back(size);
+        return size;
+      },
+      4));
+  // One call per cluster, and one for the (empty) trailing data.
+  ASSERT_EQ(blocks.size() + 1, sizes.size());
+  for (size_t i = 0; i < blocks.size(); i++)
+    EXPECT_EQ(blocks[i].compressed_length, sizes[i]);
+}
+
+TEST_F(Lz4diffCompressTest, ParallelCompressSinkFailureTest) {
+  Blob blob;
+  vector<CompressedBlock> blocks;
+  MakeClusters(100, 4 * kBlockSize, 0, &blob, &blocks);
+  CompressionAlgorithm algo;
+  algo.set_type(CompressionAlgorithm::LZ4);
+  size_t calls = 0;
+  EXPECT_FALSE(TryCompressBlob(
+      ToStringView(blob),
+      blocks,
+      false,
+      algo,
+      [&calls](const uint8_t* data, size_t size) -> size_t {
+        return ++calls == 10 ? 0 : size;
+      },
+      4));
+  EXPECT_EQ(10u, calls);
+}
+
+TEST_F(Lz4diffCompressTest, ClusterCompressorMatchesTryCompressBlobTest) {
+  Blob blob;
+  vector<CompressedBlock> blocks;
+  MakeClusters(20, 4 * kBlockSize, 7, &blob, &blocks);
+  CompressionAlgorithm algo;
+  algo.set_type(CompressionAlgorithm::LZ4HC);
+  algo.set_level(9);
+  const Blob expected = TryCompressBlob(ToStringView(blob), blocks, true, algo);
+  ASSERT_FALSE(expected.empty());
+
+  ClusterCompressor compressor(true, algo);
+  Blob actual;
+  Blob cluster;
+  for (const auto& block : blocks) {
+    ASSERT_TRUE(compressor.Compress(
+        ToStringView(blob).substr(block.uncompressed_offset), block, &cluster));
+    ASSERT_EQ(block.compressed_length, cluster.size());
+    actual.insert(actual.end(), cluster.begin(), cluster.end());
+  }
+  EXPECT_EQ(expected, actual);
+}
+
 }  // namespace
 
 }  // namespace chromeos_update_engine
@@ -56,11 +56,14 @@ int ExecuteLz4diff(const char* src_image_path,
 
   brillo::Blob lz4diff_patch;
   if (op == DIFF || op == TEST) {
+    // Only one file is diffed at a time, so PUFFDIFF gets a thread of its own.
     Lz4Diff(src_blob,
             dst_blob,
             src_file.compressed_file_info,
             dst_file.compressed_file_info,
-            &lz4diff_patch);
+            &lz4diff_patch,
+            /*op_type=*/nullptr,
+            /*concurrent_puffdiff=*/true);
     if (patch_file) {
       CHECK(utils::WriteFile(
           patch_file, lz4diff_patch.data(), lz4diff_patch.size()));
@@ -0,0 +1,92 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/lz4diff/lz4diff_test_utils.h"
+
+#include <cstring>
+#include <iterator>
+
+#include <base/logging.h>
+#include <lz4hc.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/delta_diff_generator.h"
+
+namespace chromeos_update_engine {
+namespace test_utils {
+
+Blob MakeCompressibleData(size_t size, uint32_t seed) {
+  const char* const kWords[] = {"update ", "engine ", "lz4 ", "cluster ",
+                                "erofs ", "block ", "patch ", "payload "};
+  Blob data;
+  data.reserve(size);
+  while (data.size() < size) {
+    seed = seed * 1103515245 + 12345;
+    const char* word = kWords[(seed >> 16) % std::size(kWords)];
+    data.insert(data.end(), word, word + strlen(word));
+    if ((seed >> 8) % 97 == 0) {
+      data.push_back(seed & 0xff);
+    }
+  }
+  data.resize(size);
+  return data;
+}
+
+bool CompressLikeErofs(const Blob& data,
+                       int level,
+                       Blob* output,
+                       CompressedFile* info) {
+  auto hc = LZ4_createStreamHC();
+  TEST_AND_RETURN_FALSE(hc != nullptr);
+  DEFER {
+    LZ4_freeStreamHC(hc);
+  };
+  info->algo.set_type(CompressionAlgorithm::LZ4HC);
+  info->algo.set_level(level);
+  info->zero_padding_enabled = true;
+  info->blocks.clear();
+  output->clear();
+  size_t offset = 0;
+  Blob cluster(kBlockSize);
+  while (offset < data.size()) {
+    int src_size = data.size() - offset;
+    const int compressed_size =
+        LZ4_compress_HC_destSize(hc,
+                                 reinterpret_cast<const char*>(data.data()) +
+                                     offset,
+                                 reinterpret_cast<char*>(cluster.data()),
+                                 &src_size,
+                                 kBlockSize,
+                                 level);
+    TEST_AND_RETURN_FALSE(compressed_size > 0);
+    if (static_cast<size_t>(src_size) <= kBlockSize) {
+      output->insert(output->end(),
+                     data.begin() + offset,
+                     data.begin() + offset + src_size);
+      info->blocks.emplace_back(offset, src_size, src_size);
+    } else {
+      output->insert(output->end(), kBlockSize - compressed_size, 0);
+      output->insert(
+          output->end(), cluster.begin(), cluster.begin() + compressed_size);
+      info->blocks.emplace_back(offset, kBlockSize, src_size);
+    }
+    offset += src_size;
+  }
+  return true;
+}
+
+}  // namespace test_utils
+}  // namespace chromeos_update_engine
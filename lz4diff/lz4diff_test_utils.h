@@ -0,0 +1,44 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_LZ4DIFF_LZ4DIFF_TEST_UTILS_H_
+#define UPDATE_ENGINE_LZ4DIFF_LZ4DIFF_TEST_UTILS_H_
+
+#include <cstdint>
+
+#include "update_engine/lz4diff/lz4diff_format.h"
+
+// Synthetic LZ4 compressed files, shared by the lz4diff unittests and the
+// benchmarks.
+
+namespace chromeos_update_engine {
+namespace test_utils {
+
+// Returns |size| bytes of compressible data which depends on |seed|.
+Blob MakeCompressibleData(size_t size, uint32_t seed);
+
+// Compresses |data| with LZ4HC at |level| into clusters of one block each,
+// zero padded in front, the way mkfs.erofs does. A cluster which does not
+// compress is stored as is. Returns false on compression errors.
+bool CompressLikeErofs(const Blob& data,
+                       int level,
+                       Blob* output,
+                       CompressedFile* info);
+
+}  // namespace test_utils
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_LZ4DIFF_LZ4DIFF_TEST_UTILS_H_
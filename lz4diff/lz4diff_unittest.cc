@@ -14,6 +14,7 @@
 // limitations under the License.
 //
 
+#include <endian.h>
 #include <unistd.h>
 
 #include <algorithm>
@@ -35,6 +36,7 @@
 #include "update_engine/common/test_utils.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/lz4diff/lz4diff_compress.h"
+#include "update_engine/lz4diff/lz4diff_test_utils.h"
 #include "update_engine/payload_generator/delta_diff_generator.h"
 #include "update_engine/payload_generator/erofs_filesystem.h"
 #include "update_engine/payload_generator/extent_utils.h"
@@ -45,9 +47,12 @@ using std::vector;
 namespace chromeos_update_engine {
 
 namespace {
+
 class Lz4diffTest : public ::testing::Test {};
 
+using test_utils::CompressLikeErofs;
 using test_utils::GetBuildArtifactsPath;
+using test_utils::MakeCompressibleData;
 
 // This test parses the sample images generated during build time with the
 // "generate_image.sh" script. The expected conditions of each file in these
@@ -105,6 +110,77 @@ TEST_F(Lz4diffTest, DiffElfBinary) {
   ASSERT_EQ(patched_new_data, new_data);
 }
 
+// Lz4Patch recompresses the destination while the inner patch still writes
+// it, so patch a file much larger than the part of it held at once.
+TEST_F(Lz4diffTest, PatchLargeFile) {
+  const Blob old_data = MakeCompressibleData(2 * 1024 * 1024, 1);
+  Blob new_data = old_data;
+  const Blob inserted = MakeCompressibleData(64 * 1024, 2);
+  new_data.insert(
+      new_data.begin() + new_data.size() / 2, inserted.begin(), inserted.end());
+  std::fill(new_data.begin() + 4096, new_data.begin() + 8192, 0);
+
+  Blob old_blob;
+  CompressedFile old_info;
+  ASSERT_TRUE(CompressLikeErofs(old_data, 9, &old_blob, &old_info));
+  Blob new_blob;
+  CompressedFile new_info;
+  ASSERT_TRUE(CompressLikeErofs(new_data, 9, &new_blob, &new_info));
+  // Recompress with the level the file was compressed with, and with another
+  // one which needs postfix patches.
+  for (int level : {9, 5}) {
+    new_info.algo.set_level(level);
+    Blob diff_blob;
+    ASSERT_TRUE(Lz4Diff(old_blob, new_blob, old_info, new_info, &diff_blob));
+    Blob patched_blob;
+    ASSERT_TRUE(Lz4Patch(old_blob, diff_blob, &patched_blob));
+    ASSERT_EQ(patched_blob, new_blob) << "level " << level;
+  }
+  // The source is read in whole blocks, so it may end past the last cluster.
+  Blob padded_old_blob = old_blob;
+  padded_old_blob.resize(old_blob.size() + kBlockSize / 2);
+  Blob diff_blob;
+  ASSERT_TRUE(Lz4Diff(old_blob, new_blob, old_info, new_info, &diff_blob));
+  Blob patched_blob;
+  ASSERT_TRUE(Lz4Patch(padded_old_blob, diff_blob, &patched_blob));
+  ASSERT_EQ(patched_blob, new_blob);
+}
+
+// Clusters before the change compress to the same bytes in both files, so the
+// patch copies them from the source instead of re-compressing them.
+TEST_F(Lz4diffTest, CopyUnchangedClusters) {
+  const Blob old_data = MakeCompressibleData(1024 * 1024, 1);
+  Blob new_data = old_data;
+  const Blob changed = MakeCompressibleData(64 * 1024, 2);
+  std::copy(changed.begin(), changed.end(), new_data.end() - changed.size());
+
+  Blob old_blob;
+  CompressedFile old_info;
+  ASSERT_TRUE(CompressLikeErofs(old_data, 9, &old_blob, &old_info));
+  Blob new_blob;
+  CompressedFile new_info;
+  ASSERT_TRUE(CompressLikeErofs(new_data, 9, &new_blob, &new_info));
+  Blob diff_blob;
+  ASSERT_TRUE(Lz4Diff(old_blob, new_blob, old_info, new_info, &diff_blob));
+
+  uint32_t header_size = 0;
+  std::memcpy(&header_size,
+              diff_blob.data() + kLz4diffMagic.size() + 4,
+              sizeof(header_size));
+  Lz4diffHeader header;
+  ASSERT_TRUE(header.ParseFromArray(diff_blob.data() + kLz4diffHeaderSize,
+                                    be32toh(header_size)));
+  int num_copies = 0;
+  for (const auto& block : header.dst_info().block_info()) {
+    num_copies += block.has_src_cluster_index();
+  }
+  EXPECT_GT(num_copies, header.dst_info().block_info_size() / 2);
+
+  Blob patched_blob;
+  ASSERT_TRUE(Lz4Patch(old_blob, diff_blob, &patched_blob));
+  ASSERT_EQ(patched_blob, new_blob);
+}
+
 }  // namespace
 
 }  // namespace chromeos_update_engine
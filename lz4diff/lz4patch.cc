@@ -21,12 +21,14 @@
 #include <fcntl.h>
 
 #include <algorithm>
+#include <atomic>
+#include <memory>
 #include <string_view>
+#include <thread>
+#include <utility>
 
 #include <bsdiff/bspatch.h>
-#include <bsdiff/memory_file.h>
 #include <bsdiff/file.h>
-#include <puffin/memory_stream.h>
 
 #include "android-base/strings.h"
 #include "lz4diff/lz4diff.h"
@@ -64,63 +66,6 @@ struct Lz4diffPatch {
   std::string_view inner_patch;
 };
 
-// Utility class to interact with puffin API. C++ does not have standard
-// Read/Write trait. So everybody invent their own file descriptor wrapper.
-class StringViewStream : public puffin::StreamInterface {
- public:
-  ~StringViewStream() override = default;
-
-  bool GetSize(uint64_t* size) const override {
-    *size = read_memory_.size();
-    return true;
-  }
-
-  bool GetOffset(uint64_t* offset) const override {
-    *offset = offset_;
-    return true;
-  }
-
-  bool Seek(uint64_t offset) override {
-    TEST_AND_RETURN_FALSE(open_);
-    uint64_t size;
-    GetSize(&size);
-    TEST_AND_RETURN_FALSE(offset <= size);
-    offset_ = offset;
-    return true;
-  }
-
-  bool Read(void* buffer, size_t length) override {
-    TEST_AND_RETURN_FALSE(open_);
-    TEST_AND_RETURN_FALSE(offset_ + length <= read_memory_.size());
-    memcpy(buffer, read_memory_.data() + offset_, length);
-    offset_ += length;
-    return true;
-  }
-
-  bool Write(const void* buffer, size_t length) override {
-    LOG(ERROR) << "Unsupported operation " << __FUNCTION__;
-    return false;
-  }
-
-  bool Close() override {
-    open_ = false;
-    return true;
-  }
-
-  constexpr StringViewStream(std::string_view read_memory)
-      : read_memory_(read_memory) {
-    CHECK(!read_memory.empty());
-  }
-
- private:
-  // The memory buffer for reading.
-  std::string_view read_memory_;
-
-  // The current offset.
-  uint64_t offset_{};
-  bool open_{true};
-};
-
 bool ParseLz4DifffPatch(std::string_view patch_data, Lz4diffPatch* output) {
   CHECK_NE(output, nullptr);
   if (!android::base::StartsWith(patch_data, kLz4diffMagic)) {
@@ -169,19 +114,6 @@ bool bspatch(std::string_view input_data,
   return err == 0;
 }
 
-bool puffpatch(std::string_view input_data,
-               std::string_view patch_data,
-               Blob* output) {
-  // Cache size has a big impact on speed of puffpatch, use a default of 5MB to
-  // match update_engine behavior.
-  static constexpr size_t kPuffPatchCacheSize = 5 * 1024 * 1024;
-  return puffin::PuffPatch(std::make_unique<StringViewStream>(input_data),
-                           puffin::MemoryStream::CreateForWrite(output),
-                           reinterpret_cast<const uint8_t*>(patch_data.data()),
-                           patch_data.size(),
-                           kPuffPatchCacheSize);
-}
-
 std::vector<CompressedBlock> ToCompressedBlockVec(
     const google::protobuf::RepeatedPtrField<CompressedBlockInfo>& rpf) {
   std::vector<CompressedBlock> ret;
@@ -195,15 +127,6 @@ std::vector<CompressedBlock> ToCompressedBlockVec(
   return ret;
 }
 
-bool HasPosfixPatches(const Lz4diffPatch& patch) {
-  for (const auto& info : patch.pb_header.dst_info().block_info()) {
-    if (!info.postfix_bspatch().empty()) {
-      return true;
-    }
-  }
-  return false;
-}
-
 size_t GetCompressedSize(
     const google::protobuf::RepeatedPtrField<CompressedBlockInfo>& info) {
   size_t compressed_size = 0;
@@ -213,102 +136,546 @@ size_t GetCompressedSize(
   return compressed_size;
 }
 
-size_t GetDecompressedSize(
-    const google::protobuf::RepeatedPtrField<CompressedBlockInfo>& info) {
-  size_t decompressed_size = 0;
-  for (const auto& block : info) {
-    decompressed_size += block.uncompressed_length();
+// Number of decompressed source clusters kept around by
+// |LazyDecompressedBlob|. Patches mostly read the source forward, so a few are
+// enough to decompress each cluster about once.
+constexpr size_t kCachedSourceClusters = 4;
+
+// Bytes of the destination past a cluster handed to the compressor at first.
+// The LZ4 compressors look past the end of the cluster, so whether this is
+// enough is checked against the hash of the recompressed cluster, doubling it
+// until it is.
+constexpr size_t kInitialRecompressLookahead = 256 * 1024;
+
+// Most threads recompressing destination clusters, like |TryCompressBlob|.
+constexpr size_t kMaxRecompressThreads = 4;
+// Ready clusters each thread gets per batch. Waiting for a batch holds that
+// many more clusters of the destination in memory, but starting the threads
+// for a single cluster costs more than it saves.
+constexpr size_t kRecompressClustersPerThread = 8;
+
+// An LZ4 compressed blob which is decompressed a few clusters at a time, as
+// they are read, instead of all at once.
+class LazyDecompressedBlob {
+ public:
+  LazyDecompressedBlob(std::string_view blob,
+                       std::vector<CompressedBlock> block_info,
+                       const bool zero_padding_enabled)
+      : blob_(blob),
+        block_info_(std::move(block_info)),
+        zero_padding_enabled_(zero_padding_enabled) {}
+
+  // Checks |block_info_| against the blob, which must be called first.
+  bool Init() {
+    TEST_AND_RETURN_FALSE(!block_info_.empty());
+    compressed_offsets_.reserve(block_info_.size());
+    uint64_t compressed_size = 0;
+    for (const auto& block : block_info_) {
+      TEST_EQ(size_, block.uncompressed_offset);
+      compressed_offsets_.push_back(compressed_size);
+      size_ += block.uncompressed_length;
+      compressed_size += block.compressed_length;
+    }
+    if (blob_.size() < compressed_size) {
+      LOG(INFO) << "File is chunked. Skip lz4 decompress. Expected size: "
+                << compressed_size << ", actual size: " << blob_.size();
+      return false;
+    }
+    // The blob is read in whole blocks, so it may have a few bytes past the
+    // last cluster, which are ignored.
+    return size_ > 0;
+  }
+
+  uint64_t size() const { return size_; }
+  bool zero_padding_enabled() const { return zero_padding_enabled_; }
+
+  // Sets |cluster| to the compressed bytes of cluster |index|, which must have
+  // the same lengths as |block|.
+  bool GetCompressedCluster(size_t index,
+                            const CompressedBlock& block,
+                            std::string_view* cluster) const {
+    TEST_AND_RETURN_FALSE(index < block_info_.size());
+    const auto& src_block = block_info_[index];
+    TEST_EQ(src_block.compressed_length, block.compressed_length);
+    TEST_EQ(src_block.uncompressed_length, block.uncompressed_length);
+    *cluster =
+        blob_.substr(compressed_offsets_[index], src_block.compressed_length);
+    return true;
+  }
+
+  // Reads |length| decompressed bytes at |offset| into |buffer|.
+  bool Read(uint64_t offset, void* buffer, size_t length) {
+    TEST_AND_RETURN_FALSE(offset + length <= size_);
+    auto out = static_cast<uint8_t*>(buffer);
+    while (length > 0) {
+      const Blob* cluster = nullptr;
+      uint64_t cluster_offset = 0;
+      TEST_AND_RETURN_FALSE(GetCluster(offset, &cluster, &cluster_offset));
+      const size_t offset_in_cluster = offset - cluster_offset;
+      const size_t n =
+          std::min<size_t>(length, cluster->size() - offset_in_cluster);
+      memcpy(out, cluster->data() + offset_in_cluster, n);
+      out += n;
+      offset += n;
+      length -= n;
+    }
+    return true;
+  }
+
+ private:
+  struct CachedCluster {
+    size_t index{SIZE_MAX};
+    uint64_t last_used{};
+    Blob data;
+  };
+
+  // Sets |cluster| to the decompressed cluster holding |offset|, which starts
+  // at |cluster_offset|.
+  bool GetCluster(uint64_t offset,
+                  const Blob** cluster,
+                  uint64_t* cluster_offset) {
+    const auto it = std::upper_bound(
+        block_info_.begin(),
+        block_info_.end(),
+        offset,
+        [](uint64_t offset, const CompressedBlock& block) {
+          return offset < block.uncompressed_offset;
+        });
+    TEST_AND_RETURN_FALSE(it != block_info_.begin());
+    const size_t index = std::distance(block_info_.begin(), it) - 1;
+    const auto& block = block_info_[index];
+    *cluster_offset = block.uncompressed_offset;
+
+    CachedCluster* victim = nullptr;
+    for (auto& cached : cache_) {
+      if (cached.index == index) {
+        cached.last_used = ++clock_;
+        *cluster = &cached.data;
+        return true;
+      }
+      if (victim == nullptr || cached.last_used < victim->last_used) {
+        victim = &cached;
+      }
+    }
+    if (cache_.size() < kCachedSourceClusters) {
+      victim = &cache_.emplace_back();
+    }
+    // Decompress the cluster on its own, as if it were the only one.
+    victim->index = SIZE_MAX;
+    victim->data = TryDecompressBlob(
+        blob_.substr(compressed_offsets_[index], block.compressed_length),
+        {CompressedBlock(
+            0, block.compressed_length, block.uncompressed_length)},
+        zero_padding_enabled_);
+    TEST_EQ(victim->data.size(), block.uncompressed_length);
+    victim->index = index;
+    victim->last_used = ++clock_;
+    *cluster = &victim->data;
+    return true;
+  }
+
+  const std::string_view blob_;
+  const std::vector<CompressedBlock> block_info_;
+  const bool zero_padding_enabled_;
+  // Offset of each cluster of |block_info_| in |blob_|.
+  std::vector<uint64_t> compressed_offsets_;
+  uint64_t size_{};
+  std::vector<CachedCluster> cache_;
+  uint64_t clock_{};
+
+  DISALLOW_COPY_AND_ASSIGN(LazyDecompressedBlob);
+};
+
+// Recompresses the decompressed destination as the inner patch writes it,
+// handing each cluster to |sink| with its postfix patch applied, so only the
+// clusters not compressed yet are held in memory. Once a batch of clusters is
+// ready, they're recompressed on several threads, each with its own
+// |ClusterCompressor|, and handed to |sink| in order.
+class StreamingRecompressor {
+ public:
+  StreamingRecompressor(const CompressionInfo& dst_info,
+                        const LazyDecompressedBlob* src,
+                        const SinkFunc& sink)
+      : dst_info_(dst_info),
+        src_(src),
+        block_info_(ToCompressedBlockVec(dst_info.block_info())),
+        sink_(sink) {
+    for (const auto& block : block_info_) {
+      CHECK_EQ(uncompressed_size_, block.uncompressed_offset)
+          << "Compressed block info is expected to be sorted.";
+      uncompressed_size_ += block.uncompressed_length;
+    }
+    const size_t num_threads = std::clamp<size_t>(
+        std::thread::hardware_concurrency(), 1, kMaxRecompressThreads);
+    for (size_t i = 0; i < num_threads; i++) {
+      compressors_.push_back(std::make_unique<ClusterCompressor>(
+          dst_info.zero_padding_enabled(), dst_info.algo()));
+    }
+    batch_size_ =
+        num_threads > 1 ? num_threads * kRecompressClustersPerThread : 1;
+  }
+
+  bool Write(const void* data, size_t size) {
+    const auto bytes = static_cast<const uint8_t*>(data);
+    pending_.insert(pending_.end(), bytes, bytes + size);
+    return Drain(false);
+  }
+
+  // Called once the inner patch wrote all of the destination.
+  bool Finish() {
+    TEST_AND_RETURN_FALSE(pending_offset_ + pending_.size() >=
+                          uncompressed_size_);
+    TEST_AND_RETURN_FALSE(Drain(true));
+    TEST_EQ(next_cluster_, block_info_.size());
+    return true;
+  }
+
+ private:
+  // Compresses every cluster for which enough of the destination is written,
+  // a batch at a time, or all of them once |eof|.
+  bool Drain(bool eof) {
+    while (next_cluster_ < block_info_.size()) {
+      const uint64_t written = pending_offset_ + pending_.size();
+      size_t num_ready = 0;
+      while (next_cluster_ + num_ready < block_info_.size()) {
+        const size_t index = next_cluster_ + num_ready;
+        const auto& block = block_info_[index];
+        if (!eof && written < WantedBytes(index)) {
+          break;
+        }
+        TEST_AND_RETURN_FALSE(written >=
+                              block.uncompressed_offset +
+                                  block.uncompressed_length);
+        num_ready++;
+      }
+      // Unless the batch is full or there are no clusters left, more of the
+      // destination is needed first.
+      if (num_ready == 0 || (num_ready < batch_size_ &&
+                             next_cluster_ + num_ready < block_info_.size())) {
+        return true;
+      }
+      TEST_AND_RETURN_FALSE(CompressClusters(num_ready, written));
+      const uint64_t available = std::min(written, uncompressed_size_);
+      for (size_t i = 0; i < num_ready; i++) {
+        const auto& block = block_info_[next_cluster_];
+        const auto& info = dst_info_.block_info(next_cluster_);
+        if (info.has_src_cluster_index()) {
+          TEST_AND_RETURN_FALSE(src_->zero_padding_enabled() ==
+                                dst_info_.zero_padding_enabled());
+          std::string_view src_cluster;
+          TEST_AND_RETURN_FALSE(src_->GetCompressedCluster(
+              info.src_cluster_index(), block, &src_cluster));
+          TEST_EQ(sink_(reinterpret_cast<const uint8_t*>(src_cluster.data()),
+                        src_cluster.size()),
+                  src_cluster.size());
+          NextCluster();
+          continue;
+        }
+        const Blob& cluster = clusters_[i];
+        if (available < uncompressed_size_ && block.IsCompressed()) {
+          Blob hash;
+          TEST_AND_RETURN_FALSE(HashCalculator::RawHashOfBytes(
+              cluster.data(), cluster.size(), &hash));
+          if (ToStringView(hash) != info.sha256_hash()) {
+            // The compressor would have used bytes not written yet, so this
+            // cluster and the rest of the batch are compressed again.
+            lookahead_ *= 2;
+            break;
+          }
+        }
+        TEST_AND_RETURN_FALSE(SinkCluster(info, cluster));
+        NextCluster();
+      }
+    }
+    // Any trailing data past the clusters is copied as is.
+    TEST_EQ(sink_(pending_.data(), pending_.size()), pending_.size());
+    pending_offset_ += pending_.size();
+    pending_.clear();
+    return true;
+  }
+
+  // Returns how much of the destination must be written before cluster
+  // |index| is compressed.
+  uint64_t WantedBytes(size_t index) const {
+    const auto& block = block_info_[index];
+    const uint64_t cluster_end =
+        block.uncompressed_offset + block.uncompressed_length;
+    // Clusters copied from the source need none of the destination past
+    // them. Without a hash there is no telling whether part of the
+    // destination recompresses the same as all of it, so wait for all of it.
+    if (!block.IsCompressed() ||
+        dst_info_.block_info(index).has_src_cluster_index()) {
+      return cluster_end;
+    }
+    if (dst_info_.block_info(index).sha256_hash().empty()) {
+      return uncompressed_size_;
+    }
+    // Only the first cluster not compressed yet may need more than the
+    // initial lookahead.
+    const size_t lookahead =
+        index == next_cluster_ ? lookahead_ : kInitialRecompressLookahead;
+    return std::min(uncompressed_size_, cluster_end + lookahead);
+  }
+
+  // Compresses the |num_ready| clusters from |next_cluster_| into |clusters_|,
+  // from the first |written| bytes of the destination, on up to one thread
+  // per compressor. Clusters copied from the source are skipped.
+  bool CompressClusters(size_t num_ready, uint64_t written) {
+    if (clusters_.size() < num_ready) {
+      clusters_.resize(num_ready);
+    }
+    const uint64_t available = std::min(written, uncompressed_size_);
+    std::atomic<size_t> next{0};
+    std::atomic<bool> success{true};
+    auto worker = [&](ClusterCompressor* compressor) {
+      for (size_t i = next++; i < num_ready && success; i = next++) {
+        const size_t index = next_cluster_ + i;
+        if (dst_info_.block_info(index).has_src_cluster_index()) {
+          continue;
+        }
+        const auto& block = block_info_[index];
+        const auto data = ToStringView(pending_).substr(
+            block.uncompressed_offset - pending_offset_,
+            available - block.uncompressed_offset);
+        if (!compressor->Compress(data, block, &clusters_[i])) {
+          success = false;
+        }
+      }
+    };
+    const size_t num_threads = std::min(compressors_.size(), num_ready);
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < num_threads; i++) {
+      threads.emplace_back(worker, compressors_[i].get());
+    }
+    worker(compressors_[0].get());
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    return success;
+  }
+
+  // Moves on to the next cluster, dropping the destination before it.
+  void NextCluster() {
+    lookahead_ = kInitialRecompressLookahead;
+    next_cluster_++;
+    const uint64_t consumed =
+        (next_cluster_ < block_info_.size()
+             ? block_info_[next_cluster_].uncompressed_offset
+             : uncompressed_size_) -
+        pending_offset_;
+    pending_.erase(pending_.begin(), pending_.begin() + consumed);
+    pending_offset_ += consumed;
+  }
+
+  // Hands |cluster|, the recompressed cluster |info|, to the sink with its
+  // postfix patch applied.
+  bool SinkCluster(const CompressedBlockInfo& info, const Blob& cluster) {
+    TEST_EQ(cluster.size(), info.compressed_length());
+    if (info.postfix_bspatch().empty()) {
+      TEST_EQ(sink_(cluster.data(), cluster.size()), cluster.size());
+      return true;
+    }
+    if (!info.sha256_hash().empty()) {
+      Blob actual_hash;
+      TEST_AND_RETURN_FALSE(HashCalculator::RawHashOfBytes(
+          cluster.data(), cluster.size(), &actual_hash));
+      if (ToStringView(actual_hash) != info.sha256_hash()) {
+        LOG(ERROR) << "Block " << info
+                   << " is corrupted. This usually means the patch generator "
+                      "used a different version of LZ4, or an incompatible LZ4 "
+                      "patch generator was used, or LZ4 produces different "
+                      "output on different platforms. Expected hash: "
+                   << HexEncode(info.sha256_hash())
+                   << ", actual hash: " << HexEncode(actual_hash);
+        return false;
+      }
+    }
+    Blob fixed_block;
+    TEST_AND_RETURN_FALSE(
+        bspatch(ToStringView(cluster), info.postfix_bspatch(), &fixed_block));
+    TEST_EQ(sink_(fixed_block.data(), fixed_block.size()), fixed_block.size());
+    return true;
+  }
+
+  const CompressionInfo& dst_info_;
+  // The source, which clusters are copied from.
+  const LazyDecompressedBlob* src_;
+  const std::vector<CompressedBlock> block_info_;
+  // One compressor per thread recompressing a batch.
+  std::vector<std::unique_ptr<ClusterCompressor>> compressors_;
+  // Clusters compressed at once, when ready.
+  size_t batch_size_{};
+  const SinkFunc& sink_;
+  uint64_t uncompressed_size_{};
+  // The destination written but not compressed yet, from |pending_offset_|.
+  Blob pending_;
+  uint64_t pending_offset_{};
+  size_t next_cluster_{};
+  size_t lookahead_{kInitialRecompressLookahead};
+  // The last batch of recompressed clusters, in order.
+  std::vector<Blob> clusters_;
+
+  DISALLOW_COPY_AND_ASSIGN(StreamingRecompressor);
+};
+
+// Reads the source of the inner patch from a |LazyDecompressedBlob| or writes
+// its destination to a |StreamingRecompressor|, for bspatch.
+class Lz4BsdiffFile : public bsdiff::FileInterface {
+ public:
+  explicit Lz4BsdiffFile(LazyDecompressedBlob* src)
+      : src_(src), size_(src->size()) {}
+  explicit Lz4BsdiffFile(StreamingRecompressor* dst) : dst_(dst) {}
+
+  ~Lz4BsdiffFile() override = default;
+
+  bool Read(void* buf, size_t count, size_t* bytes_read) override {
+    TEST_AND_RETURN_FALSE(src_ != nullptr);
+    count = std::min<uint64_t>(count, size_ - offset_);
+    TEST_AND_RETURN_FALSE(src_->Read(offset_, buf, count));
+    *bytes_read = count;
+    offset_ += count;
+    return true;
   }
-  return decompressed_size;
-}
 
-bool ApplyInnerPatch(Blob decompressed_src,
+  bool Write(const void* buf, size_t count, size_t* bytes_written) override {
+    TEST_AND_RETURN_FALSE(dst_ != nullptr);
+    TEST_AND_RETURN_FALSE(dst_->Write(buf, count));
+    *bytes_written = count;
+    offset_ += count;
+    return true;
+  }
+
+  bool Seek(off_t pos) override {
+    if (src_ != nullptr) {
+      TEST_AND_RETURN_FALSE(pos >= 0 && static_cast<uint64_t>(pos) <= size_);
+      offset_ = pos;
+    } else {
+      // The destination is only written sequentially.
+      TEST_AND_RETURN_FALSE(offset_ == static_cast<uint64_t>(pos));
+    }
+    return true;
+  }
+
+  bool Close() override { return true; }
+
+  bool GetSize(uint64_t* size) override {
+    *size = src_ != nullptr ? size_ : offset_;
+    return true;
+  }
+
+ private:
+  LazyDecompressedBlob* src_{};
+  StreamingRecompressor* dst_{};
+  uint64_t size_{};
+  uint64_t offset_{};
+
+  DISALLOW_COPY_AND_ASSIGN(Lz4BsdiffFile);
+};
+
+// Same as |Lz4BsdiffFile|, for puffpatch.
+class Lz4PuffinStream : public puffin::StreamInterface {
+ public:
+  explicit Lz4PuffinStream(LazyDecompressedBlob* src)
+      : src_(src), size_(src->size()) {}
+  explicit Lz4PuffinStream(StreamingRecompressor* dst) : dst_(dst) {}
+
+  ~Lz4PuffinStream() override = default;
+
+  bool GetSize(uint64_t* size) const override {
+    *size = src_ != nullptr ? size_ : offset_;
+    return true;
+  }
+
+  bool GetOffset(uint64_t* offset) const override {
+    *offset = offset_;
+    return true;
+  }
+
+  bool Seek(uint64_t offset) override {
+    TEST_AND_RETURN_FALSE(open_);
+    if (src_ != nullptr) {
+      TEST_AND_RETURN_FALSE(offset <= size_);
+      offset_ = offset;
+    } else {
+      // The destination is only written sequentially.
+      TEST_AND_RETURN_FALSE(offset_ == offset);
+    }
+    return true;
+  }
+
+  bool Read(void* buffer, size_t length) override {
+    TEST_AND_RETURN_FALSE(open_ && src_ != nullptr);
+    TEST_AND_RETURN_FALSE(src_->Read(offset_, buffer, length));
+    offset_ += length;
+    return true;
+  }
+
+  bool Write(const void* buffer, size_t length) override {
+    TEST_AND_RETURN_FALSE(open_ && dst_ != nullptr);
+    TEST_AND_RETURN_FALSE(dst_->Write(buffer, length));
+    offset_ += length;
+    return true;
+  }
+
+  bool Close() override {
+    open_ = false;
+    return true;
+  }
+
+ private:
+  LazyDecompressedBlob* src_{};
+  StreamingRecompressor* dst_{};
+  uint64_t size_{};
+  uint64_t offset_{};
+  bool open_{true};
+
+  DISALLOW_COPY_AND_ASSIGN(Lz4PuffinStream);
+};
+
+bool ApplyInnerPatch(LazyDecompressedBlob* src,
                      const Lz4diffPatch& patch,
-                     Blob* decompressed_dst) {
+                     StreamingRecompressor* dst) {
   switch (patch.pb_header.inner_type()) {
     case InnerPatchType::BSDIFF:
-      TEST_AND_RETURN_FALSE(bspatch(
-          ToStringView(decompressed_src), patch.inner_patch, decompressed_dst));
+      TEST_AND_RETURN_FALSE(
+          bsdiff::bspatch(std::make_unique<Lz4BsdiffFile>(src),
+                          std::make_unique<Lz4BsdiffFile>(dst),
+                          reinterpret_cast<const uint8_t*>(
+                              patch.inner_patch.data()),
+                          patch.inner_patch.size()) == 0);
       break;
-    case InnerPatchType::PUFFDIFF:
-      TEST_AND_RETURN_FALSE(puffpatch(
-          ToStringView(decompressed_src), patch.inner_patch, decompressed_dst));
+    case InnerPatchType::PUFFDIFF: {
+      // Cache size has a big impact on speed of puffpatch, use a default of
+      // 5MB to match update_engine behavior.
+      static constexpr size_t kPuffPatchCacheSize = 5 * 1024 * 1024;
+      TEST_AND_RETURN_FALSE(puffin::PuffPatch(
+          std::make_unique<Lz4PuffinStream>(src),
+          std::make_unique<Lz4PuffinStream>(dst),
+          reinterpret_cast<const uint8_t*>(patch.inner_patch.data()),
+          patch.inner_patch.size(),
+          kPuffPatchCacheSize));
       break;
+    }
     default:
       LOG(ERROR) << "Unsupported patch type: " << patch.pb_header.inner_type();
       return false;
   }
-  return true;
+  return dst->Finish();
 }
 
-// TODO(zhangkelvin) Rewrite this in C++ 20 coroutine once that's available.
-// Hand coding CPS is not fun.
+// Neither the source nor the destination is decompressed all at once: source
+// clusters are decompressed as the inner patch reads them, and destination
+// clusters recompressed as soon as enough of it is written.
 bool Lz4Patch(std::string_view src_data,
               const Lz4diffPatch& patch,
               const SinkFunc& sink) {
-  auto decompressed_src = TryDecompressBlob(
+  LazyDecompressedBlob src(
       src_data,
       ToCompressedBlockVec(patch.pb_header.src_info().block_info()),
       patch.pb_header.src_info().zero_padding_enabled());
-  TEST_AND_RETURN_FALSE(!decompressed_src.empty());
-  Blob decompressed_dst;
-  const auto decompressed_dst_size =
-      GetDecompressedSize(patch.pb_header.dst_info().block_info());
-  decompressed_dst.reserve(decompressed_dst_size);
-
-  ApplyInnerPatch(std::move(decompressed_src), patch, &decompressed_dst);
-
-  if (!HasPosfixPatches(patch)) {
-    return TryCompressBlob(
-        ToStringView(decompressed_dst),
-        ToCompressedBlockVec(patch.pb_header.dst_info().block_info()),
-        patch.pb_header.dst_info().zero_padding_enabled(),
-        patch.pb_header.dst_info().algo(),
-        sink);
-  }
-  auto postfix_patcher =
-      [&sink,
-       block_idx = 0,
-       &dst_block_info = patch.pb_header.dst_info().block_info()](
-          const uint8_t* data, size_t size) mutable -> size_t {
-    if (block_idx >= dst_block_info.size()) {
-      return sink(data, size);
-    }
-    const auto& block_info = dst_block_info[block_idx];
-    TEST_EQ(size, block_info.compressed_length());
-    DEFER { block_idx++; };
-    if (block_info.postfix_bspatch().empty()) {
-      return sink(data, size);
-    }
-    if (!block_info.sha256_hash().empty()) {
-      Blob actual_hash;
-      TEST_AND_RETURN_FALSE(
-          HashCalculator::RawHashOfBytes(data, size, &actual_hash));
-      if (ToStringView(actual_hash) != block_info.sha256_hash()) {
-        LOG(ERROR) << "Block " << block_info
-                   << " is corrupted. This usually means the patch generator "
-                      "used a different version of LZ4, or an incompatible LZ4 "
-                      "patch generator was used, or LZ4 produces different "
-                      "output on different platforms. Expected hash: "
-                   << HexEncode(block_info.sha256_hash())
-                   << ", actual hash: " << HexEncode(actual_hash);
-        return 0;
-      }
-    }
-    Blob fixed_block;
-    TEST_AND_RETURN_FALSE(
-        bspatch(std::string_view(reinterpret_cast<const char*>(data), size),
-                block_info.postfix_bspatch(),
-                &fixed_block));
-    return sink(fixed_block.data(), fixed_block.size());
-  };
-
-  return TryCompressBlob(
-      ToStringView(decompressed_dst),
-      ToCompressedBlockVec(patch.pb_header.dst_info().block_info()),
-      patch.pb_header.dst_info().zero_padding_enabled(),
-      patch.pb_header.dst_info().algo(),
-      postfix_patcher);
+  TEST_AND_RETURN_FALSE(src.Init());
+  StreamingRecompressor dst(patch.pb_header.dst_info(), &src, sink);
+  return ApplyInnerPatch(&src, patch, &dst);
 }
 
 bool Lz4Patch(std::string_view src_data,
@@ -0,0 +1,226 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/batched_cow_writer.h"
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include <base/logging.h>
+
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+using android::snapshot::ICowWriter;
+
+BatchedCowWriter::BatchedCowWriter(std::unique_ptr<ICowWriter> cow_writer,
+                                   size_t block_size,
+                                   size_t batch_size)
+    : cow_writer_(std::move(cow_writer)),
+      block_size_(block_size),
+      batch_size_(batch_size),
+      worker_(&BatchedCowWriter::WorkerLoop, this) {}
+
+BatchedCowWriter::~BatchedCowWriter() {
+  LOG_IF(ERROR, !Flush()) << "Failed to write staged COW blocks.";
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  cv_.notify_all();
+  worker_.join();
+}
+
+bool BatchedCowWriter::AddCopy(uint64_t new_block,
+                               uint64_t old_block,
+                               uint64_t num_blocks) {
+  TEST_AND_RETURN_FALSE(Flush());
+  return cow_writer_->AddCopy(new_block, old_block, num_blocks);
+}
+
+bool BatchedCowWriter::AddRawBlocks(uint64_t new_block_start,
+                                    const void* data,
+                                    size_t size) {
+  return Stage(Batch::Type::kRaw, new_block_start, data, size, 0, 0);
+}
+
+bool BatchedCowWriter::AddXorBlocks(uint32_t new_block_start,
+                                    const void* data,
+                                    size_t size,
+                                    uint32_t old_block,
+                                    uint16_t offset) {
+  return Stage(
+      Batch::Type::kXor, new_block_start, data, size, old_block, offset);
+}
+
+bool BatchedCowWriter::AddZeroBlocks(uint64_t new_block_start,
+                                     uint64_t num_blocks) {
+  TEST_AND_RETURN_FALSE(Flush());
+  return cow_writer_->AddZeroBlocks(new_block_start, num_blocks);
+}
+
+bool BatchedCowWriter::AddLabel(uint64_t label) {
+  TEST_AND_RETURN_FALSE(Flush());
+  return cow_writer_->AddLabel(label);
+}
+
+bool BatchedCowWriter::AddSequenceData(size_t num_ops, const uint32_t* data) {
+  TEST_AND_RETURN_FALSE(Flush());
+  return cow_writer_->AddSequenceData(num_ops, data);
+}
+
+bool BatchedCowWriter::Finalize() {
+  TEST_AND_RETURN_FALSE(Flush());
+  return cow_writer_->Finalize();
+}
+
+uint32_t BatchedCowWriter::GetBlockSize() const {
+  return cow_writer_->GetBlockSize();
+}
+
+std::optional<uint32_t> BatchedCowWriter::GetMaxBlocks() const {
+  return cow_writer_->GetMaxBlocks();
+}
+
+android::snapshot::CowSizeInfo BatchedCowWriter::GetCowSizeInfo() const {
+  // Wait for the queued batches and keep holding |mutex_| so the worker can't
+  // write to |cow_writer_| concurrently. Doesn't account for the blocks of the
+  // batch still being staged by the caller.
+  std::unique_lock<std::mutex> lock(mutex_);
+  cv_.wait(lock, [this] { return queue_.empty() && !worker_busy_; });
+  return cow_writer_->GetCowSizeInfo();
+}
+
+std::unique_ptr<android::snapshot::ICowReader> BatchedCowWriter::OpenReader() {
+  if (!Flush()) {
+    return nullptr;
+  }
+  return cow_writer_->OpenReader();
+}
+
+std::unique_ptr<FileDescriptor> BatchedCowWriter::OpenFileDescriptor(
+    const std::optional<std::string>& source_device) {
+  if (!Flush()) {
+    return nullptr;
+  }
+  return cow_writer_->OpenFileDescriptor(source_device);
+}
+
+bool BatchedCowWriter::Flush() {
+  TEST_AND_RETURN_FALSE(SubmitCurrentBatch());
+  std::unique_lock<std::mutex> lock(mutex_);
+  cv_.wait(lock, [this] { return queue_.empty() && !worker_busy_; });
+  return !failed_;
+}
+
+bool BatchedCowWriter::Stage(Batch::Type type,
+                             uint64_t new_block_start,
+                             const void* data,
+                             size_t size,
+                             uint32_t old_block,
+                             uint16_t offset) {
+  if (size == 0) {
+    return true;
+  }
+  if (current_batch_) {
+    const Batch& batch = *current_batch_;
+    const uint64_t staged_blocks = batch.data.size() / block_size_;
+    const bool continues_batch =
+        batch.type == type &&
+        batch.new_block_start + staged_blocks == new_block_start &&
+        (type == Batch::Type::kRaw ||
+         (batch.old_block + staged_blocks == old_block &&
+          batch.offset == offset));
+    if (!continues_batch || batch.data.size() + size > batch_size_) {
+      TEST_AND_RETURN_FALSE(SubmitCurrentBatch());
+    }
+  }
+  if (!current_batch_) {
+    current_batch_ = Batch{.type = type,
+                           .new_block_start = new_block_start,
+                           .old_block = old_block,
+                           .offset = offset};
+    current_batch_->data.reserve(std::max(batch_size_, size));
+  }
+  const auto bytes = static_cast<const uint8_t*>(data);
+  current_batch_->data.insert(current_batch_->data.end(), bytes, bytes + size);
+  return true;
+}
+
+bool BatchedCowWriter::SubmitCurrentBatch() {
+  if (!current_batch_) {
+    return true;
+  }
+  std::unique_lock<std::mutex> lock(mutex_);
+  // Bound the memory held by staged batches.
+  cv_.wait(lock, [this] { return queue_.size() < kMaxQueuedBatches; });
+  queue_.push_back(std::move(*current_batch_));
+  current_batch_.reset();
+  const bool failed = failed_;
+  lock.unlock();
+  cv_.notify_all();
+  return !failed;
+}
+
+bool BatchedCowWriter::WriteBatch(const Batch& batch) {
+  switch (batch.type) {
+    case Batch::Type::kRaw:
+      return cow_writer_->AddRawBlocks(
+          batch.new_block_start, batch.data.data(), batch.data.size());
+    case Batch::Type::kXor:
+      return cow_writer_->AddXorBlocks(batch.new_block_start,
+                                       batch.data.data(),
+                                       batch.data.size(),
+                                       batch.old_block,
+                                       batch.offset);
+  }
+  return false;
+}
+
+void BatchedCowWriter::WorkerLoop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    cv_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+    if (queue_.empty()) {
+      return;
+    }
+    Batch batch = std::move(queue_.front());
+    queue_.pop_front();
+    worker_busy_ = true;
+    // Nothing after a failed batch may reach the COW image.
+    const bool skip = failed_;
+    lock.unlock();
+    cv_.notify_all();
+
+    bool success = true;
+    if (!skip) {
+      success = WriteBatch(batch);
+      LOG_IF(ERROR, !success)
+          << "Failed to write " << batch.data.size() / block_size_
+          << " COW blocks at " << batch.new_block_start;
+    }
+
+    lock.lock();
+    failed_ = failed_ || !success;
+    worker_busy_ = false;
+    cv_.notify_all();
+  }
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,126 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_BATCHED_COW_WRITER_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_BATCHED_COW_WRITER_H_
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+
+#include <brillo/secure_blob.h>
+#include <libsnapshot/cow_writer.h>
+
+namespace chromeos_update_engine {
+
+// An ICowWriter which stages raw and XOR blocks from consecutive calls into
+// large contiguous batches, and hands them to the wrapped writer from a
+// background thread. Compression happens inside the wrapped writer, so this
+// moves it off the thread applying InstallOperations, and the larger calls
+// let a threaded COW writer spread one batch over all of its compression
+// threads.
+//
+// Every other call (copy, zero, label, finalize, ...) first waits for all
+// staged blocks to reach the wrapped writer, so the order of operations in the
+// COW image is preserved and a label still covers all data written before it.
+class BatchedCowWriter final : public android::snapshot::ICowWriter {
+ public:
+  // Size of the data accumulated before a batch is queued to the background
+  // thread.
+  static constexpr size_t kDefaultBatchSize = 2 * 1024 * 1024;
+  // Number of batches queued to the background thread before staging blocks
+  // blocks the caller.
+  static constexpr size_t kMaxQueuedBatches = 2;
+
+  explicit BatchedCowWriter(
+      std::unique_ptr<android::snapshot::ICowWriter> cow_writer,
+      size_t block_size,
+      size_t batch_size = kDefaultBatchSize);
+  ~BatchedCowWriter() override;
+
+  bool AddCopy(uint64_t new_block,
+               uint64_t old_block,
+               uint64_t num_blocks) override;
+  bool AddRawBlocks(uint64_t new_block_start,
+                    const void* data,
+                    size_t size) override;
+  bool AddXorBlocks(uint32_t new_block_start,
+                    const void* data,
+                    size_t size,
+                    uint32_t old_block,
+                    uint16_t offset) override;
+  bool AddZeroBlocks(uint64_t new_block_start, uint64_t num_blocks) override;
+  bool AddLabel(uint64_t label) override;
+  bool AddSequenceData(size_t num_ops, const uint32_t* data) override;
+  bool Finalize() override;
+  uint32_t GetBlockSize() const override;
+  std::optional<uint32_t> GetMaxBlocks() const override;
+  android::snapshot::CowSizeInfo GetCowSizeInfo() const override;
+  std::unique_ptr<android::snapshot::ICowReader> OpenReader() override;
+  std::unique_ptr<FileDescriptor> OpenFileDescriptor(
+      const std::optional<std::string>& source_device) override;
+
+  // Waits until all staged blocks were handed to the wrapped writer. Returns
+  // false if any of them failed, failures are sticky.
+  [[nodiscard]] bool Flush();
+
+ private:
+  struct Batch {
+    enum class Type { kRaw, kXor } type;
+    uint64_t new_block_start;
+    // Only used by XOR batches.
+    uint32_t old_block;
+    uint16_t offset;
+    brillo::Blob data;
+  };
+
+  // Appends |size| bytes of |data| to the current batch, or starts a new one if
+  // the blocks don't continue it.
+  bool Stage(Batch::Type type,
+             uint64_t new_block_start,
+             const void* data,
+             size_t size,
+             uint32_t old_block,
+             uint16_t offset);
+  // Queues the current batch to the background thread.
+  bool SubmitCurrentBatch();
+  bool WriteBatch(const Batch& batch);
+  void WorkerLoop();
+
+  std::unique_ptr<android::snapshot::ICowWriter> cow_writer_;
+  const size_t block_size_;
+  const size_t batch_size_;
+  std::optional<Batch> current_batch_;
+
+  // Mutable so GetCowSizeInfo() can wait for the worker.
+  mutable std::mutex mutex_;
+  mutable std::condition_variable cv_;
+  // Protected by |mutex_|.
+  std::deque<Batch> queue_;
+  bool worker_busy_{false};
+  bool failed_{false};
+  bool stopping_{false};
+  std::thread worker_;
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_BATCHED_COW_WRITER_H_
@@ -0,0 +1,146 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/batched_cow_writer.h"
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <utility>
+
+#include <brillo/secure_blob.h>
+#include <gtest/gtest.h>
+#include <libsnapshot/mock_cow_writer.h>
+
+#include "update_engine/payload_generator/delta_diff_generator.h"
+
+namespace chromeos_update_engine {
+
+using android::snapshot::MockCowWriter;
+using testing::_;
+using testing::Invoke;
+using testing::Return;
+using testing::Sequence;
+
+class BatchedCowWriterTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    auto cow_writer = std::make_unique<MockCowWriter>();
+    mock_cow_writer_ = cow_writer.get();
+    writer_ = std::make_unique<BatchedCowWriter>(
+        std::move(cow_writer), kBlockSize, kBlockSize * 4);
+  }
+
+  MockCowWriter* mock_cow_writer_{};
+  std::unique_ptr<BatchedCowWriter> writer_;
+  brillo::Blob data_ = brillo::Blob(kBlockSize * 8, 0x42);
+};
+
+// Contiguous raw blocks from separate calls reach the COW writer in one call,
+// and a label is only added after them.
+TEST_F(BatchedCowWriterTest, MergeContiguousRawBlocksTest) {
+  Sequence s;
+  EXPECT_CALL(*mock_cow_writer_, AddRawBlocks(10, _, kBlockSize * 3))
+      .InSequence(s)
+      .WillOnce(Return(true));
+  EXPECT_CALL(*mock_cow_writer_, AddLabel(1))
+      .InSequence(s)
+      .WillOnce(Return(true));
+
+  ASSERT_TRUE(writer_->AddRawBlocks(10, data_.data(), kBlockSize));
+  ASSERT_TRUE(writer_->AddRawBlocks(11, data_.data(), kBlockSize * 2));
+  ASSERT_TRUE(writer_->AddLabel(1));
+}
+
+// Blocks are split into separate calls on discontinuity and when the batch
+// size is reached, preserving their order.
+TEST_F(BatchedCowWriterTest, SplitBatchesTest) {
+  Sequence s;
+  EXPECT_CALL(*mock_cow_writer_, AddRawBlocks(10, _, kBlockSize))
+      .InSequence(s)
+      .WillOnce(Return(true));
+  EXPECT_CALL(*mock_cow_writer_, AddRawBlocks(20, _, kBlockSize * 4))
+      .InSequence(s)
+      .WillOnce(Return(true));
+  EXPECT_CALL(*mock_cow_writer_, AddRawBlocks(24, _, kBlockSize))
+      .InSequence(s)
+      .WillOnce(Return(true));
+
+  ASSERT_TRUE(writer_->AddRawBlocks(10, data_.data(), kBlockSize));
+  ASSERT_TRUE(writer_->AddRawBlocks(20, data_.data(), kBlockSize * 2));
+  ASSERT_TRUE(writer_->AddRawBlocks(22, data_.data(), kBlockSize * 2));
+  ASSERT_TRUE(writer_->AddRawBlocks(24, data_.data(), kBlockSize));
+  ASSERT_TRUE(writer_->Flush());
+}
+
+// XOR blocks are only merged if their source blocks and offset line up too.
+TEST_F(BatchedCowWriterTest, MergeXorBlocksTest) {
+  Sequence s;
+  EXPECT_CALL(*mock_cow_writer_, AddXorBlocks(10, _, kBlockSize * 2, 5, 7))
+      .InSequence(s)
+      .WillOnce(Return(true));
+  EXPECT_CALL(*mock_cow_writer_, AddXorBlocks(12, _, kBlockSize, 30, 7))
+      .InSequence(s)
+      .WillOnce(Return(true));
+  EXPECT_CALL(*mock_cow_writer_, AddZeroBlocks(40, 1))
+      .InSequence(s)
+      .WillOnce(Return(true));
+
+  ASSERT_TRUE(writer_->AddXorBlocks(10, data_.data(), kBlockSize, 5, 7));
+  ASSERT_TRUE(writer_->AddXorBlocks(11, data_.data(), kBlockSize, 6, 7));
+  ASSERT_TRUE(writer_->AddXorBlocks(12, data_.data(), kBlockSize, 30, 7));
+  ASSERT_TRUE(writer_->AddZeroBlocks(40, 1));
+}
+
+// A failed batch fails every later flush, and later blocks are dropped.
+TEST_F(BatchedCowWriterTest, FailureIsStickyTest) {
+  EXPECT_CALL(*mock_cow_writer_, AddRawBlocks(10, _, kBlockSize))
+      .WillOnce(Return(false));
+  EXPECT_CALL(*mock_cow_writer_, AddRawBlocks(20, _, _)).Times(0);
+  EXPECT_CALL(*mock_cow_writer_, AddLabel(_)).Times(0);
+
+  ASSERT_TRUE(writer_->AddRawBlocks(10, data_.data(), kBlockSize));
+  ASSERT_FALSE(writer_->AddLabel(1));
+  ASSERT_TRUE(writer_->AddRawBlocks(20, data_.data(), kBlockSize));
+  ASSERT_FALSE(writer_->Flush());
+}
+
+// GetCowSizeInfo() waits for the queued batches to be written.
+TEST_F(BatchedCowWriterTest, GetCowSizeInfoWaitsForWorkerTest) {
+  std::atomic<bool> written{false};
+  EXPECT_CALL(*mock_cow_writer_, AddRawBlocks(10, _, kBlockSize))
+      .WillOnce(Invoke([&written](uint64_t, const void*, size_t) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        written = true;
+        return true;
+      }));
+  EXPECT_CALL(*mock_cow_writer_, GetCowSizeInfo())
+      .WillOnce(Invoke([&written]() {
+        EXPECT_TRUE(written);
+        return android::snapshot::CowSizeInfo{};
+      }));
+  EXPECT_CALL(*mock_cow_writer_, AddRawBlocks(20, _, kBlockSize))
+      .WillOnce(Return(true));
+
+  ASSERT_TRUE(writer_->AddRawBlocks(10, data_.data(), kBlockSize));
+  // Not contiguous, so the first block is queued to the worker.
+  ASSERT_TRUE(writer_->AddRawBlocks(20, data_.data(), kBlockSize));
+  writer_->GetCowSizeInfo();
+  ASSERT_TRUE(writer_->Flush());
+}
+
+}  // namespace chromeos_update_engine
@@ -33,8 +33,8 @@ bool BlockExtentWriter::Init(
   TEST_NE(extents.size(), 0);
   extents_ = extents;
   cur_extent_idx_ = 0;
-  buffer_.clear();
-  buffer_.reserve(block_size);
+  buffered_size_ = 0;
+  writable_size_ = 0;
   block_size_ = block_size;
   return true;
 }
@@ -51,61 +51,125 @@ bool BlockExtentWriter::WriteExtent(const void* bytes, const size_t count) {
   return WriteExtent(bytes, write_extent, block_size_);
 }
 
+size_t BlockExtentWriter::NextWriteSize() const {
+  if (cur_extent_idx_ >= static_cast<size_t>(extents_.size())) {
+    return 0;
+  }
+  const auto& cur_extent = extents_[cur_extent_idx_];
+  const auto cur_extent_size =
+      static_cast<size_t>(cur_extent.num_blocks() * block_size_);
+  return std::min(cur_extent_size - offset_in_extent_, BUFFER_SIZE);
+}
+
+bool BlockExtentWriter::FlushBuffer() {
+  const auto start_block = extents_[cur_extent_idx_].start_block();
+  const auto write_size = buffered_size_;
+  buffered_size_ = 0;
+  if (!WriteExtent(buffer_.data(), write_size)) {
+    LOG(ERROR) << "WriteExtent(" << start_block << ", " << write_size
+               << ") failed.";
+    return false;
+  }
+  return true;
+}
+
+bool BlockExtentWriter::FlushBufferIfFull() {
+  if (buffered_size_ < NextWriteSize()) {
+    return true;
+  }
+  return FlushBuffer();
+}
+
 size_t BlockExtentWriter::ConsumeWithBuffer(const uint8_t* const data,
                                             const size_t count) {
-  if (cur_extent_idx_ >= static_cast<size_t>(extents_.size())) {
+  auto write_size = NextWriteSize();
+  if (write_size == 0) {
     if (count > 0) {
       LOG(ERROR) << "Exhausted all blocks, but still have " << count
                  << " bytes pending for write";
     }
     return 0;
   }
-  const auto& cur_extent = extents_[cur_extent_idx_];
-  const auto cur_extent_size =
-      static_cast<size_t>(cur_extent.num_blocks() * block_size_);
-
-  const auto write_size =
-      std::min(cur_extent_size - offset_in_extent_, BUFFER_SIZE);
-  if (buffer_.empty() && count >= write_size) {
-    if (!WriteExtent(data, write_size)) {
-      LOG(ERROR) << "WriteExtent(" << cur_extent.start_block() << ", "
-                 << write_size << ") failed.";
-      // return value is expected to be greater than 0. Return 0 to signal error
-      // condition
+  const bool large_write = count >= MIN_DIRECT_WRITE_SIZE;
+  // Complete blocks are buffered only to be merged with small writes. Send
+  // them on before a large write, so that it can skip |buffer_|.
+  if (large_write && buffered_size_ > 0 && buffered_size_ % block_size_ == 0) {
+    if (!FlushBuffer()) {
       return 0;
     }
-    return write_size;
+    write_size = NextWriteSize();
   }
-  if (buffer_.size() >= write_size) {
+  if (buffered_size_ == 0) {
+    const size_t direct_size =
+        std::min(count, write_size) / block_size_ * block_size_;
+    if (direct_size == write_size ||
+        (large_write && direct_size >= MIN_DIRECT_WRITE_SIZE)) {
+      const auto start_block = extents_[cur_extent_idx_].start_block();
+      if (!WriteExtent(data, direct_size)) {
+        LOG(ERROR) << "WriteExtent(" << start_block << ", " << direct_size
+                   << ") failed.";
+        // return value is expected to be greater than 0. Return 0 to signal
+        // error condition
+        return 0;
+      }
+      return direct_size;
+    }
+  }
+  if (buffered_size_ >= write_size) {
     LOG(ERROR)
         << "Data left in buffer should never be >= write_size, otherwise "
            "we should have send that data to CowWriter. Buffer size: "
-        << buffer_.size() << " write_size: " << write_size;
+        << buffered_size_ << " write_size: " << write_size;
+  }
+  size_t bytes_to_copy = std::min<size_t>(count, write_size - buffered_size_);
+  if (large_write) {
+    // Only complete the partially buffered block, the rest of a large write
+    // skips |buffer_|.
+    bytes_to_copy = std::min<size_t>(
+        bytes_to_copy, block_size_ - buffered_size_ % block_size_);
   }
-  const size_t bytes_to_copy =
-      std::min<size_t>(count, write_size - buffer_.size());
   TEST_GT(bytes_to_copy, 0U);
 
-  buffer_.insert(buffer_.end(), data, data + bytes_to_copy);
-  TEST_LE(buffer_.size(), write_size);
+  if (buffer_.size() < write_size) {
+    buffer_.resize(write_size);
+  }
+  std::copy(data, data + bytes_to_copy, buffer_.data() + buffered_size_);
+  buffered_size_ += bytes_to_copy;
+  TEST_LE(buffered_size_, write_size);
 
-  if (buffer_.size() == write_size) {
-    if (!WriteExtent(buffer_.data(), write_size)) {
-      LOG(ERROR) << "WriteExtent(" << cur_extent.start_block() << ", "
-                 << cur_extent.num_blocks() << ") failed.";
-      return 0;
-    }
-    buffer_.clear();
+  if (!FlushBufferIfFull()) {
+    return 0;
   }
   return bytes_to_copy;
 }
 
+uint8_t* BlockExtentWriter::GetWritableBuffer(size_t* size) {
+  const auto write_size = NextWriteSize();
+  if (write_size == 0 || buffered_size_ >= write_size) {
+    return nullptr;
+  }
+  if (buffer_.size() < write_size) {
+    buffer_.resize(write_size);
+  }
+  writable_size_ = write_size - buffered_size_;
+  *size = writable_size_;
+  return buffer_.data() + buffered_size_;
+}
+
+bool BlockExtentWriter::CommitBuffer(size_t count) {
+  TEST_AND_RETURN_FALSE(count <= writable_size_);
+  writable_size_ = 0;
+  buffered_size_ += count;
+  return FlushBufferIfFull();
+}
+
 // Returns true on success.
 // This will construct a COW_REPLACE operation and forward it to CowWriter. It
 // is important that caller does not perform SOURCE_COPY operation on this
 // class, otherwise raw data will be stored. Caller should find ways to use
 // COW_COPY whenever possible.
 bool BlockExtentWriter::Write(const void* bytes, size_t count) {
+  writable_size_ = 0;
   if (count == 0) {
     return true;
   }
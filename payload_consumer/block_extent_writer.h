@@ -25,10 +25,15 @@
 
 namespace chromeos_update_engine {
 
-// Cache data upto size of one extent before writing.
+// Cache data upto size of one extent before writing. Block aligned data from
+// large writes is passed to WriteExtent() directly, only small writes and
+// partial blocks are copied into the buffer.
 class BlockExtentWriter : public chromeos_update_engine::ExtentWriter {
  public:
   static constexpr size_t BUFFER_SIZE = 1024 * 1024;
+  // Writes of at least this size skip the buffer, except for the bytes needed
+  // to complete a partially buffered block.
+  static constexpr size_t MIN_DIRECT_WRITE_SIZE = 128 * 1024;
   BlockExtentWriter() = default;
   ~BlockExtentWriter() = default;
   // Returns true on success.
@@ -36,6 +41,10 @@ class BlockExtentWriter : public chromeos_update_engine::ExtentWriter {
             uint32_t block_size) override;
   // Returns true on success.
   bool Write(const void* bytes, size_t count) final;
+  // Hands out the unused part of the internal buffer, so that decompressors
+  // can write into it directly instead of going through Write().
+  uint8_t* GetWritableBuffer(size_t* size) override;
+  bool CommitBuffer(size_t count) override;
   // Write data for 1 extent. |bytes| will be a pointer which points to data of
   // size |extent.num_blocks()*block_size|. |extent| is the current extent we
   // are writing to.
@@ -47,6 +56,13 @@ class BlockExtentWriter : public chromeos_update_engine::ExtentWriter {
  private:
   bool WriteExtent(const void* bytes, size_t count);
   bool NextExtent();
+  // Returns the number of bytes which will be passed to the next WriteExtent()
+  // call, or 0 if all extents were written.
+  size_t NextWriteSize() const;
+  // Passes the data in |buffer_| to WriteExtent().
+  bool FlushBuffer();
+  // Calls FlushBuffer() once |buffer_| holds NextWriteSize() bytes.
+  bool FlushBufferIfFull();
   [[nodiscard]] size_t ConsumeWithBuffer(const uint8_t* const bytes,
                                          const size_t count);
   // It's a non-owning pointer, because PartitionWriter owns the CowWriter. This
@@ -55,6 +71,10 @@ class BlockExtentWriter : public chromeos_update_engine::ExtentWriter {
   google::protobuf::RepeatedPtrField<Extent> extents_;
   size_t cur_extent_idx_{};
   std::vector<uint8_t> buffer_;
+  // Number of bytes at the start of |buffer_| which are pending for write.
+  size_t buffered_size_{};
+  // Size of the buffer returned by the last GetWritableBuffer() call.
+  size_t writable_size_{};
   size_t block_size_{};
   size_t offset_in_extent_{};
 };
@@ -143,11 +143,18 @@ TEST_F(BlockExtentWriterTest, SingleBufferMultiCall) {
   FillArbitraryData(&buffer);
 
   ON_CALL(writer, WriteExtent(_, _, _)).WillByDefault(Return(true));
+  // Block aligned writes are passed through as they are.
+  EXPECT_CALL(
+      writer,
+      WriteExtent(static_cast<void*>(buffer.data()),
+                  ExtentForRange(10, BLOCKS_PER_BUFFER - 1),
+                  kBlockSize));
   EXPECT_CALL(writer,
-              WriteExtent(_, ExtentForRange(10, BLOCKS_PER_BUFFER), kBlockSize))
-      .WillOnce([&buffer](const void* data, const Extent& extent, size_t) {
-        return memcmp(data, buffer.data(), buffer.size()) == 0;
-      });
+              WriteExtent(static_cast<void*>(buffer.data() +
+                                             BlockExtentWriter::BUFFER_SIZE -
+                                             kBlockSize),
+                          ExtentForRange(10 + BLOCKS_PER_BUFFER - 1, 1),
+                          kBlockSize));
 
   ASSERT_TRUE(
       writer.Write(buffer.data(), BlockExtentWriter::BUFFER_SIZE - kBlockSize));
@@ -181,4 +188,90 @@ TEST_F(BlockExtentWriterTest, MultiBufferMultiCall) {
   ASSERT_TRUE(writer.Write(buffer.data(), kBlockSize));
 }
 
+TEST_F(BlockExtentWriterTest, WritableBufferTest) {
+  google::protobuf::RepeatedPtrField<Extent> extents;
+  *extents.Add() = ExtentForRange(10, 2);
+  *extents.Add() = ExtentForRange(20, 1);
+  MockBlockExtentWriter writer;
+  ASSERT_TRUE(writer.Init(extents, kBlockSize));
+  std::string buffer;
+  buffer.resize(kBlockSize * 3);
+  FillArbitraryData(&buffer);
+
+  EXPECT_CALL(writer, WriteExtent(_, ExtentForRange(10, 2), kBlockSize))
+      .WillOnce([&buffer](const void* data, const Extent& extent, size_t) {
+        return memcmp(data, buffer.data(), kBlockSize * 2) == 0;
+      });
+  EXPECT_CALL(writer, WriteExtent(_, ExtentForRange(20, 1), kBlockSize))
+      .WillOnce([&buffer](const void* data, const Extent& extent, size_t) {
+        return memcmp(data, buffer.data() + kBlockSize * 2, kBlockSize) == 0;
+      });
+
+  // Fill the first extent half through the buffer, half through Write().
+  size_t size = 0;
+  uint8_t* writable = writer.GetWritableBuffer(&size);
+  ASSERT_NE(writable, nullptr);
+  ASSERT_EQ(size, kBlockSize * 2);
+  memcpy(writable, buffer.data(), kBlockSize);
+  ASSERT_TRUE(writer.CommitBuffer(kBlockSize));
+  ASSERT_TRUE(writer.Write(buffer.data() + kBlockSize, kBlockSize));
+
+  writable = writer.GetWritableBuffer(&size);
+  ASSERT_NE(writable, nullptr);
+  ASSERT_EQ(size, kBlockSize);
+  memcpy(writable, buffer.data() + kBlockSize * 2, kBlockSize);
+  ASSERT_FALSE(writer.CommitBuffer(kBlockSize + 1));
+  ASSERT_TRUE(writer.CommitBuffer(kBlockSize));
+
+  // All extents are written.
+  ASSERT_EQ(writer.GetWritableBuffer(&size), nullptr);
+}
+
+TEST_F(BlockExtentWriterTest, SmallWritesMergedTest) {
+  google::protobuf::RepeatedPtrField<Extent> extents;
+  *extents.Add() = ExtentForRange(10, 4);
+  MockBlockExtentWriter writer;
+  ASSERT_TRUE(writer.Init(extents, kBlockSize));
+  std::string buffer;
+  buffer.resize(kBlockSize * 4);
+  FillArbitraryData(&buffer);
+
+  EXPECT_CALL(writer, WriteExtent(_, ExtentForRange(10, 4), kBlockSize))
+      .WillOnce([&buffer](const void* data, const Extent& extent, size_t) {
+        return memcmp(data, buffer.data(), buffer.size()) == 0;
+      });
+
+  for (size_t i = 0; i < buffer.size(); i += 1000) {
+    ASSERT_TRUE(writer.Write(buffer.data() + i,
+                             std::min<size_t>(1000, buffer.size() - i)));
+  }
+}
+
+TEST_F(BlockExtentWriterTest, UnalignedLargeWriteTest) {
+  google::protobuf::RepeatedPtrField<Extent> extents;
+  static constexpr auto BLOCKS_PER_BUFFER =
+      BlockExtentWriter::BUFFER_SIZE / kBlockSize;
+  *extents.Add() = ExtentForRange(10, BLOCKS_PER_BUFFER);
+  MockBlockExtentWriter writer;
+  ASSERT_TRUE(writer.Init(extents, kBlockSize));
+  std::string buffer;
+  buffer.resize(BlockExtentWriter::BUFFER_SIZE);
+  FillArbitraryData(&buffer);
+
+  // Only the first block is copied to be completed, the rest of the large
+  // write is passed through.
+  EXPECT_CALL(writer, WriteExtent(_, ExtentForRange(10, 1), kBlockSize))
+      .WillOnce([&buffer](const void* data, const Extent& extent, size_t) {
+        return memcmp(data, buffer.data(), kBlockSize) == 0;
+      });
+  EXPECT_CALL(writer,
+              WriteExtent(static_cast<void*>(buffer.data() + kBlockSize),
+                          ExtentForRange(11, BLOCKS_PER_BUFFER - 1),
+                          kBlockSize))
+      .WillOnce(Return(true));
+
+  ASSERT_TRUE(writer.Write(buffer.data(), 100));
+  ASSERT_TRUE(writer.Write(buffer.data() + 100, buffer.size() - 100));
+}
+
 }  // namespace chromeos_update_engine
@@ -22,7 +22,8 @@ using google::protobuf::RepeatedPtrField;
 namespace chromeos_update_engine {
 
 namespace {
-const brillo::Blob::size_type kOutputBufferLength = 16 * 1024;
+// Only used if the underlying writer can't provide a buffer to decompress into.
+const brillo::Blob::size_type kOutputBufferLength = 256 * 1024;
 }
 
 BzipExtentWriter::~BzipExtentWriter() {
@@ -43,8 +44,6 @@ bool BzipExtentWriter::Init(const RepeatedPtrField<Extent>& extents,
 }
 
 bool BzipExtentWriter::Write(const void* bytes, size_t count) {
-  brillo::Blob output_buffer(kOutputBufferLength);
-
   // Copy the input data into |input_buffer_| only if |input_buffer_| already
   // contains unconsumed data. Otherwise, process the data directly from the
   // source.
@@ -59,21 +58,34 @@ bool BzipExtentWriter::Write(const void* bytes, size_t count) {
   stream_.avail_in = input_end - input;
 
   for (;;) {
-    stream_.next_out = reinterpret_cast<char*>(output_buffer.data());
-    stream_.avail_out = output_buffer.size();
+    // Decompress straight into the underlying writer's buffer if it has one.
+    size_t output_size = 0;
+    uint8_t* output = next_->GetWritableBuffer(&output_size);
+    const bool in_place = output != nullptr;
+    if (!in_place) {
+      output_buffer_.resize(kOutputBufferLength);
+      output = output_buffer_.data();
+      output_size = output_buffer_.size();
+    }
+    stream_.next_out = reinterpret_cast<char*>(output);
+    stream_.avail_out = output_size;
 
     int rc = BZ2_bzDecompress(&stream_);
     TEST_AND_RETURN_FALSE(rc == BZ_OK || rc == BZ_STREAM_END);
 
-    if (stream_.avail_out == output_buffer.size())
+    const size_t output_length = output_size - stream_.avail_out;
+    if (output_length == 0)
       break;  // got no new bytes
 
-    TEST_AND_RETURN_FALSE(next_->Write(
-        output_buffer.data(), output_buffer.size() - stream_.avail_out));
+    TEST_AND_RETURN_FALSE(in_place ? next_->CommitBuffer(output_length)
+                                   : next_->Write(output, output_length));
 
-    if (rc == BZ_STREAM_END)
+    if (rc == BZ_STREAM_END) {
       CHECK_EQ(stream_.avail_in, 0u);
-    if (stream_.avail_in == 0)
+      break;
+    }
+    // A full output buffer may leave decompressed data pending in |stream_|.
+    if (stream_.avail_in == 0 && stream_.avail_out > 0)
       break;  // no more input to process
   }
 
@@ -47,6 +47,8 @@ class BzipExtentWriter : public ExtentWriter {
   std::unique_ptr<ExtentWriter> next_;  // The underlying ExtentWriter.
   bz_stream stream_{};                  // the libbz2 stream
   brillo::Blob input_buffer_;
+  // Decompression buffer, only allocated if |next_| has none to offer.
+  brillo::Blob output_buffer_;
 };
 
 }  // namespace chromeos_update_engine
@@ -27,6 +27,8 @@
 
 #include "update_engine/common/test_utils.h"
 #include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/fake_extent_writer.h"
+#include "update_engine/payload_generator/bzip.h"
 #include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/payload_generator/delta_diff_generator.h"
 
@@ -111,4 +113,27 @@ TEST_F(BzipExtentWriterTest, ChunkedTest) {
   test_utils::ExpectVectorsEq(decompressed_data, output);
 }
 
+// The decompressed data goes straight into the buffer of a BlockExtentWriter.
+TEST_F(BzipExtentWriterTest, WritableBufferTest) {
+  brillo::Blob data(BlockExtentWriter::BUFFER_SIZE * 2 + kBlockSize * 3);
+  test_utils::FillWithData(&data);
+  brillo::Blob compressed;
+  ASSERT_TRUE(BzipCompress(data, &compressed));
+
+  google::protobuf::RepeatedPtrField<Extent> extents;
+  *extents.Add() = ExtentForRange(0, 3);
+  *extents.Add() = ExtentForRange(100, data.size() / kBlockSize - 3);
+  auto fake_writer = std::make_unique<FakeBlockExtentWriter>();
+  const FakeBlockExtentWriter* fake_writer_ptr = fake_writer.get();
+  BzipExtentWriter bzip_writer(std::move(fake_writer));
+  ASSERT_TRUE(bzip_writer.Init(extents, kBlockSize));
+  // Small input chunks exercise the partially filled buffer.
+  const size_t chunk_size = compressed.size() / 7 + 1;
+  for (size_t i = 0; i < compressed.size(); i += chunk_size) {
+    ASSERT_TRUE(bzip_writer.Write(compressed.data() + i,
+                                  min(chunk_size, compressed.size() - i)));
+  }
+  test_utils::ExpectVectorsEq(data, fake_writer_ptr->WrittenData());
+}
+
 }  // namespace chromeos_update_engine
@@ -19,6 +19,7 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <utility>
 
 #include <base/logging.h>
 
@@ -52,6 +53,23 @@ ssize_t CachedFileDescriptorBase::Write(const void* buf, size_t count) {
   auto bytes = static_cast<const uint8_t*>(buf);
   size_t total_bytes_wrote = 0;
   while (total_bytes_wrote < count) {
+    const size_t bytes_left = count - total_bytes_wrote;
+    if (bytes_cached_ == 0 && bytes_left >= cache_.size()) {
+      // Whole cache sized chunks gain nothing from the cache, write them
+      // directly instead of copying them first.
+      const size_t bytes_to_write = bytes_left - bytes_left % cache_.size();
+      const auto bytes_wrote =
+          GetFd()->Write(bytes + total_bytes_wrote, bytes_to_write);
+      if (bytes_wrote < 0) {
+        PLOG(ERROR) << "Failed to write data!";
+        if (total_bytes_wrote == 0) {
+          return -1;
+        }
+        break;
+      }
+      total_bytes_wrote += bytes_wrote;
+      continue;
+    }
     auto bytes_to_cache =
         std::min(count - total_bytes_wrote, cache_.size() - bytes_cached_);
     if (bytes_to_cache > 0) {  // Which means |cache_| is still have some space.
@@ -99,4 +117,199 @@ bool CachedFileDescriptorBase::FlushCache() {
 void UnownedCachedFileDescriptor::SetFD(FileDescriptor* fd) {
   fd_ = fd;
 }
+
+AsyncCachedFileDescriptor::AsyncCachedFileDescriptor(FileDescriptorPtr fd,
+                                                     size_t buffer_size)
+    : fd_(std::move(fd)) {
+  for (auto& buffer : buffers_) {
+    buffer.data.resize(buffer_size);
+  }
+  worker_ = std::thread(&AsyncCachedFileDescriptor::WorkerLoop, this);
+}
+
+AsyncCachedFileDescriptor::~AsyncCachedFileDescriptor() {
+  LOG_IF(ERROR, !Drain()) << "Failed to write buffered data.";
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  cv_.notify_all();
+  worker_.join();
+}
+
+bool AsyncCachedFileDescriptor::Open(const char* path, int flags, mode_t mode) {
+  offset_ = 0;
+  return fd_->Open(path, flags, mode);
+}
+
+bool AsyncCachedFileDescriptor::Open(const char* path, int flags) {
+  offset_ = 0;
+  return fd_->Open(path, flags);
+}
+
+ssize_t AsyncCachedFileDescriptor::Read(void* buf, size_t count) {
+  if (!Drain()) {
+    return -1;
+  }
+  const ssize_t bytes_read = fd_->Read(buf, count);
+  if (bytes_read > 0) {
+    offset_ += bytes_read;
+  }
+  return bytes_read;
+}
+
+ssize_t AsyncCachedFileDescriptor::Write(const void* buf, size_t count) {
+  auto bytes = static_cast<const uint8_t*>(buf);
+  size_t total_bytes_wrote = 0;
+  while (total_bytes_wrote < count) {
+    Buffer& buffer = buffers_[current_];
+    if (buffer.used == buffer.data.size()) {
+      if (!SubmitBuffer()) {
+        break;
+      }
+      continue;
+    }
+    const size_t bytes_to_cache =
+        std::min(count - total_bytes_wrote, buffer.data.size() - buffer.used);
+    if (buffer.ranges.empty() ||
+        buffer.ranges.back().offset +
+                static_cast<off64_t>(buffer.ranges.back().length) !=
+            offset_) {
+      buffer.ranges.push_back(
+          {.offset = offset_, .buffer_offset = buffer.used, .length = 0});
+    }
+    memcpy(buffer.data.data() + buffer.used,
+           bytes + total_bytes_wrote,
+           bytes_to_cache);
+    buffer.ranges.back().length += bytes_to_cache;
+    buffer.used += bytes_to_cache;
+    offset_ += bytes_to_cache;
+    total_bytes_wrote += bytes_to_cache;
+  }
+  if (total_bytes_wrote == 0 && count > 0) {
+    return -1;
+  }
+  return total_bytes_wrote;
+}
+
+off64_t AsyncCachedFileDescriptor::Seek(off64_t offset, int whence) {
+  // Same as CachedFileDescriptorBase, SEEK_END would need the size of the file
+  // including the data not written yet.
+  CHECK(whence == SEEK_SET || whence == SEEK_CUR);
+  const off64_t next_offset = whence == SEEK_SET ? offset : offset_ + offset;
+  if (next_offset < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  offset_ = next_offset;
+  return offset_;
+}
+
+bool AsyncCachedFileDescriptor::BlkIoctl(int request,
+                                         uint64_t start,
+                                         uint64_t length,
+                                         int* result) {
+  return Drain() && fd_->BlkIoctl(request, start, length, result);
+}
+
+bool AsyncCachedFileDescriptor::Flush() {
+  return Drain() && fd_->Flush();
+}
+
+bool AsyncCachedFileDescriptor::Close() {
+  const bool drained = Drain();
+  const auto stats = GetStats();
+  if (stats.flushes > 0) {
+    LOG(INFO) << "Wrote " << stats.bytes_written << " bytes in "
+              << stats.flushes << " buffers, waited for the writer "
+              << stats.stalls << " times.";
+  }
+  offset_ = 0;
+  return drained && fd_->Close();
+}
+
+int AsyncCachedFileDescriptor::Fd() {
+  return Drain() ? fd_->Fd() : -1;
+}
+
+AsyncCachedFileDescriptor::Stats AsyncCachedFileDescriptor::GetStats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return stats_;
+}
+
+bool AsyncCachedFileDescriptor::SubmitBuffer() {
+  if (buffers_[current_].used == 0) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return !failed_;
+  }
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (write_pending_) {
+      stats_.stalls++;
+      cv_.wait(lock, [this] { return !write_pending_; });
+    }
+    if (failed_) {
+      return false;
+    }
+    pending_ = current_;
+    write_pending_ = true;
+    stats_.flushes++;
+  }
+  cv_.notify_all();
+  current_ ^= 1;
+  buffers_[current_].used = 0;
+  buffers_[current_].ranges.clear();
+  return true;
+}
+
+bool AsyncCachedFileDescriptor::Drain() {
+  TEST_AND_RETURN_FALSE(SubmitBuffer());
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this] { return !write_pending_; });
+    TEST_AND_RETURN_FALSE(!failed_);
+  }
+  // Writes in the background don't move the wrapped descriptor.
+  return !fd_->IsOpen() || fd_->Seek(offset_, SEEK_SET) >= 0;
+}
+
+bool AsyncCachedFileDescriptor::WriteBuffer(const Buffer& buffer) {
+  const int fd = fd_->Fd();
+  for (const Range& range : buffer.ranges) {
+    const uint8_t* data = buffer.data.data() + range.buffer_offset;
+    if (fd >= 0) {
+      TEST_AND_RETURN_FALSE(
+          utils::PWriteAll(fd, data, range.length, range.offset));
+    } else {
+      // Only this thread uses |fd_| until the buffer is written.
+      TEST_AND_RETURN_FALSE(fd_->Seek(range.offset, SEEK_SET) >= 0);
+      TEST_AND_RETURN_FALSE(utils::WriteAll(fd_.get(), data, range.length));
+    }
+  }
+  return true;
+}
+
+void AsyncCachedFileDescriptor::WorkerLoop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    cv_.wait(lock, [this] { return stopping_ || write_pending_; });
+    if (!write_pending_) {
+      return;
+    }
+    // The caller doesn't touch the submitted buffer until |write_pending_| is
+    // cleared.
+    const Buffer& buffer = buffers_[pending_];
+    lock.unlock();
+    const bool success = WriteBuffer(buffer);
+    lock.lock();
+    if (success) {
+      stats_.bytes_written += buffer.used;
+    } else {
+      PLOG(ERROR) << "Failed to write buffered data!";
+      failed_ = true;
+    }
+    write_pending_ = false;
+    cv_.notify_all();
+  }
+}
 }  // namespace chromeos_update_engine
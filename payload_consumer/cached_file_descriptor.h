@@ -20,7 +20,10 @@
 #include <errno.h>
 #include <sys/types.h>
 
+#include <condition_variable>
 #include <memory>
+#include <mutex>
+#include <thread>
 #include <vector>
 
 #include <brillo/secure_blob.h>
@@ -56,6 +59,9 @@ class CachedFileDescriptorBase : public FileDescriptor {
   bool Close() override;
   bool IsSettingErrno() override { return GetFd()->IsSettingErrno(); }
   bool IsOpen() override { return GetFd()->IsOpen(); }
+  // Cached bytes are written out before the raw fd is handed out, so direct
+  // syscalls on it observe the same contents as Read()/Write() on |this|.
+  int Fd() override { return FlushCache() ? GetFd()->Fd() : -1; }
 
  protected:
   virtual FileDescriptor* GetFd() = 0;
@@ -93,6 +99,89 @@ class UnownedCachedFileDescriptor final : public CachedFileDescriptorBase {
   FileDescriptor* fd_;
 };
 
+// Like CachedFileDescriptor, but with two buffers: once the one being filled
+// is full it's written out by a background thread while the caller fills the
+// other. Seeking doesn't flush, the buffer keeps a list of the file ranges
+// written so far and the background thread writes each of them at its offset.
+//
+// Reads, Flush(), Close(), BlkIoctl() and Fd() first wait for all buffered
+// data to be written. A failed write in the background is reported by the
+// next call which waits for it.
+class AsyncCachedFileDescriptor final : public FileDescriptor {
+ public:
+  struct Stats {
+    // Bytes written to the wrapped descriptor.
+    uint64_t bytes_written{0};
+    // Buffers handed to the background thread.
+    uint64_t flushes{0};
+    // Times the caller had to wait for the background thread to finish the
+    // previous buffer before it could hand over the next one.
+    uint64_t stalls{0};
+  };
+
+  AsyncCachedFileDescriptor(FileDescriptorPtr fd, size_t buffer_size);
+  ~AsyncCachedFileDescriptor() override;
+
+  bool Open(const char* path, int flags, mode_t mode) override;
+  bool Open(const char* path, int flags) override;
+  ssize_t Read(void* buf, size_t count) override;
+  ssize_t Write(const void* buf, size_t count) override;
+  off64_t Seek(off64_t offset, int whence) override;
+  uint64_t BlockDevSize() override { return fd_->BlockDevSize(); }
+  bool BlkIoctl(int request,
+                uint64_t start,
+                uint64_t length,
+                int* result) override;
+  bool Flush() override;
+  bool Close() override;
+  bool IsSettingErrno() override { return fd_->IsSettingErrno(); }
+  bool IsOpen() override { return fd_->IsOpen(); }
+  int Fd() override;
+
+  Stats GetStats() const;
+
+ private:
+  // A contiguous range of the file, stored at |buffer_offset| in the buffer.
+  struct Range {
+    off64_t offset;
+    size_t buffer_offset;
+    size_t length;
+  };
+  struct Buffer {
+    brillo::Blob data;
+    size_t used{0};
+    std::vector<Range> ranges;
+  };
+
+  // Hands the buffer being filled to the background thread, waiting for the
+  // previous one to be written first. Returns false if a write failed.
+  bool SubmitBuffer();
+  // Writes out everything buffered so far and moves the wrapped descriptor to
+  // |offset_|. Returns false if a write failed.
+  bool Drain();
+  bool WriteBuffer(const Buffer& buffer);
+  void WorkerLoop();
+
+  FileDescriptorPtr fd_;
+  off64_t offset_{0};
+  // The caller fills |buffers_[current_]|, the background thread writes
+  // |buffers_[pending_]| while |write_pending_| is set.
+  Buffer buffers_[2];
+  size_t current_{0};
+
+  mutable std::mutex mutex_;
+  std::condition_variable cv_;
+  // Protected by |mutex_|.
+  size_t pending_{0};
+  bool write_pending_{false};
+  bool failed_{false};
+  bool stopping_{false};
+  Stats stats_;
+  std::thread worker_;
+
+  DISALLOW_COPY_AND_ASSIGN(AsyncCachedFileDescriptor);
+};
+
 }  // namespace chromeos_update_engine
 
 #endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_CACHED_FILE_DESCRIPTOR_H_
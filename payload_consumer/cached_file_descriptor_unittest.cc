@@ -19,6 +19,7 @@
 #include <fcntl.h>
 
 #include <algorithm>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -201,4 +202,93 @@ TEST_F(CachedFileDescriptorTest, SeekAfterWriteTest) {
   EXPECT_EQ(blob_in, blob_out);
 }
 
+TEST_F(CachedFileDescriptorTest, OverCacheSizeWriteTest) {
+  off64_t seek = 10;
+  size_t over_cache_size = kCacheSize * 2 + 50;
+  EXPECT_EQ(cfd_->Seek(seek, SEEK_SET), seek);
+  brillo::Blob blob_in(kFileSize, 0);
+  std::fill_n(&blob_in[seek], over_cache_size, value_);
+  // Whole cache sized chunks are written directly, only the rest is cached.
+  Write(&blob_in[seek], over_cache_size);
+
+  brillo::Blob blob_out;
+  EXPECT_TRUE(utils::ReadFile(temp_file_.path(), &blob_out));
+  std::fill_n(&blob_in[seek + kCacheSize * 2], 50, 0);
+  EXPECT_EQ(blob_in, blob_out);
+
+  // The cached bytes follow after a flush.
+  EXPECT_TRUE(cfd_->Flush());
+  std::fill_n(&blob_in[seek + kCacheSize * 2], 50, value_);
+  EXPECT_TRUE(utils::ReadFile(temp_file_.path(), &blob_out));
+  EXPECT_EQ(blob_in, blob_out);
+}
+
+class AsyncCachedFileDescriptorTest : public CachedFileDescriptorTest {
+ public:
+  void SetUp() override {
+    brillo::Blob zero_blob(kFileSize, 0);
+    EXPECT_TRUE(utils::WriteFile(
+        temp_file_.path().c_str(), zero_blob.data(), zero_blob.size()));
+    acfd_ = new AsyncCachedFileDescriptor(fd_, kCacheSize);
+    cfd_.reset(acfd_);
+    EXPECT_TRUE(cfd_->Open(temp_file_.path().c_str(), O_RDWR, 0600));
+  }
+
+ protected:
+  AsyncCachedFileDescriptor* acfd_{nullptr};
+};
+
+TEST_F(AsyncCachedFileDescriptorTest, RandomWriteTest) {
+  brillo::Blob blob_in(kFileSize, 0);
+  uint32_t rand_seed = time(nullptr);
+  for (size_t idx = 0; idx < kRandomIterations; idx++) {
+    size_t start = rand_r(&rand_seed) % blob_in.size();
+    size_t size = rand_r(&rand_seed) % (blob_in.size() - start);
+    std::fill_n(&blob_in[start], size, idx % 256);
+    EXPECT_EQ(cfd_->Seek(start, SEEK_SET), static_cast<off64_t>(start));
+    Write(&blob_in[start], size);
+  }
+  EXPECT_TRUE(cfd_->Flush());
+
+  brillo::Blob blob_out;
+  EXPECT_TRUE(utils::ReadFile(temp_file_.path(), &blob_out));
+  EXPECT_EQ(blob_in, blob_out);
+}
+
+TEST_F(AsyncCachedFileDescriptorTest, ScatteredWriteTest) {
+  brillo::Blob blob_in(kFileSize, 0);
+  // Seeking between writes doesn't flush the buffer.
+  for (off64_t seek : {500, 10, 300}) {
+    std::fill_n(&blob_in[seek], 20, value_);
+    EXPECT_EQ(cfd_->Seek(seek, SEEK_SET), seek);
+    Write(&blob_in[seek], 20);
+  }
+  brillo::Blob blob_out;
+  EXPECT_TRUE(utils::ReadFile(temp_file_.path(), &blob_out));
+  EXPECT_EQ(brillo::Blob(kFileSize, 0), blob_out);
+  EXPECT_EQ(0u, acfd_->GetStats().flushes);
+
+  EXPECT_TRUE(cfd_->Flush());
+  EXPECT_TRUE(utils::ReadFile(temp_file_.path(), &blob_out));
+  EXPECT_EQ(blob_in, blob_out);
+  EXPECT_EQ(1u, acfd_->GetStats().flushes);
+  EXPECT_EQ(60u, acfd_->GetStats().bytes_written);
+}
+
+TEST_F(AsyncCachedFileDescriptorTest, ReadAfterWriteTest) {
+  brillo::Blob blob_in(kCacheSize * 3 + 10, value_);
+  EXPECT_EQ(cfd_->Seek(5, SEEK_SET), 5);
+  Write(blob_in.data(), blob_in.size());
+  EXPECT_GE(acfd_->GetStats().flushes, 3u);
+
+  // Reads see the data still buffered.
+  brillo::Blob blob_out(blob_in.size());
+  EXPECT_EQ(cfd_->Seek(5, SEEK_SET), 5);
+  EXPECT_EQ(static_cast<ssize_t>(blob_out.size()),
+            cfd_->Read(blob_out.data(), blob_out.size()));
+  EXPECT_EQ(blob_in, blob_out);
+  EXPECT_EQ(static_cast<off64_t>(5 + blob_in.size()), cfd_->Seek(0, SEEK_CUR));
+  EXPECT_EQ(blob_in.size(), acfd_->GetStats().bytes_written);
+}
+
 }  // namespace chromeos_update_engine
@@ -0,0 +1,108 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/checkpoint_scheduler.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include <base/logging.h>
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// Bounds of the interval between checkpoints, in seconds.
+constexpr double kMinIntervalSeconds = 0.5;
+constexpr double kMaxIntervalSeconds = 30;
+
+// Cost assumed for a checkpoint until one was measured, and the weight of a
+// new measurement in the moving average.
+constexpr double kInitialCheckpointCostSeconds = 0.01;
+constexpr double kCheckpointCostWeight = 0.25;
+
+// Mean time before an update is interrupted when the device is on a charger,
+// on battery, and on a low or hot battery.
+constexpr double kOnExternalPowerSeconds = 60 * 60;
+constexpr double kOnBatterySeconds = 10 * 60;
+constexpr double kOnLowBatterySeconds = 60;
+constexpr int kLowBatteryPercent = 15;
+
+// How often the power state is queried.
+constexpr int64_t kPowerStateRefreshSeconds = 30;
+
+}  // namespace
+
+CheckpointScheduler::CheckpointScheduler(HardwareInterface* hardware)
+    : hardware_(hardware),
+      checkpoint_cost_(kInitialCheckpointCostSeconds),
+      time_between_interruptions_(kOnBatterySeconds) {
+  UpdateInterval();
+}
+
+bool CheckpointScheduler::ShouldCheckpoint(base::TimeTicks now,
+                                           uint64_t bytes_applied) {
+  if (now > next_power_state_time_) {
+    next_power_state_time_ =
+        now + base::TimeDelta::FromSeconds(kPowerStateRefreshSeconds);
+    double previous = time_between_interruptions_;
+    HardwareInterface::PowerState state;
+    if (hardware_ && hardware_->GetPowerState(&state)) {
+      bool low_battery = !state.on_external_power &&
+                         state.battery_percent >= 0 &&
+                         state.battery_percent < kLowBatteryPercent;
+      if (state.thermal_throttled || low_battery) {
+        time_between_interruptions_ = kOnLowBatterySeconds;
+      } else if (state.on_external_power) {
+        time_between_interruptions_ = kOnExternalPowerSeconds;
+      } else {
+        time_between_interruptions_ = kOnBatterySeconds;
+      }
+    } else {
+      time_between_interruptions_ = kOnBatterySeconds;
+    }
+    if (time_between_interruptions_ != previous) {
+      UpdateInterval();
+      LOG(INFO) << "Saving update progress every "
+                << interval_.InMilliseconds() << "ms, expecting an "
+                << "interruption every " << time_between_interruptions_
+                << "s.";
+    }
+  }
+  return now > next_checkpoint_time_ ||
+         bytes_applied >= checkpoint_bytes_ + kMaxBytesBetweenCheckpoints;
+}
+
+void CheckpointScheduler::CheckpointSaved(base::TimeTicks now,
+                                          base::TimeDelta duration,
+                                          uint64_t bytes_applied) {
+  checkpoint_cost_ += kCheckpointCostWeight *
+                      (duration.InSecondsF() - checkpoint_cost_);
+  UpdateInterval();
+  total_duration_ += duration;
+  next_checkpoint_time_ = now + interval_;
+  checkpoint_bytes_ = bytes_applied;
+}
+
+void CheckpointScheduler::UpdateInterval() {
+  double interval =
+      std::sqrt(2 * checkpoint_cost_ * time_between_interruptions_);
+  interval = std::clamp(interval, kMinIntervalSeconds, kMaxIntervalSeconds);
+  interval_ = base::TimeDelta::FromMilliseconds(
+      static_cast<int64_t>(interval * 1000));
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,93 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_CHECKPOINT_SCHEDULER_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_CHECKPOINT_SCHEDULER_H_
+
+#include <cstdint>
+
+#include <base/macros.h>
+#include <base/time/time.h>
+
+#include "update_engine/common/hardware_interface.h"
+
+namespace chromeos_update_engine {
+
+// Decides when DeltaPerformer saves its progress. Saving a checkpoint syncs
+// the prefs and the COW to disk, while the operations applied since the last
+// checkpoint have to be applied again if the update is interrupted. The
+// interval between checkpoints follows Young's approximation of the optimal
+// one, sqrt(2 * checkpoint cost * mean time between interruptions), where the
+// checkpoint cost is measured as the update goes and the time between
+// interruptions is estimated from the power state of the device: an update on
+// a charger is rarely cut short, one on a low or hot battery may be any time.
+// Regardless of the interval, a checkpoint is due once enough bytes were
+// applied since the last one.
+class CheckpointScheduler {
+ public:
+  // Most payload bytes applied between two checkpoints.
+  static constexpr uint64_t kMaxBytesBetweenCheckpoints = 64 * 1024 * 1024;
+
+  // |hardware| is used to query the power state and may be null, in which
+  // case the device is assumed to be running on battery.
+  explicit CheckpointScheduler(HardwareInterface* hardware);
+
+  // Returns whether a checkpoint should be saved at |now|, once the first
+  // |bytes_applied| bytes of the payload were applied.
+  bool ShouldCheckpoint(base::TimeTicks now, uint64_t bytes_applied);
+
+  // Records that a checkpoint of the first |bytes_applied| bytes of the
+  // payload was saved at |now| and took |duration|.
+  void CheckpointSaved(base::TimeTicks now,
+                       base::TimeDelta duration,
+                       uint64_t bytes_applied);
+
+  // The current interval between checkpoints.
+  base::TimeDelta interval() const { return interval_; }
+
+  // The time spent saving checkpoints, including |previous_duration| spent
+  // before the update was resumed.
+  base::TimeDelta total_duration() const { return total_duration_; }
+  void set_previous_duration(base::TimeDelta previous_duration) {
+    total_duration_ = previous_duration;
+  }
+
+ private:
+  // Queries the power state and recomputes |interval_| from it.
+  void UpdateInterval();
+
+  HardwareInterface* hardware_;
+
+  // Moving average of the time a checkpoint takes, in seconds.
+  double checkpoint_cost_;
+  // Estimated mean time before the update is interrupted, in seconds.
+  double time_between_interruptions_;
+
+  base::TimeDelta interval_;
+  base::TimeDelta total_duration_;
+
+  // When the power state is queried next, and when the next checkpoint is
+  // due. Null until the first call to ShouldCheckpoint().
+  base::TimeTicks next_power_state_time_;
+  base::TimeTicks next_checkpoint_time_;
+  uint64_t checkpoint_bytes_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(CheckpointScheduler);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_CHECKPOINT_SCHEDULER_H_
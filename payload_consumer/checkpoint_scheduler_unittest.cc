@@ -0,0 +1,121 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/checkpoint_scheduler.h"
+
+#include <gtest/gtest.h>
+
+#include "update_engine/common/fake_hardware.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+
+HardwareInterface::PowerState MakePowerState(bool on_external_power,
+                                             int battery_percent,
+                                             bool thermal_throttled) {
+  HardwareInterface::PowerState state;
+  state.on_external_power = on_external_power;
+  state.battery_percent = battery_percent;
+  state.thermal_throttled = thermal_throttled;
+  return state;
+}
+
+}  // namespace
+
+class CheckpointSchedulerTest : public ::testing::Test {
+ protected:
+  // Returns the interval chosen for the power state |state|.
+  base::TimeDelta IntervalFor(const HardwareInterface::PowerState& state) {
+    fake_hardware_.SetPowerState(state);
+    CheckpointScheduler scheduler(&fake_hardware_);
+    scheduler.ShouldCheckpoint(now_, 0);
+    return scheduler.interval();
+  }
+
+  FakeHardware fake_hardware_;
+  base::TimeTicks now_ = base::TimeTicks::Now();
+};
+
+TEST_F(CheckpointSchedulerTest, FirstCallCheckpointsTest) {
+  CheckpointScheduler scheduler(&fake_hardware_);
+  EXPECT_TRUE(scheduler.ShouldCheckpoint(now_, 0));
+}
+
+TEST_F(CheckpointSchedulerTest, CheckpointDueAfterIntervalTest) {
+  CheckpointScheduler scheduler(&fake_hardware_);
+  ASSERT_TRUE(scheduler.ShouldCheckpoint(now_, 0));
+  scheduler.CheckpointSaved(now_, base::TimeDelta::FromMilliseconds(10), 0);
+  base::TimeDelta interval = scheduler.interval();
+  EXPECT_FALSE(scheduler.ShouldCheckpoint(now_ + interval / 2, 0));
+  EXPECT_TRUE(scheduler.ShouldCheckpoint(
+      now_ + interval + base::TimeDelta::FromMilliseconds(1), 0));
+}
+
+TEST_F(CheckpointSchedulerTest, ManyBytesForceCheckpointTest) {
+  CheckpointScheduler scheduler(&fake_hardware_);
+  scheduler.CheckpointSaved(now_, base::TimeDelta::FromMilliseconds(10), 100);
+  EXPECT_FALSE(scheduler.ShouldCheckpoint(
+      now_, 100 + CheckpointScheduler::kMaxBytesBetweenCheckpoints - 1));
+  EXPECT_TRUE(scheduler.ShouldCheckpoint(
+      now_, 100 + CheckpointScheduler::kMaxBytesBetweenCheckpoints));
+}
+
+TEST_F(CheckpointSchedulerTest, PowerStateTest) {
+  base::TimeDelta charging = IntervalFor(MakePowerState(true, 50, false));
+  base::TimeDelta battery = IntervalFor(MakePowerState(false, 50, false));
+  base::TimeDelta low_battery = IntervalFor(MakePowerState(false, 5, false));
+  base::TimeDelta hot = IntervalFor(MakePowerState(true, 50, true));
+  EXPECT_GT(charging, battery);
+  EXPECT_GT(battery, low_battery);
+  EXPECT_EQ(low_battery, hot);
+  // A low battery doesn't matter while charging.
+  EXPECT_EQ(charging, IntervalFor(MakePowerState(true, 5, false)));
+}
+
+TEST_F(CheckpointSchedulerTest, UnknownPowerStateTest) {
+  CheckpointScheduler scheduler(nullptr);
+  EXPECT_TRUE(scheduler.ShouldCheckpoint(now_, 0));
+  EXPECT_EQ(IntervalFor(MakePowerState(false, 50, false)),
+            scheduler.interval());
+}
+
+TEST_F(CheckpointSchedulerTest, CheckpointCostTest) {
+  CheckpointScheduler scheduler(&fake_hardware_);
+  base::TimeDelta interval = scheduler.interval();
+  scheduler.CheckpointSaved(now_, base::TimeDelta::FromMilliseconds(200), 0);
+  EXPECT_GT(scheduler.interval(), interval);
+
+  // Slow checkpoints never space them more than the upper bound.
+  for (int i = 0; i < 20; i++)
+    scheduler.CheckpointSaved(now_, base::TimeDelta::FromSeconds(10), 0);
+  EXPECT_EQ(base::TimeDelta::FromSeconds(30), scheduler.interval());
+
+  // Fast ones never bring them closer than the lower bound.
+  for (int i = 0; i < 50; i++)
+    scheduler.CheckpointSaved(now_, base::TimeDelta(), 0);
+  EXPECT_EQ(base::TimeDelta::FromMilliseconds(500), scheduler.interval());
+}
+
+TEST_F(CheckpointSchedulerTest, TotalDurationTest) {
+  CheckpointScheduler scheduler(&fake_hardware_);
+  scheduler.set_previous_duration(base::TimeDelta::FromMilliseconds(100));
+  scheduler.CheckpointSaved(now_, base::TimeDelta::FromMilliseconds(20), 0);
+  scheduler.CheckpointSaved(now_, base::TimeDelta::FromMilliseconds(30), 0);
+  EXPECT_EQ(base::TimeDelta::FromMilliseconds(150), scheduler.total_duration());
+}
+
+}  // namespace chromeos_update_engine
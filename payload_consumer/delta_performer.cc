@@ -16,12 +16,15 @@
 
 #include "update_engine/payload_consumer/delta_performer.h"
 
+#include <errno.h>
 #include <linux/fs.h>
+#include <unistd.h>
 
 #include <algorithm>
 #include <chrono>
 #include <cstring>
 #include <memory>
+#include <optional>
 #include <set>
 #include <string>
 #include <utility>
@@ -58,6 +61,7 @@
 #include "update_engine/payload_consumer/payload_constants.h"
 #include "update_engine/payload_consumer/payload_verifier.h"
 
+using google::protobuf::Arena;
 using google::protobuf::RepeatedPtrField;
 using std::min;
 using std::string;
@@ -68,11 +72,12 @@ const unsigned DeltaPerformer::kProgressLogMaxChunks = 10;
 const unsigned DeltaPerformer::kProgressLogTimeoutSeconds = 30;
 const unsigned DeltaPerformer::kProgressDownloadWeight = 50;
 const unsigned DeltaPerformer::kProgressOperationsWeight = 50;
-const uint64_t DeltaPerformer::kCheckpointFrequencySeconds = 1;
 
 namespace {
 const int kUpdateStateOperationInvalid = -1;
 const int kMaxResumedUpdateFailures = 10;
+const char kOperationIndexFileName[] = "operation_index";
+const char kOperationStatsFileName[] = "operation_stats";
 
 }  // namespace
 
@@ -185,6 +190,29 @@ size_t DeltaPerformer::CopyDataToBuffer(const char** bytes_p,
   return read_len;
 }
 
+bool DeltaPerformer::UseDataInPlace(const InstallOperation& operation,
+                                    const char** bytes_p,
+                                    size_t* count_p) {
+  if (!buffer_.empty() || !operation.has_data_length() ||
+      operation.data_length() == 0 || *count_p < operation.data_length() ||
+      operation.data_offset() != buffer_offset_) {
+    return false;
+  }
+  inplace_buffer_ = reinterpret_cast<const uint8_t*>(*bytes_p);
+  inplace_buffer_size_ = operation.data_length();
+  *bytes_p += inplace_buffer_size_;
+  *count_p -= inplace_buffer_size_;
+  return true;
+}
+
+const uint8_t* DeltaPerformer::BufferData() const {
+  return inplace_buffer_ ? inplace_buffer_ : buffer_.data();
+}
+
+size_t DeltaPerformer::BufferSize() const {
+  return inplace_buffer_ ? inplace_buffer_size_ : buffer_.size();
+}
+
 bool DeltaPerformer::HandleOpResult(bool op_result,
                                     const char* op_type_name,
                                     ErrorCode* error) {
@@ -205,12 +233,13 @@ int DeltaPerformer::Close() {
   // can resume from exactly where update_engine left last time.
   CheckpointUpdateProgress(true);
   int err = -CloseCurrentPartition();
+  WriteOperationStats();
   LOG_IF(ERROR,
          !payload_hash_calculator_.Finalize() ||
              !signed_hash_calculator_.Finalize())
       << "Unable to finalize the hash.";
-  if (!buffer_.empty()) {
-    LOG(INFO) << "Discarding " << buffer_.size() << " unused downloaded bytes";
+  if (BufferSize() > 0) {
+    LOG(INFO) << "Discarding " << BufferSize() << " unused downloaded bytes";
     if (err >= 0)
       err = 1;
   }
@@ -221,8 +250,11 @@ int DeltaPerformer::CloseCurrentPartition() {
   if (!partition_writer_) {
     return 0;
   }
+  source_prefetcher_.Close();
   int err = partition_writer_->Close();
   partition_writer_ = nullptr;
+  current_partition_update_ = nullptr;
+  partition_arena_.reset();
   return err;
 }
 
@@ -230,19 +262,25 @@ bool DeltaPerformer::OpenCurrentPartition() {
   if (current_partition_ >= partitions_.size())
     return false;
 
-  const PartitionUpdate& partition = partitions_[current_partition_];
+  // Only the operations of the partition being written are kept in memory.
+  auto arena = std::make_unique<Arena>();
+  auto partition = Arena::CreateMessage<PartitionUpdate>(arena.get());
+  partition->CopyFrom(partitions_[current_partition_]);
+  TEST_AND_RETURN_FALSE(LoadPartitionOperations(current_partition_, partition));
   size_t num_previous_partitions =
       install_plan_->partitions.size() - partitions_.size();
   const InstallPlan::Partition& install_part =
       install_plan_->partitions[num_previous_partitions + current_partition_];
   auto dynamic_control = boot_control_->GetDynamicPartitionControl();
   partition_writer_ = CreatePartitionWriter(
-      partition,
+      *partition,
       install_part,
       dynamic_control,
       block_size_,
       interactive_,
       IsDynamicPartition(install_part.name, install_plan_->target_slot));
+  partition_arena_ = std::move(arena);
+  current_partition_update_ = partition;
   // Open source fds if we have a delta payload, or for partitions in the
   // partial update.
   const bool source_may_exist = manifest_.partial_update() ||
@@ -251,6 +289,14 @@ bool DeltaPerformer::OpenCurrentPartition() {
 
   TEST_AND_RETURN_FALSE(partition_writer_->Init(
       install_plan_, source_may_exist, partition_operation_num));
+  operation_stats_.set_tracing(install_plan_->trace_operations);
+  operation_stats_.StartPartition(install_part.name);
+  partition_writer_->SetOperationStats(&operation_stats_);
+  if (source_may_exist && !install_part.source_path.empty()) {
+    source_prefetcher_.Open(install_part.source_path,
+                            block_size_,
+                            install_plan_->source_prefetch_ops);
+  }
   CheckpointUpdateProgress(true);
   return true;
 }
@@ -380,7 +426,8 @@ MetadataParseResult DeltaPerformer::ParsePayloadMetadata(
   }
 
   // The payload metadata is deemed valid, it's safe to parse the protobuf.
-  if (!payload_metadata_.GetManifest(payload, &manifest_)) {
+  if (!payload_metadata_.GetManifest(
+          payload, &operations_loader_, &manifest_)) {
     LOG(ERROR) << "Unable to parse manifest in update file.";
     *error = ErrorCode::kDownloadManifestParseError;
     return MetadataParseResult::kError;
@@ -449,6 +496,12 @@ bool DeltaPerformer::Write(const void* bytes, size_t count, ErrorCode* error) {
   *error = ErrorCode::kSuccess;
   const char* c_bytes = reinterpret_cast<const char*>(bytes);
 
+  ScopedMainThreadLease lease(main_thread_lease_);
+  if (!lease.Acquire()) {
+    *error = ErrorCode::kDownloadWriteError;
+    return false;
+  }
+
   // Update the total byte downloaded count and the progress logs.
   total_bytes_received_ += count;
   UpdateOverallProgress(false, "Completed ");
@@ -498,14 +551,33 @@ bool DeltaPerformer::Write(const void* bytes, size_t count, ErrorCode* error) {
     }
 
     const InstallOperation& op =
-        partitions_[current_partition_].operations(GetPartitionOperationNum());
+        current_partition_update_->operations(GetPartitionOperationNum());
+    // Read ahead the source of the next operations, from this one on since
+    // its data may still have to be downloaded.
+    source_prefetcher_.Prefetch(current_partition_update_->operations(),
+                                GetPartitionOperationNum());
 
-    CopyDataToBuffer(&c_bytes, &count, op.data_length());
+    // Local payloads usually pass whole operation blobs at once, there's no
+    // need to copy those.
+    if (!UseDataInPlace(op, &c_bytes, &count))
+      CopyDataToBuffer(&c_bytes, &count, op.data_length());
 
     // Check whether we received all of the next operation's data payload.
     if (!CanPerformInstallOperation(op))
       return true;
-    if (!ProcessOperation(&op, error)) {
+    // Operations only write to the partitions, let the main thread run
+    // meanwhile.
+    lease.Release();
+    const bool op_result = ProcessOperation(&op, error);
+    // Never keep pointing at the caller's bytes past this call.
+    inplace_buffer_ = nullptr;
+    inplace_buffer_size_ = 0;
+    if (!lease.Acquire()) {
+      LOG(ERROR) << "Stopped applying the payload.";
+      *error = ErrorCode::kDownloadWriteError;
+      return false;
+    }
+    if (!op_result) {
       LOG(ERROR) << "unable to process operation: "
                  << InstallOperationTypeName(op.type())
                  << " Error: " << utils::ErrorCodeToString(*error);
@@ -521,6 +593,7 @@ bool DeltaPerformer::Write(const void* bytes, size_t count, ErrorCode* error) {
     TEST_AND_RETURN_FALSE(partition_writer_->FinishedInstallOps());
   }
   CloseCurrentPartition();
+  DeleteOperationIndex();
 
   // In major version 2, we don't add unused operation to the payload.
   // If we already extracted the signature we should skip this step.
@@ -606,27 +679,25 @@ bool DeltaPerformer::ParseManifest(const char** c_bytes,
                  "compression is enabled.";
     manifest_.mutable_dynamic_partition_metadata()->set_vabc_compression_param(
         "none");
-    for (auto& partition : *manifest_.mutable_partitions()) {
+    for (int i = 0; i < manifest_.partitions_size(); i++) {
+      auto& partition = *manifest_.mutable_partitions(i);
       if (!partition.has_estimate_cow_size()) {
         continue;
       }
+      Arena arena;
+      auto operations = Arena::CreateMessage<PartitionUpdate>(&arena);
+      operations->CopyFrom(partition);
+      if (!LoadPartitionOperations(i, operations)) {
+        *error = ErrorCode::kDownloadManifestParseError;
+        return false;
+      }
       auto new_cow_size = partition.new_partition_info().size();
-      for (const auto& operation : partition.merge_operations()) {
+      for (const auto& operation : operations->merge_operations()) {
         if (operation.type() == CowMergeOperation::COW_COPY) {
           new_cow_size -=
               operation.dst_extent().num_blocks() * manifest_.block_size();
         }
       }
-      // Remove all COW_XOR merge ops, as XOR without compression is useless.
-      // It increases CPU usage but does not reduce space usage at all.
-      auto&& merge_ops = *partition.mutable_merge_operations();
-      merge_ops.erase(std::remove_if(merge_ops.begin(),
-                                     merge_ops.end(),
-                                     [](const auto& op) {
-                                       return op.type() ==
-                                              CowMergeOperation::COW_XOR;
-                                     }),
-                      merge_ops.end());
 
       // Every block written to COW device will come with a header which
       // stores src/dst block info along with other data.
@@ -636,8 +707,8 @@ bool DeltaPerformer::ParseManifest(const char** c_bytes,
       // update_engine will emit a label op every op or every two seconds,
       // whichever one is longer. In the worst case, we add 1 label per
       // InstallOp. So take size of label ops into account.
-      const auto label_ops_size =
-          partition.operations_size() * sizeof(android::snapshot::CowOperation);
+      const auto label_ops_size = operations->operations_size() *
+                                  sizeof(android::snapshot::CowOperation);
       // Adding extra 2MB headroom just for any unexpected space usage.
       // If we overrun reserved COW size, entire OTA will fail
       // and no way for user to retry OTA
@@ -681,8 +752,8 @@ bool DeltaPerformer::ParseManifest(const char** c_bytes,
     return false;
 
   num_total_operations_ = 0;
-  for (const auto& partition : partitions_) {
-    num_total_operations_ += partition.operations_size();
+  for (size_t i = 0; i < partitions_.size(); i++) {
+    num_total_operations_ += GetPartitionOperationsSize(i);
     acc_num_operations_.push_back(num_total_operations_);
   }
 
@@ -721,7 +792,11 @@ bool DeltaPerformer::ProcessOperation(const InstallOperation* op,
   // Note: Validate must be called only if CanPerformInstallOperation is
   // called. Otherwise, we might be failing operations before even if there
   // isn't sufficient data to compute the proper hash.
-  *error = ValidateOperationHash(*op);
+  ScopedOperation scoped_operation(&operation_stats_, op->type());
+  {
+    ScopedOperationStage stage(&operation_stats_, OperationStats::Stage::kHash);
+    *error = ValidateOperationHash(*op);
+  }
   if (*error != ErrorCode::kSuccess) {
     if (install_plan_->hash_checks_mandatory) {
       LOG(ERROR) << "Mandatory operation hash check failed";
@@ -869,6 +944,120 @@ bool DeltaPerformer::ParseManifestPartitions(ErrorCode* error) {
   return true;
 }
 
+size_t DeltaPerformer::GetPartitionOperationsSize(size_t index) const {
+  if (index < operations_loader_.partitions_size())
+    return operations_loader_.operations_size(index);
+  return partitions_[index].operations_size();
+}
+
+bool DeltaPerformer::LoadPartitionOperations(size_t index,
+                                             PartitionUpdate* partition) {
+  if (index < operations_loader_.partitions_size())
+    TEST_AND_RETURN_FALSE(operations_loader_.LoadOperations(index, partition));
+  if (install_plan_->vabc_none) {
+    // Remove all COW_XOR merge ops, as XOR without compression is useless.
+    // It increases CPU usage but does not reduce space usage at all.
+    auto&& merge_ops = *partition->mutable_merge_operations();
+    merge_ops.erase(std::remove_if(merge_ops.begin(),
+                                   merge_ops.end(),
+                                   [](const auto& op) {
+                                     return op.type() ==
+                                            CowMergeOperation::COW_XOR;
+                                   }),
+                    merge_ops.end());
+  }
+  return true;
+}
+
+bool DeltaPerformer::GetOperationIndexPath(string* path) const {
+  base::FilePath dir;
+  if (!hardware_ || !hardware_->GetNonVolatileDirectory(&dir))
+    return false;
+  *path = dir.Append(kOperationIndexFileName).value();
+  return true;
+}
+
+void DeltaPerformer::LoadOperationIndex() {
+  string path;
+  if (!GetOperationIndexPath(&path))
+    return;
+  brillo::Blob key;
+  if (!HashCalculator::RawHashOfBytes(operations_loader_.data().data(),
+                                      operations_loader_.data().size(),
+                                      &key)) {
+    return;
+  }
+  operation_index_ = OperationIndex::Load(path, key);
+  if (!operation_index_)
+    return;
+  bool matches = operation_index_->partitions_size() ==
+                 operations_loader_.partitions_size();
+  for (size_t i = 0; matches && i < operation_index_->partitions_size(); i++) {
+    matches = operation_index_->partition(i).operations_size ==
+              operations_loader_.operations_size(i);
+  }
+  if (!matches) {
+    LOG(WARNING) << "Operation index doesn't match the manifest, ignoring it.";
+    operation_index_.reset();
+    return;
+  }
+  LOG(INFO) << "Loaded the operation index from " << path;
+}
+
+void DeltaPerformer::WriteOperationIndex(
+    const RepeatedPtrField<PartitionUpdate>& partitions) {
+  operation_index_.reset();
+  string path;
+  if (!GetOperationIndexPath(&path))
+    return;
+  brillo::Blob key;
+  if (!HashCalculator::RawHashOfBytes(operations_loader_.data().data(),
+                                      operations_loader_.data().size(),
+                                      &key) ||
+      !OperationIndex::Write(path, key, partitions)) {
+    LOG(WARNING) << "Unable to write the operation index to " << path;
+    return;
+  }
+  LoadOperationIndex();
+}
+
+void DeltaPerformer::DeleteOperationIndex() {
+  operation_index_.reset();
+  string path;
+  if (!GetOperationIndexPath(&path))
+    return;
+  if (unlink(path.c_str()) != 0 && errno != ENOENT)
+    PLOG(WARNING) << "Unable to remove the operation index " << path;
+}
+
+void DeltaPerformer::WriteOperationStats() {
+  base::FilePath dir;
+  if (operation_stats_.empty() || !hardware_ ||
+      !hardware_->GetNonVolatileDirectory(&dir)) {
+    return;
+  }
+  const string path = dir.Append(kOperationStatsFileName).value();
+  const string stats = operation_stats_.ToString();
+  if (!utils::WriteFile(path.c_str(), stats.data(), stats.size())) {
+    LOG(WARNING) << "Unable to write the operation stats to " << path;
+    return;
+  }
+  LOG(INFO) << "Wrote the operation stats to " << path;
+}
+
+namespace {
+// Whether the partitions were already prepared for the payload with
+// |update_check_response_hash|, in which case only their metadata is needed.
+bool ArePartitionsPrepared(PrefsInterface* prefs,
+                           const string& update_check_response_hash) {
+  string last_hash;
+  ignore_result(
+      prefs->GetString(kPrefsDynamicPartitionMetadataUpdated, &last_hash));
+  return !update_check_response_hash.empty() &&
+         last_hash == update_check_response_hash;
+}
+}  // namespace
+
 bool DeltaPerformer::PreparePartitionsForUpdate(uint64_t* required_size,
                                                 ErrorCode* error) {
   // Call static PreparePartitionsForUpdate with hash from
@@ -877,13 +1066,38 @@ bool DeltaPerformer::PreparePartitionsForUpdate(uint64_t* required_size,
   string update_check_response_hash;
   ignore_result(prefs_->GetString(kPrefsUpdateCheckResponseHash,
                                   &update_check_response_hash));
-  return PreparePartitionsForUpdate(prefs_,
-                                    boot_control_,
-                                    install_plan_->target_slot,
-                                    manifest_,
-                                    update_check_response_hash,
-                                    required_size,
-                                    error);
+
+  // When resuming, the partitions are already prepared and their operations
+  // aren't needed. Use the operation index written when preparing them.
+  if (ArePartitionsPrepared(prefs_, update_check_response_hash)) {
+    LoadOperationIndex();
+    return PreparePartitionsForUpdate(prefs_,
+                                      boot_control_,
+                                      install_plan_->target_slot,
+                                      manifest_,
+                                      update_check_response_hash,
+                                      required_size,
+                                      error);
+  }
+
+  // Creating the snapshots needs the operations of every partition. Parse them
+  // on an arena which is freed as soon as the partitions are prepared.
+  Arena arena;
+  auto manifest = Arena::CreateMessage<DeltaArchiveManifest>(&arena);
+  manifest->CopyFrom(manifest_);
+  for (int i = 0; i < manifest->partitions_size(); i++) {
+    TEST_AND_RETURN_FALSE(
+        LoadPartitionOperations(i, manifest->mutable_partitions(i)));
+  }
+  TEST_AND_RETURN_FALSE(PreparePartitionsForUpdate(prefs_,
+                                                   boot_control_,
+                                                   install_plan_->target_slot,
+                                                   *manifest,
+                                                   update_check_response_hash,
+                                                   required_size,
+                                                   error));
+  WriteOperationIndex(manifest->partitions());
+  return true;
 }
 
 bool DeltaPerformer::PreparePartitionsForUpdate(
@@ -898,8 +1112,7 @@ bool DeltaPerformer::PreparePartitionsForUpdate(
   ignore_result(
       prefs->GetString(kPrefsDynamicPartitionMetadataUpdated, &last_hash));
 
-  bool is_resume = !update_check_response_hash.empty() &&
-                   last_hash == update_check_response_hash;
+  bool is_resume = ArePartitionsPrepared(prefs, update_check_response_hash);
 
   if (is_resume) {
     LOG(INFO) << "Using previously prepared partitions for update. hash = "
@@ -948,7 +1161,7 @@ bool DeltaPerformer::CanPerformInstallOperation(
   }
 
   return (operation.data_offset() + operation.data_length() <=
-          buffer_offset_ + buffer_.size());
+          buffer_offset_ + BufferSize());
 }
 
 bool DeltaPerformer::PerformReplaceOperation(
@@ -959,12 +1172,12 @@ bool DeltaPerformer::PerformReplaceOperation(
 
   // Since we delete data off the beginning of the buffer as we use it,
   // the data we need should be exactly at the beginning of the buffer.
-  TEST_AND_RETURN_FALSE(buffer_.size() >= operation.data_length());
+  TEST_AND_RETURN_FALSE(BufferSize() >= operation.data_length());
 
   TEST_AND_RETURN_FALSE(partition_writer_->PerformReplaceOperation(
-      operation, buffer_.data(), buffer_.size()));
+      operation, BufferData(), BufferSize()));
   // Update buffer
-  DiscardBuffer(true, buffer_.size());
+  DiscardBuffer(true, BufferSize());
   return true;
 }
 
@@ -1016,15 +1229,15 @@ bool DeltaPerformer::PerformDiffOperation(const InstallOperation& operation,
   // Since we delete data off the beginning of the buffer as we use it,
   // the data we need should be exactly at the beginning of the buffer.
   TEST_AND_RETURN_FALSE(buffer_offset_ == operation.data_offset());
-  TEST_AND_RETURN_FALSE(buffer_.size() >= operation.data_length());
+  TEST_AND_RETURN_FALSE(BufferSize() >= operation.data_length());
   if (operation.has_src_length())
     TEST_AND_RETURN_FALSE(operation.src_length() % block_size_ == 0);
   if (operation.has_dst_length())
     TEST_AND_RETURN_FALSE(operation.dst_length() % block_size_ == 0);
 
   TEST_AND_RETURN_FALSE(partition_writer_->PerformDiffOperation(
-      operation, error, buffer_.data(), buffer_.size()));
-  DiscardBuffer(true, buffer_.size());
+      operation, error, BufferData(), BufferSize()));
+  DiscardBuffer(true, BufferSize());
   return true;
 }
 
@@ -1291,7 +1504,7 @@ ErrorCode DeltaPerformer::ValidateOperationHash(
 
   brillo::Blob calculated_op_hash;
   if (!HashCalculator::RawHashOfBytes(
-          buffer_.data(), operation.data_length(), &calculated_op_hash)) {
+          BufferData(), operation.data_length(), &calculated_op_hash)) {
     LOG(ERROR) << "Unable to compute actual hash of operation "
                << next_operation_num_;
     return ErrorCode::kDownloadOperationHashVerificationError;
@@ -1375,14 +1588,16 @@ void DeltaPerformer::DiscardBuffer(bool do_advance_offset,
                                    size_t signed_hash_buffer_size) {
   // Update the buffer offset.
   if (do_advance_offset)
-    buffer_offset_ += buffer_.size();
+    buffer_offset_ += BufferSize();
 
   // Hash the content.
-  payload_hash_calculator_.Update(buffer_.data(), buffer_.size());
-  signed_hash_calculator_.Update(buffer_.data(), signed_hash_buffer_size);
+  payload_hash_calculator_.Update(BufferData(), BufferSize());
+  signed_hash_calculator_.Update(BufferData(), signed_hash_buffer_size);
 
   // Swap content with an empty vector to ensure that all memory is released.
   brillo::Blob().swap(buffer_);
+  inplace_buffer_ = nullptr;
+  inplace_buffer_size_ = 0;
 }
 
 bool DeltaPerformer::CanResumeUpdate(PrefsInterface* prefs,
@@ -1469,6 +1684,12 @@ bool DeltaPerformer::ResetUpdateProgress(
     prefs->SetInt64(kPrefsManifestMetadataSize, -1);
     prefs->SetInt64(kPrefsManifestSignatureSize, -1);
     prefs->SetInt64(kPrefsResumedUpdateFailures, 0);
+    prefs->Delete(kPrefsUpdateStateCheckpointInterval);
+    prefs->Delete(kPrefsUpdateStateCheckpointDuration);
+    prefs->Delete(kPrefsUpdateStateSpillQueuePeakBytes);
+    prefs->Delete(kPrefsUpdateStateSpillQueueSpilledBytes);
+    prefs->Delete(kPrefsUpdateStateSpillQueueHighWaterWaits);
+    prefs->Delete(kPrefsUpdateStateSpillQueueEmptyWaits);
     prefs->Delete(kPrefsPostInstallSucceeded);
     prefs->Delete(kPrefsVerityWritten);
     if (!skip_dynamic_partititon_metadata_updated) {
@@ -1480,18 +1701,15 @@ bool DeltaPerformer::ResetUpdateProgress(
 }
 
 bool DeltaPerformer::ShouldCheckpoint() {
-  base::TimeTicks curr_time = base::TimeTicks::Now();
-  if (curr_time > update_checkpoint_time_) {
-    update_checkpoint_time_ = curr_time + update_checkpoint_wait_;
-    return true;
-  }
-  return false;
+  return checkpoint_scheduler_.ShouldCheckpoint(base::TimeTicks::Now(),
+                                                buffer_offset_);
 }
 
 bool DeltaPerformer::CheckpointUpdateProgress(bool force) {
   if (!force && !ShouldCheckpoint()) {
     return false;
   }
+  base::TimeTicks start_time = base::TimeTicks::Now();
   Terminator::set_exit_blocked(true);
   LOG_IF(WARNING, !prefs_->StartTransaction())
       << "unable to start transaction in checkpointing";
@@ -1531,16 +1749,37 @@ bool DeltaPerformer::CheckpointUpdateProgress(bool force) {
       const size_t partition_operation_num =
           next_operation_num_ -
           (partition_index ? acc_num_operations_[partition_index - 1] : 0);
-      const InstallOperation& op =
-          partitions_[partition_index].operations(partition_operation_num);
+      uint64_t next_data_length;
+      if (operation_index_ &&
+          partition_index < operation_index_->partitions_size()) {
+        next_data_length = operation_index_->partition(partition_index)
+                               .operations[partition_operation_num]
+                               .data_length;
+      } else if (partition_index == current_partition_ &&
+                 current_partition_update_) {
+        next_data_length =
+            current_partition_update_->operations(partition_operation_num)
+                .data_length();
+      } else if (partition_index < operations_loader_.partitions_size()) {
+        // The next operation is the first one of a partition not opened yet.
+        InstallOperation op;
+        TEST_AND_RETURN_FALSE(operations_loader_.LoadOperation(
+            partition_index, partition_operation_num, &op));
+        next_data_length = op.data_length();
+      } else {
+        next_data_length = partitions_[partition_index]
+                               .operations(partition_operation_num)
+                               .data_length();
+      }
       TEST_AND_RETURN_FALSE(
-          prefs_->SetInt64(kPrefsUpdateStateNextDataLength, op.data_length()));
+          prefs_->SetInt64(kPrefsUpdateStateNextDataLength, next_data_length));
     } else {
       TEST_AND_RETURN_FALSE(
           prefs_->SetInt64(kPrefsUpdateStateNextDataLength, 0));
     }
     if (partition_writer_) {
-      partition_writer_->CheckpointUpdateProgress(GetPartitionOperationNum());
+      TEST_AND_RETURN_FALSE(partition_writer_->CheckpointUpdateProgress(
+          GetPartitionOperationNum()));
     } else {
       CHECK_EQ(next_operation_num_, num_total_operations_)
           << "Partition writer is null, we are expected to finish all "
@@ -1550,9 +1789,17 @@ bool DeltaPerformer::CheckpointUpdateProgress(bool force) {
   }
   TEST_AND_RETURN_FALSE(
       prefs_->SetInt64(kPrefsUpdateStateNextOperation, next_operation_num_));
+  // Recorded for the update metrics. The duration covers the checkpoints
+  // before this one, whose own cost isn't known until it's submitted.
+  prefs_->SetInt64(kPrefsUpdateStateCheckpointInterval,
+                   checkpoint_scheduler_.interval().InMilliseconds());
+  prefs_->SetInt64(kPrefsUpdateStateCheckpointDuration,
+                   checkpoint_scheduler_.total_duration().InMilliseconds());
   if (!prefs_->SubmitTransaction()) {
     LOG(ERROR) << "Failed to submit transaction in checkpointing";
   }
+  base::TimeTicks now = base::TimeTicks::Now();
+  checkpoint_scheduler_.CheckpointSaved(now, now - start_time, buffer_offset_);
   return true;
 }
 
@@ -1606,6 +1853,13 @@ bool DeltaPerformer::PrimeUpdateState() {
   // re-downloaded.
   total_bytes_received_ += buffer_offset_;
 
+  int64_t checkpoint_duration_ms = 0;
+  if (prefs_->GetInt64(kPrefsUpdateStateCheckpointDuration,
+                       &checkpoint_duration_ms)) {
+    checkpoint_scheduler_.set_previous_duration(
+        base::TimeDelta::FromMilliseconds(checkpoint_duration_ms));
+  }
+
   // Speculatively count the resume as a failure.
   int64_t resumed_update_failures{};
   if (prefs_->GetInt64(kPrefsResumedUpdateFailures, &resumed_update_failures)) {
@@ -1630,13 +1884,19 @@ std::unique_ptr<PartitionWriterInterface> DeltaPerformer::CreatePartitionWriter(
     size_t block_size,
     bool is_interactive,
     bool is_dynamic_partition) {
+  std::optional<OperationIndex::Partition> operation_index;
+  if (operation_index_ &&
+      current_partition_ < operation_index_->partitions_size()) {
+    operation_index = operation_index_->partition(current_partition_);
+  }
   return partition_writer::CreatePartitionWriter(
       partition_update,
       install_part,
       dynamic_control,
       block_size_,
       interactive_,
-      IsDynamicPartition(install_part.name, install_plan_->target_slot));
+      IsDynamicPartition(install_part.name, install_plan_->target_slot),
+      operation_index ? &operation_index.value() : nullptr);
 }
 
 }  // namespace chromeos_update_engine
@@ -27,16 +27,23 @@
 
 #include <base/time/time.h>
 #include <brillo/secure_blob.h>
+#include <google/protobuf/arena.h>
 #include <google/protobuf/repeated_field.h>
 #include <gtest/gtest_prod.h>  // for FRIEND_TEST
 
 #include "update_engine/common/hash_calculator.h"
 #include "update_engine/common/platform_constants.h"
+#include "update_engine/payload_consumer/checkpoint_scheduler.h"
 #include "update_engine/payload_consumer/file_writer.h"
 #include "update_engine/payload_consumer/install_plan.h"
+#include "update_engine/payload_consumer/main_thread_lease.h"
+#include "update_engine/payload_consumer/operation_index.h"
+#include "update_engine/payload_consumer/operation_stats.h"
+#include "update_engine/payload_consumer/partition_operations_loader.h"
 #include "update_engine/payload_consumer/partition_writer_interface.h"
 #include "update_engine/payload_consumer/payload_metadata.h"
 #include "update_engine/payload_consumer/payload_verifier.h"
+#include "update_engine/payload_consumer/source_prefetcher.h"
 #include "update_engine/update_metadata.pb.h"
 
 namespace chromeos_update_engine {
@@ -62,7 +69,6 @@ class DeltaPerformer : public FileWriter {
   // operations. They must add up to one hundred (100).
   static const unsigned kProgressDownloadWeight;
   static const unsigned kProgressOperationsWeight;
-  static const uint64_t kCheckpointFrequencySeconds;
 
   DeltaPerformer(
       PrefsInterface* prefs,
@@ -80,7 +86,8 @@ class DeltaPerformer : public FileWriter {
         install_plan_(install_plan),
         payload_(payload),
         update_certificates_path_(std::move(update_certificates_path)),
-        interactive_(interactive) {
+        interactive_(interactive),
+        checkpoint_scheduler_(hardware) {
     CHECK(install_plan_);
   }
 
@@ -104,6 +111,18 @@ class DeltaPerformer : public FileWriter {
   // work. Returns whether the required file descriptors were successfully open.
   bool OpenCurrentPartition();
 
+  // Drops the source prefetch requests not issued yet, e.g. when the update is
+  // suspended. May be called from any thread.
+  void CancelPrefetch() { source_prefetcher_.Cancel(); }
+
+  // Lets Write() run on another thread than the one owning the prefs, the
+  // boot control, the hardware and the download delegate. Write() holds
+  // |lease| except while it processes an operation, which only writes to the
+  // partitions.
+  void set_main_thread_lease(MainThreadLease* lease) {
+    main_thread_lease_ = lease;
+  }
+
   // Closes the current partition file descriptors if open. Returns 0 on success
   // or -errno on error.
   int CloseCurrentPartition();
@@ -192,6 +211,9 @@ class DeltaPerformer : public FileWriter {
       uint64_t* required_size,
       ErrorCode* error = nullptr);
 
+  // The time spent applying each type of operation so far.
+  const OperationStats& operation_stats() const { return operation_stats_; }
+
  protected:
   // Exposed as virtual for testing purposes.
   virtual std::unique_ptr<PartitionWriterInterface> CreatePartitionWriter(
@@ -202,8 +224,8 @@ class DeltaPerformer : public FileWriter {
       bool is_interactive,
       bool is_dynamic_partition);
 
-  // return true if it has been long enough and a checkpoint should be saved.
-  // Exposed for unittest purposes.
+  // return true if it has been long enough, or enough data was applied, that a
+  // checkpoint should be saved. Exposed for unittest purposes.
   virtual bool ShouldCheckpoint();
 
  private:
@@ -224,12 +246,53 @@ class DeltaPerformer : public FileWriter {
   // manifest to be parsed and valid.
   bool ParseManifestPartitions(ErrorCode* error = nullptr);
 
+  // Returns the number of operations of partition |index| in |partitions_|.
+  size_t GetPartitionOperationsSize(size_t index) const;
+
+  // Adds the operations and merge operations of partition |index| of the
+  // manifest to |partition|, which already holds the rest of it. Partitions not
+  // found in the payload keep their operations in |partitions_|.
+  bool LoadPartitionOperations(size_t index, PartitionUpdate* partition);
+
+  // Stores in |path| where the operation index of the payload is kept. Returns
+  // false if the device has no non-volatile directory to keep it in.
+  bool GetOperationIndexPath(std::string* path) const;
+
+  // Maps the operation index written for this payload when its partitions were
+  // prepared, if any, into |operation_index_|.
+  void LoadOperationIndex();
+
+  // Writes the operation index of |partitions|, which include their
+  // operations, and maps it. Failing to do so only makes resuming slower.
+  void WriteOperationIndex(
+      const google::protobuf::RepeatedPtrField<PartitionUpdate>& partitions);
+
+  // Unmaps and removes the operation index once all operations are applied.
+  void DeleteOperationIndex();
+
+  // Writes the stats of the operations applied so far to the non-volatile
+  // directory, replacing those of the previous attempt.
+  void WriteOperationStats();
+
   // Appends up to |*count_p| bytes from |*bytes_p| to |buffer_|, but only to
   // the extent that the size of |buffer_| does not exceed |max|. Advances
   // |*cbytes_p| and decreases |*count_p| by the actual number of bytes copied,
   // and returns this number.
   size_t CopyDataToBuffer(const char** bytes_p, size_t* count_p, size_t max);
 
+  // If |buffer_| is empty and |*count_p| covers the whole data blob of
+  // |operation|, points the buffer at the blob in |*bytes_p| instead of copying
+  // it, and advances |*bytes_p| and |*count_p| past it. The blob must be
+  // consumed before returning from Write(). Returns whether it did so.
+  bool UseDataInPlace(const InstallOperation& operation,
+                      const char** bytes_p,
+                      size_t* count_p);
+
+  // The data of the buffer, either |buffer_| or the blob set by
+  // UseDataInPlace().
+  const uint8_t* BufferData() const;
+  size_t BufferSize() const;
+
   // If |op_result| is false, emits an error message using |op_type_name| and
   // sets |*error| accordingly. Otherwise does nothing. Returns |op_result|.
   bool HandleOpResult(bool op_result,
@@ -336,6 +399,9 @@ class DeltaPerformer : public FileWriter {
   // nullptr if not used.
   DownloadActionDelegate* download_delegate_;
 
+  // Set while Write() runs on another thread, see set_main_thread_lease().
+  MainThreadLease* main_thread_lease_{nullptr};
+
   // Install Plan based on Omaha Response.
   InstallPlan* install_plan_;
 
@@ -345,8 +411,10 @@ class DeltaPerformer : public FileWriter {
   PayloadMetadata payload_metadata_;
 
   // Parsed manifest. Set after enough bytes to parse the manifest were
-  // downloaded.
+  // downloaded. Its partitions don't include their operations, those are only
+  // parsed from |operations_loader_| when needed.
   DeltaArchiveManifest manifest_;
+  PartitionOperationsLoader operations_loader_;
   bool manifest_parsed_{false};
   bool manifest_valid_{false};
   uint64_t metadata_size_{0};
@@ -364,13 +432,31 @@ class DeltaPerformer : public FileWriter {
 
   // The list of partitions to update as found in the manifest major
   // version 2. When parsing an older manifest format, the information is
-  // converted over to this format instead.
+  // converted over to this format instead. Like in |manifest_|, partitions
+  // from the payload don't include their operations.
   std::vector<PartitionUpdate> partitions_;
 
   // Index in the list of partitions (|partitions_| member) of the current
   // partition being processed.
   size_t current_partition_{0};
 
+  // The current partition including its operations, allocated on
+  // |partition_arena_| while its partition writer is open.
+  std::unique_ptr<google::protobuf::Arena> partition_arena_;
+  PartitionUpdate* current_partition_update_{nullptr};
+
+  // Index of the operations of every partition, used instead of parsing them
+  // all again when resuming. Must outlive |partition_writer_|.
+  std::unique_ptr<OperationIndex> operation_index_;
+
+  // Prefetches the source extents of the next operations of the current
+  // partition.
+  SourcePrefetcher source_prefetcher_;
+
+  // Where the time spent applying the operations goes. Must outlive
+  // |partition_writer_|.
+  OperationStats operation_stats_;
+
   // Index of the next operation to perform in the manifest. The index is
   // linear on the total number of operation on the manifest.
   size_t next_operation_num_{0};
@@ -379,6 +465,10 @@ class DeltaPerformer : public FileWriter {
   // payload metadata; once that's downloaded and parsed, it stores data for
   // the next update operation.
   brillo::Blob buffer_;
+  // Set instead of |buffer_| by UseDataInPlace(), only while the bytes passed
+  // to Write() are still valid.
+  const uint8_t* inplace_buffer_{nullptr};
+  size_t inplace_buffer_size_{0};
   // Offset of buffer_ in the binary blobs section of the update.
   uint64_t buffer_offset_{0};
 
@@ -426,11 +516,8 @@ class DeltaPerformer : public FileWriter {
       base::TimeDelta::FromSeconds(kProgressLogTimeoutSeconds)};
   base::TimeTicks forced_progress_log_time_;
 
-  // The frequency that we should write an update checkpoint (constant), and
-  // the point in time at which the next checkpoint should be written.
-  const base::TimeDelta update_checkpoint_wait_{
-      base::TimeDelta::FromSeconds(kCheckpointFrequencySeconds)};
-  base::TimeTicks update_checkpoint_time_;
+  // Decides when the next update checkpoint should be written.
+  CheckpointScheduler checkpoint_scheduler_;
 
   std::unique_ptr<PartitionWriterInterface> partition_writer_;
 
@@ -1175,7 +1175,10 @@ TEST_F(DeltaPerformerTest, SetNextOpIndex) {
   std::vector<size_t> indices;
   EXPECT_CALL(writer1, CheckpointUpdateProgress(_))
       .WillRepeatedly(
-          [&indices](size_t index) mutable { indices.emplace_back(index); });
+          [&indices](size_t index) mutable {
+            indices.emplace_back(index);
+            return true;
+          });
   EXPECT_CALL(writer1, Init(_, true, _)).Times(1).WillOnce(Return(true));
   EXPECT_CALL(writer1, PerformSourceCopyOperation(_, _))
       .Times(2)
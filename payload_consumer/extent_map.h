@@ -18,6 +18,7 @@
 #define UPDATE_ENGINE_PAYLOAD_CONSUMER_EXTENT_MAP_H_
 
 #include <map>
+#include <optional>
 #include <utility>
 #include <vector>
 
@@ -46,6 +47,22 @@ class ExtentMap {
     return inserted;
   }
 
+  // Like AddExtent(), but |extent| must start after all extents in the map.
+  // Takes constant time. Returns false if |extent| wasn't added.
+  bool AppendExtent(const Extent& extent, T&& value) {
+    if (!map_.empty()) {
+      const Extent& last = map_.rbegin()->first;
+      if (extent.start_block() < last.start_block() + last.num_blocks()) {
+        return false;
+      }
+    }
+    if (!set_.AppendExtent(extent)) {
+      return false;
+    }
+    map_.emplace_hint(map_.end(), extent, std::forward<T>(value));
+    return true;
+  }
+
   size_t size() const { return map_.size(); }
 
   // Return a pointer to entry which is intersecting |extent|. If T is already
@@ -158,4 +158,14 @@ TEST_F(ExtentMapTest, GetTouchingExtents) {
   ASSERT_EQ(extents[1], ExtentForRange(10, 5));
 }
 
+TEST_F(ExtentMapTest, AppendExtentTest) {
+  ASSERT_TRUE(map_.AppendExtent(ExtentForRange(5, 5), 7));
+  ASSERT_TRUE(map_.AppendExtent(ExtentForRange(10, 5), 12));
+  ASSERT_FALSE(map_.AppendExtent(ExtentForRange(12, 5), 13));
+  ASSERT_FALSE(map_.AppendExtent(ExtentForRange(0, 5), 13));
+  ASSERT_EQ(map_.size(), 2UL);
+  ASSERT_EQ(map_.Get(ExtentForRange(11, 2)), 12);
+  ASSERT_FALSE(map_.AddExtent(ExtentForRange(9, 2), 13));
+}
+
 }  // namespace chromeos_update_engine
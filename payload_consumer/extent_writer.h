@@ -42,6 +42,17 @@ class ExtentWriter {
 
   // Returns true on success.
   virtual bool Write(const void* bytes, size_t count) = 0;
+
+  // Returns a buffer owned by this writer which the caller can fill in place,
+  // instead of passing its own buffer to Write(), and sets |size| to the
+  // number of bytes available in it. Returns nullptr if this writer has no such
+  // buffer, in which case Write() must be used. The buffer is only valid until
+  // the next call to this writer.
+  virtual uint8_t* GetWritableBuffer(size_t* size) { return nullptr; }
+
+  // Writes the first |count| bytes of the buffer returned by the last call to
+  // GetWritableBuffer(). Returns true on success.
+  virtual bool CommitBuffer(size_t count) { return count == 0; }
 };
 
 // DirectExtentWriter is probably the simplest ExtentWriter implementation.
@@ -21,6 +21,7 @@
 
 #include <brillo/secure_blob.h>
 
+#include "update_engine/payload_consumer/block_extent_writer.h"
 #include "update_engine/payload_consumer/extent_writer.h"
 
 namespace chromeos_update_engine {
@@ -58,6 +59,37 @@ class FakeExtentWriter : public ExtentWriter {
   DISALLOW_COPY_AND_ASSIGN(FakeExtentWriter);
 };
 
+// FakeBlockExtentWriter keeps track of all the data passed to WriteExtent().
+// If |offer_buffer| is false, it behaves like a writer without a writable
+// buffer, so that callers have to go through Write().
+class FakeBlockExtentWriter : public BlockExtentWriter {
+ public:
+  explicit FakeBlockExtentWriter(bool offer_buffer = true)
+      : offer_buffer_(offer_buffer) {}
+  ~FakeBlockExtentWriter() override = default;
+
+  bool WriteExtent(const void* bytes,
+                   const Extent& extent,
+                   size_t block_size) override {
+    const auto data = static_cast<const uint8_t*>(bytes);
+    written_data_.insert(
+        written_data_.end(), data, data + extent.num_blocks() * block_size);
+    return true;
+  }
+  uint8_t* GetWritableBuffer(size_t* size) override {
+    return offer_buffer_ ? BlockExtentWriter::GetWritableBuffer(size)
+                         : nullptr;
+  }
+
+  const brillo::Blob& WrittenData() const { return written_data_; }
+
+ private:
+  const bool offer_buffer_;
+  brillo::Blob written_data_;
+
+  DISALLOW_COPY_AND_ASSIGN(FakeBlockExtentWriter);
+};
+
 }  // namespace chromeos_update_engine
 
 #endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_FAKE_EXTENT_WRITER_H_
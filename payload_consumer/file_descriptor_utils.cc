@@ -16,14 +16,21 @@
 
 #include "update_engine/payload_consumer/file_descriptor_utils.h"
 
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
 #include <algorithm>
+#include <vector>
 
 #include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
 
 #include "update_engine/common/hash_calculator.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/extent_reader.h"
 #include "update_engine/payload_consumer/extent_writer.h"
+#include "update_engine/payload_consumer/payload_constants.h"
 
 using google::protobuf::RepeatedPtrField;
 using std::min;
@@ -35,6 +42,69 @@ namespace {
 // Size of the buffer used to copy blocks.
 const uint64_t kMaxCopyBufferSize = 1024 * 1024;
 
+// Largest chunk handed to a single copy_file_range()/sendfile() call. The
+// kernel caps both at MAX_RW_COUNT anyway.
+const uint64_t kMaxKernelCopyChunk = 1024 * 1024 * 1024;
+
+// copy_file_range() is only declared by recent libc versions, so issue the raw
+// syscall instead.
+ssize_t CopyFileRange(
+    int fd_in, off64_t* off_in, int fd_out, off64_t* off_out, size_t len) {
+#ifdef __NR_copy_file_range
+  return syscall(__NR_copy_file_range, fd_in, off_in, fd_out, off_out, len, 0);
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+// Copies |length| bytes with copy_file_range(). The positions of both fds are
+// left untouched. Returns the number of bytes copied before an error.
+uint64_t CopyWithCopyFileRange(int src_fd,
+                               off64_t src_offset,
+                               int dst_fd,
+                               off64_t dst_offset,
+                               uint64_t length) {
+  uint64_t copied = 0;
+  while (copied < length) {
+    ssize_t rc = HANDLE_EINTR(
+        CopyFileRange(src_fd,
+                      &src_offset,
+                      dst_fd,
+                      &dst_offset,
+                      std::min(length - copied, kMaxKernelCopyChunk)));
+    if (rc <= 0)
+      break;
+    copied += rc;
+  }
+  return copied;
+}
+
+// Copies |length| bytes with sendfile(), which unlike copy_file_range() also
+// accepts block devices. sendfile() writes at the current position of
+// |dst_fd|, which is restored afterwards.
+bool CopyWithSendfile(int src_fd,
+                      off64_t src_offset,
+                      int dst_fd,
+                      off64_t dst_offset,
+                      uint64_t length) {
+  off64_t saved_position = lseek64(dst_fd, 0, SEEK_CUR);
+  if (saved_position < 0 || lseek64(dst_fd, dst_offset, SEEK_SET) < 0)
+    return false;
+  uint64_t copied = 0;
+  while (copied < length) {
+    ssize_t rc = HANDLE_EINTR(
+        sendfile64(dst_fd,
+                   src_fd,
+                   &src_offset,
+                   std::min(length - copied, kMaxKernelCopyChunk)));
+    if (rc <= 0)
+      break;
+    copied += rc;
+  }
+  return lseek64(dst_fd, saved_position, SEEK_SET) >= 0 && copied == length;
+}
+
 }  // namespace
 namespace fd_utils {
 
@@ -81,6 +151,14 @@ bool CopyAndHashExtents(FileDescriptorPtr source,
                         const RepeatedPtrField<Extent>& tgt_extents,
                         uint64_t block_size,
                         brillo::Blob* hash_out) {
+  std::vector<CopyRange> ranges;
+  if (hash_out == nullptr &&
+      ComputeCopyRanges(src_extents, tgt_extents, block_size, &ranges) &&
+      std::all_of(ranges.begin(), ranges.end(), [&](const CopyRange& range) {
+        return CopyRangeInKernel(source, target, range);
+      })) {
+    return true;
+  }
   DirectExtentWriter writer{target};
   TEST_AND_RETURN_FALSE(writer.Init(tgt_extents, block_size));
   TEST_AND_RETURN_FALSE(utils::BlocksInExtents(src_extents) ==
@@ -97,6 +175,73 @@ bool ReadAndHashExtents(FileDescriptorPtr source,
   return CommonHashExtents(source, extents, nullptr, block_size, hash_out);
 }
 
+bool ComputeCopyRanges(const RepeatedPtrField<Extent>& src_extents,
+                       const RepeatedPtrField<Extent>& tgt_extents,
+                       uint64_t block_size,
+                       std::vector<CopyRange>* ranges) {
+  ranges->clear();
+  auto src_it = src_extents.begin();
+  auto tgt_it = tgt_extents.begin();
+  // Blocks of |*src_it| and |*tgt_it| already assigned to a range.
+  uint64_t src_used = 0;
+  uint64_t tgt_used = 0;
+  while (src_it != src_extents.end() && tgt_it != tgt_extents.end()) {
+    if (src_it->start_block() == kSparseHole ||
+        tgt_it->start_block() == kSparseHole) {
+      return false;
+    }
+    const uint64_t num_blocks = std::min(src_it->num_blocks() - src_used,
+                                         tgt_it->num_blocks() - tgt_used);
+    const CopyRange range{(src_it->start_block() + src_used) * block_size,
+                          (tgt_it->start_block() + tgt_used) * block_size,
+                          num_blocks * block_size};
+    if (!ranges->empty() &&
+        ranges->back().src_offset + ranges->back().length ==
+            range.src_offset &&
+        ranges->back().dst_offset + ranges->back().length ==
+            range.dst_offset) {
+      ranges->back().length += range.length;
+    } else if (range.length > 0) {
+      ranges->push_back(range);
+    }
+    src_used += num_blocks;
+    tgt_used += num_blocks;
+    if (src_used == src_it->num_blocks()) {
+      src_it++;
+      src_used = 0;
+    }
+    if (tgt_used == tgt_it->num_blocks()) {
+      tgt_it++;
+      tgt_used = 0;
+    }
+  }
+  return src_it == src_extents.end() && tgt_it == tgt_extents.end();
+}
+
+bool CopyRangeInKernel(FileDescriptorPtr source,
+                       FileDescriptorPtr target,
+                       const CopyRange& range) {
+  const int src_fd = source->Fd();
+  if (src_fd < 0)
+    return false;
+  // Fetch the target fd last, a cached descriptor flushes its pending writes
+  // before exposing the raw fd.
+  const int dst_fd = target->Fd();
+  if (dst_fd < 0)
+    return false;
+  const uint64_t copied = CopyWithCopyFileRange(
+      src_fd, range.src_offset, dst_fd, range.dst_offset, range.length);
+  if (copied == range.length)
+    return true;
+  // copy_file_range() refuses block devices and copies across filesystems on
+  // older kernels, retry the remainder with sendfile().
+  return CopyWithSendfile(src_fd,
+                          range.src_offset + copied,
+                          dst_fd,
+                          range.dst_offset + copied,
+                          range.length - copied);
+}
+
 }  // namespace fd_utils
 
 }  // namespace chromeos_update_engine
@@ -17,6 +17,8 @@
 #ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_FILE_DESCRIPTOR_UTILS_H_
 #define UPDATE_ENGINE_PAYLOAD_CONSUMER_FILE_DESCRIPTOR_UTILS_H_
 
+#include <vector>
+
 #include <brillo/secure_blob.h>
 
 #include "update_engine/payload_consumer/extent_writer.h"
@@ -26,6 +28,14 @@
 namespace chromeos_update_engine {
 namespace fd_utils {
 
+// A byte range which is contiguous both in the source and in the target file
+// of a copy.
+struct CopyRange {
+  uint64_t src_offset;
+  uint64_t dst_offset;
+  uint64_t length;
+};
+
 bool CommonHashExtents(
     FileDescriptorPtr source,
     const google::protobuf::RepeatedPtrField<Extent>& src_extents,
@@ -39,7 +49,8 @@ bool CommonHashExtents(
 // must have the same length in number of blocks. Stores the hash of the
 // copied blocks in Blob pointed by |hash_out| if not null. The block size
 // is passed as |block_size|. In case of error reading or writing, returns
-// false and the value pointed by |hash_out| is undefined.
+// false and the value pointed by |hash_out| is undefined. When no hash is
+// requested the copy is done in kernel if both descriptors allow it.
 // The |source| and |target| files must be different, or otherwise |src_extents|
 // and |tgt_extents| must not overlap.
 bool CopyAndHashExtents(
@@ -60,6 +71,25 @@ bool ReadAndHashExtents(
     uint64_t block_size,
     brillo::Blob* hash_out);
 
+// Pairs up |src_extents| and |tgt_extents| into the list of byte ranges which
+// are contiguous on both sides, merging adjacent ranges together. Returns
+// false if the extents don't cover the same number of blocks or contain
+// sparse holes.
+bool ComputeCopyRanges(
+    const google::protobuf::RepeatedPtrField<Extent>& src_extents,
+    const google::protobuf::RepeatedPtrField<Extent>& tgt_extents,
+    uint64_t block_size,
+    std::vector<CopyRange>* ranges);
+
+// Copies |range| from |source| to |target| without moving the data through
+// user space, using copy_file_range(2) or, for block devices, sendfile(2).
+// Returns false if either descriptor doesn't expose a raw fd or the kernel
+// refuses the copy. On failure |target| may be partially written, callers are
+// expected to redo the copy through a buffered path.
+bool CopyRangeInKernel(FileDescriptorPtr source,
+                       FileDescriptorPtr target,
+                       const CopyRange& range);
+
 }  // namespace fd_utils
 }  // namespace chromeos_update_engine
 
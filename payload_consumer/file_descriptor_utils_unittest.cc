@@ -193,4 +193,48 @@ TEST_F(FileDescriptorUtilsTest, ReadAndHashExtentsTest) {
   EXPECT_EQ(expected_hash, hash_out);
 }
 
+// Ranges contiguous on both sides are merged, everything else is split at the
+// extent boundaries of either list.
+TEST_F(FileDescriptorUtilsTest, ComputeCopyRangesTest) {
+  auto src_extents = CreateExtentList({{1, 2}, {3, 1}, {10, 2}});
+  auto tgt_extents = CreateExtentList({{5, 4}, {20, 1}});
+  std::vector<fd_utils::CopyRange> ranges;
+  ASSERT_TRUE(
+      fd_utils::ComputeCopyRanges(src_extents, tgt_extents, 4, &ranges));
+  ASSERT_EQ(3U, ranges.size());
+  EXPECT_EQ(4U, ranges[0].src_offset);
+  EXPECT_EQ(20U, ranges[0].dst_offset);
+  EXPECT_EQ(12U, ranges[0].length);
+  EXPECT_EQ(40U, ranges[1].src_offset);
+  EXPECT_EQ(32U, ranges[1].dst_offset);
+  EXPECT_EQ(4U, ranges[1].length);
+  EXPECT_EQ(44U, ranges[2].src_offset);
+  EXPECT_EQ(80U, ranges[2].dst_offset);
+  EXPECT_EQ(4U, ranges[2].length);
+}
+
+TEST_F(FileDescriptorUtilsTest, ComputeCopyRangesMismatchBlocksTest) {
+  auto src_extents = CreateExtentList({{1, 4}});
+  auto tgt_extents = CreateExtentList({{0, 5}});
+  std::vector<fd_utils::CopyRange> ranges;
+  EXPECT_FALSE(
+      fd_utils::ComputeCopyRanges(src_extents, tgt_extents, 4, &ranges));
+}
+
+// The fake source doesn't expose a raw fd, so no in-kernel copy is possible.
+TEST_F(FileDescriptorUtilsTest, CopyRangeInKernelFakeSourceTest) {
+  EXPECT_FALSE(fd_utils::CopyRangeInKernel(source_, target_, {0, 0, 8}));
+}
+
+TEST_F(FileDescriptorUtilsTest, CopyRangeInKernelTest) {
+  ScopedTempFile src_file{"fd_src.XXXXXX"};
+  ASSERT_TRUE(utils::WriteFile(src_file.path().c_str(), "0123456789", 10));
+  FileDescriptorPtr source{new EintrSafeFileDescriptor()};
+  ASSERT_TRUE(source->Open(src_file.path().c_str(), O_RDONLY));
+
+  EXPECT_TRUE(fd_utils::CopyRangeInKernel(source, target_, {2, 4, 4}));
+  // Gaps in the target are filled with zeros.
+  ExpectTarget(std::string(4, '\0') + "2345");
+}
+
 }  // namespace chromeos_update_engine
@@ -205,6 +205,18 @@ struct InstallPlan {
 
   // Whether to enable multi-threaded compression on COW writes
   std::optional<bool> enable_threading;
+
+  // Whether to apply the payload on a separate thread, buffering the
+  // downloaded data in memory and a spill file meanwhile.
+  bool spill_download = false;
+
+  // Number of operations ahead of the one being applied whose source extents
+  // are prefetched into the page cache. 0 disables prefetching.
+  uint32_t source_prefetch_ops = 8;
+
+  // Whether the stages of every install operation are marked in the system
+  // trace.
+  bool trace_operations = false;
 };
 
 class InstallPlanAction;
@@ -0,0 +1,94 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/main_thread_lease.h"
+
+#include <utility>
+
+#include <base/bind.h>
+#include <base/location.h>
+
+namespace chromeos_update_engine {
+
+MainThreadLease::MainThreadLease(
+    scoped_refptr<base::SingleThreadTaskRunner> task_runner)
+    : task_runner_(std::move(task_runner)) {
+  weak_this_ = weak_ptr_factory_.GetWeakPtr();
+}
+
+bool MainThreadLease::Acquire() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  waiting_ = true;
+  while (!aborted_ && (!parked_ || suspended_)) {
+    if (!parked_ && !suspended_ && !park_posted_) {
+      park_posted_ = true;
+      task_runner_->PostTask(
+          FROM_HERE,
+          base::BindOnce(&MainThreadLease::ParkForWorker, weak_this_));
+    }
+    cv_.wait(lock);
+  }
+  waiting_ = false;
+  if (aborted_)
+    return false;
+  held_ = true;
+  return true;
+}
+
+void MainThreadLease::Release() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  held_ = false;
+  cv_.notify_all();
+}
+
+void MainThreadLease::Park() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  parked_ = true;
+  cv_.notify_all();
+}
+
+void MainThreadLease::Unpark() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  cv_.wait(lock, [this] { return !held_; });
+  parked_ = false;
+}
+
+void MainThreadLease::SetSuspended(bool suspended) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  suspended_ = suspended;
+  cv_.notify_all();
+}
+
+void MainThreadLease::Abort() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  aborted_ = true;
+  cv_.notify_all();
+}
+
+void MainThreadLease::ParkForWorker() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  park_posted_ = false;
+  if (!waiting_ || suspended_ || aborted_)
+    return;
+  parked_ = true;
+  cv_.notify_all();
+  // The worker may take the lease again right after releasing it if the main
+  // thread didn't wake up in between, that's still the same request.
+  cv_.wait(lock, [this] { return !held_ && !waiting_; });
+  parked_ = false;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,113 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_MAIN_THREAD_LEASE_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_MAIN_THREAD_LEASE_H_
+
+#include <condition_variable>
+#include <mutex>
+
+#include <base/macros.h>
+#include <base/memory/weak_ptr.h>
+#include <base/single_thread_task_runner.h>
+
+namespace chromeos_update_engine {
+
+// Lets a worker thread use objects which belong to the main thread and aren't
+// thread-safe, like the prefs, the boot control and the hardware. The worker
+// may only use them while it holds the lease, which it only gets while the
+// main thread is parked: either in a task the worker posts to the main thread,
+// or between Park() and Unpark() calls of the main thread itself.
+//
+// Acquire() and Release() must be called from the worker, everything else from
+// the main thread.
+class MainThreadLease {
+ public:
+  explicit MainThreadLease(
+      scoped_refptr<base::SingleThreadTaskRunner> task_runner);
+  ~MainThreadLease() = default;
+
+  // Waits until the main thread is parked and the lease isn't suspended, then
+  // takes the lease. Returns false once the lease was aborted.
+  bool Acquire();
+
+  // Gives the lease back and lets the main thread continue.
+  void Release();
+
+  // Lets the worker take the lease until Unpark(), which waits for the worker
+  // to release it. Meant for when the main thread waits for the worker.
+  void Park();
+  void Unpark();
+
+  // While suspended, Acquire() waits and the main thread is never parked for
+  // the worker.
+  void SetSuspended(bool suspended);
+
+  // Makes Acquire() fail from now on.
+  void Abort();
+
+ private:
+  // Parks the main thread until the worker waiting in Acquire() took the lease
+  // and released it.
+  void ParkForWorker();
+
+  scoped_refptr<base::SingleThreadTaskRunner> task_runner_;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  // Protected by |mutex_|.
+  bool parked_{false};
+  bool held_{false};
+  bool waiting_{false};
+  bool park_posted_{false};
+  bool suspended_{false};
+  bool aborted_{false};
+
+  // Created on the main thread, for the tasks posted by the worker.
+  base::WeakPtr<MainThreadLease> weak_this_;
+  base::WeakPtrFactory<MainThreadLease> weak_ptr_factory_{this};
+
+  DISALLOW_COPY_AND_ASSIGN(MainThreadLease);
+};
+
+// Holds a MainThreadLease, if there is one, until it goes out of scope.
+class ScopedMainThreadLease {
+ public:
+  explicit ScopedMainThreadLease(MainThreadLease* lease) : lease_(lease) {}
+  ~ScopedMainThreadLease() { Release(); }
+
+  // Returns false if the lease was aborted. Always succeeds without a lease.
+  bool Acquire() {
+    held_ = lease_ == nullptr || lease_->Acquire();
+    return held_;
+  }
+
+  void Release() {
+    if (lease_ && held_)
+      lease_->Release();
+    held_ = false;
+  }
+
+ private:
+  MainThreadLease* lease_;
+  bool held_{false};
+
+  DISALLOW_COPY_AND_ASSIGN(ScopedMainThreadLease);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_MAIN_THREAD_LEASE_H_
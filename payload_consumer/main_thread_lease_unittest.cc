@@ -0,0 +1,149 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/main_thread_lease.h"
+
+#include <chrono>
+#include <future>
+#include <thread>
+
+#include <base/bind.h>
+#if BASE_VER < 780000  // Android
+#include <base/message_loop/message_loop.h>
+#else  // CrOS
+#include <base/task/single_thread_task_executor.h>
+#endif  // BASE_VER < 780000
+#include <base/threading/thread_task_runner_handle.h>
+#include <brillo/message_loops/base_message_loop.h>
+#include <brillo/message_loops/message_loop_utils.h>
+#include <gtest/gtest.h>
+
+namespace chromeos_update_engine {
+
+namespace {
+// How long the tests wait to check that something doesn't happen.
+constexpr std::chrono::milliseconds kShortWait{100};
+}  // namespace
+
+class MainThreadLeaseTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    loop_.SetAsCurrent();
+    lease_ = std::make_unique<MainThreadLease>(
+        base::ThreadTaskRunnerHandle::Get());
+  }
+
+  // Acquires the lease on a worker thread, the future is set to the result
+  // once Acquire() returned. The lease is released after |hold| is set.
+  std::future<bool> AcquireOnWorker(std::shared_future<void> hold) {
+    std::promise<bool> acquired;
+    std::future<bool> result = acquired.get_future();
+    worker_ = std::thread(
+        [this, hold](std::promise<bool> acquired) {
+          const bool success = lease_->Acquire();
+          acquired.set_value(success);
+          if (success) {
+            hold.wait();
+            lease_->Release();
+          }
+        },
+        std::move(acquired));
+    return result;
+  }
+
+  void RunUntilReady(const std::future<bool>& future) {
+    brillo::MessageLoopRunUntil(
+        &loop_,
+        base::TimeDelta::FromSeconds(10),
+        base::Bind(
+            [](const std::future<bool>* future) {
+              return future->wait_for(std::chrono::seconds(0)) ==
+                     std::future_status::ready;
+            },
+            base::Unretained(&future)));
+  }
+
+  void TearDown() override {
+    if (worker_.joinable())
+      worker_.join();
+  }
+
+#if BASE_VER < 780000  // Android
+  base::MessageLoopForIO base_loop_;
+  brillo::BaseMessageLoop loop_{&base_loop_};
+#else   // CrOS
+  base::SingleThreadTaskExecutor base_loop_{base::MessagePumpType::IO};
+  brillo::BaseMessageLoop loop_{base_loop_.task_runner()};
+#endif  // BASE_VER < 780000
+
+  std::unique_ptr<MainThreadLease> lease_;
+  std::thread worker_;
+};
+
+// The worker only gets the lease once the main thread runs the task it posted.
+TEST_F(MainThreadLeaseTest, AcquireWaitsForMainThreadTest) {
+  std::promise<void> hold;
+  hold.set_value();
+  std::future<bool> acquired = AcquireOnWorker(hold.get_future().share());
+  EXPECT_EQ(std::future_status::timeout, acquired.wait_for(kShortWait));
+
+  RunUntilReady(acquired);
+  EXPECT_TRUE(acquired.get());
+}
+
+TEST_F(MainThreadLeaseTest, ParkTest) {
+  std::promise<void> hold;
+  lease_->Park();
+  std::future<bool> acquired = AcquireOnWorker(hold.get_future().share());
+  EXPECT_TRUE(acquired.get());
+
+  // Unpark() waits for the worker to release the lease.
+  std::thread releaser([&hold] {
+    std::this_thread::sleep_for(kShortWait);
+    hold.set_value();
+  });
+  lease_->Unpark();
+  releaser.join();
+}
+
+TEST_F(MainThreadLeaseTest, SuspendedTest) {
+  std::promise<void> hold;
+  hold.set_value();
+  lease_->SetSuspended(true);
+  lease_->Park();
+  std::future<bool> acquired = AcquireOnWorker(hold.get_future().share());
+  EXPECT_EQ(std::future_status::timeout, acquired.wait_for(kShortWait));
+
+  lease_->SetSuspended(false);
+  EXPECT_TRUE(acquired.get());
+  lease_->Unpark();
+}
+
+TEST_F(MainThreadLeaseTest, AbortTest) {
+  std::promise<void> hold;
+  hold.set_value();
+  std::future<bool> acquired = AcquireOnWorker(hold.get_future().share());
+  EXPECT_EQ(std::future_status::timeout, acquired.wait_for(kShortWait));
+
+  lease_->Abort();
+  EXPECT_FALSE(acquired.get());
+  worker_.join();
+  // The task the worker posted must not park the main thread anymore.
+  lease_.reset();
+  brillo::MessageLoopRunMaxIterations(&loop_, 10);
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,269 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/operation_index.h"
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#include <base/files/file_path.h>
+#include <base/logging.h>
+
+#include "update_engine/common/utils.h"
+
+using google::protobuf::RepeatedPtrField;
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+constexpr uint32_t kIndexMagic = 0x58444955;  // "UIDX"
+constexpr uint32_t kIndexVersion = 1;
+
+struct Header {
+  uint32_t magic;
+  uint32_t version;
+  uint8_t key[32];
+  uint64_t partitions_size;
+  uint64_t operations_size;
+  uint64_t copy_extents_size;
+  uint64_t xor_entries_size;
+};
+
+struct PartitionEntry {
+  uint64_t first_operation;
+  uint64_t operations_size;
+  uint64_t first_copy_extent;
+  uint64_t copy_extents_size;
+  uint64_t first_xor_entry;
+  uint64_t xor_entries_size;
+  uint64_t merge_operations_size;
+};
+
+// Every table starts 8 byte aligned, so the mapped entries can be used as is.
+static_assert(sizeof(Header) % 8 == 0);
+static_assert(sizeof(PartitionEntry) % 8 == 0);
+static_assert(sizeof(OperationIndex::Operation) % 8 == 0);
+static_assert(sizeof(OperationIndex::IndexExtent) % 8 == 0);
+static_assert(sizeof(OperationIndex::XorEntry) % 8 == 0);
+
+template <typename T>
+void AppendTable(const vector<T>& table, string* out) {
+  out->append(reinterpret_cast<const char*>(table.data()),
+              table.size() * sizeof(T));
+}
+
+// Returns whether |first| + |size| entries fit in a table of |table_size|.
+bool InTable(uint64_t first, uint64_t size, uint64_t table_size) {
+  return first <= table_size && size <= table_size - first;
+}
+
+}  // namespace
+
+bool OperationIndex::Partition::GetCopyBlocks(
+    const RepeatedPtrField<CowMergeOperation>& merge_ops,
+    ExtentRanges* copy_blocks) const {
+  TEST_AND_RETURN_FALSE(static_cast<size_t>(merge_ops.size()) ==
+                        merge_operations_size);
+  for (size_t i = 0; i < copy_extents_size; i++) {
+    TEST_AND_RETURN_FALSE(copy_blocks->AppendExtent(ExtentForRange(
+        copy_extents[i].start_block, copy_extents[i].num_blocks)));
+  }
+  return true;
+}
+
+bool OperationIndex::Partition::GetXorMap(
+    const RepeatedPtrField<CowMergeOperation>& merge_ops,
+    ExtentMap<const CowMergeOperation*, ExtentLess>* xor_map) const {
+  TEST_AND_RETURN_FALSE(static_cast<size_t>(merge_ops.size()) ==
+                        merge_operations_size);
+  for (size_t i = 0; i < xor_entries_size; i++) {
+    const XorEntry& entry = xor_entries[i];
+    TEST_AND_RETURN_FALSE(entry.merge_op_index < merge_operations_size);
+    const CowMergeOperation& merge_op = merge_ops.Get(entry.merge_op_index);
+    const Extent dst_extent = ExtentForRange(entry.dst_extent.start_block,
+                                             entry.dst_extent.num_blocks);
+    TEST_AND_RETURN_FALSE(merge_op.type() == CowMergeOperation::COW_XOR &&
+                          merge_op.dst_extent() == dst_extent);
+    TEST_AND_RETURN_FALSE(xor_map->AppendExtent(dst_extent, &merge_op));
+  }
+  return true;
+}
+
+bool OperationIndex::Write(
+    const string& path,
+    const brillo::Blob& key,
+    const RepeatedPtrField<PartitionUpdate>& partitions) {
+  Header header{};
+  TEST_AND_RETURN_FALSE(key.size() == sizeof(header.key));
+  header.magic = kIndexMagic;
+  header.version = kIndexVersion;
+  memcpy(header.key, key.data(), key.size());
+
+  vector<PartitionEntry> entries;
+  vector<Operation> operations;
+  vector<IndexExtent> copy_extents;
+  vector<XorEntry> xor_entries;
+  for (const auto& partition : partitions) {
+    PartitionEntry entry{};
+    entry.first_operation = operations.size();
+    entry.operations_size = partition.operations_size();
+    for (const auto& operation : partition.operations()) {
+      operations.push_back({operation.data_offset(), operation.data_length()});
+    }
+
+    // Same as what VABCPartitionWriter computes from the merge operations: the
+    // union of all COW_COPY destinations, and every COW_XOR operation not
+    // overlapping an earlier one.
+    ExtentRanges copy_blocks;
+    ExtentRanges xor_blocks(false);
+    const size_t first_xor_entry = xor_entries.size();
+    for (int i = 0; i < partition.merge_operations_size(); i++) {
+      const auto& merge_op = partition.merge_operations(i);
+      const auto& dst_extent = merge_op.dst_extent();
+      if (merge_op.type() == CowMergeOperation::COW_COPY) {
+        copy_blocks.AddExtent(dst_extent);
+      } else if (merge_op.type() == CowMergeOperation::COW_XOR &&
+                 dst_extent.num_blocks() > 0 &&
+                 !xor_blocks.OverlapsWithExtent(dst_extent)) {
+        xor_blocks.AddExtent(dst_extent);
+        xor_entries.push_back(
+            {{dst_extent.start_block(), dst_extent.num_blocks()},
+             static_cast<uint64_t>(i)});
+      }
+    }
+    entry.first_copy_extent = copy_extents.size();
+    entry.copy_extents_size = copy_blocks.extent_set().size();
+    for (const auto& extent : copy_blocks.extent_set()) {
+      copy_extents.push_back({extent.start_block(), extent.num_blocks()});
+    }
+    std::sort(xor_entries.begin() + first_xor_entry,
+              xor_entries.end(),
+              [](const XorEntry& a, const XorEntry& b) {
+                return a.dst_extent.start_block < b.dst_extent.start_block;
+              });
+    entry.first_xor_entry = first_xor_entry;
+    entry.xor_entries_size = xor_entries.size() - first_xor_entry;
+    entry.merge_operations_size = partition.merge_operations_size();
+    entries.push_back(entry);
+  }
+  header.partitions_size = entries.size();
+  header.operations_size = operations.size();
+  header.copy_extents_size = copy_extents.size();
+  header.xor_entries_size = xor_entries.size();
+
+  string content(reinterpret_cast<const char*>(&header), sizeof(header));
+  AppendTable(entries, &content);
+  AppendTable(operations, &content);
+  AppendTable(copy_extents, &content);
+  AppendTable(xor_entries, &content);
+  TEST_AND_RETURN_FALSE(utils::WriteStringToFileAtomic(path, content));
+  LOG(INFO) << "Wrote operation index of " << operations.size()
+            << " operations to " << path << ", " << content.size() << " bytes";
+  return true;
+}
+
+std::unique_ptr<OperationIndex> OperationIndex::Load(const string& path,
+                                                     const brillo::Blob& key) {
+  if (!utils::FileExists(path.c_str()))
+    return nullptr;
+  std::unique_ptr<OperationIndex> index(new OperationIndex());
+  if (!index->file_.Initialize(base::FilePath(path))) {
+    LOG(WARNING) << "Unable to map operation index " << path;
+    return nullptr;
+  }
+
+  Header header;
+  const size_t file_size = index->file_.length();
+  if (file_size < sizeof(header)) {
+    LOG(WARNING) << "Operation index " << path << " is truncated";
+    return nullptr;
+  }
+  memcpy(&header, index->file_.data(), sizeof(header));
+  if (header.magic != kIndexMagic || header.version != kIndexVersion ||
+      key.size() != sizeof(header.key) ||
+      memcmp(header.key, key.data(), key.size()) != 0) {
+    LOG(INFO) << "Operation index " << path << " is for another payload";
+    return nullptr;
+  }
+
+  // Check the sizes one table at a time, so they can't overflow.
+  size_t remaining = file_size - sizeof(header);
+  const std::pair<uint64_t, size_t> tables[] = {
+      {header.partitions_size, sizeof(PartitionEntry)},
+      {header.operations_size, sizeof(Operation)},
+      {header.copy_extents_size, sizeof(IndexExtent)},
+      {header.xor_entries_size, sizeof(XorEntry)},
+  };
+  for (const auto& [size, entry_size] : tables) {
+    if (size > remaining / entry_size) {
+      LOG(WARNING) << "Operation index " << path << " is truncated";
+      return nullptr;
+    }
+    remaining -= size * entry_size;
+  }
+  if (remaining != 0) {
+    LOG(WARNING) << "Operation index " << path << " has trailing data";
+    return nullptr;
+  }
+
+  index->partitions_size_ = header.partitions_size;
+  const auto* entries = reinterpret_cast<const PartitionEntry*>(
+      index->file_.data() + sizeof(header));
+  for (size_t i = 0; i < index->partitions_size_; i++) {
+    const PartitionEntry& entry = entries[i];
+    if (!InTable(entry.first_operation,
+                 entry.operations_size,
+                 header.operations_size) ||
+        !InTable(entry.first_copy_extent,
+                 entry.copy_extents_size,
+                 header.copy_extents_size) ||
+        !InTable(entry.first_xor_entry,
+                 entry.xor_entries_size,
+                 header.xor_entries_size)) {
+      LOG(WARNING) << "Operation index " << path << " is corrupt";
+      return nullptr;
+    }
+  }
+  return index;
+}
+
+OperationIndex::Partition OperationIndex::partition(size_t index) const {
+  CHECK_LT(index, partitions_size_);
+  const uint8_t* data = file_.data();
+  const auto& header = *reinterpret_cast<const Header*>(data);
+  const auto* entries =
+      reinterpret_cast<const PartitionEntry*>(data + sizeof(Header));
+  const auto* operations = reinterpret_cast<const Operation*>(
+      entries + header.partitions_size);
+  const auto* copy_extents = reinterpret_cast<const IndexExtent*>(
+      operations + header.operations_size);
+  const auto* xor_entries = reinterpret_cast<const XorEntry*>(
+      copy_extents + header.copy_extents_size);
+  const PartitionEntry& entry = entries[index];
+  return {operations + entry.first_operation,
+          entry.operations_size,
+          copy_extents + entry.first_copy_extent,
+          entry.copy_extents_size,
+          xor_entries + entry.first_xor_entry,
+          entry.xor_entries_size,
+          entry.merge_operations_size};
+}
+
+}  // namespace chromeos_update_engine
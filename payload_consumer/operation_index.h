@@ -0,0 +1,112 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_OPERATION_INDEX_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_OPERATION_INDEX_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include <base/files/memory_mapped_file.h>
+#include <base/macros.h>
+#include <brillo/secure_blob.h>
+#include <google/protobuf/repeated_field.h>
+
+#include "update_engine/payload_consumer/extent_map.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// A flat, memory mapped index of what resuming an update needs from the
+// operations of every partition: where the data of each operation is in the
+// payload, the blocks written by COW_COPY merge operations and the COW_XOR
+// merge operations sorted by destination. It's written once the operations
+// were parsed for a new update, so resuming doesn't have to derive all of this
+// from the manifest again.
+//
+// The file is only valid on the device which wrote it, all fields are in host
+// byte order.
+class OperationIndex {
+ public:
+  struct Operation {
+    uint64_t data_offset;
+    uint64_t data_length;
+  };
+  struct IndexExtent {
+    uint64_t start_block;
+    uint64_t num_blocks;
+  };
+  struct XorEntry {
+    IndexExtent dst_extent;
+    // Index of the COW_XOR operation in the partition's merge_operations.
+    uint64_t merge_op_index;
+  };
+
+  // The entries of one partition.
+  struct Partition {
+    const Operation* operations;
+    size_t operations_size;
+    // Sorted, neither overlapping nor touching.
+    const IndexExtent* copy_extents;
+    size_t copy_extents_size;
+    // Sorted by destination, not overlapping.
+    const XorEntry* xor_entries;
+    size_t xor_entries_size;
+    // Number of merge operations the entries were computed from.
+    size_t merge_operations_size;
+
+    // Builds the blocks written by the COW_COPY operations in |merge_ops|,
+    // which must be the ones the index was written from.
+    bool GetCopyBlocks(
+        const google::protobuf::RepeatedPtrField<CowMergeOperation>& merge_ops,
+        ExtentRanges* copy_blocks) const;
+    // Builds the map from destination extents to the COW_XOR operations in
+    // |merge_ops|, as VABCPartitionWriter does from the merge operations.
+    bool GetXorMap(
+        const google::protobuf::RepeatedPtrField<CowMergeOperation>& merge_ops,
+        ExtentMap<const CowMergeOperation*, ExtentLess>* xor_map) const;
+  };
+
+  // Writes the index of |partitions|, which must include their operations, to
+  // |path|. |key| identifies the payload and must be a SHA-256 hash.
+  static bool Write(
+      const std::string& path,
+      const brillo::Blob& key,
+      const google::protobuf::RepeatedPtrField<PartitionUpdate>& partitions);
+
+  // Maps the index at |path|. Returns nullptr if it doesn't exist, is corrupt
+  // or was written for a different |key|.
+  static std::unique_ptr<OperationIndex> Load(const std::string& path,
+                                              const brillo::Blob& key);
+
+  size_t partitions_size() const { return partitions_size_; }
+  Partition partition(size_t index) const;
+
+ private:
+  OperationIndex() = default;
+
+  base::MemoryMappedFile file_;
+  size_t partitions_size_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(OperationIndex);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_OPERATION_INDEX_H_
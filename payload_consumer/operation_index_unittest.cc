@@ -0,0 +1,141 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/operation_index.h"
+
+#include <string>
+
+#include <base/files/file_path.h>
+#include <base/files/scoped_temp_dir.h>
+#include <brillo/secure_blob.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/utils.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+void AddMergeOperation(PartitionUpdate* partition,
+                       CowMergeOperation::Type type,
+                       uint64_t src_start,
+                       uint64_t dst_start,
+                       uint64_t num_blocks) {
+  auto merge_op = partition->add_merge_operations();
+  merge_op->set_type(type);
+  *merge_op->mutable_src_extent() = ExtentForRange(src_start, num_blocks);
+  *merge_op->mutable_dst_extent() = ExtentForRange(dst_start, num_blocks);
+}
+
+}  // namespace
+
+class OperationIndexTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    ASSERT_TRUE(temp_dir_.CreateUniqueTempDir());
+    path_ = temp_dir_.GetPath().Append("operation_index").value();
+
+    auto system = partitions_.Add();
+    system->set_partition_name("system");
+    for (uint64_t i = 0; i < 4; i++) {
+      auto op = system->add_operations();
+      op->set_type(InstallOperation::REPLACE);
+      op->set_data_offset(i * 100);
+      op->set_data_length(100);
+    }
+    system->add_operations()->set_type(InstallOperation::SOURCE_COPY);
+    AddMergeOperation(system, CowMergeOperation::COW_COPY, 0, 20, 5);
+    AddMergeOperation(system, CowMergeOperation::COW_XOR, 30, 50, 4);
+    // Touches the first COW_COPY, so they are merged.
+    AddMergeOperation(system, CowMergeOperation::COW_COPY, 40, 25, 2);
+    AddMergeOperation(system, CowMergeOperation::COW_XOR, 60, 10, 2);
+    // Overlaps an earlier COW_XOR and is ignored, like in the XOR map.
+    AddMergeOperation(system, CowMergeOperation::COW_XOR, 70, 52, 4);
+    AddMergeOperation(system, CowMergeOperation::COW_COPY, 0, 100, 1);
+
+    partitions_.Add()->set_partition_name("vendor");
+  }
+
+  base::ScopedTempDir temp_dir_;
+  string path_;
+  brillo::Blob key_ = brillo::Blob(32, 0xab);
+  google::protobuf::RepeatedPtrField<PartitionUpdate> partitions_;
+};
+
+TEST_F(OperationIndexTest, WriteAndLoadTest) {
+  ASSERT_TRUE(OperationIndex::Write(path_, key_, partitions_));
+  auto index = OperationIndex::Load(path_, key_);
+  ASSERT_NE(index, nullptr);
+  ASSERT_EQ(2u, index->partitions_size());
+
+  const auto system = index->partition(0);
+  ASSERT_EQ(5u, system.operations_size);
+  EXPECT_EQ(300u, system.operations[3].data_offset);
+  EXPECT_EQ(100u, system.operations[3].data_length);
+  EXPECT_EQ(0u, system.operations[4].data_length);
+  EXPECT_EQ(6u, system.merge_operations_size);
+
+  ExtentRanges copy_blocks;
+  ASSERT_TRUE(
+      system.GetCopyBlocks(partitions_[0].merge_operations(), &copy_blocks));
+  ExtentRanges expected_copy_blocks;
+  for (const auto& merge_op : partitions_[0].merge_operations()) {
+    if (merge_op.type() == CowMergeOperation::COW_COPY)
+      expected_copy_blocks.AddExtent(merge_op.dst_extent());
+  }
+  EXPECT_EQ(expected_copy_blocks.extent_set(), copy_blocks.extent_set());
+
+  ExtentMap<const CowMergeOperation*, ExtentLess> xor_map;
+  ASSERT_TRUE(system.GetXorMap(partitions_[0].merge_operations(), &xor_map));
+  EXPECT_EQ(2u, xor_map.size());
+  EXPECT_EQ(&partitions_[0].merge_operations(3),
+            xor_map.Get(ExtentForRange(10, 2)));
+  EXPECT_EQ(&partitions_[0].merge_operations(1),
+            xor_map.Get(ExtentForRange(51, 2)));
+
+  const auto vendor = index->partition(1);
+  EXPECT_EQ(0u, vendor.operations_size);
+  EXPECT_EQ(0u, vendor.copy_extents_size);
+  EXPECT_EQ(0u, vendor.xor_entries_size);
+
+  // Merge operations other than the indexed ones are rejected.
+  partitions_[0].mutable_merge_operations()->RemoveLast();
+  ExtentRanges other_copy_blocks;
+  EXPECT_FALSE(system.GetCopyBlocks(partitions_[0].merge_operations(),
+                                    &other_copy_blocks));
+  ExtentMap<const CowMergeOperation*, ExtentLess> other_xor_map;
+  EXPECT_FALSE(
+      system.GetXorMap(partitions_[0].merge_operations(), &other_xor_map));
+}
+
+TEST_F(OperationIndexTest, LoadInvalidTest) {
+  EXPECT_EQ(nullptr, OperationIndex::Load(path_, key_));
+
+  ASSERT_TRUE(OperationIndex::Write(path_, key_, partitions_));
+  EXPECT_EQ(nullptr, OperationIndex::Load(path_, brillo::Blob(32, 0xcd)));
+
+  brillo::Blob data;
+  ASSERT_TRUE(utils::ReadFile(path_, &data));
+  data.pop_back();
+  ASSERT_TRUE(utils::WriteFile(path_.c_str(), data.data(), data.size()));
+  EXPECT_EQ(nullptr, OperationIndex::Load(path_, key_));
+
+  EXPECT_FALSE(OperationIndex::Write(path_, brillo::Blob(16), partitions_));
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,326 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/operation_stats.h"
+
+#include <algorithm>
+#include <cinttypes>
+
+#include <base/strings/stringprintf.h>
+#include <cutils/trace.h>
+
+#include "update_engine/payload_consumer/payload_constants.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// Stages are only traced when requested for the update, so they're always
+// emitted once tracing is on rather than behind a trace category.
+constexpr uint64_t kTraceTag = ATRACE_TAG_ALWAYS;
+
+size_t BucketIndex(base::TimeDelta duration) {
+  uint64_t us = std::max<int64_t>(duration.InMicroseconds(), 0);
+  size_t index = 0;
+  while (us > 0 && index < OperationStats::kNumBuckets - 1) {
+    us >>= 1;
+    index++;
+  }
+  return index;
+}
+
+// Formats |duration| in milliseconds, down to the microsecond.
+string FormatMillis(base::TimeDelta duration) {
+  return base::StringPrintf("%.3f", duration.InMillisecondsF());
+}
+
+// Bridges an ExtentWriter to another one, timing the calls that write.
+class TimedExtentWriter : public ExtentWriter {
+ public:
+  TimedExtentWriter(std::unique_ptr<ExtentWriter> writer,
+                    OperationStats* stats)
+      : writer_(std::move(writer)), stats_(stats) {}
+  ~TimedExtentWriter() override = default;
+
+  bool Init(const google::protobuf::RepeatedPtrField<Extent>& extents,
+            uint32_t block_size) override {
+    return writer_->Init(extents, block_size);
+  }
+  bool Write(const void* bytes, size_t count) override {
+    ScopedOperationStage stage(stats_, OperationStats::Stage::kWrite);
+    return writer_->Write(bytes, count);
+  }
+  uint8_t* GetWritableBuffer(size_t* size) override {
+    return writer_->GetWritableBuffer(size);
+  }
+  bool CommitBuffer(size_t count) override {
+    ScopedOperationStage stage(stats_, OperationStats::Stage::kWrite);
+    return writer_->CommitBuffer(count);
+  }
+
+ private:
+  std::unique_ptr<ExtentWriter> writer_;
+  OperationStats* stats_;
+
+  DISALLOW_COPY_AND_ASSIGN(TimedExtentWriter);
+};
+
+// Bridges a FileDescriptor to another one, timing the calls that read.
+class TimedFileDescriptor : public FileDescriptor {
+ public:
+  TimedFileDescriptor(FileDescriptorPtr fd, OperationStats* stats)
+      : fd_(std::move(fd)), stats_(stats) {}
+  ~TimedFileDescriptor() override = default;
+
+  bool Open(const char* path, int flags, mode_t mode) override {
+    return fd_->Open(path, flags, mode);
+  }
+  bool Open(const char* path, int flags) override {
+    return fd_->Open(path, flags);
+  }
+  ssize_t Read(void* buf, size_t count) override {
+    ScopedOperationStage stage(stats_, OperationStats::Stage::kSourceRead);
+    return fd_->Read(buf, count);
+  }
+  ssize_t Write(const void* buf, size_t count) override {
+    return fd_->Write(buf, count);
+  }
+  off64_t Seek(off64_t offset, int whence) override {
+    return fd_->Seek(offset, whence);
+  }
+  uint64_t BlockDevSize() override { return fd_->BlockDevSize(); }
+  bool BlkIoctl(int request,
+                uint64_t start,
+                uint64_t length,
+                int* result) override {
+    return fd_->BlkIoctl(request, start, length, result);
+  }
+  bool Flush() override { return fd_->Flush(); }
+  bool Close() override { return fd_->Close(); }
+  bool IsSettingErrno() override { return fd_->IsSettingErrno(); }
+  bool IsOpen() override { return fd_->IsOpen(); }
+  int Fd() override { return fd_->Fd(); }
+
+ private:
+  FileDescriptorPtr fd_;
+  OperationStats* stats_;
+
+  DISALLOW_COPY_AND_ASSIGN(TimedFileDescriptor);
+};
+
+}  // namespace
+
+void OperationStats::Histogram::Add(base::TimeDelta duration) {
+  count++;
+  total += duration;
+  max = std::max(max, duration);
+  buckets[BucketIndex(duration)]++;
+}
+
+base::TimeDelta OperationStats::Histogram::Percentile(int percentile) const {
+  if (count == 0)
+    return base::TimeDelta();
+  // The rank of the sample, rounded up.
+  uint64_t rank = (count * percentile + 99) / 100;
+  uint64_t seen = 0;
+  for (size_t i = 0; i < kNumBuckets - 1; i++) {
+    seen += buckets[i];
+    if (seen >= rank)
+      return std::min(base::TimeDelta::FromMicroseconds((1ll << i) - 1), max);
+  }
+  return max;
+}
+
+const char* OperationStats::StageName(Stage stage) {
+  switch (stage) {
+    case Stage::kWaitForData:
+      return "wait";
+    case Stage::kHash:
+      return "hash";
+    case Stage::kSourceRead:
+      return "source_read";
+    case Stage::kPatch:
+      return "patch";
+    case Stage::kWrite:
+      return "write";
+  }
+  return "<unknown>";
+}
+
+void OperationStats::StartPartition(const string& partition_name) {
+  partitions_.emplace_back(partition_name, PartitionStats());
+  in_operation_ = false;
+  end_time_ = base::TimeTicks();
+}
+
+void OperationStats::BeginOperation(InstallOperation::Type type) {
+  if (partitions_.empty())
+    return;
+  in_operation_ = true;
+  type_ = type;
+  begin_time_ = base::TimeTicks::Now();
+  stage_times_.fill(base::TimeDelta());
+  stage_seen_.fill(false);
+  if (!end_time_.is_null())
+    AddStageTime(Stage::kWaitForData, begin_time_ - end_time_);
+  if (tracing_)
+    atrace_begin(kTraceTag, InstallOperationTypeName(type));
+}
+
+void OperationStats::EndOperation() {
+  if (!in_operation_)
+    return;
+  in_operation_ = false;
+  end_time_ = base::TimeTicks::Now();
+  if (tracing_)
+    atrace_end(kTraceTag);
+
+  // Whatever wasn't spent in another stage is patching.
+  base::TimeDelta patch_time = end_time_ - begin_time_;
+  for (size_t i = 0; i < kNumStages; i++) {
+    if (i != static_cast<size_t>(Stage::kWaitForData))
+      patch_time -= stage_times_[i];
+  }
+  stage_times_[static_cast<size_t>(Stage::kPatch)] =
+      std::max(patch_time, base::TimeDelta());
+  stage_seen_[static_cast<size_t>(Stage::kPatch)] = true;
+
+  TypeStats& type_stats = partitions_.back().second[type_];
+  for (size_t i = 0; i < kNumStages; i++) {
+    if (stage_seen_[i])
+      type_stats[i].Add(stage_times_[i]);
+  }
+}
+
+void OperationStats::AddStageTime(Stage stage, base::TimeDelta duration) {
+  if (!in_operation_)
+    return;
+  stage_times_[static_cast<size_t>(stage)] += duration;
+  stage_seen_[static_cast<size_t>(stage)] = true;
+}
+
+const OperationStats::Histogram* OperationStats::GetHistogram(
+    const string& partition_name,
+    InstallOperation::Type type,
+    Stage stage) const {
+  for (const auto& [name, partition_stats] : partitions_) {
+    if (name != partition_name)
+      continue;
+    auto it = partition_stats.find(type);
+    if (it == partition_stats.end())
+      return nullptr;
+    const Histogram& histogram = it->second[static_cast<size_t>(stage)];
+    return histogram.count ? &histogram : nullptr;
+  }
+  return nullptr;
+}
+
+string OperationStats::ToString() const {
+  string result =
+      "partition operation stage count total_ms p50_ms p90_ms p99_ms max_ms\n";
+  for (const auto& [name, partition_stats] : partitions_) {
+    for (const auto& [type, type_stats] : partition_stats) {
+      for (size_t i = 0; i < kNumStages; i++) {
+        const Histogram& histogram = type_stats[i];
+        if (histogram.count == 0)
+          continue;
+        base::StringAppendF(&result,
+                            "%s %s %s %" PRIu64 " %s %s %s %s %s\n",
+                            name.c_str(),
+                            InstallOperationTypeName(type),
+                            StageName(static_cast<Stage>(i)),
+                            histogram.count,
+                            FormatMillis(histogram.total).c_str(),
+                            FormatMillis(histogram.Percentile(50)).c_str(),
+                            FormatMillis(histogram.Percentile(90)).c_str(),
+                            FormatMillis(histogram.Percentile(99)).c_str(),
+                            FormatMillis(histogram.max).c_str());
+      }
+    }
+  }
+  return result;
+}
+
+std::unique_ptr<base::ListValue> OperationStats::ToValue() const {
+  auto result = std::make_unique<base::ListValue>();
+  for (const auto& [name, partition_stats] : partitions_) {
+    for (const auto& [type, type_stats] : partition_stats) {
+      for (size_t i = 0; i < kNumStages; i++) {
+        const Histogram& histogram = type_stats[i];
+        if (histogram.count == 0)
+          continue;
+        auto entry = std::make_unique<base::DictionaryValue>();
+        entry->SetString("partition", name);
+        entry->SetString("operation", InstallOperationTypeName(type));
+        entry->SetString("stage", StageName(static_cast<Stage>(i)));
+        entry->SetInteger("count", static_cast<int>(histogram.count));
+        entry->SetDouble("total_ms", histogram.total.InMillisecondsF());
+        entry->SetDouble("p50_ms", histogram.Percentile(50).InMillisecondsF());
+        entry->SetDouble("p90_ms", histogram.Percentile(90).InMillisecondsF());
+        entry->SetDouble("p99_ms", histogram.Percentile(99).InMillisecondsF());
+        entry->SetDouble("max_ms", histogram.max.InMillisecondsF());
+        result->Append(std::move(entry));
+      }
+    }
+  }
+  return result;
+}
+
+ScopedOperation::ScopedOperation(OperationStats* stats,
+                                 InstallOperation::Type type)
+    : stats_(stats) {
+  stats_->BeginOperation(type);
+}
+
+ScopedOperation::~ScopedOperation() {
+  stats_->EndOperation();
+}
+
+ScopedOperationStage::ScopedOperationStage(OperationStats* stats,
+                                           OperationStats::Stage stage)
+    : stats_(stats), stage_(stage) {
+  if (!stats_)
+    return;
+  start_time_ = base::TimeTicks::Now();
+  if (stats_->tracing())
+    atrace_begin(kTraceTag, OperationStats::StageName(stage_));
+}
+
+ScopedOperationStage::~ScopedOperationStage() {
+  if (!stats_)
+    return;
+  if (stats_->tracing())
+    atrace_end(kTraceTag);
+  stats_->AddStageTime(stage_, base::TimeTicks::Now() - start_time_);
+}
+
+std::unique_ptr<ExtentWriter> TimeExtentWriter(
+    std::unique_ptr<ExtentWriter> writer, OperationStats* stats) {
+  if (!stats)
+    return writer;
+  return std::make_unique<TimedExtentWriter>(std::move(writer), stats);
+}
+
+FileDescriptorPtr TimeSourceFileDescriptor(FileDescriptorPtr fd,
+                                           OperationStats* stats) {
+  if (!stats)
+    return fd;
+  return std::make_shared<TimedFileDescriptor>(std::move(fd), stats);
+}
+
+}  // namespace chromeos_update_engine
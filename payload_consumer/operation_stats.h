@@ -0,0 +1,183 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_OPERATION_STATS_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_OPERATION_STATS_H_
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <base/macros.h>
+#include <base/time/time.h>
+#include <base/values.h>
+
+#include "update_engine/payload_consumer/extent_writer.h"
+#include "update_engine/payload_consumer/file_descriptor.h"
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// Breaks down the time spent applying the install operations into the stages
+// of the apply path, and keeps a latency histogram of each stage for each
+// type of operation of each partition. Stages may optionally be marked in the
+// system trace as well.
+//
+// DeltaPerformer brackets every operation with BeginOperation() and
+// EndOperation(), the partition writers attribute the time they spend reading
+// the source and writing the target with ScopedOperationStage or by wrapping
+// the source file descriptor and the target writer, and the rest of the
+// operation is accounted as patching.
+class OperationStats {
+ public:
+  enum class Stage {
+    // Between the end of the previous operation and the data of this one
+    // being fully downloaded.
+    kWaitForData,
+    // Verifying the hash of the operation data.
+    kHash,
+    // Choosing and verifying the source extents, and reading them while
+    // patching.
+    kSourceRead,
+    // Decompressing or patching, everything not in another stage.
+    kPatch,
+    // Writing the target, to the partition or the COW.
+    kWrite,
+  };
+  static constexpr size_t kNumStages = 5;
+
+  // Latencies are bucketed by powers of two microseconds, the last bucket
+  // holding anything from 2^(kNumBuckets - 2) microseconds up.
+  static constexpr size_t kNumBuckets = 28;
+
+  struct Histogram {
+    uint64_t count{0};
+    base::TimeDelta total;
+    base::TimeDelta max;
+    std::array<uint64_t, kNumBuckets> buckets{};
+
+    void Add(base::TimeDelta duration);
+    // Returns the upper bound of the bucket holding the |percentile|th
+    // sample.
+    base::TimeDelta Percentile(int percentile) const;
+  };
+
+  OperationStats() = default;
+
+  static const char* StageName(Stage stage);
+
+  // Whether stages are marked in the system trace.
+  void set_tracing(bool tracing) { tracing_ = tracing; }
+  bool tracing() const { return tracing_; }
+
+  // Attributes the operations from now on to |partition_name|.
+  void StartPartition(const std::string& partition_name);
+
+  // Marks the start and the end of applying an operation of |type|. The time
+  // since the previous operation ended is recorded as waiting for data.
+  void BeginOperation(InstallOperation::Type type);
+  void EndOperation();
+
+  // Adds |duration| to |stage| of the operation being applied. Ignored outside
+  // of an operation.
+  void AddStageTime(Stage stage, base::TimeDelta duration);
+
+  // Returns the histogram of |stage| for operations of |type| in
+  // |partition_name|, or nullptr if there was none.
+  const Histogram* GetHistogram(const std::string& partition_name,
+                                InstallOperation::Type type,
+                                Stage stage) const;
+
+  bool empty() const { return partitions_.empty(); }
+
+  // Returns a human readable table of the histograms.
+  std::string ToString() const;
+
+  // Returns the histograms as a list of dictionaries, one per partition,
+  // operation type and stage, with the same columns as ToString().
+  std::unique_ptr<base::ListValue> ToValue() const;
+
+ private:
+  using TypeStats = std::array<Histogram, kNumStages>;
+  using PartitionStats = std::map<InstallOperation::Type, TypeStats>;
+
+  bool tracing_{false};
+
+  // The stats of every partition, in the order they were applied.
+  std::vector<std::pair<std::string, PartitionStats>> partitions_;
+
+  // The operation being applied, if |in_operation_|.
+  bool in_operation_{false};
+  InstallOperation::Type type_{};
+  base::TimeTicks begin_time_;
+  std::array<base::TimeDelta, kNumStages> stage_times_{};
+  std::array<bool, kNumStages> stage_seen_{};
+
+  // When the last operation ended, null at the start of a partition.
+  base::TimeTicks end_time_;
+
+  DISALLOW_COPY_AND_ASSIGN(OperationStats);
+};
+
+// Calls BeginOperation() of |stats| for an operation of |type| on construction
+// and EndOperation() on destruction, so no early return leaves the operation
+// open.
+class ScopedOperation {
+ public:
+  ScopedOperation(OperationStats* stats, InstallOperation::Type type);
+  ~ScopedOperation();
+
+ private:
+  OperationStats* stats_;
+
+  DISALLOW_COPY_AND_ASSIGN(ScopedOperation);
+};
+
+// Adds the time between its construction and destruction to |stage| of
+// |stats|, and marks it in the system trace if enabled. Does nothing if
+// |stats| is nullptr.
+class ScopedOperationStage {
+ public:
+  ScopedOperationStage(OperationStats* stats, OperationStats::Stage stage);
+  ~ScopedOperationStage();
+
+ private:
+  OperationStats* stats_;
+  OperationStats::Stage stage_;
+  base::TimeTicks start_time_;
+
+  DISALLOW_COPY_AND_ASSIGN(ScopedOperationStage);
+};
+
+// Wraps |writer| so the time spent in it is recorded as the write stage of
+// |stats|. Returns |writer| itself if |stats| is nullptr.
+std::unique_ptr<ExtentWriter> TimeExtentWriter(
+    std::unique_ptr<ExtentWriter> writer, OperationStats* stats);
+
+// Wraps |fd| so the time spent reading from it is recorded as the source read
+// stage of |stats|. Returns |fd| itself if |stats| is nullptr. The reads must
+// not happen within another stage, or they'd be counted twice.
+FileDescriptorPtr TimeSourceFileDescriptor(FileDescriptorPtr fd,
+                                           OperationStats* stats);
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_OPERATION_STATS_H_
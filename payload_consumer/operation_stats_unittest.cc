@@ -0,0 +1,237 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/operation_stats.h"
+
+#include <memory>
+#include <string>
+#include <utility>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/payload_consumer/fake_file_descriptor.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// Counts the bytes written to it.
+class CountingExtentWriter : public ExtentWriter {
+ public:
+  explicit CountingExtentWriter(size_t* written) : written_(written) {}
+  bool Init(const google::protobuf::RepeatedPtrField<Extent>& extents,
+            uint32_t block_size) override {
+    return true;
+  }
+  bool Write(const void* bytes, size_t count) override {
+    *written_ += count;
+    return true;
+  }
+
+ private:
+  size_t* written_;
+};
+
+}  // namespace
+
+using Stage = OperationStats::Stage;
+
+class OperationStatsTest : public ::testing::Test {
+ protected:
+  OperationStats stats_;
+};
+
+TEST_F(OperationStatsTest, HistogramTest) {
+  OperationStats::Histogram histogram;
+  EXPECT_EQ(base::TimeDelta(), histogram.Percentile(50));
+  for (int i = 1; i <= 100; i++)
+    histogram.Add(base::TimeDelta::FromMicroseconds(i * 10));
+  EXPECT_EQ(100u, histogram.count);
+  EXPECT_EQ(base::TimeDelta::FromMicroseconds(50500), histogram.total);
+  EXPECT_EQ(base::TimeDelta::FromMilliseconds(1), histogram.max);
+  // The 50th sample is 500us, in the [256us, 512us) bucket.
+  EXPECT_EQ(base::TimeDelta::FromMicroseconds(511), histogram.Percentile(50));
+  // Percentiles never go past the largest sample.
+  EXPECT_EQ(base::TimeDelta::FromMilliseconds(1), histogram.Percentile(99));
+}
+
+TEST_F(OperationStatsTest, StagesTest) {
+  stats_.StartPartition("system");
+  stats_.BeginOperation(InstallOperation::SOURCE_BSDIFF);
+  stats_.AddStageTime(Stage::kHash, base::TimeDelta());
+  stats_.AddStageTime(Stage::kSourceRead, base::TimeDelta());
+  stats_.EndOperation();
+  stats_.BeginOperation(InstallOperation::SOURCE_BSDIFF);
+  stats_.EndOperation();
+
+  auto histogram = [this](Stage stage) {
+    return stats_.GetHistogram(
+        "system", InstallOperation::SOURCE_BSDIFF, stage);
+  };
+  ASSERT_NE(nullptr, histogram(Stage::kHash));
+  EXPECT_EQ(1u, histogram(Stage::kHash)->count);
+  ASSERT_NE(nullptr, histogram(Stage::kSourceRead));
+  EXPECT_EQ(1u, histogram(Stage::kSourceRead)->count);
+  // Every operation patches, only the second one waited for the first.
+  ASSERT_NE(nullptr, histogram(Stage::kPatch));
+  EXPECT_EQ(2u, histogram(Stage::kPatch)->count);
+  ASSERT_NE(nullptr, histogram(Stage::kWaitForData));
+  EXPECT_EQ(1u, histogram(Stage::kWaitForData)->count);
+  EXPECT_EQ(nullptr, histogram(Stage::kWrite));
+  EXPECT_EQ(nullptr,
+            stats_.GetHistogram("system", InstallOperation::REPLACE,
+                                Stage::kPatch));
+  EXPECT_EQ(nullptr,
+            stats_.GetHistogram("vendor", InstallOperation::SOURCE_BSDIFF,
+                                Stage::kPatch));
+}
+
+TEST_F(OperationStatsTest, PatchIsTheRestTest) {
+  stats_.StartPartition("system");
+  stats_.BeginOperation(InstallOperation::REPLACE);
+  // More time than really elapsed was spent in other stages, so nothing is
+  // left for patching.
+  stats_.AddStageTime(Stage::kWrite, base::TimeDelta::FromMinutes(1));
+  stats_.EndOperation();
+  const auto* patch =
+      stats_.GetHistogram("system", InstallOperation::REPLACE, Stage::kPatch);
+  ASSERT_NE(nullptr, patch);
+  EXPECT_EQ(base::TimeDelta(), patch->total);
+}
+
+TEST_F(OperationStatsTest, OutsideOperationTest) {
+  EXPECT_TRUE(stats_.empty());
+  // Nothing is recorded before a partition is started.
+  stats_.BeginOperation(InstallOperation::ZERO);
+  stats_.EndOperation();
+  EXPECT_TRUE(stats_.empty());
+
+  stats_.StartPartition("vendor");
+  stats_.AddStageTime(Stage::kWrite, base::TimeDelta::FromSeconds(1));
+  { ScopedOperationStage stage(&stats_, Stage::kWrite); }
+  EXPECT_EQ(nullptr,
+            stats_.GetHistogram("vendor", InstallOperation::ZERO,
+                                Stage::kWrite));
+  // Waiting isn't counted across partitions.
+  stats_.BeginOperation(InstallOperation::ZERO);
+  stats_.EndOperation();
+  EXPECT_EQ(nullptr,
+            stats_.GetHistogram("vendor", InstallOperation::ZERO,
+                                Stage::kWaitForData));
+}
+
+TEST_F(OperationStatsTest, ScopedOperationTest) {
+  stats_.StartPartition("system");
+  {
+    ScopedOperation operation(&stats_, InstallOperation::SOURCE_COPY);
+    ScopedOperationStage stage(&stats_, Stage::kHash);
+  }
+  // The operation ended, so this stage isn't recorded.
+  { ScopedOperationStage stage(&stats_, Stage::kWrite); }
+  EXPECT_NE(nullptr,
+            stats_.GetHistogram("system", InstallOperation::SOURCE_COPY,
+                                Stage::kHash));
+  EXPECT_NE(nullptr,
+            stats_.GetHistogram("system", InstallOperation::SOURCE_COPY,
+                                Stage::kPatch));
+  EXPECT_EQ(nullptr,
+            stats_.GetHistogram("system", InstallOperation::SOURCE_COPY,
+                                Stage::kWrite));
+}
+
+TEST_F(OperationStatsTest, TimeExtentWriterTest) {
+  size_t written = 0;
+  EXPECT_EQ(nullptr,
+            dynamic_cast<CountingExtentWriter*>(
+                TimeExtentWriter(
+                    std::make_unique<CountingExtentWriter>(&written), &stats_)
+                    .get()));
+  auto writer = std::make_unique<CountingExtentWriter>(&written);
+  auto* raw_writer = writer.get();
+  EXPECT_EQ(raw_writer, TimeExtentWriter(std::move(writer), nullptr).get());
+
+  stats_.StartPartition("system");
+  stats_.BeginOperation(InstallOperation::REPLACE_XZ);
+  auto timed = TimeExtentWriter(
+      std::make_unique<CountingExtentWriter>(&written), &stats_);
+  const char data[] = "data";
+  EXPECT_TRUE(timed->Write(data, sizeof(data)));
+  EXPECT_TRUE(timed->Write(data, sizeof(data)));
+  size_t size = 0;
+  EXPECT_EQ(nullptr, timed->GetWritableBuffer(&size));
+  stats_.EndOperation();
+  EXPECT_EQ(2 * sizeof(data), written);
+  const auto* write = stats_.GetHistogram(
+      "system", InstallOperation::REPLACE_XZ, Stage::kWrite);
+  ASSERT_NE(nullptr, write);
+  // Both writes are part of a single sample for the operation.
+  EXPECT_EQ(1u, write->count);
+}
+
+TEST_F(OperationStatsTest, TimeSourceFileDescriptorTest) {
+  auto fd = std::make_shared<FakeFileDescriptor>();
+  EXPECT_EQ(fd, TimeSourceFileDescriptor(fd, nullptr));
+
+  stats_.StartPartition("system");
+  stats_.BeginOperation(InstallOperation::SOURCE_BSDIFF);
+  FileDescriptorPtr timed = TimeSourceFileDescriptor(fd, &stats_);
+  EXPECT_NE(fd, timed);
+  ASSERT_TRUE(timed->Open("/dev/null", O_RDONLY));
+  EXPECT_TRUE(fd->IsOpen());
+  char buf[8];
+  EXPECT_EQ(0, timed->Seek(0, SEEK_SET));
+  EXPECT_EQ(static_cast<ssize_t>(sizeof(buf)), timed->Read(buf, sizeof(buf)));
+  EXPECT_EQ(static_cast<ssize_t>(sizeof(buf)), timed->Read(buf, sizeof(buf)));
+  stats_.EndOperation();
+  EXPECT_EQ(2u, fd->GetReadOps().size());
+  const auto* source_read = stats_.GetHistogram(
+      "system", InstallOperation::SOURCE_BSDIFF, Stage::kSourceRead);
+  ASSERT_NE(nullptr, source_read);
+  // Both reads are part of a single sample for the operation.
+  EXPECT_EQ(1u, source_read->count);
+}
+
+TEST_F(OperationStatsTest, ToStringTest) {
+  stats_.StartPartition("system");
+  stats_.BeginOperation(InstallOperation::PUFFDIFF);
+  stats_.EndOperation();
+  string result = stats_.ToString();
+  EXPECT_NE(string::npos, result.find("system PUFFDIFF patch 1 "));
+}
+
+TEST_F(OperationStatsTest, ToValueTest) {
+  stats_.StartPartition("system");
+  stats_.BeginOperation(InstallOperation::PUFFDIFF);
+  stats_.EndOperation();
+  auto value = stats_.ToValue();
+  ASSERT_EQ(1u, value->GetSize());
+  const base::DictionaryValue* entry = nullptr;
+  ASSERT_TRUE(value->GetDictionary(0, &entry));
+  string str;
+  EXPECT_TRUE(entry->GetString("partition", &str));
+  EXPECT_EQ("system", str);
+  EXPECT_TRUE(entry->GetString("operation", &str));
+  EXPECT_EQ("PUFFDIFF", str);
+  EXPECT_TRUE(entry->GetString("stage", &str));
+  EXPECT_EQ("patch", str);
+  int count = 0;
+  EXPECT_TRUE(entry->GetInteger("count", &count));
+  EXPECT_EQ(1, count);
+}
+
+}  // namespace chromeos_update_engine
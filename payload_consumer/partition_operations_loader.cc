@@ -0,0 +1,180 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/partition_operations_loader.h"
+
+#include <limits>
+#include <memory>
+
+#include <base/logging.h>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/wire_format_lite.h>
+
+#include "update_engine/common/utils.h"
+
+using google::protobuf::Arena;
+using google::protobuf::io::CodedInputStream;
+using google::protobuf::internal::WireFormatLite;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+void AppendVarint(uint64_t value, std::string* out) {
+  while (value >= 0x80) {
+    out->push_back(static_cast<char>(value | 0x80));
+    value >>= 7;
+  }
+  out->push_back(static_cast<char>(value));
+}
+
+// Reads the length of a length delimited field and returns its offset in
+// |input|'s buffer.
+bool ReadLengthDelimited(CodedInputStream* input,
+                         size_t* offset,
+                         uint32_t* size) {
+  TEST_AND_RETURN_FALSE(input->ReadVarint32(size));
+  *offset = input->CurrentPosition();
+  return input->Skip(*size);
+}
+
+bool IsLengthDelimited(uint32_t tag, int field_number) {
+  return WireFormatLite::GetTagFieldNumber(tag) == field_number &&
+         WireFormatLite::GetTagWireType(tag) ==
+             WireFormatLite::WIRETYPE_LENGTH_DELIMITED;
+}
+
+}  // namespace
+
+bool PartitionOperationsLoader::Init(const uint8_t* data,
+                                     size_t size,
+                                     DeltaArchiveManifest* manifest) {
+  Reset();
+  TEST_AND_RETURN_FALSE(size <= std::numeric_limits<int>::max());
+  data_.assign(reinterpret_cast<const char*>(data), size);
+
+  // Everything but the operations is copied as is into |stripped|, which is
+  // what actually gets parsed into |manifest|.
+  std::string stripped;
+  CodedInputStream input(reinterpret_cast<const uint8_t*>(data_.data()),
+                         data_.size());
+  size_t field_start = 0;
+  while (uint32_t tag = input.ReadTag()) {
+    if (IsLengthDelimited(tag, DeltaArchiveManifest::kPartitionsFieldNumber)) {
+      size_t offset;
+      uint32_t partition_size;
+      TEST_AND_RETURN_FALSE(
+          ReadLengthDelimited(&input, &offset, &partition_size));
+      std::string partition;
+      TEST_AND_RETURN_FALSE(IndexPartition(offset, partition_size, &partition));
+      AppendVarint(tag, &stripped);
+      AppendVarint(partition.size(), &stripped);
+      stripped.append(partition);
+    } else {
+      TEST_AND_RETURN_FALSE(WireFormatLite::SkipField(&input, tag));
+      stripped.append(
+          data_, field_start, input.CurrentPosition() - field_start);
+    }
+    field_start = input.CurrentPosition();
+  }
+  // ReadTag() also returns 0 on malformed input.
+  TEST_AND_RETURN_FALSE(field_start == data_.size());
+  if (!manifest->ParseFromString(stripped)) {
+    Reset();
+    return false;
+  }
+  return true;
+}
+
+void PartitionOperationsLoader::Reset() {
+  data_.clear();
+  data_.shrink_to_fit();
+  partitions_.clear();
+}
+
+bool PartitionOperationsLoader::IndexPartition(size_t offset,
+                                               size_t size,
+                                               std::string* stripped) {
+  Partition partition{offset, size, 0};
+  CodedInputStream input(
+      reinterpret_cast<const uint8_t*>(data_.data()) + offset, size);
+  size_t field_start = 0;
+  while (uint32_t tag = input.ReadTag()) {
+    const bool is_operation =
+        IsLengthDelimited(tag, PartitionUpdate::kOperationsFieldNumber);
+    TEST_AND_RETURN_FALSE(WireFormatLite::SkipField(&input, tag));
+    if (is_operation) {
+      partition.operations_size++;
+    } else if (!IsLengthDelimited(
+                   tag, PartitionUpdate::kMergeOperationsFieldNumber)) {
+      stripped->append(
+          data_, offset + field_start, input.CurrentPosition() - field_start);
+    }
+    field_start = input.CurrentPosition();
+  }
+  TEST_AND_RETURN_FALSE(field_start == size);
+  partitions_.push_back(partition);
+  return true;
+}
+
+bool PartitionOperationsLoader::LoadOperations(
+    size_t index, PartitionUpdate* partition) const {
+  TEST_AND_RETURN_FALSE(index < partitions_.size());
+  const Partition& location = partitions_[index];
+  // Parse the whole partition on the same arena, so the operations can be
+  // moved over without copying them.
+  Arena* arena = partition->GetArena();
+  std::unique_ptr<PartitionUpdate> owned;
+  PartitionUpdate* parsed;
+  if (arena) {
+    parsed = Arena::CreateMessage<PartitionUpdate>(arena);
+  } else {
+    owned = std::make_unique<PartitionUpdate>();
+    parsed = owned.get();
+  }
+  TEST_AND_RETURN_FALSE(
+      parsed->ParseFromArray(data_.data() + location.offset, location.size));
+  partition->mutable_operations()->Swap(parsed->mutable_operations());
+  partition->mutable_merge_operations()->Swap(
+      parsed->mutable_merge_operations());
+  return true;
+}
+
+bool PartitionOperationsLoader::LoadOperation(
+    size_t index, size_t op_index, InstallOperation* operation) const {
+  TEST_AND_RETURN_FALSE(index < partitions_.size());
+  const Partition& location = partitions_[index];
+  TEST_AND_RETURN_FALSE(op_index < location.operations_size);
+  CodedInputStream input(
+      reinterpret_cast<const uint8_t*>(data_.data()) + location.offset,
+      location.size);
+  while (uint32_t tag = input.ReadTag()) {
+    if (!IsLengthDelimited(tag, PartitionUpdate::kOperationsFieldNumber)) {
+      TEST_AND_RETURN_FALSE(WireFormatLite::SkipField(&input, tag));
+      continue;
+    }
+    size_t offset;
+    uint32_t size;
+    TEST_AND_RETURN_FALSE(ReadLengthDelimited(&input, &offset, &size));
+    if (op_index-- == 0) {
+      return operation->ParseFromArray(
+          data_.data() + location.offset + offset, size);
+    }
+  }
+  return false;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,91 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_PARTITION_OPERATIONS_LOADER_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_PARTITION_OPERATIONS_LOADER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <base/macros.h>
+
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// Keeps the serialized manifest of a payload around so that the operations and
+// merge operations of every partition can be parsed when they are needed,
+// instead of holding all of them in memory for the whole update. For payloads
+// with millions of operations those account for almost all of the manifest.
+//
+// Messages passed to the Load*() methods may live on a protobuf Arena, in which
+// case the parsed operations are allocated on the same arena.
+class PartitionOperationsLoader {
+ public:
+  PartitionOperationsLoader() = default;
+
+  // Copies the |size| bytes of serialized DeltaArchiveManifest in |data|,
+  // indexes its partitions and parses it into |manifest|, leaving out the
+  // operations and merge_operations of every partition. Returns false if the
+  // manifest can't be parsed.
+  bool Init(const uint8_t* data, size_t size, DeltaArchiveManifest* manifest);
+
+  // Drops the serialized manifest.
+  void Reset();
+
+  // The serialized manifest passed to Init().
+  const std::string& data() const { return data_; }
+
+  // Number of partitions in the manifest passed to Init().
+  size_t partitions_size() const { return partitions_.size(); }
+
+  // Number of operations of partition |index|.
+  size_t operations_size(size_t index) const {
+    return partitions_[index].operations_size;
+  }
+
+  // Replaces the operations and merge_operations of |partition| with the ones
+  // of partition |index|.
+  bool LoadOperations(size_t index, PartitionUpdate* partition) const;
+
+  // Parses operation |op_index| of partition |index| into |operation|.
+  bool LoadOperation(size_t index,
+                     size_t op_index,
+                     InstallOperation* operation) const;
+
+ private:
+  struct Partition {
+    // Location of the serialized PartitionUpdate in |data_|.
+    size_t offset;
+    size_t size;
+    size_t operations_size;
+  };
+
+  // Indexes the PartitionUpdate at |offset| in |data_| and appends it to
+  // |stripped| without its operations and merge_operations.
+  bool IndexPartition(size_t offset, size_t size, std::string* stripped);
+
+  std::string data_;
+  std::vector<Partition> partitions_;
+
+  DISALLOW_COPY_AND_ASSIGN(PartitionOperationsLoader);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_PARTITION_OPERATIONS_LOADER_H_
@@ -0,0 +1,132 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/partition_operations_loader.h"
+
+#include <string>
+
+#include <google/protobuf/arena.h>
+#include <gtest/gtest.h>
+
+using google::protobuf::Arena;
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+void AddOperations(PartitionUpdate* partition, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    auto op = partition->add_operations();
+    op->set_type(InstallOperation::SOURCE_COPY);
+    op->set_data_offset(i * 4096);
+    op->set_data_length(4096);
+    auto src = op->add_src_extents();
+    src->set_start_block(i * 2);
+    src->set_num_blocks(1);
+    auto dst = op->add_dst_extents();
+    dst->set_start_block(i);
+    dst->set_num_blocks(1);
+  }
+}
+
+DeltaArchiveManifest CreateManifest() {
+  DeltaArchiveManifest manifest;
+  manifest.set_block_size(4096);
+  manifest.set_minor_version(8);
+  auto system = manifest.add_partitions();
+  system->set_partition_name("system");
+  system->mutable_new_partition_info()->set_size(1 << 20);
+  AddOperations(system, 5);
+  auto merge_op = system->add_merge_operations();
+  merge_op->set_type(CowMergeOperation::COW_COPY);
+  merge_op->mutable_src_extent()->set_start_block(10);
+  merge_op->mutable_dst_extent()->set_start_block(20);
+  system->add_new_partition_signature()->set_data("signature");
+  manifest.set_max_timestamp(1234);
+  auto vendor = manifest.add_partitions();
+  vendor->set_partition_name("vendor");
+  AddOperations(vendor, 3);
+  return manifest;
+}
+
+}  // namespace
+
+TEST(PartitionOperationsLoaderTest, InitTest) {
+  const DeltaArchiveManifest expected = CreateManifest();
+  const string data = expected.SerializeAsString();
+
+  PartitionOperationsLoader loader;
+  DeltaArchiveManifest manifest;
+  ASSERT_TRUE(loader.Init(
+      reinterpret_cast<const uint8_t*>(data.data()), data.size(), &manifest));
+  ASSERT_EQ(2u, loader.partitions_size());
+  EXPECT_EQ(5u, loader.operations_size(0));
+  EXPECT_EQ(3u, loader.operations_size(1));
+
+  // Everything but the operations is parsed.
+  DeltaArchiveManifest stripped = expected;
+  for (auto& partition : *stripped.mutable_partitions()) {
+    partition.clear_operations();
+    partition.clear_merge_operations();
+  }
+  EXPECT_EQ(stripped.SerializeAsString(), manifest.SerializeAsString());
+}
+
+TEST(PartitionOperationsLoaderTest, LoadOperationsTest) {
+  const DeltaArchiveManifest expected = CreateManifest();
+  const string data = expected.SerializeAsString();
+  PartitionOperationsLoader loader;
+  DeltaArchiveManifest manifest;
+  ASSERT_TRUE(loader.Init(
+      reinterpret_cast<const uint8_t*>(data.data()), data.size(), &manifest));
+
+  // On the heap.
+  PartitionUpdate* system = manifest.mutable_partitions(0);
+  ASSERT_TRUE(loader.LoadOperations(0, system));
+  EXPECT_EQ(expected.partitions(0).SerializeAsString(),
+            system->SerializeAsString());
+
+  // On an arena.
+  Arena arena;
+  auto vendor = Arena::CreateMessage<PartitionUpdate>(&arena);
+  vendor->CopyFrom(manifest.partitions(1));
+  ASSERT_TRUE(loader.LoadOperations(1, vendor));
+  EXPECT_EQ(expected.partitions(1).SerializeAsString(),
+            vendor->SerializeAsString());
+  EXPECT_FALSE(loader.LoadOperations(2, vendor));
+
+  InstallOperation op;
+  ASSERT_TRUE(loader.LoadOperation(0, 4, &op));
+  EXPECT_EQ(expected.partitions(0).operations(4).SerializeAsString(),
+            op.SerializeAsString());
+  EXPECT_FALSE(loader.LoadOperation(1, 3, &op));
+}
+
+TEST(PartitionOperationsLoaderTest, MalformedManifestTest) {
+  const string data = CreateManifest().SerializeAsString();
+  PartitionOperationsLoader loader;
+  DeltaArchiveManifest manifest;
+  EXPECT_FALSE(loader.Init(reinterpret_cast<const uint8_t*>(data.data()),
+                           data.size() - 1,
+                           &manifest));
+  const string garbage(16, '\xff');
+  EXPECT_FALSE(loader.Init(reinterpret_cast<const uint8_t*>(garbage.data()),
+                           garbage.size(),
+                           &manifest));
+}
+
+}  // namespace chromeos_update_engine
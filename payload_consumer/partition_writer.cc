@@ -40,6 +40,7 @@
 #include "update_engine/payload_consumer/install_operation_executor.h"
 #include "update_engine/payload_consumer/install_plan.h"
 #include "update_engine/payload_consumer/mount_history.h"
+#include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/payload_generator/extent_utils.h"
 
 namespace chromeos_update_engine {
@@ -95,7 +96,7 @@ FileDescriptorPtr OpenFile(const char* path,
 
   FileDescriptorPtr fd(new EintrSafeFileDescriptor());
   if (cache_writes && !read_only) {
-    fd = FileDescriptorPtr(new CachedFileDescriptor(fd, kCacheSize));
+    fd = FileDescriptorPtr(new AsyncCachedFileDescriptor(fd, kCacheSize));
     LOG(INFO) << "Caching writes.";
   }
   if (!fd->Open(path, mode, 000)) {
@@ -187,6 +188,7 @@ bool PartitionWriter::Init(const InstallPlan* install_plan,
 bool PartitionWriter::PerformReplaceOperation(const InstallOperation& operation,
                                               const void* data,
                                               size_t count) {
+  TEST_AND_RETURN_FALSE(FlushPendingSourceCopy());
   // Setup the ExtentWriter stack based on the operation type.
   std::unique_ptr<ExtentWriter> writer = CreateBaseExtentWriter();
   return install_op_executor_.ExecuteReplaceOperation(
@@ -195,6 +197,7 @@ bool PartitionWriter::PerformReplaceOperation(const InstallOperation& operation,
 
 bool PartitionWriter::PerformZeroOrDiscardOperation(
     const InstallOperation& operation) {
+  TEST_AND_RETURN_FALSE(FlushPendingSourceCopy());
 #ifdef BLKZEROOUT
   int request =
       (operation.type() == InstallOperation::ZERO ? BLKZEROOUT : BLKDISCARD);
@@ -208,7 +211,14 @@ bool PartitionWriter::PerformZeroOrDiscardOperation(
     const uint64_t start = extent.start_block() * block_size_;
     const uint64_t length = extent.num_blocks() * block_size_;
     int result = 0;
-    if (target_fd_->BlkIoctl(request, start, length, &result) && result == 0) {
+    bool zeroed = false;
+    {
+      ScopedOperationStage stage(operation_stats_,
+                                 OperationStats::Stage::kWrite);
+      zeroed = target_fd_->BlkIoctl(request, start, length, &result) &&
+               result == 0;
+    }
+    if (zeroed) {
       continue;
     }
     // In case of failure, we fall back to writing 0 for the entire operation.
@@ -245,6 +255,18 @@ bool PartitionWriter::PerformSourceCopyOperation(
       partition.partition_name(), operation, &buf);
   const InstallOperation& optimized = should_optimize ? buf : operation;
 
+  // Source hash was already verified by ChooseSourceFD(), so the blocks can be
+  // copied in kernel without passing through our buffers.
+  std::vector<fd_utils::CopyRange> ranges;
+  if (kernel_copy_supported_ && source_fd->Fd() >= 0 &&
+      fd_utils::ComputeCopyRanges(optimized.src_extents(),
+                                  optimized.dst_extents(),
+                                  block_size_,
+                                  &ranges)) {
+    return QueueSourceCopy(source_fd, ranges);
+  }
+
+  TEST_AND_RETURN_FALSE(FlushPendingSourceCopy());
   auto writer = CreateBaseExtentWriter();
   return install_op_executor_.ExecuteSourceCopyOperation(
       optimized, std::move(writer), source_fd);
@@ -254,22 +276,84 @@ bool PartitionWriter::PerformDiffOperation(const InstallOperation& operation,
                                            ErrorCode* error,
                                            const void* data,
                                            size_t count) {
+  TEST_AND_RETURN_FALSE(FlushPendingSourceCopy());
   FileDescriptorPtr source_fd = ChooseSourceFD(operation, error);
   TEST_AND_RETURN_FALSE(source_fd != nullptr);
 
   auto writer = CreateBaseExtentWriter();
   return install_op_executor_.ExecuteDiffOperation(
-      operation, std::move(writer), source_fd, data, count);
+      operation,
+      std::move(writer),
+      TimeSourceFileDescriptor(source_fd, operation_stats_),
+      data,
+      count);
 }
 
 FileDescriptorPtr PartitionWriter::ChooseSourceFD(
     const InstallOperation& operation, ErrorCode* error) {
+  ScopedOperationStage stage(operation_stats_,
+                             OperationStats::Stage::kSourceRead);
   return verified_source_fd_.ChooseSourceFD(operation, error);
 }
 
+bool PartitionWriter::QueueSourceCopy(
+    const FileDescriptorPtr& source_fd,
+    const std::vector<fd_utils::CopyRange>& ranges) {
+  for (const auto& range : ranges) {
+    if (pending_copy_ && pending_copy_source_ == source_fd &&
+        pending_copy_->src_offset + pending_copy_->length == range.src_offset &&
+        pending_copy_->dst_offset + pending_copy_->length == range.dst_offset) {
+      pending_copy_->length += range.length;
+      continue;
+    }
+    TEST_AND_RETURN_FALSE(FlushPendingSourceCopy());
+    pending_copy_ = range;
+    pending_copy_source_ = source_fd;
+  }
+  return true;
+}
+
+bool PartitionWriter::FlushPendingSourceCopy() {
+  if (!pending_copy_) {
+    return true;
+  }
+  // The copy is attributed to the operation which flushes it.
+  ScopedOperationStage stage(operation_stats_, OperationStats::Stage::kWrite);
+  const fd_utils::CopyRange range = *pending_copy_;
+  FileDescriptorPtr source_fd = std::move(pending_copy_source_);
+  pending_copy_.reset();
+  pending_copy_source_.reset();
+
+  if (fd_utils::CopyRangeInKernel(source_fd, target_fd_, range)) {
+    return true;
+  }
+  PLOG(WARNING) << "In-kernel copy to " << target_path_
+                << " failed, falling back to buffered copies.";
+  kernel_copy_supported_ = false;
+
+  google::protobuf::RepeatedPtrField<Extent> src_extents;
+  google::protobuf::RepeatedPtrField<Extent> dst_extents;
+  *src_extents.Add() = ExtentForRange(range.src_offset / block_size_,
+                                      range.length / block_size_);
+  *dst_extents.Add() = ExtentForRange(range.dst_offset / block_size_,
+                                      range.length / block_size_);
+  DirectExtentWriter writer{target_fd_};
+  TEST_AND_RETURN_FALSE(writer.Init(dst_extents, block_size_));
+  return fd_utils::CommonHashExtents(
+      source_fd, src_extents, &writer, block_size_, nullptr);
+}
+
+bool PartitionWriter::FinishedInstallOps() {
+  return FlushPendingSourceCopy();
+}
+
 int PartitionWriter::Close() {
   int err = 0;
 
+  if (!FlushPendingSourceCopy()) {
+    LOG(ERROR) << "Failed to write pending SOURCE_COPY to " << target_path_;
+    err = EIO;
+  }
   source_path_.clear();
 
   if (target_fd_ && !target_fd_->Close()) {
@@ -284,14 +368,17 @@ int PartitionWriter::Close() {
   return -err;
 }
 
-void PartitionWriter::CheckpointUpdateProgress(size_t next_op_index) {
+bool PartitionWriter::CheckpointUpdateProgress(size_t next_op_index) {
+  TEST_AND_RETURN_FALSE(FlushPendingSourceCopy());
   if (target_fd_) {
     target_fd_->Flush();
   }
+  return true;
 }
 
 std::unique_ptr<ExtentWriter> PartitionWriter::CreateBaseExtentWriter() {
-  return std::make_unique<DirectExtentWriter>(target_fd_);
+  return TimeExtentWriter(std::make_unique<DirectExtentWriter>(target_fd_),
+                          operation_stats_);
 }
 
 bool PartitionWriter::ValidateSourceHash(const InstallOperation& operation,
@@ -19,7 +19,9 @@
 
 #include <cstdint>
 #include <memory>
+#include <optional>
 #include <string>
+#include <vector>
 
 #include <brillo/secure_blob.h>
 #include <gtest/gtest_prod.h>
@@ -27,8 +29,10 @@
 #include "update_engine/common/dynamic_partition_control_interface.h"
 #include "update_engine/payload_consumer/extent_writer.h"
 #include "update_engine/payload_consumer/file_descriptor.h"
+#include "update_engine/payload_consumer/file_descriptor_utils.h"
 #include "update_engine/payload_consumer/install_operation_executor.h"
 #include "update_engine/payload_consumer/install_plan.h"
+#include "update_engine/payload_consumer/operation_index.h"
 #include "update_engine/payload_consumer/partition_writer_interface.h"
 #include "update_engine/payload_consumer/verified_source_fd.h"
 #include "update_engine/update_metadata.pb.h"
@@ -62,7 +66,7 @@ class PartitionWriter : public PartitionWriterInterface {
   // applied.
   //   |next_op_index| is index of next operation that should be applied.
   // |next_op_index-1| is the last operation that is already applied.
-  void CheckpointUpdateProgress(size_t next_op_index) override;
+  [[nodiscard]] bool CheckpointUpdateProgress(size_t next_op_index) override;
 
   // Close partition writer, when calling this function there's no guarantee
   // that all |InstallOperations| are sent to |PartitionWriter|. This function
@@ -88,11 +92,16 @@ class PartitionWriter : public PartitionWriterInterface {
   // |DeltaPerformer| calls this when all Install Ops are sent to partition
   // writer. No |Perform*Operation| methods will be called in the future, and
   // the partition writer is expected to be closed soon.
-  [[nodiscard]] bool FinishedInstallOps() override { return true; }
+  [[nodiscard]] bool FinishedInstallOps() override;
+
+  void SetOperationStats(OperationStats* stats) override {
+    operation_stats_ = stats;
+  }
 
  private:
   friend class PartitionWriterTest;
   FRIEND_TEST(PartitionWriterTest, ChooseSourceFDTest);
+  FRIEND_TEST(PartitionWriterTest, CoalescedSourceCopyTest);
 
   [[nodiscard]] bool OpenSourcePartition(uint32_t source_slot,
                                          bool source_may_exist);
@@ -101,6 +110,17 @@ class PartitionWriter : public PartitionWriterInterface {
 
   [[nodiscard]] std::unique_ptr<ExtentWriter> CreateBaseExtentWriter();
 
+  // Queues the SOURCE_COPY of |ranges| from |source_fd| for an in-kernel copy.
+  // A range which is contiguous on both sides with the pending copy is merged
+  // into it, so runs of unchanged blocks spanning many operations turn into a
+  // single copy. Returns false if |source_fd| can't be copied from in kernel.
+  [[nodiscard]] bool QueueSourceCopy(
+      const FileDescriptorPtr& source_fd,
+      const std::vector<fd_utils::CopyRange>& ranges);
+  // Writes out the pending SOURCE_COPY, falling back to a buffered copy if the
+  // kernel refuses it. Must be called before anything else touches the target.
+  [[nodiscard]] bool FlushPendingSourceCopy();
+
   const PartitionUpdate& partition_update_;
   const InstallPlan::Partition& install_part_;
   DynamicPartitionControlInterface* dynamic_control_;
@@ -113,6 +133,16 @@ class PartitionWriter : public PartitionWriterInterface {
   const bool interactive_;
   const size_t block_size_;
 
+  // SOURCE_COPY which was already reported as applied but not yet written to
+  // |target_fd_|, and the descriptor it reads from.
+  std::optional<fd_utils::CopyRange> pending_copy_;
+  FileDescriptorPtr pending_copy_source_;
+  // Cleared once the kernel refuses a copy between the partitions.
+  bool kernel_copy_supported_{true};
+
+  // Where the time spent reading and writing is recorded, if set.
+  OperationStats* operation_stats_{nullptr};
+
   // This instance handles decompression/bsdfif/puffdiff. It's responsible for
   // constructing data which should be written to target partition, actual
   // "writing" is handled by |PartitionWriter|
@@ -121,14 +151,16 @@ class PartitionWriter : public PartitionWriterInterface {
 
 namespace partition_writer {
 // Return a PartitionWriter instance for perform InstallOps on this partition.
-// Uses VABCPartitionWriter for Virtual AB Compression
+// Uses VABCPartitionWriter for Virtual AB Compression. |operation_index|, if
+// set, is the index of this partition written when the update started.
 std::unique_ptr<PartitionWriterInterface> CreatePartitionWriter(
     const PartitionUpdate& partition_update,
     const InstallPlan::Partition& install_part,
     DynamicPartitionControlInterface* dynamic_control,
     size_t block_size,
     bool is_interactive,
-    bool is_dynamic_partition);
+    bool is_dynamic_partition,
+    const OperationIndex::Partition* operation_index = nullptr);
 }  // namespace partition_writer
 }  // namespace chromeos_update_engine
 
@@ -30,14 +30,18 @@ std::unique_ptr<PartitionWriterInterface> CreatePartitionWriter(
     DynamicPartitionControlInterface* dynamic_control,
     size_t block_size,
     bool is_interactive,
-    bool is_dynamic_partition) {
+    bool is_dynamic_partition,
+    const OperationIndex::Partition* operation_index) {
   if (dynamic_control && dynamic_control->UpdateUsesSnapshotCompression() &&
       is_dynamic_partition) {
     LOG(INFO)
         << "Virtual AB Compression Enabled, using VABC Partition Writer for `"
         << install_part.name << '`';
-    return std::make_unique<VABCPartitionWriter>(
-        partition_update, install_part, dynamic_control, block_size);
+    return std::make_unique<VABCPartitionWriter>(partition_update,
+                                                 install_part,
+                                                 dynamic_control,
+                                                 block_size,
+                                                 operation_index);
   } else {
     LOG(INFO) << "Virtual AB Compression disabled, using Partition Writer for `"
               << install_part.name << '`';
@@ -28,7 +28,8 @@ std::unique_ptr<PartitionWriterInterface> CreatePartitionWriter(
     DynamicPartitionControlInterface* dynamic_control,
     size_t block_size,
     bool is_interactive,
-    bool is_dynamic_partition) {
+    bool is_dynamic_partition,
+    const OperationIndex::Partition* operation_index) {
   return std::make_unique<PartitionWriter>(partition_update,
                                            install_part,
                                            dynamic_control,
@@ -24,6 +24,7 @@
 #include <gtest/gtest_prod.h>
 
 #include "update_engine/payload_consumer/install_plan.h"
+#include "update_engine/payload_consumer/operation_stats.h"
 #include "update_engine/update_metadata.pb.h"
 
 namespace chromeos_update_engine {
@@ -42,7 +43,9 @@ class PartitionWriterInterface {
   // applied.
   //   |next_op_index| is index of next operation that should be applied.
   // |next_op_index-1| is the last operation that is already applied.
-  virtual void CheckpointUpdateProgress(size_t next_op_index) = 0;
+  // Returns false if operations before |next_op_index| couldn't be persisted,
+  // in which case the checkpoint must not be recorded.
+  [[nodiscard]] virtual bool CheckpointUpdateProgress(size_t next_op_index) = 0;
 
   // Close partition writer, when calling this function there's no guarantee
   // that all |InstallOperations| are sent to |PartitionWriter|. This function
@@ -69,6 +72,10 @@ class PartitionWriterInterface {
   // writer. No |Perform*Operation| methods will be called in the future, and
   // the partition writer is expected to be closed soon.
   [[nodiscard]] virtual bool FinishedInstallOps() = 0;
+
+  // Sets where the time spent reading the source and writing the target of
+  // the operations is recorded. |stats| must outlive the partition writer.
+  virtual void SetOperationStats(OperationStats* stats) {}
 };
 }  // namespace chromeos_update_engine
 
@@ -107,7 +107,7 @@ class PartitionWriterTest : public testing::Test {
       return {};
     }
     EXPECT_TRUE(writer_.PerformSourceCopyOperation(op, &error));
-    writer_.CheckpointUpdateProgress(1);
+    EXPECT_TRUE(writer_.CheckpointUpdateProgress(1));
 
     brillo::Blob output_data;
     EXPECT_TRUE(utils::ReadFile(target_partition.path(), &output_data));
@@ -186,6 +186,35 @@ TEST_F(PartitionWriterTest, ErrorCorrectionSourceCopyFallbackTest) {
   EXPECT_EQ(1U, GetSourceEccRecoveredFailures());
 }
 
+// Consecutive SOURCE_COPY operations contiguous in both the source and the
+// target are merged and only written out on checkpoint.
+TEST_F(PartitionWriterTest, CoalescedSourceCopyTest) {
+  constexpr size_t kSourceSize = 4 * 4096;
+  brillo::Blob expected_data = FakeFileDescriptorData(kSourceSize);
+  ASSERT_TRUE(
+      test_utils::WriteFileVector(source_partition.path(), expected_data));
+  install_part_.source_size = kSourceSize;
+  install_part_.target_size = kSourceSize;
+  ASSERT_TRUE(writer_.Init(&install_plan_, true, 0));
+
+  ErrorCode error = ErrorCode::kSuccess;
+  for (uint64_t block = 0; block < kSourceSize / 4096; block++) {
+    InstallOperation op;
+    op.set_type(InstallOperation::SOURCE_COPY);
+    *(op.add_src_extents()) = ExtentForRange(block, 1);
+    *(op.add_dst_extents()) = ExtentForRange(block, 1);
+    ASSERT_TRUE(writer_.PerformSourceCopyOperation(op, &error));
+  }
+  ASSERT_TRUE(writer_.pending_copy_.has_value());
+  EXPECT_EQ(kSourceSize, writer_.pending_copy_->length);
+
+  ASSERT_TRUE(writer_.CheckpointUpdateProgress(kSourceSize / 4096));
+  EXPECT_FALSE(writer_.pending_copy_.has_value());
+  brillo::Blob output_data;
+  ASSERT_TRUE(utils::ReadFile(target_partition.path(), &output_data));
+  ASSERT_EQ(expected_data, output_data);
+}
+
 TEST_F(PartitionWriterTest, ChooseSourceFDTest) {
   constexpr size_t kSourceSize = 4 * 4096;
   ScopedTempFile source("Source-XXXXXX");
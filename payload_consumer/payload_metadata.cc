@@ -153,6 +153,15 @@ bool PayloadMetadata::GetManifest(const unsigned char* payload,
                                       manifest_size_);
 }
 
+bool PayloadMetadata::GetManifest(const brillo::Blob& payload,
+                                  PartitionOperationsLoader* loader,
+                                  DeltaArchiveManifest* out_manifest) const {
+  uint64_t manifest_offset = GetManifestOffset();
+  CHECK_GE(payload.size(), manifest_offset + manifest_size_);
+  return loader->Init(
+      payload.data() + manifest_offset, manifest_size_, out_manifest);
+}
+
 ErrorCode PayloadMetadata::ValidateMetadataSignature(
     const brillo::Blob& payload,
     const string& metadata_signature,
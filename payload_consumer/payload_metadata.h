@@ -26,6 +26,7 @@
 #include <brillo/secure_blob.h>
 
 #include "update_engine/common/error_code.h"
+#include "update_engine/payload_consumer/partition_operations_loader.h"
 #include "update_engine/payload_consumer/payload_verifier.h"
 #include "update_engine/update_metadata.pb.h"
 
@@ -94,6 +95,12 @@ class PayloadMetadata {
                    size_t size,
                    DeltaArchiveManifest* out_manifest) const;
 
+  // Like GetManifest(), but leaves the operations of every partition out of
+  // |*out_manifest|, they can be loaded through |loader| instead.
+  bool GetManifest(const brillo::Blob& payload,
+                   PartitionOperationsLoader* loader,
+                   DeltaArchiveManifest* out_manifest) const;
+
   // Parses a payload file |payload_path| and prepares the metadata properties,
   // manifest and metadata signatures. Can be used as an easy to use utility to
   // get the payload information without manually the process.
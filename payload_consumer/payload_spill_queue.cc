@@ -0,0 +1,205 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/payload_spill_queue.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <base/logging.h>
+
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+// Largest chunk returned by Pop(), so space is handed back to the producer
+// while the consumer is still working through the queue.
+constexpr size_t kMaxPopSize = 1024 * 1024;
+}  // namespace
+
+PayloadSpillQueue::PayloadSpillQueue(size_t memory_size,
+                                     const std::string& spill_path,
+                                     uint64_t spill_size)
+    : memory_size_(memory_size),
+      spill_path_(spill_path),
+      spill_size_(spill_path.empty() ? 0 : spill_size) {}
+
+bool PayloadSpillQueue::Init() {
+  TEST_AND_RETURN_FALSE(memory_size_ > 0);
+  ring_.resize(memory_size_);
+  if (spill_size_ == 0) {
+    return true;
+  }
+  spill_fd_.reset(open(
+      spill_path_.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600));
+  if (spill_fd_ < 0) {
+    PLOG(ERROR) << "Unable to create spill file " << spill_path_;
+    return false;
+  }
+  // Only the descriptor is needed, so nothing is left behind on a crash.
+  if (unlink(spill_path_.c_str()) != 0) {
+    PLOG(WARNING) << "Unable to unlink spill file " << spill_path_;
+  }
+  return true;
+}
+
+void PayloadSpillQueue::CopyToRing(uint64_t offset,
+                                   const uint8_t* data,
+                                   size_t size) {
+  offset %= memory_size_;
+  const size_t first = std::min<uint64_t>(size, memory_size_ - offset);
+  std::copy(data, data + first, ring_.begin() + offset);
+  std::copy(data + first, data + size, ring_.begin());
+}
+
+bool PayloadSpillQueue::Push(const void* data, size_t size) {
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (size > 0) {
+    if (aborted_) {
+      return false;
+    }
+    const uint64_t spill_used = spill_write_offset_ - spill_read_offset_;
+    size_t count = 0;
+    if (!waiting_for_low_water_ && spill_used == 0 &&
+        ring_used_ < memory_size_) {
+      count = std::min<uint64_t>(size, memory_size_ - ring_used_);
+      const uint64_t offset = ring_start_ + ring_used_;
+      lock.unlock();
+      CopyToRing(offset, bytes, count);
+      lock.lock();
+      ring_used_ += count;
+    } else if (!waiting_for_low_water_ && spill_size_ > 0 &&
+               (spill_used == 0 || spill_write_offset_ < spill_size_)) {
+      if (spill_used == 0) {
+        // Reuse the file from the start once the consumer caught up.
+        spill_read_offset_ = spill_write_offset_ = 0;
+      }
+      count = std::min<uint64_t>(size, spill_size_ - spill_write_offset_);
+      const uint64_t offset = spill_write_offset_;
+      lock.unlock();
+      const bool success =
+          utils::PWriteAll(spill_fd_.get(), bytes, count, offset);
+      lock.lock();
+      if (!success) {
+        PLOG(ERROR) << "Unable to write to spill file " << spill_path_;
+        return false;
+      }
+      spill_write_offset_ += count;
+      stats_.spilled_bytes += count;
+    } else {
+      if (!waiting_for_low_water_) {
+        waiting_for_low_water_ = true;
+        stats_.high_water_waits++;
+      }
+      cv_.wait(lock, [this] { return aborted_ || !waiting_for_low_water_; });
+      continue;
+    }
+    bytes += count;
+    size -= count;
+    stats_.buffered_bytes += count;
+    stats_.peak_buffered_bytes =
+        std::max(stats_.peak_buffered_bytes, stats_.buffered_bytes);
+    cv_.notify_all();
+  }
+  return true;
+}
+
+void PayloadSpillQueue::Close() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  closed_ = true;
+  cv_.notify_all();
+}
+
+void PayloadSpillQueue::Abort() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  aborted_ = true;
+  cv_.notify_all();
+}
+
+void PayloadSpillQueue::SetPaused(bool paused) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  paused_ = paused;
+  cv_.notify_all();
+}
+
+bool PayloadSpillQueue::Pop(brillo::Blob* data) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  bool empty_wait = false;
+  while (!aborted_ && (paused_ || (!closed_ && stats_.buffered_bytes == 0))) {
+    if (!paused_ && !empty_wait) {
+      stats_.empty_waits++;
+      empty_wait = true;
+    }
+    cv_.wait(lock);
+  }
+  if (aborted_) {
+    return false;
+  }
+  const uint64_t spill_used = spill_write_offset_ - spill_read_offset_;
+  size_t count = 0;
+  if (ring_used_ > 0) {
+    const uint64_t start = ring_start_;
+    count = std::min<uint64_t>(
+        {ring_used_, memory_size_ - start, uint64_t{kMaxPopSize}});
+    lock.unlock();
+    data->assign(ring_.begin() + start, ring_.begin() + start + count);
+    lock.lock();
+    ring_start_ = (ring_start_ + count) % memory_size_;
+    ring_used_ -= count;
+  } else if (spill_used > 0) {
+    count = std::min<uint64_t>(spill_used, kMaxPopSize);
+    const uint64_t offset = spill_read_offset_;
+    lock.unlock();
+    data->resize(count);
+    ssize_t bytes_read = 0;
+    const bool success = utils::PReadAll(spill_fd_.get(),
+                                         data->data(),
+                                         count,
+                                         offset,
+                                         &bytes_read) &&
+                         bytes_read == static_cast<ssize_t>(count);
+    lock.lock();
+    if (!success) {
+      PLOG(ERROR) << "Unable to read from spill file " << spill_path_;
+      return false;
+    }
+    spill_read_offset_ += count;
+  } else {
+    // Closed and empty.
+    return false;
+  }
+  stats_.buffered_bytes -= count;
+  // Let the producer continue once it has room to keep going for a while. The
+  // spill file is only reused from its start once it was fully drained.
+  if (waiting_for_low_water_ && stats_.buffered_bytes <= low_water_mark() &&
+      (spill_read_offset_ == spill_write_offset_ ||
+       spill_write_offset_ < spill_size_)) {
+    waiting_for_low_water_ = false;
+    cv_.notify_all();
+  }
+  return true;
+}
+
+PayloadSpillQueue::Stats PayloadSpillQueue::GetStats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return stats_;
+}
+
+}  // namespace chromeos_update_engine
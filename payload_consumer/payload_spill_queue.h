@@ -0,0 +1,130 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_PAYLOAD_SPILL_QUEUE_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_PAYLOAD_SPILL_QUEUE_H_
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+#include <android-base/unique_fd.h>
+#include <base/macros.h>
+#include <brillo/secure_blob.h>
+
+namespace chromeos_update_engine {
+
+// A byte queue between the thread downloading a payload and the thread
+// applying it. Data is kept in a ring buffer in memory, and once that is full
+// it's appended to a spill file instead, so a slow operation doesn't stall the
+// download until both are full. Bytes are popped in the order they were
+// pushed.
+//
+// Once the queue reaches its high-water mark (memory and spill file full),
+// Push() blocks until the applier drained it down to the low-water mark, so
+// the download resumes with enough room to keep going for a while.
+//
+// Push() and Close() must be called from a single producer thread, Pop() from
+// a single consumer thread.
+class PayloadSpillQueue {
+ public:
+  struct Stats {
+    // Bytes pushed and not popped yet.
+    uint64_t buffered_bytes{0};
+    // Highest value of |buffered_bytes|.
+    uint64_t peak_buffered_bytes{0};
+    // Bytes which went through the spill file.
+    uint64_t spilled_bytes{0};
+    // Times the producer blocked at the high-water mark.
+    uint64_t high_water_waits{0};
+    // Times the consumer found the queue empty and had to wait.
+    uint64_t empty_waits{0};
+  };
+
+  // Buffers up to |memory_size| bytes in memory and |spill_size| more in a
+  // file at |spill_path|. The file is unlinked as soon as it's opened. Without
+  // a |spill_path| only memory is used.
+  PayloadSpillQueue(size_t memory_size,
+                    const std::string& spill_path,
+                    uint64_t spill_size);
+  ~PayloadSpillQueue() = default;
+
+  // Opens the spill file. Returns false if it can't be created.
+  bool Init();
+
+  // Appends |size| bytes of |data|, blocking while the queue is at its
+  // high-water mark. Returns false if the queue was aborted or writing to the
+  // spill file failed.
+  bool Push(const void* data, size_t size);
+
+  // Signals that no more data will be pushed.
+  void Close();
+
+  // Makes both Push() and Pop() fail from now on, and wakes up any of them
+  // which is blocked.
+  void Abort();
+
+  // While paused, Pop() waits even if there is data, e.g. while the update is
+  // suspended. Push() is not affected.
+  void SetPaused(bool paused);
+
+  // Replaces |data| with the oldest bytes in the queue, waiting for some if
+  // it's empty or while the queue is paused. Returns false once the queue is
+  // closed and empty, or aborted.
+  bool Pop(brillo::Blob* data);
+
+  Stats GetStats() const;
+
+  uint64_t high_water_mark() const { return memory_size_ + spill_size_; }
+  uint64_t low_water_mark() const { return memory_size_ / 2; }
+
+ private:
+  // Copies |size| bytes to the ring buffer at |offset|, wrapping around.
+  void CopyToRing(uint64_t offset, const uint8_t* data, size_t size);
+
+  const size_t memory_size_;
+  const std::string spill_path_;
+  const uint64_t spill_size_;
+
+  // The memory ring and the spill file. Only the producer writes to the free
+  // part of them and only the consumer reads from the used part, so the data
+  // is copied without holding |mutex_|.
+  brillo::Blob ring_;
+  android::base::unique_fd spill_fd_;
+
+  mutable std::mutex mutex_;
+  std::condition_variable cv_;
+  // Protected by |mutex_|. Data in the spill file always follows the data in
+  // the ring, so nothing is pushed to the ring while the spill file isn't
+  // empty.
+  uint64_t ring_start_{0};
+  uint64_t ring_used_{0};
+  uint64_t spill_read_offset_{0};
+  uint64_t spill_write_offset_{0};
+  bool waiting_for_low_water_{false};
+  bool closed_{false};
+  bool aborted_{false};
+  bool paused_{false};
+  Stats stats_;
+
+  DISALLOW_COPY_AND_ASSIGN(PayloadSpillQueue);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_PAYLOAD_SPILL_QUEUE_H_
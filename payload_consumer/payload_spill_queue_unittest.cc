@@ -0,0 +1,168 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/payload_spill_queue.h"
+
+#include <algorithm>
+#include <chrono>
+#include <future>
+#include <string>
+#include <thread>
+
+#include <base/files/file_path.h>
+#include <base/files/scoped_temp_dir.h>
+#include <brillo/secure_blob.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+class PayloadSpillQueueTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    ASSERT_TRUE(temp_dir_.CreateUniqueTempDir());
+    spill_path_ = temp_dir_.GetPath().Append("spill").value();
+    for (size_t i = 0; i < 10000; i++) {
+      data_.push_back(i * 7 % 251);
+    }
+  }
+
+  // Pushes |data_| in chunks of growing size from another thread and pops it
+  // all back.
+  brillo::Blob PushAndPop(PayloadSpillQueue* queue) {
+    std::thread producer([this, queue] {
+      size_t offset = 0;
+      for (size_t chunk = 1; offset < data_.size();
+           chunk = chunk * 3 % 97 + 1) {
+        chunk = std::min(chunk, data_.size() - offset);
+        EXPECT_TRUE(queue->Push(data_.data() + offset, chunk));
+        offset += chunk;
+      }
+      queue->Close();
+    });
+    brillo::Blob result;
+    brillo::Blob chunk;
+    while (queue->Pop(&chunk)) {
+      result.insert(result.end(), chunk.begin(), chunk.end());
+    }
+    producer.join();
+    return result;
+  }
+
+  base::ScopedTempDir temp_dir_;
+  std::string spill_path_;
+  brillo::Blob data_;
+};
+
+TEST_F(PayloadSpillQueueTest, MemoryOnlyTest) {
+  PayloadSpillQueue queue(64, "", 0);
+  ASSERT_TRUE(queue.Init());
+  EXPECT_EQ(data_, PushAndPop(&queue));
+  const auto stats = queue.GetStats();
+  EXPECT_EQ(0u, stats.buffered_bytes);
+  EXPECT_EQ(0u, stats.spilled_bytes);
+  EXPECT_LE(stats.peak_buffered_bytes, 64u);
+}
+
+TEST_F(PayloadSpillQueueTest, SpillTest) {
+  PayloadSpillQueue queue(16, spill_path_, 256);
+  ASSERT_TRUE(queue.Init());
+  // The spill file is unlinked right away.
+  EXPECT_FALSE(utils::FileExists(spill_path_.c_str()));
+
+  // Fill the memory and the spill file before anything is popped.
+  ASSERT_TRUE(queue.Push(data_.data(), 272));
+  EXPECT_EQ(272u, queue.GetStats().buffered_bytes);
+  EXPECT_EQ(256u, queue.GetStats().spilled_bytes);
+  brillo::Blob result;
+  brillo::Blob chunk;
+  while (result.size() < 272) {
+    ASSERT_TRUE(queue.Pop(&chunk));
+    result.insert(result.end(), chunk.begin(), chunk.end());
+  }
+  EXPECT_EQ(brillo::Blob(data_.begin(), data_.begin() + 272), result);
+
+  PayloadSpillQueue queue2(16, spill_path_, 256);
+  ASSERT_TRUE(queue2.Init());
+  EXPECT_EQ(data_, PushAndPop(&queue2));
+  EXPECT_EQ(0u, queue2.GetStats().buffered_bytes);
+  EXPECT_LE(queue2.GetStats().peak_buffered_bytes, 272u);
+}
+
+TEST_F(PayloadSpillQueueTest, HighWaterMarkTest) {
+  PayloadSpillQueue queue(16, spill_path_, 32);
+  ASSERT_TRUE(queue.Init());
+  EXPECT_EQ(48u, queue.high_water_mark());
+  EXPECT_EQ(8u, queue.low_water_mark());
+  ASSERT_TRUE(queue.Push(data_.data(), 48));
+
+  // The producer blocks until the queue is back down to the low-water mark.
+  std::thread producer([&queue, this] {
+    EXPECT_TRUE(queue.Push(data_.data() + 48, 1));
+  });
+  brillo::Blob chunk;
+  while (queue.GetStats().high_water_waits == 0) {
+    std::this_thread::yield();
+  }
+  ASSERT_TRUE(queue.Pop(&chunk));
+  EXPECT_EQ(16u, chunk.size());
+  ASSERT_TRUE(queue.Pop(&chunk));
+  EXPECT_EQ(32u, chunk.size());
+  producer.join();
+  EXPECT_EQ(1u, queue.GetStats().buffered_bytes);
+  EXPECT_EQ(1u, queue.GetStats().high_water_waits);
+}
+
+TEST_F(PayloadSpillQueueTest, AbortTest) {
+  PayloadSpillQueue queue(16, "", 0);
+  ASSERT_TRUE(queue.Init());
+  ASSERT_TRUE(queue.Push(data_.data(), 16));
+  std::thread producer(
+      [&queue, this] { EXPECT_FALSE(queue.Push(data_.data(), 1)); });
+  while (queue.GetStats().high_water_waits == 0) {
+    std::this_thread::yield();
+  }
+  queue.Abort();
+  producer.join();
+  brillo::Blob chunk;
+  EXPECT_FALSE(queue.Pop(&chunk));
+}
+
+TEST_F(PayloadSpillQueueTest, PauseTest) {
+  PayloadSpillQueue queue(16, "", 0);
+  ASSERT_TRUE(queue.Init());
+  queue.SetPaused(true);
+  ASSERT_TRUE(queue.Push(data_.data(), 4));
+  queue.Close();
+
+  std::promise<brillo::Blob> popped;
+  std::future<brillo::Blob> result = popped.get_future();
+  std::thread consumer([&queue, &popped] {
+    brillo::Blob chunk;
+    EXPECT_TRUE(queue.Pop(&chunk));
+    popped.set_value(chunk);
+  });
+  // Pop() waits even though there is data and the queue is closed.
+  EXPECT_EQ(std::future_status::timeout,
+            result.wait_for(std::chrono::milliseconds(100)));
+  queue.SetPaused(false);
+  EXPECT_EQ(brillo::Blob(data_.begin(), data_.begin() + 4), result.get());
+  consumer.join();
+  EXPECT_EQ(0u, queue.GetStats().empty_waits);
+}
+
+}  // namespace chromeos_update_engine
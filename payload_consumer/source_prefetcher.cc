@@ -0,0 +1,185 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/source_prefetcher.h"
+
+#include <fcntl.h>
+#include <string.h>
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include <base/logging.h>
+
+#include "update_engine/payload_consumer/payload_constants.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+// Operations which read their source extents into memory before patching.
+// SOURCE_COPY is left out, it's either copied in kernel or never reads the
+// source at all with Virtual A/B compression.
+bool IsSourceDiffOperation(InstallOperation::Type type) {
+  switch (type) {
+    case InstallOperation::SOURCE_BSDIFF:
+    case InstallOperation::BROTLI_BSDIFF:
+    case InstallOperation::PUFFDIFF:
+    case InstallOperation::ZUCCHINI:
+    case InstallOperation::LZ4DIFF_BSDIFF:
+    case InstallOperation::LZ4DIFF_PUFFDIFF:
+      return true;
+    default:
+      return false;
+  }
+}
+}  // namespace
+
+SourcePrefetcher::~SourcePrefetcher() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  cv_.notify_all();
+  if (worker_.joinable()) {
+    worker_.join();
+  }
+}
+
+bool SourcePrefetcher::Open(const std::string& source_path,
+                            size_t block_size,
+                            size_t window) {
+  Close();
+  if (window == 0) {
+    return false;
+  }
+  block_size_ = block_size;
+  window_ = window;
+  android::base::unique_fd fd(open(source_path.c_str(), O_RDONLY | O_CLOEXEC));
+  if (fd < 0) {
+    PLOG(WARNING) << "Unable to open " << source_path << " for prefetching";
+    return false;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    fd_ = std::move(fd);
+  }
+  open_ = true;
+  if (!worker_.joinable()) {
+    worker_ = std::thread(&SourcePrefetcher::WorkerLoop, this);
+  }
+  return true;
+}
+
+void SourcePrefetcher::Close() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  requests_.clear();
+  // The worker may still be using the descriptor.
+  cv_.wait(lock, [this] { return !worker_busy_; });
+  fd_.reset();
+  open_ = false;
+  next_unqueued_op_ = 0;
+  queued_ops_.clear();
+  queued_ops_bytes_ = 0;
+}
+
+void SourcePrefetcher::Prefetch(
+    const google::protobuf::RepeatedPtrField<InstallOperation>& operations,
+    size_t next_op) {
+  // Prefetching is disabled or the source couldn't be opened.
+  if (!open_) {
+    return;
+  }
+  // Forget about the operations already applied.
+  while (!queued_ops_.empty() && queued_ops_.front().first < next_op) {
+    queued_ops_bytes_ -= queued_ops_.front().second;
+    queued_ops_.pop_front();
+  }
+  next_unqueued_op_ = std::max(next_unqueued_op_, next_op);
+  const size_t end =
+      std::min(static_cast<size_t>(operations.size()), next_op + window_);
+  std::vector<Request> requests;
+  for (; next_unqueued_op_ < end && queued_ops_bytes_ < kMaxPrefetchBytes;
+       next_unqueued_op_++) {
+    const InstallOperation& operation = operations[next_unqueued_op_];
+    if (!IsSourceDiffOperation(operation.type())) {
+      continue;
+    }
+    uint64_t bytes = 0;
+    for (const Extent& extent : operation.src_extents()) {
+      if (extent.start_block() == kSparseHole || extent.num_blocks() == 0) {
+        continue;
+      }
+      const Request request{extent.start_block() * block_size_,
+                            extent.num_blocks() * block_size_};
+      if (!requests.empty() &&
+          requests.back().offset + requests.back().length == request.offset) {
+        requests.back().length += request.length;
+      } else {
+        requests.push_back(request);
+      }
+      bytes += request.length;
+    }
+    queued_ops_.emplace_back(next_unqueued_op_, bytes);
+    queued_ops_bytes_ += bytes;
+  }
+  if (requests.empty()) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  requests_.insert(requests_.end(), requests.begin(), requests.end());
+  cv_.notify_all();
+}
+
+void SourcePrefetcher::Cancel() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  requests_.clear();
+}
+
+uint64_t SourcePrefetcher::prefetched_bytes() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return prefetched_bytes_;
+}
+
+void SourcePrefetcher::WorkerLoop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    cv_.wait(lock, [this] { return stopping_ || !requests_.empty(); });
+    if (stopping_) {
+      return;
+    }
+    const Request request = requests_.front();
+    requests_.pop_front();
+    const int fd = fd_.get();
+    worker_busy_ = true;
+    lock.unlock();
+    const int err =
+        posix_fadvise(fd, request.offset, request.length, POSIX_FADV_WILLNEED);
+    lock.lock();
+    worker_busy_ = false;
+    if (err == 0) {
+      prefetched_bytes_ += request.length;
+    } else {
+      // Not fatal, the data is read when the operation is applied anyway.
+      LOG(WARNING) << "posix_fadvise() failed: " << strerror(err)
+                   << ", dropping pending prefetch requests.";
+      requests_.clear();
+    }
+    cv_.notify_all();
+  }
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,109 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_SOURCE_PREFETCHER_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_SOURCE_PREFETCHER_H_
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+
+#include <android-base/unique_fd.h>
+#include <base/macros.h>
+#include <google/protobuf/repeated_field.h>
+
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// Asks the kernel to read the source extents of upcoming diff operations into
+// the page cache, so they're already there when the operation is applied
+// instead of being read while the CPU waits. The requests are issued from a
+// background thread since posix_fadvise() may block while the request queue
+// of the device is full.
+//
+// Prefetch() is meant to be called by a single thread as it walks the
+// operations of the partition, Cancel() may be called from any thread.
+class SourcePrefetcher {
+ public:
+  // Upper bound of the source data prefetched for operations which weren't
+  // applied yet, so large operations don't evict each other from the cache.
+  static constexpr uint64_t kMaxPrefetchBytes = 64 * 1024 * 1024;
+
+  SourcePrefetcher() = default;
+  ~SourcePrefetcher();
+
+  // Starts prefetching the source of up to |window| operations ahead from the
+  // source partition at |source_path|, whose extents are in blocks of
+  // |block_size| bytes. A |window| of 0 disables prefetching.
+  bool Open(const std::string& source_path, size_t block_size, size_t window);
+
+  // Drops pending requests and closes the source partition.
+  void Close();
+
+  // Queues the source extents of the diff operations starting at index
+  // |next_op| of |operations|, up to the look-ahead window. Operations queued
+  // by earlier calls aren't queued again.
+  void Prefetch(
+      const google::protobuf::RepeatedPtrField<InstallOperation>& operations,
+      size_t next_op);
+
+  // Drops the requests not issued yet. Later calls to Prefetch() only queue
+  // operations past the ones already queued.
+  void Cancel();
+
+  // Bytes of source data requested so far.
+  uint64_t prefetched_bytes() const;
+
+ private:
+  struct Request {
+    uint64_t offset;
+    uint64_t length;
+  };
+
+  void WorkerLoop();
+
+  // Only used by the thread calling Prefetch(). |open_| is set while the
+  // source is open, |next_unqueued_op_| is the first operation not queued yet,
+  // |queued_ops_| the bytes queued for every operation still ahead.
+  bool open_{false};
+  size_t block_size_{0};
+  size_t window_{0};
+  size_t next_unqueued_op_{0};
+  std::deque<std::pair<size_t, uint64_t>> queued_ops_;
+  uint64_t queued_ops_bytes_{0};
+
+  mutable std::mutex mutex_;
+  std::condition_variable cv_;
+  // Protected by |mutex_|.
+  android::base::unique_fd fd_;
+  std::deque<Request> requests_;
+  bool worker_busy_{false};
+  bool stopping_{false};
+  uint64_t prefetched_bytes_{0};
+  std::thread worker_;
+
+  DISALLOW_COPY_AND_ASSIGN(SourcePrefetcher);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_SOURCE_PREFETCHER_H_
@@ -0,0 +1,107 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/source_prefetcher.h"
+
+#include <chrono>
+#include <string>
+#include <thread>
+
+#include <base/files/file_path.h>
+#include <base/files/scoped_temp_dir.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+constexpr size_t kBlockSize = 4096;
+
+void AddOperation(
+    google::protobuf::RepeatedPtrField<InstallOperation>* operations,
+    InstallOperation::Type type,
+    uint64_t start_block,
+    uint64_t num_blocks) {
+  auto operation = operations->Add();
+  operation->set_type(type);
+  *operation->add_src_extents() = ExtentForRange(start_block, num_blocks);
+}
+}  // namespace
+
+class SourcePrefetcherTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    ASSERT_TRUE(temp_dir_.CreateUniqueTempDir());
+    source_path_ = temp_dir_.GetPath().Append("source").value();
+    const std::string data(16 * kBlockSize, 'a');
+    ASSERT_TRUE(
+        utils::WriteFile(source_path_.c_str(), data.data(), data.size()));
+  }
+
+  // Waits until |prefetcher| requested |blocks| blocks in total.
+  void WaitForPrefetchedBlocks(const SourcePrefetcher& prefetcher,
+                               uint64_t blocks) {
+    for (int i = 0;
+         i < 1000 && prefetcher.prefetched_bytes() < blocks * kBlockSize;
+         i++) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    EXPECT_EQ(blocks * kBlockSize, prefetcher.prefetched_bytes());
+  }
+
+  base::ScopedTempDir temp_dir_;
+  std::string source_path_;
+};
+
+TEST_F(SourcePrefetcherTest, WindowTest) {
+  google::protobuf::RepeatedPtrField<InstallOperation> operations;
+  AddOperation(&operations, InstallOperation::SOURCE_BSDIFF, 0, 2);
+  // SOURCE_COPY operations aren't prefetched.
+  AddOperation(&operations, InstallOperation::SOURCE_COPY, 2, 1);
+  AddOperation(&operations, InstallOperation::PUFFDIFF, 4, 1);
+  AddOperation(&operations, InstallOperation::BROTLI_BSDIFF, 5, 3);
+
+  SourcePrefetcher prefetcher;
+  ASSERT_TRUE(prefetcher.Open(source_path_, kBlockSize, 2));
+  prefetcher.Prefetch(operations, 0);
+  WaitForPrefetchedBlocks(prefetcher, 2);
+  // Operations already queued are skipped.
+  prefetcher.Prefetch(operations, 0);
+  prefetcher.Prefetch(operations, 1);
+  WaitForPrefetchedBlocks(prefetcher, 3);
+  prefetcher.Prefetch(operations, 3);
+  WaitForPrefetchedBlocks(prefetcher, 6);
+
+  // Reopening starts from the first operation again.
+  ASSERT_TRUE(prefetcher.Open(source_path_, kBlockSize, 2));
+  prefetcher.Prefetch(operations, 2);
+  WaitForPrefetchedBlocks(prefetcher, 10);
+  prefetcher.Close();
+}
+
+TEST_F(SourcePrefetcherTest, DisabledTest) {
+  SourcePrefetcher prefetcher;
+  EXPECT_FALSE(prefetcher.Open(source_path_, kBlockSize, 0));
+  EXPECT_FALSE(prefetcher.Open(source_path_ + ".missing", kBlockSize, 2));
+  google::protobuf::RepeatedPtrField<InstallOperation> operations;
+  AddOperation(&operations, InstallOperation::SOURCE_BSDIFF, 0, 2);
+  prefetcher.Prefetch(operations, 0);
+  EXPECT_EQ(0u, prefetcher.prefetched_bytes());
+}
+
+}  // namespace chromeos_update_engine
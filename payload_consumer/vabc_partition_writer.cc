@@ -27,6 +27,7 @@
 
 #include "update_engine/common/cow_operation_convert.h"
 #include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/batched_cow_writer.h"
 #include "update_engine/payload_consumer/extent_map.h"
 #include "update_engine/payload_consumer/file_descriptor.h"
 #include "update_engine/payload_consumer/install_plan.h"
@@ -80,18 +81,27 @@ VABCPartitionWriter::VABCPartitionWriter(
     const PartitionUpdate& partition_update,
     const InstallPlan::Partition& install_part,
     DynamicPartitionControlInterface* dynamic_control,
-    size_t block_size)
+    size_t block_size,
+    const OperationIndex::Partition* operation_index)
     : partition_update_(partition_update),
       install_part_(install_part),
       dynamic_control_(dynamic_control),
       block_size_(block_size),
       executor_(block_size),
       verified_source_fd_(block_size, install_part.source_path) {
-  for (const auto& cow_op : partition_update_.merge_operations()) {
-    if (cow_op.type() != CowMergeOperation::COW_COPY) {
-      continue;
+  if (operation_index) {
+    operation_index_ = *operation_index;
+  }
+  if (!operation_index_ || !operation_index_->GetCopyBlocks(
+                               partition_update_.merge_operations(),
+                               &copy_blocks_)) {
+    copy_blocks_ = ExtentRanges();
+    for (const auto& cow_op : partition_update_.merge_operations()) {
+      if (cow_op.type() != CowMergeOperation::COW_COPY) {
+        continue;
+      }
+      copy_blocks_.AddExtent(cow_op.dst_extent());
     }
-    copy_blocks_.AddExtent(cow_op.dst_extent());
   }
   LOG(INFO) << "Partition `" << partition_update.partition_name() << "` has "
             << copy_blocks_.blocks() << " copy blocks";
@@ -207,7 +217,11 @@ bool VABCPartitionWriter::Init(const InstallPlan* install_plan,
                                bool source_may_exist,
                                size_t next_op_index) {
   if (dynamic_control_->GetVirtualAbCompressionXorFeatureFlag().IsEnabled()) {
-    xor_map_ = ComputeXorMap(partition_update_.merge_operations());
+    if (!operation_index_ ||
+        !operation_index_->GetXorMap(partition_update_.merge_operations(),
+                                     &xor_map_)) {
+      xor_map_ = ComputeXorMap(partition_update_.merge_operations());
+    }
     if (xor_map_.size() > 0) {
       LOG(INFO) << "Virtual AB Compression with XOR is enabled";
     } else {
@@ -240,9 +254,14 @@ bool VABCPartitionWriter::Init(const InstallPlan* install_plan,
     label = {next_op_index};
   }
 
-  cow_writer_ =
+  auto cow_writer =
       dynamic_control_->OpenCowWriter(install_part_.name, source_path, label);
-  TEST_AND_RETURN_FALSE(cow_writer_ != nullptr);
+  TEST_AND_RETURN_FALSE(cow_writer != nullptr);
+  // Stage COW_REPLACE/COW_XOR blocks across InstallOperations, so that COW
+  // compression runs on large batches off the thread applying operations.
+  // Labels flush the staged blocks, so resume points stay exact.
+  cow_writer_ =
+      std::make_unique<BatchedCowWriter>(std::move(cow_writer), block_size_);
 
   if (label) {
     return true;
@@ -330,11 +349,14 @@ bool VABCPartitionWriter::WriteMergeSequence(
 }
 
 std::unique_ptr<ExtentWriter> VABCPartitionWriter::CreateBaseExtentWriter() {
-  return std::make_unique<SnapshotExtentWriter>(cow_writer_.get());
+  return TimeExtentWriter(
+      std::make_unique<SnapshotExtentWriter>(cow_writer_.get()),
+      operation_stats_);
 }
 
 [[nodiscard]] bool VABCPartitionWriter::PerformZeroOrDiscardOperation(
     const InstallOperation& operation) {
+  ScopedOperationStage stage(operation_stats_, OperationStats::Stage::kWrite);
   for (const auto& extent : operation.dst_extents()) {
     TEST_AND_RETURN_FALSE(
         cow_writer_->AddZeroBlocks(extent.start_block(), extent.num_blocks()));
@@ -344,8 +366,14 @@ std::unique_ptr<ExtentWriter> VABCPartitionWriter::CreateBaseExtentWriter() {
 
 [[nodiscard]] bool VABCPartitionWriter::PerformSourceCopyOperation(
     const InstallOperation& operation, ErrorCode* error) {
-  auto source_fd = verified_source_fd_.ChooseSourceFD(operation, error);
+  FileDescriptorPtr source_fd;
+  {
+    ScopedOperationStage stage(operation_stats_,
+                               OperationStats::Stage::kSourceRead);
+    source_fd = verified_source_fd_.ChooseSourceFD(operation, error);
+  }
 
+  ScopedOperationStage stage(operation_stats_, OperationStats::Stage::kWrite);
   return ProcessSourceCopyOperation(operation,
                                     block_size_,
                                     copy_blocks_,
@@ -368,30 +396,42 @@ bool VABCPartitionWriter::PerformDiffOperation(
     ErrorCode* error,
     const void* data,
     size_t count) {
-  FileDescriptorPtr source_fd =
-      verified_source_fd_.ChooseSourceFD(operation, error);
+  FileDescriptorPtr source_fd;
+  {
+    ScopedOperationStage stage(operation_stats_,
+                               OperationStats::Stage::kSourceRead);
+    source_fd = verified_source_fd_.ChooseSourceFD(operation, error);
+  }
   TEST_AND_RETURN_FALSE(source_fd != nullptr);
   TEST_AND_RETURN_FALSE(source_fd->IsOpen());
 
   std::unique_ptr<ExtentWriter> writer =
-      IsXorEnabled() ? std::make_unique<XORExtentWriter>(
-                           operation,
-                           source_fd,
-                           cow_writer_.get(),
-                           xor_map_,
-                           partition_update_.old_partition_info().size())
-                     : CreateBaseExtentWriter();
+      IsXorEnabled()
+          ? TimeExtentWriter(std::make_unique<XORExtentWriter>(
+                                 operation,
+                                 source_fd,
+                                 cow_writer_.get(),
+                                 xor_map_,
+                                 partition_update_.old_partition_info().size()),
+                             operation_stats_)
+          : CreateBaseExtentWriter();
+  // The XOR writer reads the source as part of the write stage, only the reads
+  // of the patch are timed as source reads.
   return executor_.ExecuteDiffOperation(
-      operation, std::move(writer), source_fd, data, count);
+      operation,
+      std::move(writer),
+      TimeSourceFileDescriptor(source_fd, operation_stats_),
+      data,
+      count);
 }
 
-void VABCPartitionWriter::CheckpointUpdateProgress(size_t next_op_index) {
+bool VABCPartitionWriter::CheckpointUpdateProgress(size_t next_op_index) {
   // No need to call fsync/sync, as CowWriter flushes after a label is added
   // added.
   // if cow_writer_ failed, that means Init() failed. This function shouldn't be
   // called if Init() fails.
-  TEST_AND_RETURN(cow_writer_ != nullptr);
-  cow_writer_->AddLabel(next_op_index);
+  TEST_AND_RETURN_FALSE(cow_writer_ != nullptr);
+  return cow_writer_->AddLabel(next_op_index);
 }
 
 [[nodiscard]] bool VABCPartitionWriter::FinishedInstallOps() {
@@ -19,6 +19,7 @@
 
 #include <map>
 #include <memory>
+#include <optional>
 #include <string>
 #include <vector>
 
@@ -27,6 +28,7 @@
 #include "update_engine/payload_consumer/extent_map.h"
 #include "update_engine/payload_consumer/install_operation_executor.h"
 #include "update_engine/payload_consumer/install_plan.h"
+#include "update_engine/payload_consumer/operation_index.h"
 #include "update_engine/payload_consumer/partition_writer_interface.h"
 #include "update_engine/payload_consumer/verified_source_fd.h"
 #include "update_engine/payload_generator/extent_ranges.h"
@@ -42,10 +44,14 @@ class VABCPartitionWriter final : public PartitionWriterInterface {
       android::snapshot::ICowWriter* cow_writer,
       bool sequence_op_supported);
 
-  VABCPartitionWriter(const PartitionUpdate& partition_update,
-                      const InstallPlan::Partition& install_part,
-                      DynamicPartitionControlInterface* dynamic_control,
-                      size_t block_size);
+  // If |operation_index| is set, the copy blocks and the XOR map are taken from
+  // it instead of being computed from the merge operations.
+  VABCPartitionWriter(
+      const PartitionUpdate& partition_update,
+      const InstallPlan::Partition& install_part,
+      DynamicPartitionControlInterface* dynamic_control,
+      size_t block_size,
+      const OperationIndex::Partition* operation_index = nullptr);
   [[nodiscard]] bool Init(const InstallPlan* install_plan,
                           bool source_may_exist,
                           size_t next_op_index) override;
@@ -68,10 +74,13 @@ class VABCPartitionWriter final : public PartitionWriterInterface {
                                           const void* data,
                                           size_t count) override;
 
-  void CheckpointUpdateProgress(size_t next_op_index) override;
+  [[nodiscard]] bool CheckpointUpdateProgress(size_t next_op_index) override;
 
   [[nodiscard]] bool FinishedInstallOps() override;
   int Close() override;
+  void SetOperationStats(OperationStats* stats) override {
+    operation_stats_ = stats;
+  }
   // Send merge sequence data to cow writer
   static bool WriteMergeSequence(
       const ::google::protobuf::RepeatedPtrField<CowMergeOperation>& merge_ops,
@@ -96,6 +105,9 @@ class VABCPartitionWriter final : public PartitionWriterInterface {
   VerifiedSourceFd verified_source_fd_;
   ExtentMap<const CowMergeOperation*, ExtentLess> xor_map_;
   ExtentRanges copy_blocks_;
+  std::optional<OperationIndex::Partition> operation_index_;
+  // Where the time spent reading and writing is recorded, if set.
+  OperationStats* operation_stats_{nullptr};
 };
 
 }  // namespace chromeos_update_engine
@@ -20,47 +20,81 @@
 
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/xor_extent_writer.h"
+#include "update_engine/payload_consumer/xor_utils.h"
 #include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/payload_generator/extent_utils.h"
 #include "update_engine/update_metadata.pb.h"
 
 namespace chromeos_update_engine {
-bool XORExtentWriter::WriteXorCowOp(const uint8_t* bytes,
-                                    const size_t size,
-                                    const Extent& xor_ext,
-                                    const size_t src_offset) {
-  xor_block_data.resize(BlockSize() * xor_ext.num_blocks());
-  const auto src_block = src_offset / BlockSize();
-  ssize_t bytes_read = 0;
-  TEST_AND_RETURN_FALSE_ERRNO(utils::PReadAll(source_fd_,
-                                              xor_block_data.data(),
-                                              xor_block_data.size(),
-                                              src_offset,
-                                              &bytes_read));
-  if (bytes_read != static_cast<ssize_t>(xor_block_data.size())) {
-    LOG(ERROR) << "bytes_read: " << bytes_read << ", expected to read "
-               << xor_block_data.size() << " at block " << src_block
-               << " offset " << src_offset % BlockSize();
-    return false;
+bool XORExtentWriter::WriteXorCowOp(const XorCowOp& xor_op) {
+  const size_t size = xor_op.xor_ext.num_blocks() * BlockSize();
+  uint8_t* data = xor_block_data.data() + xor_op.buffer_offset;
+  XorInPlace(data, xor_op.bytes, size);
+  TEST_AND_RETURN_FALSE(
+      cow_writer_->AddXorBlocks(xor_op.xor_ext.start_block(),
+                                data,
+                                size,
+                                xor_op.src_offset / BlockSize(),
+                                xor_op.src_offset % BlockSize()));
+  return true;
+}
+
+bool XORExtentWriter::ReadXorSources(std::vector<XorCowOp>* xor_ops) {
+  // Stage the source data in source order, so that ops reading adjacent source
+  // bytes also end up adjacent in |xor_block_data| and can share one read.
+  std::vector<XorCowOp*> by_source;
+  by_source.reserve(xor_ops->size());
+  size_t total_size = 0;
+  for (auto& xor_op : *xor_ops) {
+    by_source.push_back(&xor_op);
+    total_size += xor_op.xor_ext.num_blocks() * BlockSize();
   }
+  std::stable_sort(by_source.begin(),
+                   by_source.end(),
+                   [](const XorCowOp* a, const XorCowOp* b) {
+                     return a->src_offset < b->src_offset;
+                   });
+  xor_block_data.resize(total_size);
+
+  size_t buffer_offset = 0;
+  size_t run_buffer_offset = 0;
+  uint64_t run_src_offset = 0;
+  for (size_t i = 0; i < by_source.size(); i++) {
+    XorCowOp* xor_op = by_source[i];
+    const size_t size = xor_op->xor_ext.num_blocks() * BlockSize();
+    if (buffer_offset == run_buffer_offset) {
+      run_src_offset = xor_op->src_offset;
+    }
+    xor_op->buffer_offset = buffer_offset;
+    buffer_offset += size;
+    if (i + 1 < by_source.size() &&
+        by_source[i + 1]->src_offset == xor_op->src_offset + size) {
+      continue;
+    }
 
-  std::transform(xor_block_data.cbegin(),
-                 xor_block_data.cbegin() + xor_block_data.size(),
-                 bytes,
-                 xor_block_data.begin(),
-                 std::bit_xor<unsigned char>{});
-  TEST_AND_RETURN_FALSE(cow_writer_->AddXorBlocks(xor_ext.start_block(),
-                                                  xor_block_data.data(),
-                                                  xor_block_data.size(),
-                                                  src_block,
-                                                  src_offset % BlockSize()));
+    const size_t run_size = buffer_offset - run_buffer_offset;
+    ssize_t bytes_read = 0;
+    TEST_AND_RETURN_FALSE_ERRNO(
+        utils::PReadAll(source_fd_,
+                        xor_block_data.data() + run_buffer_offset,
+                        run_size,
+                        run_src_offset,
+                        &bytes_read));
+    if (bytes_read != static_cast<ssize_t>(run_size)) {
+      LOG(ERROR) << "bytes_read: " << bytes_read << ", expected to read "
+                 << run_size << " at block " << run_src_offset / BlockSize()
+                 << " offset " << run_src_offset % BlockSize();
+      return false;
+    }
+    run_buffer_offset = buffer_offset;
+  }
   return true;
 }
 
-bool XORExtentWriter::WriteXorExtent(const uint8_t* bytes,
-                                     const size_t size,
-                                     const Extent& xor_ext,
-                                     const CowMergeOperation* merge_op) {
+bool XORExtentWriter::PlanXorExtent(const uint8_t* bytes,
+                                    const Extent& xor_ext,
+                                    const CowMergeOperation* merge_op,
+                                    std::vector<XorCowOp>* xor_ops) {
   const auto src_block = merge_op->src_extent().start_block() +
                          xor_ext.start_block() -
                          merge_op->dst_extent().start_block();
@@ -85,23 +119,21 @@ bool XORExtentWriter::WriteXorExtent(const uint8_t* bytes,
     Extent non_oob_extent =
         ExtentForRange(xor_ext.start_block(), xor_ext.num_blocks() - 1);
     if (non_oob_extent.num_blocks() > 0) {
-      TEST_AND_RETURN_FALSE(
-          WriteXorCowOp(bytes,
-                        BlockSize() * non_oob_extent.num_blocks(),
-                        non_oob_extent,
-                        src_block * BlockSize() + merge_op->src_offset()));
+      xor_ops->push_back({non_oob_extent,
+                          bytes,
+                          src_block * BlockSize() + merge_op->src_offset(),
+                          0});
     }
     const Extent last_block =
         ExtentForRange(xor_ext.start_block() + xor_ext.num_blocks() - 1, 1);
-    TEST_AND_RETURN_FALSE(
-        WriteXorCowOp(bytes + (xor_ext.num_blocks() - 1) * BlockSize(),
-                      BlockSize(),
-                      last_block,
-                      (src_block + xor_ext.num_blocks() - 1) * BlockSize()));
+    xor_ops->push_back({last_block,
+                        bytes + (xor_ext.num_blocks() - 1) * BlockSize(),
+                        (src_block + xor_ext.num_blocks() - 1) * BlockSize(),
+                        0});
     return true;
   }
-  TEST_AND_RETURN_FALSE(WriteXorCowOp(
-      bytes, size, xor_ext, src_block * BlockSize() + merge_op->src_offset()));
+  xor_ops->push_back(
+      {xor_ext, bytes, src_block * BlockSize() + merge_op->src_offset(), 0});
   return true;
 }
 
@@ -110,6 +142,8 @@ bool XORExtentWriter::WriteExtent(const void* bytes,
                                   const Extent& extent,
                                   const size_t size) {
   const auto xor_extents = xor_map_.GetIntersectingExtents(extent);
+  std::vector<XorCowOp> xor_ops;
+  xor_ops.reserve(xor_extents.size());
   for (const auto& xor_ext : xor_extents) {
     const auto merge_op_opt = xor_map_.Get(xor_ext);
     if (!merge_op_opt.has_value()) {
@@ -143,14 +177,15 @@ bool XORExtentWriter::WriteExtent(const void* bytes,
     const auto i = xor_ext.start_block() - extent.start_block();
     const auto dst_block_data =
         static_cast<const unsigned char*>(bytes) + i * BlockSize();
-    if (!WriteXorExtent(dst_block_data,
-                        xor_ext.num_blocks() * BlockSize(),
-                        xor_ext,
-                        merge_op)) {
+    if (!PlanXorExtent(dst_block_data, xor_ext, merge_op, &xor_ops)) {
       LOG(ERROR) << "Failed to write XOR extent " << xor_ext;
       return false;
     }
   }
+  TEST_AND_RETURN_FALSE(ReadXorSources(&xor_ops));
+  for (const auto& xor_op : xor_ops) {
+    TEST_AND_RETURN_FALSE(WriteXorCowOp(xor_op));
+  }
   const auto replace_extents = xor_map_.GetNonIntersectingExtents(extent);
   return WriteReplaceExtents(replace_extents, extent, bytes, size);
 }
@@ -56,18 +56,31 @@ class XORExtentWriter : public BlockExtentWriter {
                            const Extent& extent,
                            const void* bytes,
                            size_t size);
-  bool WriteXorExtent(const uint8_t* bytes,
-                      const size_t size,
-                      const Extent& xor_ext,
-                      const CowMergeOperation* merge_op);
-  bool WriteXorCowOp(const uint8_t* bytes,
-                     const size_t size,
+  // A single AddXorBlocks() call: the target blocks |xor_ext|, whose new data
+  // is at |bytes|, get XORed with the source data at byte |src_offset|.
+  struct XorCowOp {
+    Extent xor_ext;
+    const uint8_t* bytes;
+    uint64_t src_offset;
+    // Where the source data of this op is staged in |xor_block_data|.
+    size_t buffer_offset;
+  };
+
+  // Validates |xor_ext| against |merge_op| and appends the COW ops needed to
+  // write it to |xor_ops|.
+  bool PlanXorExtent(const uint8_t* bytes,
                      const Extent& xor_ext,
-                     size_t src_offset);
+                     const CowMergeOperation* merge_op,
+                     std::vector<XorCowOp>* xor_ops);
+  // Reads the source data of all |xor_ops| into |xor_block_data| in one pass,
+  // with one read per run of contiguous source bytes.
+  bool ReadXorSources(std::vector<XorCowOp>* xor_ops);
+  bool WriteXorCowOp(const XorCowOp& xor_op);
   const google::protobuf::RepeatedPtrField<Extent>& src_extents_;
   const FileDescriptorPtr source_fd_;
   const ExtentMap<const CowMergeOperation*>& xor_map_;
   android::snapshot::ICowWriter* cow_writer_;
+  // Staging buffer for source data, reused across calls.
   std::vector<uint8_t> xor_block_data;
   const size_t partition_size_;
 };
@@ -20,6 +20,7 @@
 #include <unistd.h>
 
 #include <android-base/file.h>
+#include <base/logging.h>
 #include <gtest/gtest.h>
 #include <libsnapshot/mock_cow_writer.h>
 
@@ -27,6 +28,7 @@
 #include "update_engine/payload_consumer/extent_map.h"
 #include "update_engine/payload_consumer/file_descriptor.h"
 #include "update_engine/payload_consumer/xor_extent_writer.h"
+#include "update_engine/payload_consumer/xor_utils.h"
 #include "update_engine/payload_generator/delta_diff_generator.h"
 #include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/payload_generator/merge_sequence_generator.h"
@@ -36,6 +38,7 @@ namespace chromeos_update_engine {
 
 using testing::_;
 using testing::Args;
+using testing::Invoke;
 using testing::Return;
 
 class XorExtentWriterTest : public ::testing::Test {
@@ -293,4 +296,74 @@ TEST_F(XorExtentWriterTest, LastMultiBlockTest) {
   ASSERT_TRUE(writer_.Write(op_data.data(), op_data.size()));
 }
 
+TEST_F(XorExtentWriterTest, XorDataTest) {
+  constexpr auto COW_XOR = CowMergeOperation::COW_XOR;
+  // The sources of |op1| and |op2| are adjacent and read together, |op3| reads
+  // blocks before them.
+  const auto op1 = CreateCowMergeOperation(
+      ExtentForRange(20, 2), ExtentForRange(10, 2), COW_XOR, 100);
+  const auto op2 = CreateCowMergeOperation(
+      ExtentForRange(22, 2), ExtentForRange(12, 2), COW_XOR, 100);
+  const auto op3 = CreateCowMergeOperation(
+      ExtentForRange(2, 1), ExtentForRange(14, 1), COW_XOR, 100);
+  ASSERT_TRUE(xor_map_.AddExtent(op1.dst_extent(), &op1));
+  ASSERT_TRUE(xor_map_.AddExtent(op2.dst_extent(), &op2));
+  ASSERT_TRUE(xor_map_.AddExtent(op3.dst_extent(), &op3));
+  *op_.add_src_extents() = ExtentForRange(2, 1);
+  *op_.add_src_extents() = ExtentForRange(20, 4);
+  *op_.add_dst_extents() = ExtentForRange(10, 5);
+  XORExtentWriter writer_{
+      op_, source_fd_, &cow_writer_, xor_map_, NUM_BLOCKS * kBlockSize};
+
+  brillo::Blob target(5 * kBlockSize);
+  for (size_t i = 0; i < target.size(); i++) {
+    target[i] = (i * 7 + 3) & 0xFF;
+  }
+  // Every source block holds bytes 0x00..0xFF repeated, so reading at offset
+  // 100 of any block yields (i + 100) & 0xFF.
+  auto verify_xor_data = [&target](uint32_t new_block_start,
+                                   const void* data,
+                                   size_t size,
+                                   uint32_t,
+                                   uint16_t) {
+    const size_t target_offset = (new_block_start - 10) * kBlockSize;
+    const auto bytes = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < size; i++) {
+      if (bytes[i] != (target[target_offset + i] ^ ((i + 100) & 0xFF))) {
+        return false;
+      }
+    }
+    return true;
+  };
+  EXPECT_CALL(cow_writer_, AddXorBlocks(10, _, kBlockSize * 2, 20, 100))
+      .WillOnce(Invoke(verify_xor_data));
+  EXPECT_CALL(cow_writer_, AddXorBlocks(12, _, kBlockSize * 2, 22, 100))
+      .WillOnce(Invoke(verify_xor_data));
+  EXPECT_CALL(cow_writer_, AddXorBlocks(14, _, kBlockSize, 2, 100))
+      .WillOnce(Invoke(verify_xor_data));
+
+  ASSERT_TRUE(writer_.Init(op_.dst_extents(), kBlockSize));
+  ASSERT_TRUE(writer_.Write(target.data(), target.size()));
+}
+
+TEST(XorUtilsTest, XorInPlaceTest) {
+  brillo::Blob src(1024 + 16);
+  brillo::Blob dst(src.size());
+  for (size_t i = 0; i < src.size(); i++) {
+    src[i] = (i * 31 + 7) & 0xFF;
+    dst[i] = (i * 13 + 1) & 0xFF;
+  }
+  // Cover every tail length and misaligned buffers.
+  for (size_t offset = 0; offset < 4; offset++) {
+    for (size_t size = 0; size <= 1024; size += (size < 256 ? 1 : 61)) {
+      brillo::Blob expected = dst;
+      brillo::Blob actual = dst;
+      XorInPlaceScalar(
+          expected.data() + offset, src.data() + 3 - offset % 4, size);
+      XorInPlace(actual.data() + offset, src.data() + 3 - offset % 4, size);
+      ASSERT_EQ(expected, actual) << "offset " << offset << " size " << size;
+    }
+  }
+}
+
 }  // namespace chromeos_update_engine
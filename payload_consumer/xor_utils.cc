@@ -0,0 +1,119 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/xor_utils.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+namespace chromeos_update_engine {
+
+namespace {
+
+#if defined(__x86_64__) || defined(__i386__)
+
+__attribute__((target("sse2"))) size_t XorSse2(uint8_t* dst,
+                                               const uint8_t* src,
+                                               size_t size) {
+  size_t i = 0;
+  for (; i + 64 <= size; i += 64) {
+    for (size_t j = 0; j < 64; j += 16) {
+      auto d = reinterpret_cast<__m128i*>(dst + i + j);
+      const auto s = reinterpret_cast<const __m128i*>(src + i + j);
+      _mm_storeu_si128(d,
+                       _mm_xor_si128(_mm_loadu_si128(d), _mm_loadu_si128(s)));
+    }
+  }
+  for (; i + 16 <= size; i += 16) {
+    auto d = reinterpret_cast<__m128i*>(dst + i);
+    const auto s = reinterpret_cast<const __m128i*>(src + i);
+    _mm_storeu_si128(d,
+                     _mm_xor_si128(_mm_loadu_si128(d), _mm_loadu_si128(s)));
+  }
+  return i;
+}
+
+__attribute__((target("avx2"))) size_t XorAvx2(uint8_t* dst,
+                                               const uint8_t* src,
+                                               size_t size) {
+  size_t i = 0;
+  for (; i + 128 <= size; i += 128) {
+    for (size_t j = 0; j < 128; j += 32) {
+      auto d = reinterpret_cast<__m256i*>(dst + i + j);
+      const auto s = reinterpret_cast<const __m256i*>(src + i + j);
+      _mm256_storeu_si256(
+          d, _mm256_xor_si256(_mm256_loadu_si256(d), _mm256_loadu_si256(s)));
+    }
+  }
+  for (; i + 32 <= size; i += 32) {
+    auto d = reinterpret_cast<__m256i*>(dst + i);
+    const auto s = reinterpret_cast<const __m256i*>(src + i);
+    _mm256_storeu_si256(
+        d, _mm256_xor_si256(_mm256_loadu_si256(d), _mm256_loadu_si256(s)));
+  }
+  return i;
+}
+
+size_t XorVector(uint8_t* dst, const uint8_t* src, size_t size) {
+  static const bool has_avx2 = __builtin_cpu_supports("avx2");
+  return has_avx2 ? XorAvx2(dst, src, size) : XorSse2(dst, src, size);
+}
+
+#elif defined(__aarch64__) || defined(__ARM_NEON)
+
+size_t XorVector(uint8_t* dst, const uint8_t* src, size_t size) {
+  size_t i = 0;
+  for (; i + 64 <= size; i += 64) {
+    const uint8x16x4_t d = vld1q_u8_x4(dst + i);
+    const uint8x16x4_t s = vld1q_u8_x4(src + i);
+    uint8x16x4_t r;
+    r.val[0] = veorq_u8(d.val[0], s.val[0]);
+    r.val[1] = veorq_u8(d.val[1], s.val[1]);
+    r.val[2] = veorq_u8(d.val[2], s.val[2]);
+    r.val[3] = veorq_u8(d.val[3], s.val[3]);
+    vst1q_u8_x4(dst + i, r);
+  }
+  for (; i + 16 <= size; i += 16) {
+    vst1q_u8(dst + i, veorq_u8(vld1q_u8(dst + i), vld1q_u8(src + i)));
+  }
+  return i;
+}
+
+#else
+
+size_t XorVector(uint8_t*, const uint8_t*, size_t) {
+  return 0;
+}
+
+#endif
+
+}  // namespace
+
+void XorInPlace(uint8_t* dst, const uint8_t* src, size_t size) {
+  const size_t done = XorVector(dst, src, size);
+  XorInPlaceScalar(dst + done, src + done, size - done);
+}
+
+void XorInPlaceScalar(uint8_t* dst, const uint8_t* src, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    dst[i] ^= src[i];
+  }
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,35 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_XOR_UTILS_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_XOR_UTILS_H_
+
+#include <cstddef>
+#include <cstdint>
+
+namespace chromeos_update_engine {
+
+// Computes |dst[i] ^= src[i]| for |size| bytes. Uses the widest vector unit
+// available at runtime (AVX2 or SSE2 on x86, NEON on ARM). Neither buffer needs
+// to be aligned, but they must not partially overlap.
+void XorInPlace(uint8_t* dst, const uint8_t* src, size_t size);
+
+// Byte by byte reference implementation of XorInPlace().
+void XorInPlaceScalar(uint8_t* dst, const uint8_t* src, size_t size);
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_XOR_UTILS_H_
@@ -22,7 +22,8 @@ using google::protobuf::RepeatedPtrField;
 namespace chromeos_update_engine {
 
 namespace {
-const brillo::Blob::size_type kOutputBufferLength = 16 * 1024;
+// Only used if the underlying writer can't provide a buffer to decompress into.
+const brillo::Blob::size_type kOutputBufferLength = 256 * 1024;
 
 // xz uses a variable dictionary size which impacts on the compression ratio
 // and is required to be reconstructed in RAM during decompression. While we
@@ -81,11 +82,19 @@ bool XzExtentWriter::Write(const void* bytes, size_t count) {
   request.in_pos = 0;
   request.in_size = count;
 
-  brillo::Blob output_buffer(kOutputBufferLength);
-  request.out = output_buffer.data();
-  request.out_size = output_buffer.size();
   for (;;) {
+    // Decompress straight into the underlying writer's buffer if it has one.
+    size_t output_size = 0;
+    uint8_t* output = underlying_writer_->GetWritableBuffer(&output_size);
+    const bool in_place = output != nullptr;
+    if (!in_place) {
+      output_buffer_.resize(kOutputBufferLength);
+      output = output_buffer_.data();
+      output_size = output_buffer_.size();
+    }
+    request.out = output;
     request.out_pos = 0;
+    request.out_size = output_size;
 
     xz_ret ret = xz_dec_run(stream_.get(), &request);
     if (ret != XZ_OK && ret != XZ_STREAM_END) {
@@ -97,13 +106,16 @@ bool XzExtentWriter::Write(const void* bytes, size_t count) {
       break;
 
     TEST_AND_RETURN_FALSE(
-        underlying_writer_->Write(output_buffer.data(), request.out_pos));
-    if (ret == XZ_STREAM_END)
+        in_place ? underlying_writer_->CommitBuffer(request.out_pos)
+                 : underlying_writer_->Write(output, request.out_pos));
+    if (ret == XZ_STREAM_END) {
       CHECK_EQ(request.in_size, request.in_pos);
-    if (request.in_size == request.in_pos)
+      break;
+    }
+    // A full output buffer may leave decompressed data pending in |stream_|.
+    if (request.in_size == request.in_pos && request.out_pos < output_size)
       break;  // No more input to process.
   }
-  output_buffer.clear();
 
   // Store unconsumed data (if any) in |input_buffer_|. Since |input| can point
   // to the existing |input_buffer_| we create a new one before assigning it.
@@ -53,6 +53,9 @@ class XzExtentWriter : public ExtentWriter {
   // The opaque xz decompressor struct.
   std::unique_ptr<xz_dec, xz_deleter> stream_{nullptr};
   brillo::Blob input_buffer_;
+  // Decompression buffer, only allocated if |underlying_writer_| has none to
+  // offer.
+  brillo::Blob output_buffer_;
 
   DISALLOW_COPY_AND_ASSIGN(XzExtentWriter);
 };
@@ -29,6 +29,9 @@
 #include "update_engine/common/test_utils.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/fake_extent_writer.h"
+#include "update_engine/payload_generator/delta_diff_generator.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/xz.h"
 
 namespace chromeos_update_engine {
 
@@ -148,4 +151,28 @@ TEST_F(XzExtentWriterTest, PartialDataIsKept) {
   EXPECT_EQ(expected_data, fake_extent_writer_->WrittenData());
 }
 
+// The decompressed data goes straight into the buffer of a BlockExtentWriter.
+TEST_F(XzExtentWriterTest, WritableBufferTest) {
+  XzCompressInit();
+  brillo::Blob data(BlockExtentWriter::BUFFER_SIZE + kBlockSize * 3);
+  test_utils::FillWithData(&data);
+  brillo::Blob compressed;
+  ASSERT_TRUE(XzCompress(data, &compressed));
+
+  google::protobuf::RepeatedPtrField<Extent> extents;
+  *extents.Add() = ExtentForRange(0, 3);
+  *extents.Add() = ExtentForRange(100, data.size() / kBlockSize - 3);
+  auto fake_writer = std::make_unique<FakeBlockExtentWriter>();
+  const FakeBlockExtentWriter* fake_writer_ptr = fake_writer.get();
+  XzExtentWriter xz_writer(std::move(fake_writer));
+  ASSERT_TRUE(xz_writer.Init(extents, kBlockSize));
+  // Small input chunks exercise the partially filled buffer.
+  const size_t chunk_size = compressed.size() / 7 + 1;
+  for (size_t i = 0; i < compressed.size(); i += chunk_size) {
+    ASSERT_TRUE(xz_writer.Write(compressed.data() + i,
+                                std::min(chunk_size, compressed.size() - i)));
+  }
+  EXPECT_EQ(data, fake_writer_ptr->WrittenData());
+}
+
 }  // namespace chromeos_update_engine
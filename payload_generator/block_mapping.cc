@@ -20,12 +20,14 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include <algorithm>
 #include <functional>
 #include <string>
 #include <utility>
 #include <vector>
 
 #include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/sparse_utils.h"
 
 using std::string;
 using std::vector;
@@ -137,6 +139,31 @@ bool BlockMapping::UniqueBlock::CompareData(const brillo::Blob& other_block,
   return true;
 }
 
+// Adds the first |num_blocks| blocks of |fd| to |mapping|. Blocks in the holes
+// of |fd| read as zeros, so they get the block id 0 without being read.
+static bool AddPartitionBlocks(BlockMapping* mapping,
+                               int fd,
+                               size_t num_blocks,
+                               size_t block_size,
+                               vector<BlockMapping::BlockId>* block_ids) {
+  vector<Extent> data_extents;
+  TEST_AND_RETURN_FALSE(sparse_utils::GetDataExtents(
+      fd, num_blocks * block_size, block_size, &data_extents));
+  block_ids->assign(num_blocks, 0);
+  vector<BlockMapping::BlockId> extent_block_ids;
+  for (const Extent& extent : data_extents) {
+    TEST_AND_RETURN_FALSE(mapping->AddManyDiskBlocks(fd,
+                                                     extent.start_block() *
+                                                         block_size,
+                                                     extent.num_blocks(),
+                                                     &extent_block_ids));
+    std::copy(extent_block_ids.begin(),
+              extent_block_ids.end(),
+              block_ids->begin() + extent.start_block());
+  }
+  return true;
+}
+
 bool MapPartitionBlocks(const string& old_part,
                         const string& new_part,
                         size_t old_size,
@@ -152,10 +179,10 @@ bool MapPartitionBlocks(const string& old_part,
   ScopedFdCloser old_fd_closer(&old_fd);
   ScopedFdCloser new_fd_closer(&new_fd);
 
-  TEST_AND_RETURN_FALSE(mapping.AddManyDiskBlocks(
-      old_fd, 0, old_size / block_size, old_block_ids));
-  TEST_AND_RETURN_FALSE(mapping.AddManyDiskBlocks(
-      new_fd, 0, new_size / block_size, new_block_ids));
+  TEST_AND_RETURN_FALSE(AddPartitionBlocks(
+      &mapping, old_fd, old_size / block_size, block_size, old_block_ids));
+  TEST_AND_RETURN_FALSE(AddPartitionBlocks(
+      &mapping, new_fd, new_size / block_size, block_size, new_block_ids));
   return true;
 }
 
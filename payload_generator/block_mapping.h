@@ -100,7 +100,8 @@ class BlockMapping {
 // with the same data will have the same block id and vice versa, regardless of
 // the partition they are on.
 // The block ids number 0 corresponds to the block with all zeros, but any
-// other block id number is assigned randomly.
+// other block id number is assigned randomly. Blocks in the holes of sparse
+// files are mapped to 0 without reading them.
 bool MapPartitionBlocks(const std::string& old_part,
                         const std::string& new_part,
                         size_t old_size,
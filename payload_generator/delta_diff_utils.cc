@@ -56,7 +56,6 @@
 #include <zucchini/patch_writer.h>
 #include <zucchini/zucchini.h>
 
-#include "update_engine/common/hash_calculator.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/lz4diff/lz4diff.h"
 #include "update_engine/payload_consumer/payload_constants.h"
@@ -65,8 +64,11 @@
 #include "update_engine/payload_generator/bzip.h"
 #include "update_engine/payload_generator/deflate_utils.h"
 #include "update_engine/payload_generator/delta_diff_generator.h"
+#include "update_engine/payload_generator/diff_selector.h"
 #include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/payload_generator/extent_utils.h"
+#include "update_engine/payload_generator/partition_hasher.h"
+#include "update_engine/payload_generator/sparse_utils.h"
 #include "update_engine/payload_generator/xz.h"
 
 using std::list;
@@ -206,6 +208,21 @@ BestDiffGenerator::GetUsableCompressorTypes() const {
   return config_.compressors;
 }
 
+void BestDiffGenerator::AddAttempt(InstallOperation::Type type,
+                                   base::TimeTicks start_time,
+                                   uint64_t output_bytes) {
+  attempts_.push_back({.type = type,
+                       .duration = base::TimeTicks::Now() - start_time,
+                       .output_bytes = output_bytes});
+}
+
+void BestDiffGenerator::AddFailedAttempt(InstallOperation::Type type,
+                                         base::TimeTicks start_time) {
+  attempts_.push_back({.type = type,
+                       .duration = base::TimeTicks::Now() - start_time,
+                       .failed = true});
+}
+
 bool BestDiffGenerator::GenerateBestDiffOperation(
     const std::vector<std::pair<InstallOperation_Type, size_t>>&
         diff_candidates,
@@ -213,9 +230,24 @@ bool BestDiffGenerator::GenerateBestDiffOperation(
     brillo::Blob* data_blob) {
   CHECK(aop);
   CHECK(data_blob);
+  DiffSelector::Features features;
+  if (config_.diff_selector)
+    features = DiffSelector::GetFeatures(aop->name, new_data_);
+  auto worth_trying = [&](InstallOperation::Type op_type) {
+    if (!config_.diff_selector ||
+        config_.diff_selector->ShouldTry(op_type, features)) {
+      return true;
+    }
+    LOG(INFO) << op_type << " skipped for " << aop->name
+              << ", it saved too little per CPU second on similar data";
+    return false;
+  };
+
   if (!old_block_info_.blocks.empty() && !new_block_info_.blocks.empty() &&
       config_.OperationEnabled(InstallOperation::LZ4DIFF_BSDIFF) &&
-      config_.OperationEnabled(InstallOperation::LZ4DIFF_PUFFDIFF)) {
+      config_.OperationEnabled(InstallOperation::LZ4DIFF_PUFFDIFF) &&
+      worth_trying(InstallOperation::LZ4DIFF_BSDIFF)) {
+    const base::TimeTicks start_time = base::TimeTicks::Now();
     brillo::Blob patch;
     InstallOperation::Type op_type{};
     if (Lz4Diff(old_data_,
@@ -223,13 +255,18 @@ bool BestDiffGenerator::GenerateBestDiffOperation(
                 old_block_info_,
                 new_block_info_,
                 &patch,
-                &op_type)) {
+                &op_type,
+                config_.concurrent_lz4diff_puffdiff)) {
+      AddAttempt(op_type, start_time, patch.size());
       aop->op.set_type(op_type);
       // LZ4DIFF is likely significantly better than BSDIFF/PUFFDIFF when
       // working with EROFS. So no need to even try other diffing algorithms.
       *data_blob = std::move(patch);
       return true;
     }
+    // The time spent failing still counts against LZ4DIFF. Lz4Diff picks the
+    // variant itself, and DiffSelector treats both the same.
+    AddFailedAttempt(InstallOperation::LZ4DIFF_BSDIFF, start_time);
   }
 
   const uint64_t input_bytes = std::max(utils::BlocksInExtents(src_extents_),
@@ -254,6 +291,9 @@ bool BestDiffGenerator::GenerateBestDiffOperation(
       op_type = InstallOperation::BROTLI_BSDIFF;
     }
 
+    if (!worth_trying(op_type))
+      continue;
+
     switch (op_type) {
       case InstallOperation::SOURCE_BSDIFF:
       case InstallOperation::BROTLI_BSDIFF:
@@ -278,6 +318,7 @@ bool BestDiffGenerator::TryBsdiffAndUpdateOperation(
     InstallOperation_Type operation_type,
     AnnotatedOperation* aop,
     brillo::Blob* data_blob) {
+  const base::TimeTicks start_time = base::TimeTicks::Now();
   base::FilePath patch;
   TEST_AND_RETURN_FALSE(base::CreateTemporaryFile(&patch));
   ScopedPathUnlinker unlinker(patch.value());
@@ -300,6 +341,7 @@ bool BestDiffGenerator::TryBsdiffAndUpdateOperation(
 
   TEST_AND_RETURN_FALSE(utils::ReadFile(patch.value(), &bsdiff_delta));
   TEST_AND_RETURN_FALSE(!bsdiff_delta.empty());
+  AddAttempt(operation_type, start_time, bsdiff_delta.size());
 
   InstallOperation& operation = aop->op;
   if (IsDiffOperationBetter(operation,
@@ -321,6 +363,7 @@ bool BestDiffGenerator::TryPuffdiffAndUpdateOperation(AnnotatedOperation* aop,
                                                       brillo::Blob* data_blob) {
   // Only Puffdiff if both files have at least one deflate left.
   if (!old_deflates_.empty() && !new_deflates_.empty()) {
+    const base::TimeTicks start_time = base::TimeTicks::Now();
     brillo::Blob puffdiff_delta;
     ScopedTempFile temp_file("puffdiff-delta.XXXXXX");
     // Perform PuffDiff operation.
@@ -332,6 +375,7 @@ bool BestDiffGenerator::TryPuffdiffAndUpdateOperation(AnnotatedOperation* aop,
                                            temp_file.path(),
                                            &puffdiff_delta));
     TEST_AND_RETURN_FALSE(!puffdiff_delta.empty());
+    AddAttempt(InstallOperation::PUFFDIFF, start_time, puffdiff_delta.size());
 
     InstallOperation& operation = aop->op;
     if (IsDiffOperationBetter(operation,
@@ -361,6 +405,7 @@ bool BestDiffGenerator::TryZucchiniAndUpdateOperation(AnnotatedOperation* aop,
            /*, ".capex",".jar", ".apk", ".apex"*/})) {
     return true;
   }
+  const base::TimeTicks start_time = base::TimeTicks::Now();
   zucchini::ConstBufferView src_bytes(old_data_.data(), old_data_.size());
   zucchini::ConstBufferView dst_bytes(new_data_.data(), new_data_.size());
 
@@ -377,6 +422,7 @@ bool BestDiffGenerator::TryZucchiniAndUpdateOperation(AnnotatedOperation* aop,
   brillo::Blob compressed_delta;
   TEST_AND_RETURN_FALSE(puffin::BrotliEncode(
       zucchini_delta.data(), zucchini_delta.size(), &compressed_delta));
+  AddAttempt(InstallOperation::ZUCCHINI, start_time, compressed_delta.size());
 
   InstallOperation& operation = aop->op;
   if (IsDiffOperationBetter(operation,
@@ -427,6 +473,11 @@ class FileDeltaProcessor : public base::DelegateSimpleThread::Delegate {
   // Merge each file processor's ops list to aops.
   bool MergeOperation(vector<AnnotatedOperation>* aops);
 
+  // Records when the processor was handed to the thread pool.
+  void set_queued_time(base::TimeTicks queued_time) {
+    queued_time_ = queued_time;
+  }
+
  private:
   const string& old_part_;  // NOLINT(runtime/member_string_references)
   const string& new_part_;  // NOLINT(runtime/member_string_references)
@@ -444,6 +495,8 @@ class FileDeltaProcessor : public base::DelegateSimpleThread::Delegate {
   // The list of ops to reach the new file from the old file.
   vector<AnnotatedOperation> file_aops_;
 
+  base::TimeTicks queued_time_;
+
   bool failed_ = false;
 
   DISALLOW_COPY_AND_ASSIGN(FileDeltaProcessor);
@@ -476,6 +529,17 @@ void FileDeltaProcessor::Run() {
 
   LOG(INFO) << "Encoded file " << name_ << " (" << new_extents_blocks_
             << " blocks) in " << (base::TimeTicks::Now() - start);
+
+  if (config_.perf_report) {
+    config_.perf_report->AddFile(
+        {.image = new_part_,
+         .name = name_,
+         .blocks = new_extents_blocks_,
+         .thread_wait = queued_time_.is_null() ? base::TimeDelta()
+                                               : start - queued_time_,
+         .duration = base::TimeTicks::Now() - start,
+         .max_rss_kib = PerfReport::GetMaxRssKiB()});
+  }
 }
 
 bool FileDeltaProcessor::MergeOperation(vector<AnnotatedOperation>* aops) {
@@ -583,6 +647,18 @@ bool DeltaReadPartition(vector<AnnotatedOperation>* aops,
                                                   &old_zero_blocks));
   }
 
+  // Holes in the partition files read as zeros. DeltaMovedAndZeroBlocks()
+  // already turned the new ones into ZERO operations, otherwise do it here for
+  // the blocks outside of the files so they are never read or diffed.
+  TEST_AND_RETURN_FALSE(DeltaHoleBlocks(aops,
+                                        old_part,
+                                        new_part,
+                                        new_files,
+                                        soft_chunk_blocks,
+                                        config,
+                                        &old_visited_blocks,
+                                        &new_visited_blocks));
+
   map<string, FilesystemInterface::File> old_files_map;
   if (old_part.fs_interface) {
     vector<FilesystemInterface::File> old_files;
@@ -691,6 +767,7 @@ bool DeltaReadPartition(vector<AnnotatedOperation>* aops,
                                              max_threads);
   thread_pool.Start();
   for (auto& processor : file_delta_processors) {
+    processor.set_queued_time(base::TimeTicks::Now());
     thread_pool.AddWork(&processor);
   }
   thread_pool.JoinAll();
@@ -702,6 +779,55 @@ bool DeltaReadPartition(vector<AnnotatedOperation>* aops,
   return true;
 }
 
+bool DeltaHoleBlocks(vector<AnnotatedOperation>* aops,
+                     const PartitionConfig& old_part,
+                     const PartitionConfig& new_part,
+                     const vector<FilesystemInterface::File>& new_files,
+                     ssize_t chunk_blocks,
+                     const PayloadGenerationConfig& config,
+                     ExtentRanges* old_visited_blocks,
+                     ExtentRanges* new_visited_blocks) {
+  vector<Extent> data_extents;
+  if (!old_part.path.empty()) {
+    TEST_AND_RETURN_FALSE(sparse_utils::GetDataExtents(
+        old_part.path, old_part.size, kBlockSize, &data_extents));
+    old_visited_blocks->AddExtents(sparse_utils::GetHoleExtents(
+        data_extents, old_part.size / kBlockSize));
+  }
+
+  if (!config.OperationEnabled(InstallOperation::ZERO))
+    return true;
+  TEST_AND_RETURN_FALSE(sparse_utils::GetDataExtents(
+      new_part.path, new_part.size, kBlockSize, &data_extents));
+  ExtentRanges skipped_blocks = *new_visited_blocks;
+  for (const FilesystemInterface::File& file : new_files)
+    skipped_blocks.AddExtents(file.extents);
+  vector<Extent> new_holes = FilterExtentRanges(
+      sparse_utils::GetHoleExtents(data_extents, new_part.size / kBlockSize),
+      skipped_blocks);
+
+  if (chunk_blocks == -1)
+    chunk_blocks = new_part.size / kBlockSize;
+  size_t num_ops = aops->size();
+  new_visited_blocks->AddExtents(new_holes);
+  for (const Extent& extent : new_holes) {
+    for (uint64_t offset = 0; offset < extent.num_blocks();
+         offset += chunk_blocks) {
+      uint64_t num_blocks =
+          std::min(static_cast<uint64_t>(extent.num_blocks()) - offset,
+                   static_cast<uint64_t>(chunk_blocks));
+      InstallOperation operation;
+      operation.set_type(InstallOperation::ZERO);
+      *(operation.add_dst_extents()) =
+          ExtentForRange(extent.start_block() + offset, num_blocks);
+      aops->push_back({.name = "<zeros>", .op = operation});
+    }
+  }
+  LOG(INFO) << "Produced " << (aops->size() - num_ops) << " operations for "
+            << utils::BlocksInExtents(new_holes) << " blocks in holes";
+  return true;
+}
+
 bool DeltaMovedAndZeroBlocks(vector<AnnotatedOperation>* aops,
                              const string& old_part,
                              const string& new_part,
@@ -1050,6 +1176,8 @@ bool ReadExtentsToDiff(const string& old_part,
   const auto& version = config.version;
   AnnotatedOperation& aop = *out_op;
   InstallOperation& operation = aop.op;
+  const base::TimeTicks start_time = base::TimeTicks::Now();
+  PerfReport::OperationRecord record;
 
   // We read blocks from old_extents and write blocks to new_extents.
   const uint64_t blocks_to_read = utils::BlocksInExtents(src_extents);
@@ -1073,9 +1201,17 @@ bool ReadExtentsToDiff(const string& old_part,
   // Try generating a full operation for the given new data, regardless of the
   // old_data.
   InstallOperation::Type op_type{};
+  base::TimeTicks full_start_time = base::TimeTicks::Now();
   TEST_AND_RETURN_FALSE(
       GenerateBestFullOperation(new_data, version, &data_blob, &op_type));
   operation.set_type(op_type);
+  record.new_bytes = new_data.size();
+  if (config.perf_report)
+    record.entropy = DiffSelector::SampleEntropy(new_data);
+  record.attempts.push_back(
+      {.type = op_type,
+       .duration = base::TimeTicks::Now() - full_start_time,
+       .output_bytes = data_blob.size()});
 
   if (blocks_to_read > 0) {
     brillo::Blob old_data;
@@ -1085,6 +1221,7 @@ bool ReadExtentsToDiff(const string& old_part,
                                              &old_data,
                                              kBlockSize * blocks_to_read,
                                              kBlockSize));
+    record.old_bytes = old_data.size();
     if (old_data == new_data) {
       // No change in data.
       operation.set_type(InstallOperation::SOURCE_COPY);
@@ -1105,6 +1242,9 @@ bool ReadExtentsToDiff(const string& old_part,
         LOG(INFO) << "Failed to generate diff for " << new_file.name;
         return false;
       }
+      const auto& attempts = best_diff_generator.attempts();
+      record.attempts.insert(
+          record.attempts.end(), attempts.begin(), attempts.end());
     }
   }
 
@@ -1130,6 +1270,15 @@ bool ReadExtentsToDiff(const string& old_part,
     operation.clear_src_extents();
   }
 
+  if (config.perf_report) {
+    record.image = new_part;
+    record.name = new_file.name;
+    record.duration = base::TimeTicks::Now() - start_time;
+    record.winner = operation.type();
+    record.output_bytes = data_blob.size();
+    config.perf_report->AddOperation(std::move(record));
+  }
+
   *out_data = std::move(data_blob);
   *out_op = aop;
   return true;
@@ -1147,16 +1296,9 @@ bool IsNoSourceOperation(InstallOperation::Type op_type) {
 }
 
 bool InitializePartitionInfo(const PartitionConfig& part, PartitionInfo* info) {
-  info->set_size(part.size);
-  HashCalculator hasher;
-  TEST_AND_RETURN_FALSE(hasher.UpdateFile(part.path, part.size) ==
-                        static_cast<off_t>(part.size));
-  TEST_AND_RETURN_FALSE(hasher.Finalize());
-  const brillo::Blob& hash = hasher.raw_hash();
-  info->set_hash(hash.data(), hash.size());
-  LOG(INFO) << part.path << ": size=" << part.size
-            << " hash=" << HexEncode(hash);
-  return true;
+  PartitionHasher hasher(1);
+  hasher.AddPartition(part.path, part.size, info);
+  return hasher.Run();
 }
 
 bool CompareAopsByDestination(AnnotatedOperation first_aop,
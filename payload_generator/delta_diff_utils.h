@@ -22,6 +22,7 @@
 #include <utility>
 #include <vector>
 
+#include <base/time/time.h>
 #include <brillo/secure_blob.h>
 #include <puffin/puffdiff.h>
 
@@ -30,6 +31,7 @@
 #include "update_engine/payload_generator/deflate_utils.h"
 #include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/payload_generator/payload_generation_config.h"
+#include "update_engine/payload_generator/perf_report.h"
 #include "update_engine/update_metadata.pb.h"
 
 namespace chromeos_update_engine {
@@ -55,6 +57,20 @@ bool DeltaReadPartition(std::vector<AnnotatedOperation>* aops,
                         const PayloadGenerationConfig& version,
                         BlobFileWriter* blob_file);
 
+// Create ZERO operations in |aops| for the blocks in the holes of the
+// |new_part| file that are neither in |new_visited_blocks| nor in any of the
+// |new_files|, split in |chunk_blocks| blocks or unlimited if -1. The holes of
+// the |old_part| file are added to |old_visited_blocks| since they only hold
+// zeros, and the new ones to |new_visited_blocks|.
+bool DeltaHoleBlocks(std::vector<AnnotatedOperation>* aops,
+                     const PartitionConfig& old_part,
+                     const PartitionConfig& new_part,
+                     const std::vector<FilesystemInterface::File>& new_files,
+                     ssize_t chunk_blocks,
+                     const PayloadGenerationConfig& config,
+                     ExtentRanges* old_visited_blocks,
+                     ExtentRanges* new_visited_blocks);
+
 // Create operations in |aops| for identical blocks that moved around in the old
 // and new partition and also handle zeroed blocks. The old and new partition
 // are stored in the |old_part| and |new_part| files and have |old_num_blocks|
@@ -129,6 +145,8 @@ bool IsAReplaceOperation(InstallOperation::Type op_type);
 // Returns true if an operation with type |op_type| has no |src_extents|.
 bool IsNoSourceOperation(InstallOperation::Type op_type);
 
+// Sets the size and hash of |partition| in |info|. See PartitionHasher to hash
+// several partitions at once.
 bool InitializePartitionInfo(const PartitionConfig& partition,
                              PartitionInfo* info);
 
@@ -220,8 +238,21 @@ class BestDiffGenerator {
       AnnotatedOperation* aop,
       brillo::Blob* data_blob);
 
+  // The diffs generated by GenerateBestDiffOperation(), picked or not.
+  const std::vector<PerfReport::Attempt>& attempts() const {
+    return attempts_;
+  }
+
  private:
   std::vector<bsdiff::CompressorType> GetUsableCompressorTypes() const;
+  // Records that a diff of |type| started at |start_time| produced
+  // |output_bytes|.
+  void AddAttempt(InstallOperation::Type type,
+                  base::TimeTicks start_time,
+                  uint64_t output_bytes);
+  // Records that a diff of |type| started at |start_time| failed.
+  void AddFailedAttempt(InstallOperation::Type type,
+                        base::TimeTicks start_time);
   bool TryBsdiffAndUpdateOperation(InstallOperation_Type operation_type,
                                    AnnotatedOperation* aop,
                                    brillo::Blob* data_blob);
@@ -239,6 +270,7 @@ class BestDiffGenerator {
   const CompressedFile& old_block_info_;
   const CompressedFile& new_block_info_;
   const PayloadGenerationConfig& config_;
+  std::vector<PerfReport::Attempt> attempts_;
 };
 
 }  // namespace diff_utils
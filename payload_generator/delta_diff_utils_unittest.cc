@@ -30,12 +30,15 @@
 
 #include "update_engine/payload_generator/deflate_utils.h"
 #include "update_engine/payload_generator/filesystem_interface.h"
+#include "update_engine/common/hash_calculator.h"
 #include "update_engine/common/test_utils.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_generator/delta_diff_generator.h"
 #include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/payload_generator/extent_utils.h"
 #include "update_engine/payload_generator/fake_filesystem.h"
+#include "update_engine/payload_generator/perf_report.h"
+#include "update_engine/payload_generator/sparse_utils.h"
 
 using std::string;
 using std::vector;
@@ -347,6 +350,49 @@ TEST_F(DeltaDiffUtilsTest, BrotliBsdiffTest) {
   ASSERT_EQ(InstallOperation::BROTLI_BSDIFF, op.type());
 }
 
+TEST_F(DeltaDiffUtilsTest, FailedLz4diffAttemptIsRecordedTest) {
+  brillo::Blob data_blob(kBlockSize);
+  test_utils::FillWithData(&data_blob);
+
+  vector<Extent> old_extents = {ExtentForRange(1, 1)};
+  vector<Extent> new_extents = {ExtentForRange(2, 1)};
+
+  ASSERT_TRUE(WriteExtents(old_part_.path, old_extents, kBlockSize, data_blob));
+  data_blob[0]++;
+  ASSERT_TRUE(WriteExtents(new_part_.path, new_extents, kBlockSize, data_blob));
+
+  // The cluster is longer than the file, like in a file split in chunks, so
+  // Lz4Diff fails.
+  FilesystemInterface::File old_file;
+  old_file.compressed_file_info.blocks = {
+      CompressedBlock(0, 2 * kBlockSize, 4 * kBlockSize)};
+  FilesystemInterface::File new_file = old_file;
+
+  PerfReport perf_report;
+  PayloadGenerationConfig config{
+      .version = PayloadVersion(kBrilloMajorPayloadVersion,
+                                kLZ4DIFFMinorPayloadVersion),
+      .enable_lz4diff = true,
+      .perf_report = &perf_report};
+  brillo::Blob data;
+  AnnotatedOperation aop;
+  ASSERT_TRUE(diff_utils::ReadExtentsToDiff(old_part_.path,
+                                            new_part_.path,
+                                            old_extents,
+                                            new_extents,
+                                            old_file,
+                                            new_file,
+                                            config,
+                                            &data,
+                                            &aop));
+  EXPECT_NE(InstallOperation::LZ4DIFF_BSDIFF, aop.op.type());
+  EXPECT_NE(InstallOperation::LZ4DIFF_PUFFDIFF, aop.op.type());
+
+  const string json = perf_report.ToJson();
+  EXPECT_NE(string::npos, json.find("\"algorithm\": \"LZ4DIFF_BSDIFF\""));
+  EXPECT_NE(string::npos, json.find("\"failed\": true"));
+}
+
 TEST_F(DeltaDiffUtilsTest, GenerateBestDiffOperation_Zucchini) {
   // Makes sure SOURCE_BSDIFF operations are emitted whenever src_ops_allowed
   // is true. It is the same setup as BsdiffSmallTest, which checks
@@ -638,6 +684,72 @@ TEST_F(DeltaDiffUtilsTest, ZeroBlocksUseReplaceBz) {
   ASSERT_NE(0, blob_size_);
 }
 
+TEST_F(DeltaDiffUtilsTest, HoleBlocksUseZero) {
+  // Both partitions are sparse files with only holes, unless the filesystem
+  // doesn't report them.
+  vector<Extent> old_data_extents;
+  ASSERT_TRUE(sparse_utils::GetDataExtents(
+      old_part_.path, old_part_.size, block_size_, &old_data_extents));
+  if (!old_data_extents.empty())
+    GTEST_SKIP() << "The filesystem of the test partitions doesn't report "
+                    "holes.";
+  // Write some data at the start of the new one.
+  vector<Extent> new_data = {ExtentForRange(0, 10)};
+  brillo::Blob data(10 * block_size_, 'a');
+  ASSERT_TRUE(WriteExtents(new_part_.path, new_data, block_size_, data));
+  // The blocks of files are left to the file processing.
+  File new_file;
+  new_file.extents = {ExtentForRange(100, 28)};
+
+  ASSERT_TRUE(diff_utils::DeltaHoleBlocks(
+      &aops_,
+      old_part_,
+      new_part_,
+      {new_file},
+      50,  // chunk_blocks
+      {.version = PayloadVersion(kBrilloMajorPayloadVersion,
+                                 kBrotliBsdiffMinorPayloadVersion)},
+      &old_visited_blocks_,
+      &new_visited_blocks_));
+
+  // The old partition only holds zeros.
+  ASSERT_EQ(kDefaultBlockCount, old_visited_blocks_.blocks());
+  ASSERT_EQ(vector<Extent>{ExtentForRange(10, 90)},
+            new_visited_blocks_.GetExtentsForBlockCount(
+                new_visited_blocks_.blocks()));
+
+  vector<Extent> expected_op_extents = {
+      ExtentForRange(10, 50),
+      ExtentForRange(60, 40),
+  };
+  ASSERT_EQ(expected_op_extents.size(), aops_.size());
+  for (size_t i = 0; i < aops_.size(); ++i) {
+    const AnnotatedOperation& aop = aops_[i];
+    ASSERT_EQ(InstallOperation::ZERO, aop.op.type());
+    ASSERT_EQ(1, aop.op.dst_extents_size());
+    ASSERT_EQ(expected_op_extents[i], aop.op.dst_extents(0));
+  }
+  ASSERT_EQ(0, blob_size_);
+}
+
+TEST_F(DeltaDiffUtilsTest, InitializePartitionInfoHashesHolesAsZeros) {
+  vector<Extent> new_data = {ExtentForRange(5, 3), ExtentForRange(40, 1)};
+  brillo::Blob data(4 * block_size_, 'a');
+  ASSERT_TRUE(WriteExtents(new_part_.path, new_data, block_size_, data));
+
+  brillo::Blob expected_data(new_part_.size, 0);
+  std::fill_n(expected_data.begin() + 5 * block_size_, 3 * block_size_, 'a');
+  std::fill_n(expected_data.begin() + 40 * block_size_, block_size_, 'a');
+  brillo::Blob expected_hash;
+  ASSERT_TRUE(HashCalculator::RawHashOfData(expected_data, &expected_hash));
+
+  PartitionInfo info;
+  ASSERT_TRUE(diff_utils::InitializePartitionInfo(new_part_, &info));
+  ASSERT_EQ(new_part_.size, info.size());
+  ASSERT_EQ(expected_hash,
+            brillo::Blob(info.hash().begin(), info.hash().end()));
+}
+
 TEST_F(DeltaDiffUtilsTest, ShuffledBlocksAreTracked) {
   vector<uint64_t> permutation = {0, 1, 5, 6, 7, 2, 3, 4, 9, 10, 11, 12, 8};
   vector<Extent> perm_extents;
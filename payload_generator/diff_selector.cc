@@ -0,0 +1,212 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/diff_selector.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <vector>
+
+#include <base/files/file_path.h>
+#include <base/logging.h>
+#include <base/strings/string_number_conversions.h>
+#include <base/strings/string_split.h>
+#include <base/strings/string_util.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/payload_constants.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+constexpr size_t kEntropySampleSize = 64 * 1024;
+constexpr size_t kEntropySampleChunk = 4096;
+
+// Splits a CSV |line| into its fields, unquoting the quoted ones.
+vector<string> SplitCsvLine(const string& line) {
+  vector<string> fields(1);
+  bool quoted = false;
+  for (size_t i = 0; i < line.size(); i++) {
+    const char c = line[i];
+    if (quoted) {
+      if (c != '"') {
+        fields.back() += c;
+      } else if (i + 1 < line.size() && line[i + 1] == '"') {
+        fields.back() += '"';
+        i++;
+      } else {
+        quoted = false;
+      }
+    } else if (c == '"') {
+      quoted = true;
+    } else if (c == ',') {
+      fields.emplace_back();
+    } else {
+      fields.back() += c;
+    }
+  }
+  return fields;
+}
+
+// Both LZ4DIFF variants are the outcome of the same attempt.
+InstallOperation::Type GetAlgorithm(InstallOperation::Type type) {
+  return type == InstallOperation::LZ4DIFF_PUFFDIFF
+             ? InstallOperation::LZ4DIFF_BSDIFF
+             : type;
+}
+
+}  // namespace
+
+string DiffSelector::GetExtension(const string& name) {
+  if (base::StartsWith(name, "<", base::CompareCase::SENSITIVE))
+    return name;
+  return base::ToLowerASCII(base::FilePath(name).FinalExtension());
+}
+
+double DiffSelector::SampleEntropy(const brillo::Blob& data) {
+  // Sample evenly spread chunks so the beginning of the file, often a header,
+  // doesn't decide alone.
+  std::array<uint64_t, 256> histogram{};
+  uint64_t total = 0;
+  const size_t num_chunks =
+      std::max<size_t>(1, kEntropySampleSize / kEntropySampleChunk);
+  const size_t stride =
+      std::max<size_t>(kEntropySampleChunk, data.size() / num_chunks);
+  for (size_t offset = 0; offset < data.size() && total < kEntropySampleSize;
+       offset += stride) {
+    const size_t end = std::min(data.size(), offset + kEntropySampleChunk);
+    for (size_t i = offset; i < end; i++)
+      histogram[data[i]]++;
+    total += end - offset;
+  }
+  if (total == 0)
+    return 0;
+  double entropy = 0;
+  for (uint64_t count : histogram) {
+    if (count == 0)
+      continue;
+    const double p = static_cast<double>(count) / total;
+    entropy -= p * std::log2(p);
+  }
+  return entropy;
+}
+
+DiffSelector::Features DiffSelector::GetFeatures(const string& name,
+                                                 const brillo::Blob& new_data) {
+  return {.extension = GetExtension(name), .entropy = SampleEntropy(new_data)};
+}
+
+DiffSelector::Key DiffSelector::GetKey(InstallOperation::Type type,
+                                       const Features& features) {
+  return {
+      features.extension, features.entropy >= kHighEntropy, GetAlgorithm(type)};
+}
+
+bool DiffSelector::LoadHistory(const string& path) {
+  string content;
+  TEST_AND_RETURN_FALSE(utils::ReadFile(path, &content));
+  vector<string> lines = base::SplitString(
+      content, "\n", base::KEEP_WHITESPACE, base::SPLIT_WANT_NONEMPTY);
+  TEST_AND_RETURN_FALSE(!lines.empty());
+
+  const vector<string> header = SplitCsvLine(lines[0]);
+  auto column = [&header](const char* name) -> size_t {
+    return std::find(header.begin(), header.end(), name) - header.begin();
+  };
+  const size_t name_column = column("name");
+  const size_t algorithm_column = column("algorithm");
+  const size_t time_column = column("time_ms");
+  const size_t saved_column = column("saved_bytes");
+  const size_t entropy_column = column("entropy");
+  const size_t num_columns = std::max({name_column,
+                                       algorithm_column,
+                                       time_column,
+                                       saved_column,
+                                       entropy_column}) +
+                             1;
+  if (num_columns > header.size()) {
+    LOG(ERROR) << path << " is not a --perf_report CSV with entropy and "
+               << "saved_bytes columns.";
+    return false;
+  }
+
+  // Map the algorithm names written by PerfReport back to the types.
+  std::map<string, InstallOperation::Type> types;
+  for (InstallOperation::Type type : {InstallOperation::REPLACE,
+                                      InstallOperation::REPLACE_BZ,
+                                      InstallOperation::REPLACE_XZ,
+                                      InstallOperation::SOURCE_BSDIFF,
+                                      InstallOperation::BROTLI_BSDIFF,
+                                      InstallOperation::PUFFDIFF,
+                                      InstallOperation::ZUCCHINI,
+                                      InstallOperation::LZ4DIFF_BSDIFF,
+                                      InstallOperation::LZ4DIFF_PUFFDIFF}) {
+    types[InstallOperationTypeName(type)] = type;
+  }
+
+  size_t num_samples = 0;
+  for (size_t i = 1; i < lines.size(); i++) {
+    const vector<string> fields = SplitCsvLine(lines[i]);
+    Features features;
+    double time_ms = 0;
+    uint64_t saved_bytes = 0;
+    auto type = types.end();
+    if (fields.size() < num_columns ||
+        (type = types.find(fields[algorithm_column])) == types.end() ||
+        !base::StringToDouble(fields[time_column], &time_ms) ||
+        !base::StringToUint64(fields[saved_column], &saved_bytes) ||
+        !base::StringToDouble(fields[entropy_column], &features.entropy)) {
+      LOG(WARNING) << "Ignoring line " << i + 1 << " of " << path;
+      continue;
+    }
+    features.extension = GetExtension(fields[name_column]);
+    AddSample(type->second, features, time_ms / 1000, saved_bytes);
+    num_samples++;
+  }
+  LOG(INFO) << "Loaded " << num_samples << " diff attempts from " << path;
+  return true;
+}
+
+void DiffSelector::AddSample(InstallOperation::Type type,
+                             const Features& features,
+                             double seconds,
+                             uint64_t saved_bytes) {
+  Stats& stats = history_[GetKey(type, features)];
+  stats.samples++;
+  stats.seconds += seconds;
+  stats.saved_bytes += saved_bytes;
+}
+
+bool DiffSelector::ShouldTry(InstallOperation::Type type,
+                             const Features& features) const {
+  if (min_saved_bytes_per_second_ <= 0)
+    return true;
+  auto it = history_.find(GetKey(type, features));
+  if (it == history_.end() || it->second.samples < kMinSamples)
+    return true;
+  const Stats& stats = it->second;
+  // Something that took no measurable time is always worth it.
+  if (stats.seconds <= 0)
+    return true;
+  return stats.saved_bytes / stats.seconds >= min_saved_bytes_per_second_;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,102 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_DIFF_SELECTOR_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_DIFF_SELECTOR_H_
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <tuple>
+
+#include <base/macros.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// Decides which diff algorithms are worth trying on some data, from the
+// bytes they saved and the CPU time they took on similar data in previous
+// generations. Data is considered similar if it has the same extension and
+// the same kind of entropy; the history is read from a --perf_report CSV.
+//
+// Algorithms are only skipped when there is enough history to tell that they
+// save fewer bytes per CPU second than the threshold, so the payload stays
+// the same without history.
+class DiffSelector {
+ public:
+  // The cheap to compute properties of some data the decision is based on.
+  struct Features {
+    // The lower case extension of the file, or the name of the pseudo-file
+    // such as <non-file-data>.
+    std::string extension;
+    // Shannon entropy of a sample of the new data, in bits per byte.
+    double entropy{0};
+  };
+
+  // Entropy above which the data is most likely already compressed.
+  static constexpr double kHighEntropy = 7.5;
+
+  // Number of attempts of an algorithm on similar data needed to decide to
+  // skip it.
+  static constexpr uint64_t kMinSamples = 8;
+
+  explicit DiffSelector(double min_saved_bytes_per_second)
+      : min_saved_bytes_per_second_(min_saved_bytes_per_second) {}
+
+  // Returns the extension used to group the file |name| with similar ones.
+  static std::string GetExtension(const std::string& name);
+
+  // Returns the entropy of up to 64 KiB sampled across |data|.
+  static double SampleEntropy(const brillo::Blob& data);
+
+  static Features GetFeatures(const std::string& name,
+                              const brillo::Blob& new_data);
+
+  // Adds the attempts of a --perf_report CSV to the history.
+  bool LoadHistory(const std::string& path);
+
+  // Records that |type| took |seconds| and saved |saved_bytes| compared to
+  // the algorithms tried before it on data with |features|.
+  void AddSample(InstallOperation::Type type,
+                 const Features& features,
+                 double seconds,
+                 uint64_t saved_bytes);
+
+  // Returns whether it is worth trying |type| on data with |features|.
+  bool ShouldTry(InstallOperation::Type type, const Features& features) const;
+
+ private:
+  struct Stats {
+    uint64_t samples{0};
+    double seconds{0};
+    uint64_t saved_bytes{0};
+  };
+  // The extension, whether the entropy is high, and the algorithm.
+  using Key = std::tuple<std::string, bool, InstallOperation::Type>;
+
+  static Key GetKey(InstallOperation::Type type, const Features& features);
+
+  const double min_saved_bytes_per_second_;
+  std::map<Key, Stats> history_;
+
+  DISALLOW_COPY_AND_ASSIGN(DiffSelector);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_DIFF_SELECTOR_H_
@@ -0,0 +1,140 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/diff_selector.h"
+
+#include <string>
+
+#include <base/files/scoped_temp_dir.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/payload_generator/perf_report.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+class DiffSelectorTest : public ::testing::Test {
+ protected:
+  // Adds |samples| attempts of |type| on |features|, each taking a second
+  // and saving |saved_bytes|.
+  void AddSamples(DiffSelector* selector,
+                  InstallOperation::Type type,
+                  const DiffSelector::Features& features,
+                  uint64_t samples,
+                  uint64_t saved_bytes) {
+    for (uint64_t i = 0; i < samples; i++)
+      selector->AddSample(type, features, 1, saved_bytes);
+  }
+
+  const DiffSelector::Features so_{.extension = ".so", .entropy = 6};
+  const DiffSelector::Features apk_{.extension = ".apk", .entropy = 7.9};
+};
+
+TEST_F(DiffSelectorTest, GetExtensionTest) {
+  EXPECT_EQ(".so", DiffSelector::GetExtension("/lib/libfoo.so"));
+  EXPECT_EQ(".apk", DiffSelector::GetExtension("/app/Foo/Foo.APK"));
+  EXPECT_EQ("", DiffSelector::GetExtension("/bin/foo"));
+  EXPECT_EQ("<non-file-data>", DiffSelector::GetExtension("<non-file-data>"));
+}
+
+TEST_F(DiffSelectorTest, SampleEntropyTest) {
+  EXPECT_EQ(0, DiffSelector::SampleEntropy({}));
+  EXPECT_EQ(0, DiffSelector::SampleEntropy(brillo::Blob(1024 * 1024, 'a')));
+
+  brillo::Blob data(1024 * 1024);
+  for (size_t i = 0; i < data.size(); i++)
+    data[i] = i;
+  EXPECT_DOUBLE_EQ(8, DiffSelector::SampleEntropy(data));
+}
+
+TEST_F(DiffSelectorTest, TriesEverythingWithoutThresholdTest) {
+  DiffSelector selector(0);
+  AddSamples(&selector, InstallOperation::PUFFDIFF, apk_, 100, 0);
+  EXPECT_TRUE(selector.ShouldTry(InstallOperation::PUFFDIFF, apk_));
+}
+
+TEST_F(DiffSelectorTest, TriesEverythingWithoutHistoryTest) {
+  DiffSelector selector(1000);
+  AddSamples(&selector,
+             InstallOperation::PUFFDIFF,
+             apk_,
+             DiffSelector::kMinSamples - 1,
+             0);
+  EXPECT_TRUE(selector.ShouldTry(InstallOperation::PUFFDIFF, apk_));
+  EXPECT_TRUE(selector.ShouldTry(InstallOperation::ZUCCHINI, so_));
+}
+
+TEST_F(DiffSelectorTest, SkipsWhatDoesNotPayOffTest) {
+  DiffSelector selector(1000);
+  AddSamples(&selector, InstallOperation::ZUCCHINI, so_, 10, 100);
+  AddSamples(&selector, InstallOperation::BROTLI_BSDIFF, so_, 10, 100000);
+  EXPECT_FALSE(selector.ShouldTry(InstallOperation::ZUCCHINI, so_));
+  EXPECT_TRUE(selector.ShouldTry(InstallOperation::BROTLI_BSDIFF, so_));
+  // The history of low entropy .so files says nothing about high entropy ones.
+  DiffSelector::Features packed_so = so_;
+  packed_so.entropy = 7.9;
+  EXPECT_TRUE(selector.ShouldTry(InstallOperation::ZUCCHINI, packed_so));
+}
+
+TEST_F(DiffSelectorTest, Lz4DiffVariantsShareHistoryTest) {
+  DiffSelector selector(1000);
+  AddSamples(&selector, InstallOperation::LZ4DIFF_PUFFDIFF, so_, 10, 0);
+  EXPECT_FALSE(selector.ShouldTry(InstallOperation::LZ4DIFF_BSDIFF, so_));
+}
+
+TEST_F(DiffSelectorTest, LoadHistoryTest) {
+  const PerfReport::Attempt xz{.type = InstallOperation::REPLACE_XZ,
+                               .output_bytes = 90000};
+  const PerfReport::Attempt bsdiff{
+      .type = InstallOperation::BROTLI_BSDIFF,
+      .duration = base::TimeDelta::FromSeconds(1),
+      .output_bytes = 50000};
+  const PerfReport::Attempt puffdiff{
+      .type = InstallOperation::PUFFDIFF,
+      .duration = base::TimeDelta::FromSeconds(10),
+      .output_bytes = 49000};
+  PerfReport report;
+  for (int i = 0; i < 10; i++) {
+    report.AddOperation({.image = "system.img",
+                         .name = "/app/Foo/Foo.apk",
+                         .new_bytes = 100000,
+                         .entropy = 7.9,
+                         .attempts = {xz, bsdiff, puffdiff},
+                         .winner = InstallOperation::PUFFDIFF,
+                         .output_bytes = 49000});
+  }
+  base::ScopedTempDir temp_dir;
+  ASSERT_TRUE(temp_dir.CreateUniqueTempDir());
+  const string path = temp_dir.GetPath().Append("history.csv").value();
+  ASSERT_TRUE(report.Write(path));
+
+  // BROTLI_BSDIFF saved 40000 bytes per second, PUFFDIFF only 100 more.
+  DiffSelector selector(1000);
+  ASSERT_TRUE(selector.LoadHistory(path));
+  EXPECT_TRUE(selector.ShouldTry(InstallOperation::BROTLI_BSDIFF, apk_));
+  EXPECT_FALSE(selector.ShouldTry(InstallOperation::PUFFDIFF, apk_));
+}
+
+TEST_F(DiffSelectorTest, LoadHistoryRejectsOtherFilesTest) {
+  ScopedTempFile file("DiffSelectorTest.XXXXXX");
+  ASSERT_TRUE(test_utils::WriteFileString(file.path(), "a,b,c\n1,2,3\n"));
+  DiffSelector selector(1000);
+  EXPECT_FALSE(selector.LoadHistory(file.path()));
+}
+
+}  // namespace chromeos_update_engine
@@ -104,6 +104,22 @@ void ExtentRanges::AddExtent(Extent extent) {
   blocks_ += extent.num_blocks();
 }
 
+bool ExtentRanges::AppendExtent(const Extent& extent) {
+  if (extent.start_block() == kSparseHole || extent.num_blocks() == 0)
+    return true;
+  if (!extent_set_.empty()) {
+    const Extent& last = *extent_set_.rbegin();
+    const uint64_t last_end = last.start_block() + last.num_blocks();
+    if (extent.start_block() < last_end ||
+        (merge_touching_extents_ && extent.start_block() == last_end)) {
+      return false;
+    }
+  }
+  extent_set_.emplace_hint(extent_set_.end(), extent);
+  blocks_ += extent.num_blocks();
+  return true;
+}
+
 namespace {
 // Returns base - subtractee (set subtraction).
 ExtentRanges::ExtentSet SubtractOverlappingExtents(const Extent& base,
@@ -55,6 +55,11 @@ class ExtentRanges {
   void AddBlock(uint64_t block);
   void SubtractBlock(uint64_t block);
   void AddExtent(Extent extent);
+  // Adds |extent| if it starts after all extents in this ExtentRanges, and
+  // wouldn't be merged with the last one. Unlike AddExtent() this takes
+  // constant time, so ExtentRanges can be built from sorted extents quickly.
+  // Returns false if |extent| wasn't added.
+  bool AppendExtent(const Extent& extent);
   void SubtractExtent(const Extent& extent);
   void AddExtents(const std::vector<Extent>& extents);
   void SubtractExtents(const std::vector<Extent>& extents);
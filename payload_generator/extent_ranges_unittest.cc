@@ -406,6 +406,25 @@ TEST(ExtentRangesTest, AddExtentNoMergeStressTest) {
   ASSERT_EQ(ranges.extent_set().size(), 200000UL) << ranges.extent_set();
 }
 
+TEST(ExtentRangesTest, AppendExtentTest) {
+  ExtentRanges ranges;
+  ASSERT_TRUE(ranges.AppendExtent(ExtentForRange(5, 5)));
+  ASSERT_TRUE(ranges.AppendExtent(ExtentForRange(20, 5)));
+  // Overlapping, before or touching the last extent.
+  ASSERT_FALSE(ranges.AppendExtent(ExtentForRange(22, 5)));
+  ASSERT_FALSE(ranges.AppendExtent(ExtentForRange(0, 2)));
+  ASSERT_FALSE(ranges.AppendExtent(ExtentForRange(25, 5)));
+  ASSERT_EQ(ranges.extent_set().size(), 2UL) << ranges.extent_set();
+  ASSERT_EQ(ranges.blocks(), 10UL);
+  ASSERT_TRUE(ranges.ContainsBlock(24));
+  ASSERT_FALSE(ranges.ContainsBlock(25));
+
+  ExtentRanges unmerged(false);
+  ASSERT_TRUE(unmerged.AppendExtent(ExtentForRange(5, 5)));
+  ASSERT_TRUE(unmerged.AppendExtent(ExtentForRange(10, 5)));
+  ASSERT_EQ(unmerged.extent_set().size(), 2UL) << unmerged.extent_set();
+}
+
 TEST(ExtentRangesTest, AddExtentTouching) {
   ExtentRanges ranges(true);
   ranges.AddExtent(ExtentForRange(5, 5));
@@ -16,6 +16,7 @@
 
 #include <cstring>
 #include <map>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -43,9 +44,12 @@
 #include "update_engine/payload_consumer/filesystem_verifier_action.h"
 #include "update_engine/payload_consumer/payload_constants.h"
 #include "update_engine/payload_generator/delta_diff_generator.h"
+#include "update_engine/payload_generator/diff_selector.h"
 #include "update_engine/payload_generator/payload_generation_config.h"
 #include "update_engine/payload_generator/payload_properties.h"
 #include "update_engine/payload_generator/payload_signer.h"
+#include "update_engine/payload_generator/perf_report.h"
+#include "update_engine/payload_generator/sparse_utils.h"
 #include "update_engine/payload_generator/xz.h"
 #include "update_engine/update_metadata.pb.h"
 
@@ -444,6 +448,10 @@ DEFINE_string(compressor_types,
 DEFINE_bool(enable_lz4diff,
             false,
             "Whether to enable LZ4diff feature when processing EROFS images.");
+DEFINE_bool(concurrent_lz4diff_puffdiff,
+            false,
+            "Whether LZ4diff tries PUFFDIFF on a thread of its own while it "
+            "tries BSDIFF. Speeds up payloads with few large EROFS files.");
 
 DEFINE_bool(enable_puffdiff,
             true,
@@ -465,6 +473,29 @@ DEFINE_int64(max_threads,
              "The maximum number of threads allowed for generating "
              "ota.");
 
+DEFINE_int64(max_concurrent_hash_reads,
+             0,
+             "The maximum number of partition images read at the same time "
+             "to compute their hashes. 0 uses the default.");
+
+DEFINE_string(perf_report,
+              "",
+              "Path to write the time, input and output sizes of every "
+              "algorithm tried for every file of a delta payload to, along "
+              "with the thread wait time and memory high-water mark. Written "
+              "as CSV if the path ends in .csv and as JSON otherwise.");
+
+DEFINE_string(diff_history,
+              "",
+              "Path to the CSV --perf_report of previous payloads, used with "
+              "--min_diff_saved_bytes_per_second to skip the diff algorithms "
+              "that didn't pay off on similar files.");
+DEFINE_double(min_diff_saved_bytes_per_second,
+              0,
+              "Skip a diff algorithm on a file if, on similar files in the "
+              "--diff_history, it saved fewer bytes than this per CPU second "
+              "compared to the algorithms tried before it. 0 tries them all.");
+
 void RoundDownPartitions(const ImageConfig& config) {
   for (const auto& part : config.partitions) {
     if (part.path.empty()) {
@@ -495,6 +526,25 @@ void RoundUpPartitions(const ImageConfig& config) {
   }
 }
 
+// Replaces the Android sparse images in |config| by their raw content, written
+// to temporary files added to |raw_images|. The unused space of the sparse
+// images stays as holes in the raw images so the generator skips it.
+void UnsparsePartitions(ImageConfig* config,
+                        vector<std::unique_ptr<ScopedTempFile>>* raw_images) {
+  for (auto& part : config->partitions) {
+    if (part.path.empty() || !sparse_utils::IsSparseImage(part.path)) {
+      continue;
+    }
+    raw_images->push_back(
+        std::make_unique<ScopedTempFile>("CrAU_unsparsed.XXXXXX", true));
+    CHECK(sparse_utils::UnsparseImage(part.path, raw_images->back()->fd()))
+        << "Failed to unsparse " << part.path;
+    LOG(INFO) << "Using the unsparsed " << part.path << " from "
+              << raw_images->back()->path();
+    part.path = raw_images->back()->path();
+  }
+}
+
 int Main(int argc, char** argv) {
   gflags::SetUsageMessage(
       "Generates a payload to provide to ChromeOS' update_engine.\n\n"
@@ -616,6 +666,8 @@ int Main(int argc, char** argv) {
 
   payload_config.enable_vabc_xor = FLAGS_enable_vabc_xor;
   payload_config.enable_lz4diff = FLAGS_enable_lz4diff;
+  payload_config.concurrent_lz4diff_puffdiff =
+      FLAGS_concurrent_lz4diff_puffdiff;
   payload_config.enable_zucchini = FLAGS_enable_zucchini;
   payload_config.enable_puffdiff = FLAGS_enable_puffdiff;
 
@@ -696,6 +748,14 @@ int Main(int argc, char** argv) {
   payload_config.hard_chunk_size = FLAGS_chunk_size;
   payload_config.block_size = kBlockSize;
 
+  // Android sparse images are generated from their raw content, which must
+  // outlive the payload generation.
+  vector<std::unique_ptr<ScopedTempFile>> raw_images;
+  if (payload_config.is_delta) {
+    UnsparsePartitions(&payload_config.source, &raw_images);
+  }
+  UnsparsePartitions(&payload_config.target, &raw_images);
+
   // The partition size is never passed to the delta_generator, so we
   // need to detect those from the provided files.
   if (payload_config.is_delta) {
@@ -765,6 +825,7 @@ int Main(int argc, char** argv) {
   payload_config.security_patch_level = FLAGS_security_patch_level;
 
   payload_config.max_threads = FLAGS_max_threads;
+  payload_config.max_concurrent_hash_reads = FLAGS_max_concurrent_hash_reads;
 
   if (!FLAGS_partition_timestamps.empty()) {
     CHECK(ParsePerPartitionTimestamps(FLAGS_partition_timestamps,
@@ -797,11 +858,29 @@ int Main(int argc, char** argv) {
     return 1;
   }
 
+  PerfReport perf_report;
+  if (!FLAGS_perf_report.empty())
+    payload_config.perf_report = &perf_report;
+
+  DiffSelector diff_selector(FLAGS_min_diff_saved_bytes_per_second);
+  if (!FLAGS_diff_history.empty()) {
+    if (!diff_selector.LoadHistory(FLAGS_diff_history)) {
+      LOG(ERROR) << "Failed to load the diff history " << FLAGS_diff_history;
+      return 1;
+    }
+    payload_config.diff_selector = &diff_selector;
+  }
+
   uint64_t metadata_size{};
   if (!GenerateUpdatePayloadFile(
           payload_config, FLAGS_out_file, FLAGS_private_key, &metadata_size)) {
     return 1;
   }
+  if (!FLAGS_perf_report.empty() && !perf_report.Write(FLAGS_perf_report)) {
+    LOG(ERROR) << "Failed to write the performance report to "
+               << FLAGS_perf_report;
+    return 1;
+  }
   if (!FLAGS_out_metadata_size_file.empty()) {
     string metadata_size_string = std::to_string(metadata_size);
     CHECK(utils::WriteFile(FLAGS_out_metadata_size_file.c_str(),
@@ -0,0 +1,297 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/partition_hasher.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include <base/logging.h>
+#include <base/strings/string_number_conversions.h>
+#include <base/threading/simple_thread.h>
+#include <base/time/time.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/delta_diff_generator.h"
+#include "update_engine/payload_generator/sparse_utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// A chunk of a partition to hash. It is stored in the |buffer| of the
+// HashPipeline, or only holds zeros if |buffer| is -1.
+struct Chunk {
+  int buffer;
+  size_t size;
+};
+
+// Passes the chunks read from a partition to the thread hashing them. The
+// reader blocks while kNumBuffers chunks are waiting to be hashed.
+class HashPipeline {
+ public:
+  HashPipeline() : buffers_(PartitionHasher::kNumBuffers) {
+    for (size_t i = 0; i < buffers_.size(); i++) {
+      buffers_[i].resize(PartitionHasher::kBufferSize);
+      free_buffers_.push_back(i);
+    }
+  }
+
+  // Waits for a free buffer and returns its index, or -1 if aborted.
+  int AcquireBuffer() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this] { return aborted_ || !free_buffers_.empty(); });
+    if (aborted_)
+      return -1;
+    int buffer = free_buffers_.back();
+    free_buffers_.pop_back();
+    return buffer;
+  }
+
+  // Queues |chunk| to be hashed. Returns false if aborted.
+  bool Push(const Chunk& chunk) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this] {
+      return aborted_ || chunks_.size() < PartitionHasher::kNumBuffers;
+    });
+    if (aborted_)
+      return false;
+    chunks_.push_back(chunk);
+    cv_.notify_all();
+    return true;
+  }
+
+  // Waits for the next chunk to hash. Returns false once all the chunks were
+  // hashed after Close(), or if aborted.
+  bool Pop(Chunk* chunk) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this] { return aborted_ || closed_ || !chunks_.empty(); });
+    if (aborted_ || chunks_.empty())
+      return false;
+    *chunk = chunks_.front();
+    chunks_.pop_front();
+    cv_.notify_all();
+    return true;
+  }
+
+  // Makes the buffer of a hashed chunk available for the next reads.
+  void ReleaseBuffer(int buffer) {
+    if (buffer < 0)
+      return;
+    std::lock_guard<std::mutex> lock(mutex_);
+    free_buffers_.push_back(buffer);
+    cv_.notify_all();
+  }
+
+  // Called by the reader once all the chunks were pushed.
+  void Close() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    closed_ = true;
+    cv_.notify_all();
+  }
+
+  // Called by either side on errors to unblock the other one.
+  void Abort() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    aborted_ = true;
+    cv_.notify_all();
+  }
+
+  // The buffers are only touched by the side owning them, so no lock needed.
+  uint8_t* data(int buffer) { return buffers_[buffer].data(); }
+
+ private:
+  vector<brillo::Blob> buffers_;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  // Protected by |mutex_|.
+  vector<int> free_buffers_;
+  std::deque<Chunk> chunks_;
+  bool closed_{false};
+  bool aborted_{false};
+};
+
+// Pushes the bytes from |start| to |end| of |fd| to |pipeline|, reading them
+// if |is_data| or as zeros otherwise.
+bool QueueRange(int fd,
+                uint64_t start,
+                uint64_t end,
+                bool is_data,
+                HashPipeline* pipeline) {
+  constexpr uint64_t kBufferSize = PartitionHasher::kBufferSize;
+  for (uint64_t offset = start; offset < end;) {
+    const uint64_t chunk_end =
+        std::min(end, (offset / kBufferSize + 1) * kBufferSize);
+    Chunk chunk{.buffer = -1, .size = chunk_end - offset};
+    if (is_data) {
+      chunk.buffer = pipeline->AcquireBuffer();
+      TEST_AND_RETURN_FALSE(chunk.buffer >= 0);
+      ssize_t bytes_read = 0;
+      TEST_AND_RETURN_FALSE(utils::PReadAll(
+          fd, pipeline->data(chunk.buffer), chunk.size, offset, &bytes_read));
+      TEST_AND_RETURN_FALSE(static_cast<size_t>(bytes_read) == chunk.size);
+    }
+    TEST_AND_RETURN_FALSE(pipeline->Push(chunk));
+    offset = chunk_end;
+  }
+  return true;
+}
+
+// Pushes the first |size| bytes of |fd| to |pipeline|, only reading the
+// |data_extents|.
+bool QueuePartition(int fd,
+                    uint64_t size,
+                    const vector<Extent>& data_extents,
+                    HashPipeline* pipeline) {
+  uint64_t offset = 0;
+  for (const Extent& extent : data_extents) {
+    const uint64_t start = extent.start_block() * kBlockSize;
+    const uint64_t end =
+        std::min(start + extent.num_blocks() * kBlockSize, size);
+    TEST_AND_RETURN_FALSE(QueueRange(fd, offset, start, false, pipeline));
+    TEST_AND_RETURN_FALSE(QueueRange(fd, start, end, true, pipeline));
+    offset = end;
+  }
+  return QueueRange(fd, offset, size, false, pipeline);
+}
+
+bool HashPartition(const string& path, uint64_t size, PartitionInfo* info) {
+  int fd = HANDLE_EINTR(open(path.c_str(), O_RDONLY));
+  if (fd < 0) {
+    PLOG(ERROR) << "Failed to open " << path;
+    return false;
+  }
+  ScopedFdCloser fd_closer(&fd);
+  struct stat stbuf {};
+  if (fstat(fd, &stbuf) != 0) {
+    PLOG(ERROR) << "Failed to stat " << path;
+    return false;
+  }
+  // The bytes past the end of a regular file would look like a hole. Other
+  // files like /dev/zero have no size, a short read fails while hashing.
+  if (S_ISREG(stbuf.st_mode) && static_cast<uint64_t>(stbuf.st_size) < size) {
+    LOG(ERROR) << path << " has " << stbuf.st_size << " bytes, expected "
+               << size;
+    return false;
+  }
+  vector<Extent> data_extents;
+  TEST_AND_RETURN_FALSE(
+      sparse_utils::GetDataExtents(fd, size, kBlockSize, &data_extents));
+  posix_fadvise(fd, 0, size, POSIX_FADV_SEQUENTIAL);
+
+  HashPipeline pipeline;
+  HashCalculator hasher;
+  bool hash_ok = true;
+  std::thread hash_thread([&pipeline, &hasher, &hash_ok] {
+    static const brillo::Blob zeros(PartitionHasher::kBufferSize, 0);
+    Chunk chunk;
+    while (pipeline.Pop(&chunk)) {
+      const uint8_t* data =
+          chunk.buffer < 0 ? zeros.data() : pipeline.data(chunk.buffer);
+      if (!hasher.Update(data, chunk.size)) {
+        hash_ok = false;
+        pipeline.Abort();
+        return;
+      }
+      pipeline.ReleaseBuffer(chunk.buffer);
+    }
+  });
+  const bool read_ok = QueuePartition(fd, size, data_extents, &pipeline);
+  if (read_ok) {
+    pipeline.Close();
+  } else {
+    pipeline.Abort();
+  }
+  hash_thread.join();
+  TEST_AND_RETURN_FALSE(read_ok && hash_ok);
+  TEST_AND_RETURN_FALSE(hasher.Finalize());
+
+  const brillo::Blob& hash = hasher.raw_hash();
+  info->set_size(size);
+  info->set_hash(hash.data(), hash.size());
+  LOG(INFO) << path << ": size=" << size << " hash=" << HexEncode(hash);
+  return true;
+}
+
+}  // namespace
+
+class PartitionHasher::Job : public base::DelegateSimpleThread::Delegate {
+ public:
+  Job(const string& path, uint64_t size, PartitionInfo* info)
+      : path_(path), size_(size), info_(info) {}
+
+  void Run() override { success_ = HashPartition(path_, size_, info_); }
+
+  bool success() const { return success_; }
+
+ private:
+  const string path_;
+  const uint64_t size_;
+  PartitionInfo* info_;
+  bool success_{false};
+
+  DISALLOW_COPY_AND_ASSIGN(Job);
+};
+
+PartitionHasher::PartitionHasher(size_t max_concurrent_reads)
+    : max_concurrent_reads_(max_concurrent_reads > 0
+                                ? max_concurrent_reads
+                                : kDefaultMaxConcurrentReads) {}
+
+PartitionHasher::~PartitionHasher() = default;
+
+void PartitionHasher::AddPartition(const string& path,
+                                   uint64_t size,
+                                   PartitionInfo* info) {
+  jobs_.push_back(std::make_unique<Job>(path, size, info));
+}
+
+bool PartitionHasher::Run() {
+  if (jobs_.empty())
+    return true;
+  const base::TimeTicks start = base::TimeTicks::Now();
+  {
+    base::DelegateSimpleThreadPool thread_pool(
+        "partition-hasher", std::min(max_concurrent_reads_, jobs_.size()));
+    thread_pool.Start();
+    for (const auto& job : jobs_)
+      thread_pool.AddWork(job.get());
+    thread_pool.JoinAll();
+  }
+  const bool success =
+      std::all_of(jobs_.begin(), jobs_.end(), [](const auto& job) {
+        return job->success();
+      });
+  LOG(INFO) << "Hashed " << jobs_.size() << " partitions in "
+            << (base::TimeTicks::Now() - start).InSecondsF() << " seconds";
+  jobs_.clear();
+  return success;
+}
+
+}  // namespace chromeos_update_engine
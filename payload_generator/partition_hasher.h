@@ -0,0 +1,70 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_PARTITION_HASHER_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_PARTITION_HASHER_H_
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <base/macros.h>
+
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// Computes the size and hash of several partitions in parallel. Every
+// partition is read on a thread of a pool while a second thread hashes what was
+// read, so the reads overlap with SHA-256. Up to |max_concurrent_reads|
+// partitions are read at the same time, each one with at most kNumBuffers
+// buffers of kBufferSize bytes, which bounds the memory used. The holes of the
+// partition files are hashed as zeros without reading them.
+class PartitionHasher {
+ public:
+  // The size of every read. Reads are aligned to this size in the file.
+  static constexpr size_t kBufferSize = 2 * 1024 * 1024;  // bytes
+  // The number of buffers in flight for each partition.
+  static constexpr size_t kNumBuffers = 4;
+  // The number of partitions read at the same time by default.
+  static constexpr size_t kDefaultMaxConcurrentReads = 4;
+
+  // A |max_concurrent_reads| of 0 uses kDefaultMaxConcurrentReads.
+  explicit PartitionHasher(size_t max_concurrent_reads);
+  ~PartitionHasher();
+
+  // Queues the first |size| bytes of the file |path| to be hashed into |info|,
+  // which must remain valid until Run() returns.
+  void AddPartition(const std::string& path,
+                    uint64_t size,
+                    PartitionInfo* info);
+
+  // Hashes all the queued partitions, setting the size and hash of their
+  // PartitionInfo. Returns whether all of them succeeded.
+  bool Run();
+
+ private:
+  class Job;
+
+  size_t max_concurrent_reads_;
+  std::vector<std::unique_ptr<Job>> jobs_;
+
+  DISALLOW_COPY_AND_ASSIGN(PartitionHasher);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_PARTITION_HASHER_H_
@@ -0,0 +1,139 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/partition_hasher.h"
+
+#include <unistd.h>
+
+#include <memory>
+#include <vector>
+
+#include <brillo/secure_blob.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+
+using std::unique_ptr;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+class PartitionHasherTest : public ::testing::Test {
+ protected:
+  // Creates a partition file of |size| bytes with the given |data| at
+  // |offset|, leaving the rest as a hole.
+  const ScopedTempFile& CreatePartition(uint64_t size,
+                                        const brillo::Blob& data,
+                                        uint64_t offset) {
+    files_.push_back(std::make_unique<ScopedTempFile>(
+        "PartitionHasherTest-XXXXXX", true));
+    const ScopedTempFile& file = *files_.back();
+    EXPECT_EQ(0, ftruncate(file.fd(), size));
+    EXPECT_TRUE(
+        utils::PWriteAll(file.fd(), data.data(), data.size(), offset));
+    brillo::Blob contents(size, 0);
+    std::copy(data.begin(), data.end(), contents.begin() + offset);
+    expected_contents_.push_back(contents);
+    return file;
+  }
+
+  // Checks that |info| holds the size and hash of the |index|-th partition.
+  void ExpectInfo(size_t index, const PartitionInfo& info) {
+    const brillo::Blob& contents = expected_contents_[index];
+    brillo::Blob expected_hash;
+    ASSERT_TRUE(HashCalculator::RawHashOfData(contents, &expected_hash));
+    EXPECT_EQ(contents.size(), info.size());
+    EXPECT_EQ(expected_hash,
+              brillo::Blob(info.hash().begin(), info.hash().end()));
+  }
+
+  vector<unique_ptr<ScopedTempFile>> files_;
+  vector<brillo::Blob> expected_contents_;
+};
+
+TEST_F(PartitionHasherTest, HashesAllPartitionsTest) {
+  const size_t kBufferSize = PartitionHasher::kBufferSize;
+  brillo::Blob data(10000);
+  test_utils::FillWithData(&data);
+  brillo::Blob large_data(3 * kBufferSize + 123);
+  for (size_t i = 0; i < large_data.size(); i++)
+    large_data[i] = i * 31 + i / 4096;
+
+  CreatePartition(0, {}, 0);
+  CreatePartition(data.size(), data, 0);
+  CreatePartition(large_data.size(), large_data, 0);
+  // Data between holes, not aligned to the buffers.
+  CreatePartition(6 * kBufferSize, large_data, kBufferSize + 4096);
+
+  vector<PartitionInfo> infos(files_.size());
+  PartitionHasher hasher(2);
+  for (size_t i = 0; i < files_.size(); i++) {
+    hasher.AddPartition(
+        files_[i]->path(), expected_contents_[i].size(), &infos[i]);
+  }
+  ASSERT_TRUE(hasher.Run());
+  for (size_t i = 0; i < infos.size(); i++) {
+    SCOPED_TRACE(i);
+    ExpectInfo(i, infos[i]);
+  }
+}
+
+TEST_F(PartitionHasherTest, HashesOnlyTheRequestedSizeTest) {
+  brillo::Blob data(3 * PartitionHasher::kBufferSize, 'a');
+  const ScopedTempFile& file = CreatePartition(data.size(), data, 0);
+  expected_contents_.back().resize(PartitionHasher::kBufferSize + 10);
+
+  PartitionInfo info;
+  PartitionHasher hasher(0);
+  hasher.AddPartition(
+      file.path(), expected_contents_.back().size(), &info);
+  ASSERT_TRUE(hasher.Run());
+  ExpectInfo(0, info);
+}
+
+TEST_F(PartitionHasherTest, FailsOnMissingFileTest) {
+  const ScopedTempFile& file = CreatePartition(4096, {'a'}, 0);
+  PartitionInfo info;
+  PartitionInfo missing_info;
+  PartitionHasher hasher(1);
+  hasher.AddPartition(file.path(), 4096, &info);
+  hasher.AddPartition("/path/to/nowhere", 4096, &missing_info);
+  ASSERT_FALSE(hasher.Run());
+  ExpectInfo(0, info);
+}
+
+TEST_F(PartitionHasherTest, FailsOnShortFileTest) {
+  const ScopedTempFile& file = CreatePartition(4096, {'a'}, 0);
+  PartitionInfo info;
+  PartitionHasher hasher(1);
+  hasher.AddPartition(file.path(), 8 * PartitionHasher::kBufferSize, &info);
+  ASSERT_FALSE(hasher.Run());
+}
+
+TEST_F(PartitionHasherTest, HashesCharDeviceTest) {
+  // /dev/zero has no size, but can be read for as long as needed.
+  expected_contents_.push_back(
+      brillo::Blob(2 * PartitionHasher::kBufferSize + 10, 0));
+  PartitionInfo info;
+  PartitionHasher hasher(1);
+  hasher.AddPartition("/dev/zero", expected_contents_.back().size(), &info);
+  ASSERT_TRUE(hasher.Run());
+  ExpectInfo(0, info);
+}
+
+}  // namespace chromeos_update_engine
@@ -30,6 +30,7 @@
 #include "update_engine/payload_consumer/payload_constants.h"
 #include "update_engine/payload_generator/annotated_operation.h"
 #include "update_engine/payload_generator/delta_diff_utils.h"
+#include "update_engine/payload_generator/partition_hasher.h"
 #include "update_engine/payload_generator/payload_signer.h"
 
 using std::string;
@@ -63,6 +64,7 @@ bool WriteUint64AsBigEndian(FileWriter* writer, const uint64_t value) {
 bool PayloadFile::Init(const PayloadGenerationConfig& config) {
   TEST_AND_RETURN_FALSE(config.version.Validate());
   major_version_ = config.version.major;
+  max_concurrent_hash_reads_ = config.max_concurrent_hash_reads;
   manifest_.set_minor_version(config.version.minor);
   manifest_.set_block_size(config.block_size);
   manifest_.set_max_timestamp(config.max_timestamp);
@@ -107,20 +109,34 @@ bool PayloadFile::AddPartition(const PartitionConfig& old_conf,
   part.verity = new_conf.verity;
   part.version = new_conf.version;
   part.cow_info = cow_info;
-  // Initialize the PartitionInfo objects if present.
-  if (!old_conf.path.empty())
-    TEST_AND_RETURN_FALSE(
-        diff_utils::InitializePartitionInfo(old_conf, &part.old_info));
-  TEST_AND_RETURN_FALSE(
-      diff_utils::InitializePartitionInfo(new_conf, &part.new_info));
+  // The PartitionInfo objects are initialized by HashPartitions().
+  if (!old_conf.path.empty()) {
+    part.old_path = old_conf.path;
+    part.old_info.set_size(old_conf.size);
+  }
+  TEST_AND_RETURN_FALSE(!new_conf.path.empty());
+  part.new_path = new_conf.path;
+  part.new_info.set_size(new_conf.size);
   part_vec_.push_back(std::move(part));
   return true;
 }
 
+bool PayloadFile::HashPartitions() {
+  PartitionHasher hasher(max_concurrent_hash_reads_);
+  for (Partition& part : part_vec_) {
+    if (!part.old_path.empty())
+      hasher.AddPartition(part.old_path, part.old_info.size(), &part.old_info);
+    hasher.AddPartition(part.new_path, part.new_info.size(), &part.new_info);
+  }
+  return hasher.Run();
+}
+
 bool PayloadFile::WritePayload(const string& payload_file,
                                const string& data_blobs_path,
                                const string& private_key_path,
                                uint64_t* metadata_size_out) {
+  TEST_AND_RETURN_FALSE(HashPartitions());
+
   // Reorder the data blobs with the manifest_.
   ScopedTempFile ordered_blobs_file("CrAU_temp_data.ordered.XXXXXX");
   TEST_AND_RETURN_FALSE(
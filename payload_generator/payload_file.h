@@ -42,7 +42,9 @@ class PayloadFile {
 
   // Add a partition to the payload manifest. Including partition name, list of
   // operations and partition info. The operations in |aops|
-  // reference a blob stored in the file provided to WritePayload().
+  // reference a blob stored in the file provided to WritePayload(). The
+  // partitions are hashed by WritePayload(), so their files must be kept until
+  // then.
   bool AddPartition(const PartitionConfig& old_conf,
                     const PartitionConfig& new_conf,
                     std::vector<AnnotatedOperation> aops,
@@ -86,12 +88,20 @@ class PayloadFile {
   bool ReorderDataBlobs(const std::string& data_blobs_path,
                         const std::string& new_data_blobs_path);
 
+  // Computes the |old_info| and |new_info| of all the partitions in
+  // |part_vec_| in parallel.
+  bool HashPartitions();
+
   // Print in stderr the Payload usage report.
   void ReportPayloadUsage(uint64_t metadata_size) const;
 
   // The major_version of the requested payload.
   uint64_t major_version_;
 
+  // The maximum number of partitions read at the same time by
+  // HashPartitions(), or 0 for the default.
+  size_t max_concurrent_hash_reads_{0};
+
   DeltaArchiveManifest manifest_;
 
   // Struct has necessary information to write PartitionUpdate in protobuf.
@@ -105,6 +115,10 @@ class PayloadFile {
 
     PartitionInfo old_info;
     PartitionInfo new_info;
+    // The files hashed into |old_info| and |new_info|. |old_path| is empty for
+    // full updates.
+    std::string old_path;
+    std::string new_path;
 
     PostInstallConfig postinstall;
     VerityConfig verity;
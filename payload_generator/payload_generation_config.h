@@ -27,7 +27,9 @@
 #include <brillo/secure_blob.h>
 
 #include "bsdiff/constants.h"
+#include "update_engine/payload_generator/diff_selector.h"
 #include "update_engine/payload_generator/filesystem_interface.h"
+#include "update_engine/payload_generator/perf_report.h"
 #include "update_engine/update_metadata.pb.h"
 
 namespace chromeos_update_engine {
@@ -258,6 +260,11 @@ struct PayloadGenerationConfig {
   // Whether to enable LZ4diff ops
   bool enable_lz4diff = false;
 
+  // Whether LZ4diff runs its PUFFDIFF attempt on a thread of its own, next to
+  // the BSDIFF one. Only worth it when there are fewer files to diff than
+  // |max_threads|, as every file already gets a thread of the pool.
+  bool concurrent_lz4diff_puffdiff = false;
+
   // Whether to enable zucchini ops
   bool enable_zucchini = true;
 
@@ -268,9 +275,19 @@ struct PayloadGenerationConfig {
 
   uint32_t max_threads = 0;
 
+  // The maximum number of partition images read at the same time to compute
+  // their hashes, see PartitionHasher. 0 uses the default.
+  uint32_t max_concurrent_hash_reads = 0;
+
   std::vector<bsdiff::CompressorType> compressors{
       bsdiff::CompressorType::kBZ2, bsdiff::CompressorType::kBrotli};
 
+  // If not null, the cost of generating every operation is recorded here.
+  PerfReport* perf_report = nullptr;
+
+  // If not null, decides which diff algorithms are worth trying for a file.
+  const DiffSelector* diff_selector = nullptr;
+
   [[nodiscard]] bool OperationEnabled(InstallOperation::Type op) const noexcept;
 };
 
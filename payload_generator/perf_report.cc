@@ -0,0 +1,214 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/perf_report.h"
+
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <cinttypes>
+#include <map>
+#include <memory>
+#include <utility>
+
+#include <base/json/json_writer.h>
+#include <base/logging.h>
+#include <base/strings/string_util.h>
+#include <base/strings/stringprintf.h>
+#include <base/values.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/payload_constants.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+struct AlgorithmSummary {
+  uint64_t attempts{0};
+  uint64_t failed{0};
+  uint64_t picked{0};
+  uint64_t new_bytes{0};
+  uint64_t output_bytes{0};
+  base::TimeDelta duration;
+};
+
+// Quotes a CSV field which may contain commas or quotes, like a path.
+string QuoteCsvField(const string& field) {
+  string escaped;
+  base::ReplaceChars(field, "\"", "\"\"", &escaped);
+  return "\"" + escaped + "\"";
+}
+
+}  // namespace
+
+int64_t PerfReport::GetMaxRssKiB() {
+  struct rusage usage {};
+  if (getrusage(RUSAGE_SELF, &usage) != 0) {
+    PLOG(WARNING) << "getrusage failed";
+    return 0;
+  }
+  // ru_maxrss is in KiB on Linux.
+  return usage.ru_maxrss;
+}
+
+void PerfReport::AddOperation(OperationRecord record) {
+  base::AutoLock auto_lock(lock_);
+  operations_.push_back(std::move(record));
+}
+
+void PerfReport::AddFile(FileRecord record) {
+  base::AutoLock auto_lock(lock_);
+  files_.push_back(std::move(record));
+}
+
+string PerfReport::ToJson() const {
+  base::AutoLock auto_lock(lock_);
+  std::map<InstallOperation::Type, AlgorithmSummary> summaries;
+
+  auto files = std::make_unique<base::ListValue>();
+  for (const FileRecord& file : files_) {
+    auto entry = std::make_unique<base::DictionaryValue>();
+    entry->SetString("image", file.image);
+    entry->SetString("name", file.name);
+    entry->SetDouble("blocks", file.blocks);
+    entry->SetDouble("thread_wait_ms", file.thread_wait.InMillisecondsF());
+    entry->SetDouble("time_ms", file.duration.InMillisecondsF());
+    entry->SetDouble("max_rss_kib", file.max_rss_kib);
+    files->Append(std::move(entry));
+  }
+
+  auto operations = std::make_unique<base::ListValue>();
+  for (const OperationRecord& operation : operations_) {
+    auto attempts = std::make_unique<base::ListValue>();
+    for (const Attempt& attempt : operation.attempts) {
+      auto entry = std::make_unique<base::DictionaryValue>();
+      entry->SetString("algorithm", InstallOperationTypeName(attempt.type));
+      entry->SetDouble("time_ms", attempt.duration.InMillisecondsF());
+      entry->SetDouble("output_bytes", attempt.output_bytes);
+      if (attempt.failed)
+        entry->SetBoolean("failed", true);
+      attempts->Append(std::move(entry));
+
+      AlgorithmSummary& summary = summaries[attempt.type];
+      summary.attempts++;
+      summary.duration += attempt.duration;
+      if (attempt.failed) {
+        summary.failed++;
+        continue;
+      }
+      summary.new_bytes += operation.new_bytes;
+      summary.output_bytes += attempt.output_bytes;
+    }
+    summaries[operation.winner].picked++;
+
+    auto entry = std::make_unique<base::DictionaryValue>();
+    entry->SetString("image", operation.image);
+    entry->SetString("name", operation.name);
+    entry->SetDouble("old_bytes", operation.old_bytes);
+    entry->SetDouble("new_bytes", operation.new_bytes);
+    entry->SetDouble("entropy", operation.entropy);
+    entry->SetDouble("time_ms", operation.duration.InMillisecondsF());
+    entry->Set("attempts", std::move(attempts));
+    entry->SetString("picked", InstallOperationTypeName(operation.winner));
+    entry->SetDouble("output_bytes", operation.output_bytes);
+    operations->Append(std::move(entry));
+  }
+
+  auto algorithms = std::make_unique<base::ListValue>();
+  for (const auto& [type, summary] : summaries) {
+    auto entry = std::make_unique<base::DictionaryValue>();
+    entry->SetString("algorithm", InstallOperationTypeName(type));
+    entry->SetDouble("attempts", summary.attempts);
+    entry->SetDouble("failed", summary.failed);
+    entry->SetDouble("picked", summary.picked);
+    entry->SetDouble("new_bytes", summary.new_bytes);
+    entry->SetDouble("output_bytes", summary.output_bytes);
+    entry->SetDouble("time_ms", summary.duration.InMillisecondsF());
+    algorithms->Append(std::move(entry));
+  }
+
+  base::DictionaryValue report;
+  report.Set("algorithms", std::move(algorithms));
+  report.Set("files", std::move(files));
+  report.Set("operations", std::move(operations));
+  string json;
+  base::JSONWriter::WriteWithOptions(
+      report, base::JSONWriter::OPTIONS_PRETTY_PRINT, &json);
+  return json;
+}
+
+string PerfReport::ToCsv() const {
+  base::AutoLock auto_lock(lock_);
+  std::map<std::pair<string, string>, const FileRecord*> files;
+  for (const FileRecord& file : files_)
+    files[{file.image, file.name}] = &file;
+
+  string csv =
+      "image,name,old_bytes,new_bytes,entropy,algorithm,time_ms,output_bytes,"
+      "saved_bytes,picked,thread_wait_ms,max_rss_kib\n";
+  for (const OperationRecord& operation : operations_) {
+    auto it = files.find({operation.image, operation.name});
+    const string file_columns =
+        it == files.end()
+            ? ","
+            : base::StringPrintf("%.3f,%" PRId64,
+                                 it->second->thread_wait.InMillisecondsF(),
+                                 it->second->max_rss_kib);
+    const string image = QuoteCsvField(operation.image);
+    const string name = QuoteCsvField(operation.name);
+    uint64_t best_bytes = operation.new_bytes;
+    for (const Attempt& attempt : operation.attempts) {
+      uint64_t saved_bytes = 0;
+      if (!attempt.failed) {
+        saved_bytes = best_bytes > attempt.output_bytes
+                          ? best_bytes - attempt.output_bytes
+                          : 0;
+        best_bytes = std::min(best_bytes, attempt.output_bytes);
+      }
+      base::StringAppendF(&csv,
+                          "%s,%s,%" PRIu64 ",%" PRIu64
+                          ",%.3f,%s,%.3f,%" PRIu64 ",%" PRIu64 ",%d,%s\n",
+                          image.c_str(),
+                          name.c_str(),
+                          operation.old_bytes,
+                          operation.new_bytes,
+                          operation.entropy,
+                          InstallOperationTypeName(attempt.type),
+                          attempt.duration.InMillisecondsF(),
+                          attempt.output_bytes,
+                          saved_bytes,
+                          attempt.type == operation.winner,
+                          file_columns.c_str());
+    }
+  }
+  return csv;
+}
+
+bool PerfReport::Write(const string& path) const {
+  const string report =
+      base::EndsWith(path, ".csv", base::CompareCase::INSENSITIVE_ASCII)
+          ? ToCsv()
+          : ToJson();
+  TEST_AND_RETURN_FALSE(
+      utils::WriteFile(path.c_str(), report.data(), report.size()));
+  LOG(INFO) << "Wrote the generator performance report to " << path;
+  return true;
+}
+
+}  // namespace chromeos_update_engine
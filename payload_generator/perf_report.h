@@ -0,0 +1,112 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_PERF_REPORT_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_PERF_REPORT_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <base/macros.h>
+#include <base/synchronization/lock.h>
+#include <base/time/time.h>
+
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// Collects what generating the operations of a delta payload cost, so it can
+// be decided per type of file which diff algorithms are worth their CPU time.
+// Records are added from the threads diffing the files, in a thread safe way,
+// and written as a JSON or CSV report once the payload is generated.
+class PerfReport {
+ public:
+  // A full or diff operation that was generated for some data, whether it
+  // ended up being used or not.
+  struct Attempt {
+    InstallOperation::Type type{};
+    base::TimeDelta duration;
+    uint64_t output_bytes{0};
+    // The diff failed, so it only cost |duration| and has no output.
+    bool failed{false};
+  };
+
+  // The operation generated for one file or one chunk of a file.
+  struct OperationRecord {
+    // The new partition image and the file the operation writes.
+    std::string image;
+    std::string name;
+    uint64_t old_bytes{0};
+    uint64_t new_bytes{0};
+    // Sampled entropy of the new data in bits per byte, see DiffSelector.
+    double entropy{0};
+    // Reading the data and trying all the algorithms.
+    base::TimeDelta duration;
+    std::vector<Attempt> attempts;
+    // The type of the operation that was picked and the size of its data.
+    InstallOperation::Type winner{};
+    uint64_t output_bytes{0};
+  };
+
+  // A file diffed by one of the worker threads.
+  struct FileRecord {
+    std::string image;
+    std::string name;
+    uint64_t blocks{0};
+    // Between the work being queued and a thread picking it up.
+    base::TimeDelta thread_wait;
+    base::TimeDelta duration;
+    // The resident memory high-water mark of the whole generator, in KiB,
+    // after the file was diffed.
+    int64_t max_rss_kib{0};
+  };
+
+  PerfReport() = default;
+
+  // Returns the resident memory high-water mark of the process in KiB.
+  static int64_t GetMaxRssKiB();
+
+  void AddOperation(OperationRecord record);
+  void AddFile(FileRecord record);
+
+  // Returns a JSON object with the |files|, the |operations| and a summary of
+  // every |algorithms| attempted: how often it was tried, failed and picked,
+  // the input and output bytes, and the time it took.
+  std::string ToJson() const;
+
+  // Returns one CSV line per attempt, with the operation and file it was for.
+  // The |saved_bytes| of an attempt are how much smaller its output is than
+  // the best one tried before it, or than the new data for the first one. A
+  // failed attempt has no |output_bytes| and saved nothing.
+  // DiffSelector::LoadHistory() reads this format.
+  std::string ToCsv() const;
+
+  // Writes the report to |path|, as CSV if it ends in ".csv" and as JSON
+  // otherwise.
+  bool Write(const std::string& path) const;
+
+ private:
+  mutable base::Lock lock_;
+  std::vector<OperationRecord> operations_;
+  std::vector<FileRecord> files_;
+
+  DISALLOW_COPY_AND_ASSIGN(PerfReport);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_PERF_REPORT_H_
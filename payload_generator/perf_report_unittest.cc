@@ -0,0 +1,137 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/perf_report.h"
+
+#include <string>
+
+#include <base/files/scoped_temp_dir.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/utils.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+class PerfReportTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    report_.AddOperation(
+        {.image = "system.img",
+         .name = "/lib/libfoo.so",
+         .old_bytes = 8192,
+         .new_bytes = 8192,
+         .entropy = 5.5,
+         .duration = base::TimeDelta::FromMilliseconds(30),
+         .attempts = {{.type = InstallOperation::REPLACE_XZ,
+                       .duration = base::TimeDelta::FromMilliseconds(10),
+                       .output_bytes = 4000},
+                      {.type = InstallOperation::BROTLI_BSDIFF,
+                       .duration = base::TimeDelta::FromMilliseconds(20),
+                       .output_bytes = 100}},
+         .winner = InstallOperation::BROTLI_BSDIFF,
+         .output_bytes = 100});
+    report_.AddFile({.image = "system.img",
+                     .name = "/lib/libfoo.so",
+                     .blocks = 2,
+                     .thread_wait = base::TimeDelta::FromMilliseconds(5),
+                     .duration = base::TimeDelta::FromMilliseconds(30),
+                     .max_rss_kib = 1024});
+  }
+
+  PerfReport report_;
+};
+
+TEST_F(PerfReportTest, CsvTest) {
+  EXPECT_EQ(
+      "image,name,old_bytes,new_bytes,entropy,algorithm,time_ms,output_bytes,"
+      "saved_bytes,picked,thread_wait_ms,max_rss_kib\n"
+      "\"system.img\",\"/lib/libfoo.so\",8192,8192,5.500,REPLACE_XZ,10.000,"
+      "4000,4192,0,5.000,1024\n"
+      "\"system.img\",\"/lib/libfoo.so\",8192,8192,5.500,BROTLI_BSDIFF,20.000,"
+      "100,3900,1,5.000,1024\n",
+      report_.ToCsv());
+}
+
+// A failed attempt saves nothing, and doesn't change what the attempts after
+// it saved.
+TEST_F(PerfReportTest, FailedAttemptCsvTest) {
+  PerfReport report;
+  report.AddOperation(
+      {.image = "system.img",
+       .name = "/lib/libbar.so",
+       .old_bytes = 8192,
+       .new_bytes = 8192,
+       .attempts = {{.type = InstallOperation::LZ4DIFF_BSDIFF,
+                     .duration = base::TimeDelta::FromMilliseconds(10),
+                     .failed = true},
+                    {.type = InstallOperation::SOURCE_BSDIFF,
+                     .duration = base::TimeDelta::FromMilliseconds(20),
+                     .output_bytes = 100}},
+       .winner = InstallOperation::SOURCE_BSDIFF,
+       .output_bytes = 100});
+  EXPECT_EQ(
+      "image,name,old_bytes,new_bytes,entropy,algorithm,time_ms,output_bytes,"
+      "saved_bytes,picked,thread_wait_ms,max_rss_kib\n"
+      "\"system.img\",\"/lib/libbar.so\",8192,8192,0.000,LZ4DIFF_BSDIFF,"
+      "10.000,0,0,0,,\n"
+      "\"system.img\",\"/lib/libbar.so\",8192,8192,0.000,SOURCE_BSDIFF,20.000,"
+      "100,8092,1,,\n",
+      report.ToCsv());
+  EXPECT_NE(string::npos, report.ToJson().find("\"failed\": true"));
+}
+
+// The image paths are quoted like the names, LoadHistory() reads the columns
+// by position.
+TEST_F(PerfReportTest, QuotedCsvTest) {
+  PerfReport report;
+  report.AddOperation({.image = "out/a,b/system.img",
+                       .name = "/etc/\"quoted\",name",
+                       .attempts = {{.type = InstallOperation::REPLACE}},
+                       .winner = InstallOperation::REPLACE});
+  EXPECT_EQ(
+      "image,name,old_bytes,new_bytes,entropy,algorithm,time_ms,output_bytes,"
+      "saved_bytes,picked,thread_wait_ms,max_rss_kib\n"
+      "\"out/a,b/system.img\",\"/etc/\"\"quoted\"\",name\",0,0,0.000,REPLACE,"
+      "0.000,0,0,1,,\n",
+      report.ToCsv());
+}
+
+TEST_F(PerfReportTest, JsonTest) {
+  const string json = report_.ToJson();
+  EXPECT_NE(string::npos, json.find("\"algorithms\""));
+  EXPECT_NE(string::npos, json.find("\"files\""));
+  EXPECT_NE(string::npos, json.find("\"operations\""));
+  EXPECT_NE(string::npos, json.find("\"picked\": \"BROTLI_BSDIFF\""));
+  EXPECT_NE(string::npos, json.find("\"thread_wait_ms\": 5.0"));
+}
+
+TEST_F(PerfReportTest, WriteTest) {
+  base::ScopedTempDir temp_dir;
+  ASSERT_TRUE(temp_dir.CreateUniqueTempDir());
+  const string csv_path = temp_dir.GetPath().Append("report.csv").value();
+  const string json_path = temp_dir.GetPath().Append("report.json").value();
+  ASSERT_TRUE(report_.Write(csv_path));
+  ASSERT_TRUE(report_.Write(json_path));
+  string content;
+  ASSERT_TRUE(utils::ReadFile(csv_path, &content));
+  EXPECT_EQ(report_.ToCsv(), content);
+  ASSERT_TRUE(utils::ReadFile(json_path, &content));
+  EXPECT_EQ(report_.ToJson(), content);
+}
+
+}  // namespace chromeos_update_engine
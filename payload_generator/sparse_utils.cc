@@ -0,0 +1,162 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/sparse_utils.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <base/logging.h>
+#include <brillo/secure_blob.h>
+#include <sparse/sparse.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+namespace sparse_utils {
+
+namespace {
+// The magic number at the start of an Android sparse image, see
+// system/core/libsparse/sparse_format.h.
+constexpr char kSparseMagic[] = {'\x3A', '\xFF', '\x26', '\xED'};
+}  // namespace
+
+bool GetDataExtents(int fd,
+                    uint64_t size,
+                    size_t block_size,
+                    vector<Extent>* extents) {
+  extents->clear();
+  const uint64_t num_blocks = (size + block_size - 1) / block_size;
+  struct stat stbuf {};
+  if (fstat(fd, &stbuf) != 0) {
+    PLOG(ERROR) << "Failed to stat the file";
+    return false;
+  }
+  // Only regular files have holes. Devices like /dev/zero accept SEEK_DATA and
+  // SEEK_HOLE, but return 0 for both.
+  if (!S_ISREG(stbuf.st_mode)) {
+    *extents = {ExtentForRange(0, num_blocks)};
+    return true;
+  }
+  off_t offset = 0;
+  while (static_cast<uint64_t>(offset) < size) {
+    off_t data = lseek(fd, offset, SEEK_DATA);
+    if (data < 0 && errno == ENXIO) {
+      // Only a hole is left until the end of the file.
+      break;
+    }
+    if (data < 0 && errno == EINVAL) {
+      // The filesystem doesn't support SEEK_DATA, everything may be data.
+      *extents = {ExtentForRange(0, num_blocks)};
+      return true;
+    }
+    if (data < 0) {
+      PLOG(ERROR) << "Failed to seek to the data after offset " << offset;
+      return false;
+    }
+    if (static_cast<uint64_t>(data) >= size)
+      break;
+    off_t hole = lseek(fd, data, SEEK_HOLE);
+    if (hole < 0) {
+      PLOG(ERROR) << "Failed to seek to the hole after offset " << data;
+      return false;
+    }
+    if (hole <= data) {
+      // Not a hole after the data, so the holes can't be trusted and this
+      // would never make progress. Everything may be data.
+      *extents = {ExtentForRange(0, num_blocks)};
+      return true;
+    }
+    hole = std::min<uint64_t>(hole, size);
+
+    const uint64_t start_block = data / block_size;
+    const uint64_t end_block = (hole + block_size - 1) / block_size;
+    // Two data ranges may share a partially covered block.
+    Extent* last = extents->empty() ? nullptr : &extents->back();
+    if (last && last->start_block() + last->num_blocks() >= start_block) {
+      last->set_num_blocks(end_block - last->start_block());
+    } else {
+      extents->push_back(ExtentForRange(start_block, end_block - start_block));
+    }
+    offset = hole;
+  }
+  return true;
+}
+
+bool GetDataExtents(const string& path,
+                    uint64_t size,
+                    size_t block_size,
+                    vector<Extent>* extents) {
+  int fd = HANDLE_EINTR(open(path.c_str(), O_RDONLY));
+  if (fd < 0) {
+    PLOG(ERROR) << "Failed to open " << path;
+    return false;
+  }
+  ScopedFdCloser fd_closer(&fd);
+  return GetDataExtents(fd, size, block_size, extents);
+}
+
+vector<Extent> GetHoleExtents(const vector<Extent>& data_extents,
+                              uint64_t num_blocks) {
+  ExtentRanges data_ranges;
+  data_ranges.AddExtents(data_extents);
+  return FilterExtentRanges({ExtentForRange(0, num_blocks)}, data_ranges);
+}
+
+bool IsSparseImage(const string& path) {
+  brillo::Blob header;
+  if (!utils::ReadFileChunk(path, 0, sizeof(kSparseMagic), &header) ||
+      header.size() != sizeof(kSparseMagic))
+    return false;
+  return memcmp(header.data(), kSparseMagic, sizeof(kSparseMagic)) == 0;
+}
+
+bool UnsparseImage(const string& path, int out_fd) {
+  int fd = HANDLE_EINTR(open(path.c_str(), O_RDONLY));
+  if (fd < 0) {
+    PLOG(ERROR) << "Failed to open " << path;
+    return false;
+  }
+  ScopedFdCloser fd_closer(&fd);
+  struct sparse_file* sparse = sparse_file_import(fd, true, false);
+  if (sparse == nullptr) {
+    LOG(ERROR) << "Failed to parse the sparse image " << path;
+    return false;
+  }
+  // A raw (non-sparse) output seeks over the "don't care" chunks.
+  int ret = sparse_file_write(sparse, out_fd, false, false, false);
+  sparse_file_destroy(sparse);
+  if (ret < 0) {
+    LOG(ERROR) << "Failed to write the unsparsed image of " << path;
+    return false;
+  }
+  return true;
+}
+
+}  // namespace sparse_utils
+}  // namespace chromeos_update_engine
@@ -0,0 +1,60 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_SPARSE_UTILS_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_SPARSE_UTILS_H_
+
+#include <string>
+#include <vector>
+
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+namespace sparse_utils {
+
+// Stores in |extents| the blocks of size |block_size| within the first |size|
+// bytes of |fd| that may contain data, as reported by lseek(2) SEEK_DATA and
+// SEEK_HOLE. Every block not listed is a hole and reads as zeros, so callers
+// can skip reading it. A block partially covered by data is listed. For files
+// which aren't regular files, or on filesystems that don't track holes, the
+// whole range is returned. The file offset of |fd| is modified.
+bool GetDataExtents(int fd,
+                    uint64_t size,
+                    size_t block_size,
+                    std::vector<Extent>* extents);
+
+// Same as above, opening the file at |path|.
+bool GetDataExtents(const std::string& path,
+                    uint64_t size,
+                    size_t block_size,
+                    std::vector<Extent>* extents);
+
+// Returns the blocks in the first |num_blocks| blocks that are not covered by
+// |data_extents|.
+std::vector<Extent> GetHoleExtents(const std::vector<Extent>& data_extents,
+                                   uint64_t num_blocks);
+
+// Returns whether the file at |path| is an Android sparse image.
+bool IsSparseImage(const std::string& path);
+
+// Writes the raw image stored in the Android sparse image |path| to |out_fd|.
+// "Don't care" chunks of the sparse image are left as holes in |out_fd|.
+bool UnsparseImage(const std::string& path, int out_fd);
+
+}  // namespace sparse_utils
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_SPARSE_UTILS_H_
@@ -0,0 +1,139 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/sparse_utils.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <brillo/secure_blob.h>
+#include <gtest/gtest.h>
+#include <sparse/sparse.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/delta_diff_generator.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/extent_utils.h"
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+class SparseUtilsTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    ASSERT_EQ(0, ftruncate(file_.fd(), kNumBlocks * kBlockSize));
+    // Some filesystems don't report holes, so the whole file is data.
+    vector<Extent> extents;
+    ASSERT_TRUE(sparse_utils::GetDataExtents(
+        file_.path(), kNumBlocks * kBlockSize, kBlockSize, &extents));
+    holes_reported_ = extents.empty();
+  }
+
+  // Writes |num_blocks| blocks of non-zero data at |start_block| of |file_|.
+  void WriteBlocks(uint64_t start_block, uint64_t num_blocks) {
+    brillo::Blob data(num_blocks * kBlockSize, 'a');
+    ASSERT_TRUE(utils::PWriteAll(
+        file_.fd(), data.data(), data.size(), start_block * kBlockSize));
+  }
+
+  static constexpr uint64_t kNumBlocks = 64;
+  ScopedTempFile file_{"SparseUtilsTest-XXXXXX", true};
+  bool holes_reported_{false};
+};
+
+TEST_F(SparseUtilsTest, GetDataExtentsTest) {
+  if (!holes_reported_)
+    GTEST_SKIP() << "The filesystem of the test file doesn't report holes.";
+  WriteBlocks(3, 1);
+  WriteBlocks(10, 5);
+  vector<Extent> extents;
+  ASSERT_TRUE(sparse_utils::GetDataExtents(
+      file_.path(), kNumBlocks * kBlockSize, kBlockSize, &extents));
+  ASSERT_EQ((vector<Extent>{ExtentForRange(3, 1), ExtentForRange(10, 5)}),
+            extents);
+  ASSERT_EQ((vector<Extent>{ExtentForRange(0, 3),
+                            ExtentForRange(4, 6),
+                            ExtentForRange(15, 49)}),
+            sparse_utils::GetHoleExtents(extents, kNumBlocks));
+}
+
+TEST_F(SparseUtilsTest, GetDataExtentsOnlyHolesTest) {
+  if (!holes_reported_)
+    GTEST_SKIP() << "The filesystem of the test file doesn't report holes.";
+  vector<Extent> extents;
+  ASSERT_TRUE(sparse_utils::GetDataExtents(
+      file_.path(), kNumBlocks * kBlockSize, kBlockSize, &extents));
+  ASSERT_TRUE(extents.empty());
+  ASSERT_EQ(vector<Extent>{ExtentForRange(0, kNumBlocks)},
+            sparse_utils::GetHoleExtents(extents, kNumBlocks));
+}
+
+TEST_F(SparseUtilsTest, GetDataExtentsStopsAtSizeTest) {
+  if (!holes_reported_)
+    GTEST_SKIP() << "The filesystem of the test file doesn't report holes.";
+  WriteBlocks(60, 4);
+  vector<Extent> extents;
+  ASSERT_TRUE(sparse_utils::GetDataExtents(
+      file_.path(), 62 * kBlockSize, kBlockSize, &extents));
+  ASSERT_EQ(vector<Extent>{ExtentForRange(60, 2)}, extents);
+}
+
+TEST_F(SparseUtilsTest, GetDataExtentsCharDeviceTest) {
+  // /dev/zero has no holes to report, and must not be probed for them.
+  vector<Extent> extents;
+  ASSERT_TRUE(sparse_utils::GetDataExtents(
+      "/dev/zero", kNumBlocks * kBlockSize, kBlockSize, &extents));
+  ASSERT_EQ(vector<Extent>{ExtentForRange(0, kNumBlocks)}, extents);
+}
+
+TEST_F(SparseUtilsTest, IsSparseImageTest) {
+  WriteBlocks(0, 1);
+  ASSERT_FALSE(sparse_utils::IsSparseImage(file_.path()));
+  ASSERT_FALSE(sparse_utils::IsSparseImage("/path/to/nowhere"));
+}
+
+TEST_F(SparseUtilsTest, UnsparseImageTest) {
+  ScopedTempFile sparse_image("SparseUtilsTest-sparse-XXXXXX", true);
+  brillo::Blob data(2 * kBlockSize, 'a');
+  struct sparse_file* sparse =
+      sparse_file_new(kBlockSize, kNumBlocks * kBlockSize);
+  ASSERT_NE(nullptr, sparse);
+  ASSERT_EQ(0, sparse_file_add_data(sparse, data.data(), data.size(), 7));
+  ASSERT_EQ(0,
+            sparse_file_write(sparse, sparse_image.fd(), false, true, false));
+  sparse_file_destroy(sparse);
+  ASSERT_TRUE(sparse_utils::IsSparseImage(sparse_image.path()));
+
+  ASSERT_TRUE(sparse_utils::UnsparseImage(sparse_image.path(), file_.fd()));
+  brillo::Blob raw_image;
+  ASSERT_TRUE(utils::ReadFile(file_.path(), &raw_image));
+  brillo::Blob expected(kNumBlocks * kBlockSize, 0);
+  std::copy(data.begin(), data.end(), expected.begin() + 7 * kBlockSize);
+  ASSERT_EQ(expected, raw_image);
+
+  // The unused blocks of the sparse image are holes in the raw image.
+  if (!holes_reported_)
+    GTEST_SKIP() << "The filesystem of the test file doesn't report holes.";
+  vector<Extent> extents;
+  ASSERT_TRUE(sparse_utils::GetDataExtents(
+      file_.path(), kNumBlocks * kBlockSize, kBlockSize, &extents));
+  ASSERT_EQ(vector<Extent>{ExtentForRange(7, 2)}, extents);
+}
+
+}  // namespace chromeos_update_engine
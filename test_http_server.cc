@@ -17,7 +17,9 @@
 // This file implements a simple HTTP server. It can exhibit odd behavior
 // that's useful for testing. For example, it's useful to test that
 // the updater can continue a connection if it's dropped, or that it
-// handles very slow data transfers.
+// handles very slow data transfers. It can also serve the payload file given
+// with --payload with a given bandwidth, latency and connection drops, which is
+// used to benchmark applying a real payload end to end.
 
 // To use this, simply make an HTTP connection to localhost:port and
 // GET a url.
@@ -37,11 +39,14 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <chrono>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <base/logging.h>
 #include <base/posix/eintr_wrapper.h>
+#include <base/strings/string_number_conversions.h>
 #include <base/strings/string_split.h>
 #include <base/strings/string_util.h>
 #include <base/strings/stringprintf.h>
@@ -57,6 +62,10 @@ using std::vector;
 namespace chromeos_update_engine {
 
 static const char* kListeningMsgPrefix = "listening on port ";
+static const char* kPayloadArgPrefix = "--payload=";
+
+// The only file served by /payload/ requests, empty if none.
+static string payload_path;
 
 enum {
   RC_OK = 0,
@@ -466,6 +475,108 @@ ssize_t HandleErrorIfOffset(int fd,
   }
 }
 
+// Serves |payload_path| for /payload/<bytes_per_sec>/<latency_ms>/<drop_after>
+// requests, honoring the requested range. The response is delayed by
+// <latency_ms>, paced to <bytes_per_sec> (zero means unlimited) and, when
+// <drop_after> is non-zero, the connection is closed after that many body bytes
+// so the client has to resume. Returns the number of body bytes delivered or -1
+// for error.
+ssize_t HandlePayload(int fd, const HttpRequest& request) {
+  const vector<string> terms =
+      base::SplitString(request.url.substr(strlen("/payload/")),
+                        "/",
+                        base::KEEP_WHITESPACE,
+                        base::SPLIT_WANT_ALL);
+  uint64_t bytes_per_sec = 0;
+  int latency_ms = 0;
+  uint64_t drop_after = 0;
+  if (terms.size() != 3 || !base::StringToUint64(terms[0], &bytes_per_sec) ||
+      !base::StringToInt(terms[1], &latency_ms) || latency_ms < 0 ||
+      !base::StringToUint64(terms[2], &drop_after)) {
+    LOG(WARNING) << "Malformed payload request " << request.url
+                 << ", generating error response (" << kHttpResponseBadRequest
+                 << ")";
+    return WriteHeaders(fd, 0, 0, kHttpResponseBadRequest);
+  }
+  if (payload_path.empty()) {
+    LOG(WARNING) << "No payload to serve, see " << kPayloadArgPrefix;
+    return HandleError(fd, request);
+  }
+  const string& path = payload_path;
+
+  int file_fd = HANDLE_EINTR(open(path.c_str(), O_RDONLY));
+  if (file_fd < 0) {
+    PLOG(WARNING) << "Unable to open " << path;
+    return HandleError(fd, request);
+  }
+  struct stat stbuf {};
+  if (fstat(file_fd, &stbuf) < 0) {
+    PLOG(WARNING) << "Unable to stat " << path;
+    close(file_fd);
+    return -1;
+  }
+  const size_t total_length = stbuf.st_size;
+
+  const size_t start_offset = request.start_offset;
+  if (start_offset >= total_length) {
+    LOG(WARNING) << "start offset (" << start_offset
+                 << ") exceeds total length (" << total_length
+                 << "), generating error response ("
+                 << kHttpResponseReqRangeNotSat << ")";
+    close(file_fd);
+    return WriteHeaders(
+        fd, total_length, total_length, kHttpResponseReqRangeNotSat);
+  }
+  size_t end_offset =
+      (request.end_offset > 0 ? request.end_offset : total_length);
+  end_offset = std::min(std::max(end_offset, start_offset), total_length);
+
+  if (latency_ms > 0)
+    usleep(latency_ms * 1000);
+
+  if (WriteHeaders(fd, start_offset, end_offset, request.return_code) < 0) {
+    close(file_fd);
+    return -1;
+  }
+
+  LOG(INFO) << "serving " << path << " range=" << start_offset << "-"
+            << (end_offset - 1) << " at " << bytes_per_sec
+            << " bytes/s, dropping after " << drop_after << " bytes";
+
+  const auto begin = std::chrono::steady_clock::now();
+  size_t written = 0;
+  vector<char> buf(64 * 1024);
+  while (start_offset + written < end_offset) {
+    size_t chunk = std::min(buf.size(), end_offset - start_offset - written);
+    if (drop_after > 0)
+      chunk = std::min<uint64_t>(chunk, drop_after - written);
+    ssize_t bytes_read = HANDLE_EINTR(
+        pread(file_fd, buf.data(), chunk, start_offset + written));
+    if (bytes_read <= 0) {
+      PLOG(WARNING) << "Unable to read " << path;
+      break;
+    }
+    if (WriteString(fd, string(buf.data(), bytes_read)) < 0)
+      break;
+    written += bytes_read;
+
+    if (drop_after > 0 && written >= drop_after) {
+      LOG(INFO) << "dropping connection after " << written << " bytes";
+      break;
+    }
+    // Sleep until the time at which |written| bytes would have been sent at
+    // |bytes_per_sec|.
+    if (bytes_per_sec > 0) {
+      std::this_thread::sleep_until(
+          begin + std::chrono::microseconds(static_cast<int64_t>(
+                      written * 1000000.0 / bytes_per_sec)));
+    }
+  }
+  close(file_fd);
+  LOG(INFO) << written << " payload bytes written";
+  return written;
+}
+
 // Returns a valid response echoing in the body of the response all the headers
 // sent by the client.
 void HandleEchoHeaders(int fd, const HttpRequest& request) {
@@ -551,6 +662,8 @@ void HandleConnection(int fd) {
                  url, "/error-if-offset/", base::CompareCase::SENSITIVE)) {
     const UrlTerms terms(url, 3);
     HandleErrorIfOffset(fd, request, terms.GetSizeT(1), terms.GetInt(2));
+  } else if (base::StartsWith(url, "/payload/", base::CompareCase::SENSITIVE)) {
+    HandlePayload(fd, request);
   } else if (url == "/echo-headers") {
     HandleEchoHeaders(fd, request);
   } else if (url == "/hang") {
@@ -568,28 +681,34 @@ using namespace chromeos_update_engine;  // NOLINT(build/namespaces)
 
 void usage(const char* prog_arg) {
   fprintf(stderr,
-          "Usage: %s [ FILE ]\n"
+          "Usage: %s [ %sPATH ] [ FILE ]\n"
           "Once accepting connections, the following is written to FILE (or "
           "stdout):\n"
-          "\"%sN\" (where N is an integer port number)\n",
+          "\"%sN\" (where N is an integer port number)\n"
+          "The file at PATH is served for /payload/ requests.\n",
           basename(prog_arg),
+          kPayloadArgPrefix,
           kListeningMsgPrefix);
 }
 
 int main(int argc, char** argv) {
-  // Check invocation.
-  if (argc > 2)
-    errx(RC_BAD_ARGS, "unexpected number of arguments (use -h for usage)");
-
-  // Parse (optional) argument.
+  // Parse (optional) arguments.
   int report_fd = STDOUT_FILENO;
-  if (argc == 2) {
-    if (!strcmp(argv[1], "-h")) {
+  bool has_report_file = false;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-h")) {
       usage(argv[0]);
       exit(RC_OK);
     }
-
-    report_fd = open(argv[1], O_WRONLY | O_CREAT, 00644);
+    if (base::StartsWith(
+            argv[i], kPayloadArgPrefix, base::CompareCase::SENSITIVE)) {
+      payload_path = argv[i] + strlen(kPayloadArgPrefix);
+      continue;
+    }
+    if (has_report_file)
+      errx(RC_BAD_ARGS, "unexpected number of arguments (use -h for usage)");
+    report_fd = open(argv[i], O_WRONLY | O_CREAT, 00644);
+    has_report_file = true;
   }
 
   // Ignore SIGPIPE on write() to sockets.